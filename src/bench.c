@@ -0,0 +1,26 @@
+/*
+ * Helpers of the benchmarks, see bench.h.
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <time.h>
+
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Names are ours and contain nothing to be escaped in a JSON string.
+ */
+void bench_report(const char *bench, const char *name, double value, const char *unit)
+{
+	printf("{\"bench\":\"%s\",\"case\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n",
+		bench, name, value, unit);
+	fflush(stdout);
+}
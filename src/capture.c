@@ -0,0 +1,65 @@
+/*
+ * Captures of raw traffic between meteod and the station.
+ *
+ * See capture.h for the format. Frames are written without their unused
+ * bytes, as commands sent to the station are only two bytes long.
+ */
+
+#include "capture.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/* the part of struct capture_frame written before the data */
+#define	FRAME_HDR_LEN	offsetof(struct capture_frame, data)
+
+ulong_t capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ulong_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int capture_write_header(FILE *stream)
+{
+	struct capture_header hdr;
+	struct timespec ts;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr.realtime = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	hdr.monotonic = capture_now();
+
+	return fwrite(&hdr, sizeof(hdr), 1, stream) == 1 ? 0 : -1;
+}
+
+int capture_write_frame(FILE *stream, const struct capture_frame *frame)
+{
+	size_t len = FRAME_HDR_LEN + frame->len;
+
+	return fwrite(frame, 1, len, stream) == len ? 0 : -1;
+}
+
+int capture_read_header(FILE *stream, struct capture_header *hdr)
+{
+	if (fread(hdr, sizeof(*hdr), 1, stream) != 1
+		|| memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic)) != 0)
+		return -1;
+	return 0;
+}
+
+int capture_read_frame(FILE *stream, struct capture_frame *frame)
+{
+	size_t ret;
+
+	if ((ret = fread(frame, 1, FRAME_HDR_LEN, stream)) != FRAME_HDR_LEN)
+		return ret == 0 && feof(stream) ? 0 : -1;
+
+	if (frame->dir > CAPTURE_OUT || frame->len > CAPTURE_FRAME_MAX
+		|| fread(frame->data, 1, frame->len, stream) != frame->len)
+		return -1;
+	return 1;
+}
@@ -6,6 +6,7 @@
 #include "log.h"
 
 #include <stdlib.h>
+#include <time.h>
 
 void *realloc_safe(void *x, size_t size)
 {
@@ -19,3 +20,11 @@ void *malloc_safe(size_t size)
 {
 	return realloc_safe(NULL, size);
 }
+
+ulong_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ulong_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
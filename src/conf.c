@@ -0,0 +1,277 @@
+/*
+ * Configuration files, see conf.h.
+ *
+ * Strings of a configuration are interned: a configuration loaded again
+ * and again (such as on every SIGHUP) takes no more memory than it did
+ * the first time, and strings the old configuration shares with the new
+ * one stay where they are, so that they may still be in use by threads
+ * the configuration was passed to.
+ */
+
+#include "common.h"
+#include "conf.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+/*
+ * An interned string.
+ */
+struct interned
+{
+	struct interned *next;	/* next string of the pool */
+	char str[];		/* the string */
+};
+
+/* all strings interned so far (only ever loaded from one thread) */
+static struct interned *pool;
+
+static char *intern(const char *str)
+{
+	struct interned *cur;
+
+	for (cur = pool; cur != NULL; cur = cur->next)
+		if (strcmp(cur->str, str) == 0)
+			return cur->str;
+
+	cur = malloc_safe(sizeof(*cur) + strlen(str) + 1);
+	strcpy(cur->str, str);
+	cur->next = pool;
+	pool = cur;
+	return cur->str;
+}
+
+/*
+ * Strip leading and trailing white space off @str.
+ */
+static char *trim(char *str)
+{
+	char *end;
+
+	while (*str == ' ' || *str == '\t')
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t'
+		|| end[-1] == '\n' || end[-1] == '\r'))
+		end--;
+	*end = '\0';
+
+	return str;
+}
+
+static int parse_ull(const char *str, int base, unsigned long long max,
+	unsigned long long *val)
+{
+	char *end;
+
+	if (*str == '\0' || *str == '-')
+		return -1;
+
+	errno = 0;
+	*val = strtoull(str, &end, base);
+	if (errno != 0 || *end != '\0' || *val > max)
+		return -1;
+
+	return 0;
+}
+
+static int parse_bool(const char *str, bool *val)
+{
+	static const char *yes[] = { "yes", "true", "on", "1" };
+	static const char *no[] = { "no", "false", "off", "0" };
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(yes); i++) {
+		if (strcmp(str, yes[i]) == 0) {
+			*val = true;
+			return 0;
+		}
+		if (strcmp(str, no[i]) == 0) {
+			*val = false;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Set option @option of the structure at @base to @value.
+ */
+static int set_option(const struct conf_option *option, void *base, const char *value)
+{
+	void *ptr = (char *)base + option->offset;
+	unsigned long long ull;
+	double dbl;
+	char *end;
+	size_t i;
+
+	switch (option->type) {
+	case CONF_UINT:
+		if (parse_ull(value, 10, UINT_MAX, &ull) != 0)
+			return -1;
+		*(unsigned *)ptr = ull;
+		return 0;
+	case CONF_SIZE:
+		if (parse_ull(value, 10, SIZE_MAX, &ull) != 0)
+			return -1;
+		*(size_t *)ptr = ull;
+		return 0;
+	case CONF_OFF:
+		if (parse_ull(value, 10, INT64_MAX, &ull) != 0)
+			return -1;
+		*(off_t *)ptr = ull;
+		return 0;
+	case CONF_DOUBLE:
+		errno = 0;
+		dbl = strtod(value, &end);
+		if (*value == '\0' || errno != 0 || *end != '\0')
+			return -1;
+		*(double *)ptr = dbl;
+		return 0;
+	case CONF_BOOL:
+		return parse_bool(value, (bool *)ptr);
+	case CONF_MODE:
+		if (parse_ull(value, 8, 07777, &ull) != 0)
+			return -1;
+		*(mode_t *)ptr = ull;
+		return 0;
+	case CONF_STRING:
+		*(char **)ptr = *value != '\0' ? intern(value) : NULL;
+		return 0;
+	case CONF_ENUM:
+		for (i = 0; i < option->num_names; i++) {
+			if (option->names[i] != NULL && strcmp(option->names[i], value) == 0) {
+				*(int *)ptr = i;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	return -1;
+}
+
+static const struct conf_option *lookup(const struct conf_option *options, size_t count,
+	const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (strcmp(options[i].name, name) == 0)
+			return &options[i];
+
+	return NULL;
+}
+
+int conf_load(const char *path, const struct conf_option *options, size_t count,
+	void *base, char error[CONF_ERROR_LEN])
+{
+	const struct conf_option *option;
+	char *line = NULL;
+	size_t line_size = 0;
+	size_t line_no = 0;
+	char *name;
+	char *value;
+	FILE *stream;
+	int ret = 0;
+
+	if ((stream = fopen(path, "r")) == NULL) {
+		snprintf(error, CONF_ERROR_LEN, "Cannot open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&line, &line_size, stream) != -1) {
+		line_no++;
+		name = trim(line);
+		if (*name == '\0' || *name == '#')
+			continue;
+
+		if ((value = strchr(name, '=')) == NULL) {
+			snprintf(error, CONF_ERROR_LEN, "%s:%zu: Expected <name> = <value>",
+				path, line_no);
+			ret = -1;
+			break;
+		}
+		*value++ = '\0';
+		name = trim(name);
+		value = trim(value);
+
+		if ((option = lookup(options, count, name)) == NULL) {
+			snprintf(error, CONF_ERROR_LEN, "%s:%zu: Unknown option '%s'",
+				path, line_no, name);
+			ret = -1;
+			break;
+		}
+
+		if (set_option(option, base, value) != 0) {
+			snprintf(error, CONF_ERROR_LEN, "%s:%zu: Invalid value '%s' of %s",
+				path, line_no, value, name);
+			ret = -1;
+			break;
+		}
+	}
+
+	if (ret == 0 && ferror(stream)) {
+		snprintf(error, CONF_ERROR_LEN, "Cannot read %s: %s", path, strerror(errno));
+		ret = -1;
+	}
+
+	free(line);
+	fclose(stream);
+	return ret;
+}
+
+/*
+ * Size of the value of an option of type @type.
+ */
+static size_t value_size(enum conf_type type)
+{
+	switch (type) {
+	case CONF_UINT:
+		return sizeof(unsigned);
+	case CONF_SIZE:
+		return sizeof(size_t);
+	case CONF_OFF:
+		return sizeof(off_t);
+	case CONF_DOUBLE:
+		return sizeof(double);
+	case CONF_BOOL:
+		return sizeof(bool);
+	case CONF_MODE:
+		return sizeof(mode_t);
+	case CONF_STRING:
+		return sizeof(char *);
+	case CONF_ENUM:
+		return sizeof(int);
+	}
+
+	return 0;
+}
+
+bool conf_changed(const struct conf_option *option, const void *a, const void *b)
+{
+	const void *pa = (const char *)a + option->offset;
+	const void *pb = (const char *)b + option->offset;
+	const char *sa, *sb;
+
+	if (option->type != CONF_STRING)
+		return memcmp(pa, pb, value_size(option->type)) != 0;
+
+	sa = *(char * const *)pa;
+	sb = *(char * const *)pb;
+	if (sa == NULL || sb == NULL)
+		return sa != sb;
+	return strcmp(sa, sb) != 0;
+}
+
+void conf_copy(const struct conf_option *option, void *dst, const void *src)
+{
+	memcpy((char *)dst + option->offset, (const char *)src + option->offset,
+		value_size(option->type));
+}
@@ -0,0 +1,24 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Helpers of the benchmarks run by `make bench`.
+ *
+ * Results are written to standard output as JSON, an object per line:
+ *
+ *     {"bench":"wmr","case":"decode","value":1234567.8,"unit":"readings/s"}
+ *
+ * so that results of different builds can be compared by a script.
+ */
+
+/*
+ * Nanoseconds elapsed on the monotonic clock.
+ */
+double bench_now(void);
+
+/*
+ * Write result @value in @unit of case @name of benchmark @bench.
+ */
+void bench_report(const char *bench, const char *name, double value, const char *unit);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Captures of raw traffic between meteod and the station.
+ *
+ * A capture file is a struct capture_header followed by frames, each of
+ * them its 64-bit time, direction and length followed by the @len bytes
+ * of the frame (in host byte order). Times are microseconds on the
+ * monotonic clock; the header relates them to the wall clock.
+ */
+
+#define	CAPTURE_MAGIC		"WMRCAP1\n"
+#define	CAPTURE_FRAME_MAX	8	/* longest frame, the size of a HID report */
+
+/*
+ * Direction of a frame.
+ */
+enum capture_dir
+{
+	CAPTURE_IN,		/* received from the station */
+	CAPTURE_OUT,		/* sent to the station */
+};
+
+struct capture_header
+{
+	char magic[8];		/* CAPTURE_MAGIC */
+	int64_t realtime;	/* wall clock time the capture was started (us) */
+	int64_t monotonic;	/* monotonic time at that moment (us) */
+};
+
+struct capture_frame
+{
+	ulong_t time;		/* when the frame was read or written (us) */
+	byte_t dir;		/* enum capture_dir */
+	byte_t len;		/* length of @data */
+	byte_t data[CAPTURE_FRAME_MAX];	/* the frame */
+};
+
+/*
+ * Microseconds elapsed on the monotonic clock.
+ */
+ulong_t capture_now(void);
+
+/*
+ * Write the header of a capture started now to @stream.
+ *
+ * Return value:
+ *	Zero on success, -1 on error (see errno).
+ */
+int capture_write_header(FILE *stream);
+
+/*
+ * Write @frame to @stream.
+ *
+ * Return value:
+ *	Zero on success, -1 on error (see errno).
+ */
+int capture_write_frame(FILE *stream, const struct capture_frame *frame);
+
+/*
+ * Read the header of a capture from @stream into @hdr.
+ *
+ * Return value:
+ *	Zero on success, -1 if it can't be read or it's not a capture.
+ */
+int capture_read_header(FILE *stream, struct capture_header *hdr);
+
+/*
+ * Read the next frame from @stream into @frame.
+ *
+ * Return value:
+ *	1 if a frame was read, 0 at the end of the capture, -1 if the
+ *	capture is truncated or corrupt.
+ */
+int capture_read_frame(FILE *stream, struct capture_frame *frame);
+
+#endif
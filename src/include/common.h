@@ -38,4 +38,9 @@ typedef uint64_t		ulong_t;
 void *malloc_safe(size_t size);
 void *realloc_safe(void *x, size_t size);
 
+/*
+ * Milliseconds elapsed on the monotonic clock.
+ */
+ulong_t monotonic_ms(void);
+
 #endif
@@ -0,0 +1,72 @@
+#ifndef CONF_H
+#define CONF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Configuration files.
+ *
+ * A configuration file sets options of a configuration structure, an
+ * option per line:
+ *
+ *     # comment
+ *     <name> = <value>
+ *
+ * Options are described by a table of struct conf_option, which says
+ * where within the structure each of them is stored and what kind of
+ * value it takes. An empty value sets a string option to NULL.
+ */
+
+/*
+ * Kind of the value of an option.
+ */
+enum conf_type
+{
+	CONF_UINT,		/* unsigned */
+	CONF_SIZE,		/* size_t */
+	CONF_OFF,		/* off_t */
+	CONF_DOUBLE,		/* double */
+	CONF_BOOL,		/* bool: yes, no, true, false, on, off, 1 or 0 */
+	CONF_MODE,		/* mode_t, in octal */
+	CONF_STRING,		/* char *, NULL if the value is empty */
+	CONF_ENUM,		/* an enum, given by name */
+};
+
+/*
+ * Description of an option.
+ */
+struct conf_option
+{
+	const char *name;	/* name of the option, such as "srv.port" */
+	enum conf_type type;	/* kind of the value */
+	size_t offset;		/* offset of the value within the structure */
+	const char **names;	/* CONF_ENUM: names of the values (NULL for none) */
+	size_t num_names;	/* CONF_ENUM: number of @names */
+};
+
+#define	CONF_ERROR_LEN	256	/* longest error message */
+
+/*
+ * Set options @options (@count of them) of the structure at @base to the
+ * values in configuration file @path. Strings are kept for the lifetime
+ * of the process, a single copy of each.
+ *
+ * Return value:
+ *	Zero on success, -1 on error, in which case an error message is
+ *	stored in @error and options may have been set only partially.
+ */
+int conf_load(const char *path, const struct conf_option *options, size_t count,
+	void *base, char error[CONF_ERROR_LEN]);
+
+/*
+ * Is option @option different in the structures at @a and @b?
+ */
+bool conf_changed(const struct conf_option *option, const void *a, const void *b);
+
+/*
+ * Copy the value of option @option from the structure at @src to @dst.
+ */
+void conf_copy(const struct conf_option *option, void *dst, const void *src);
+
+#endif
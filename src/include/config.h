@@ -1,19 +1,36 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "journal.h"
+#include "log.h"
+#include "recorder.h"
+#include "rollup.h"
 #include "rrd-logger.h"
 #include "server.h"
+#include "simulator.h"
+#include "textlog.h"
+#include "tsdb.h"
 #include <sys/types.h>
 
 /*
- * Program configuration.
- *
- * TODO: In the future, add support for run-time configuration
- *       loaded from files, shall it ever be needed.
+ * Configuration file read at startup and on SIGHUP (-C to use another).
  */
-struct
+#define	CONFIG_PATH	"/etc/meteod.conf"
+
+/*
+ * Program configuration. These are the defaults, which the configuration
+ * file (see meteod.conf) and then command-line options override.
+ */
+struct config
 {
+	struct log_cfg log;		/* logging configuration */
 	struct rrd_cfg rrd;		/* RRD logger configuration */
+	struct tsdb_cfg tsdb;		/* time-series store configuration */
+	struct rollup_cfg rollup;	/* rollup engine configuration */
+	struct textlog_cfg textlog;	/* text logger configuration */
+	struct journal_cfg journal;	/* journal configuration */
+	struct recorder_cfg recorder;	/* flight recorder configuration */
+	struct simulator_cfg simulator;	/* station simulator configuration (-S) */
 	struct wmr_server_cfg srv;	/* WMR server configuration */
 	unsigned reconnect_default;	/* default reconnection interval */
 	unsigned reconnect_max;		/* maximum reconnection interval */
@@ -24,6 +41,11 @@ struct
 	uid_t uid;			/* uid obtained from user name */
 	gid_t gid;			/* gid obtained from group name */
 } cfg = {
+	.log = {
+		.level = LOG_INFO,	/* LOG_DEBUG with -v */
+		.target = LOG_TO_SYSLOG,
+		.path = NULL,		/* e.g. "/var/meteod/meteod.log" */
+	},
 	.rrd = {
 		.rrd_root = "/var/meteod",
 		.wind_rrd = "wind.rrd",
@@ -31,9 +53,55 @@ struct
 		.uvi_rrd = "uvi.rrd",
 		.baro_rrd = "baro.rrd",
 		.temp_N_rrd = "temp%i.rrd",
+		.batch_size = 64,
+		.flush_interval = 60,
+		.max_lateness = 300,
+		.daemon = NULL,
+	},
+	.tsdb = {
+		.root = NULL,		/* e.g. "/var/meteod/tsdb" */
+		.segment_len = 4096,
+	},
+	.rollup = {
+		.path = NULL,		/* e.g. "/var/meteod/rollups" */
+		.save_interval = 3600,
+		.retention = { 1440, 1008, 720, 730 },
+	},
+	.textlog = {
+		.path = NULL,		/* e.g. "/var/meteod/readings.csv" */
+		.format = TEXTLOG_CSV,
+		.buffer_size = 1 << 20,
+		.flush_interval = 1000,
+		.rotate_size = 0,
+		.rotate_daily = true,
+		.compress = NULL,	/* e.g. "gzip" */
+	},
+	.journal = {
+		.path = NULL,		/* e.g. "/var/meteod/journal" */
+		.group_size = 32,
+		.group_interval = 1000,
+		.checkpoint_interval = 600,
+	},
+	.recorder = {
+		.dump_path = "frames-%Y%m%d-%H%M%S.cap",
+		.capture_path = NULL,	/* e.g. "capture-%Y%m%d-%H%M%S.cap", or -c */
+	},
+	.simulator = {
+		.speed = 1,		/* -S */
+		.num_sensors = 3,
+		.history = 0,
+		.bad_checksum = 0,	/* e.g. 1000 for one in a thousand packets */
+		.truncated = 0,
+		.stall = 0,
+		.stall_len = 5000,
+		.seed = 0,
 	},
 	.srv = {
 		.port = 20892,
+		.request_timeout = 200,
+		.max_wait = 300,
+		.history_len = 4096,
+		.keyframe_interval = 100,
 	},
 	.reconnect_default = 1,
 	.reconnect_max = 300,
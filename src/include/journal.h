@@ -0,0 +1,94 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "common.h"
+#include "reading.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Journal configuration.
+ */
+struct journal_cfg
+{
+	char *path;			/* path of the journal file */
+	unsigned group_size;		/* readings committed at once */
+	unsigned group_interval;	/* longest a reading waits for a commit (ms) */
+	unsigned checkpoint_interval;	/* how often checkpoints are taken (s) */
+};
+
+/*
+ * Checkpoint handler. Called to have loggers write out what they can and
+ * to find out, for each slot, the time of the oldest reading they may yet
+ * need replayed. @watermarks are LONG_MAX on entry. Readings logged to the
+ * journal before the handler is called may still be on their way to other
+ * loggers, and the handler has to wait for them first (see
+ * wmr_wait_dispatch).
+ */
+typedef void journal_checkpoint_t(time_t watermarks[NUM_SLOTS], void *arg);
+
+/*
+ * Buffer of journal records.
+ */
+struct journal_buf
+{
+	byte_t *data;		/* the records */
+	size_t len;		/* length of @data */
+	size_t size;		/* capacity of @data */
+};
+
+/*
+ * Write-ahead journal of readings.
+ */
+struct journal
+{
+	struct journal_cfg cfg;		/* configuration */
+	int fd;				/* journal file descriptor */
+	struct journal_buf pending;	/* records not yet written */
+	size_t num_pending;		/* number of records in @pending */
+	ulong_t pending_since;		/* when the oldest of them came (monotonic ms) */
+	struct journal_buf spare;	/* buffer being written */
+	pthread_mutex_t lock;		/* protects @pending and @num_logged */
+	pthread_mutex_t io_lock;	/* serializes access to @fd */
+	pthread_cond_t cond;		/* signalled when there's work to do */
+	bool running;			/* is the commit thread running? */
+	pthread_t thread_id;		/* commit thread ID */
+	journal_checkpoint_t *checkpoint;	/* checkpoint handler (or NULL) */
+	void *checkpoint_arg;		/* extra argument to @checkpoint */
+	ulong_t num_logged;		/* readings logged since the start */
+};
+
+void journal_init(struct journal *journal);
+int journal_start(struct journal *journal);
+void journal_free(struct journal *journal);
+
+/*
+ * Have @func called with @arg at checkpoints.
+ */
+void journal_set_checkpoint_handler(struct journal *journal, journal_checkpoint_t *func,
+	void *arg);
+
+/*
+ * Pass readings recorded in the journal to @func, in the order they were
+ * recorded.
+ *
+ * Return value:
+ *	Number of readings replayed, or -1 if the journal can't be read.
+ */
+ssize_t journal_replay(struct journal *journal, wmr_logger_t *func, void *arg);
+
+/*
+ * Run the checkpoint handler, commit the readings recorded so far and drop
+ * from the journal those which are older than the watermark of their slot.
+ * Meant to be called every cfg.checkpoint_interval, by one thread at a
+ * time, while readings may be logged by another.
+ */
+void journal_checkpoint(struct journal *journal);
+
+void journal_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+#endif
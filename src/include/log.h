@@ -11,21 +11,83 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <syslog.h>
 
 
+/*
+ * Where log messages go.
+ */
+enum log_target
+{
+	LOG_TO_SYSLOG,		/* syslog(3) */
+	LOG_TO_STDERR,		/* standard error output */
+	LOG_TO_FILE,		/* file cfg.path */
+};
+
+/*
+ * Logging configuration.
+ */
+struct log_cfg
+{
+	int level;		/* least important priority logged, such as LOG_INFO */
+	enum log_target target;	/* where messages go */
+	char *path;		/* file messages are appended to (LOG_TO_FILE) */
+};
+
+/*
+ * Least important priority logged. Messages of priorities above it are
+ * dropped before they're formatted. Read by every thread which logs,
+ * hence atomic; see log_set_level.
+ */
+extern atomic_int log_level;
+
+#define	log_enabled(priority)	\
+	((priority) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+/*
+ * Change the least important priority logged, such as when the
+ * configuration is reloaded.
+ */
+void log_set_level(int level);
+
 void log_open_syslog(void);
 
+/*
+ * Start the writer thread. From then on, messages are queued and written
+ * by the writer thread; until then, they're written right away.
+ *
+ * Return value:
+ *	Zero on success, -1 on error.
+ */
+int log_start(struct log_cfg *cfg);
+
+/*
+ * Write out all messages queued and stop the writer thread.
+ */
+void log_stop(void);
+
 void log_msg(int priority, char *msg, ...);
 
 void log_warning(char *msg, ...);
 
 void log_error(char *msg, ...);
 
-void log_debug(char *msg, ...);
+void log_exit(char *msg, ...);
 
-void log_info(char *msg, ...);
+/*
+ * Debug and info messages are common, so even their arguments aren't
+ * evaluated unless they're to be logged.
+ */
+#define	log_debug(...) do { \
+	if (log_enabled(LOG_DEBUG)) \
+		log_msg(LOG_DEBUG, __VA_ARGS__); \
+} while (0)
 
-void log_exit(char *msg, ...);
+#define	log_info(...) do { \
+	if (log_enabled(LOG_INFO)) \
+		log_msg(LOG_INFO, __VA_ARGS__); \
+} while (0)
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef NUMFMT_H
+#define NUMFMT_H
+
+#include <stddef.h>
+
+#define	NUMFMT_MAX_LEN	32	/* buffer size which fits any number but huge ones */
+
+/*
+ * Formatting of numbers of readings without printf(3).
+ *
+ * All functions write at most @size bytes, the terminating NUL included,
+ * into @buf and return the length of the number, like snprintf(3) does.
+ */
+
+/*
+ * Write @value like "%llu" and "%lli" would.
+ */
+size_t numfmt_uint(char *buf, size_t size, unsigned long long value);
+size_t numfmt_int(char *buf, size_t size, long long value);
+
+/*
+ * Write @value with @prec decimals, like "%.*f" would.
+ */
+size_t numfmt_fixed(char *buf, size_t size, double value, unsigned prec);
+
+/*
+ * Write the shortest number in fixed notation which reads back as @value,
+ * such as "21.5" or "0.0254". Numbers which would take more than a few
+ * decimals are written like "%.9g" would.
+ */
+size_t numfmt_shortest(char *buf, size_t size, float value);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef READING_H
+#define READING_H
+
+#include "strbuf.h"
+#include "wmr200.h"
+
+/*
+ * Readings are kept apart by their slot: there's one slot for each kind
+ * of reading, and one slot for each temperature sensor.
+ */
+enum reading_slot
+{
+	SLOT_WIND,
+	SLOT_RAIN,
+	SLOT_UVI,
+	SLOT_BARO,
+	SLOT_TEMP0,
+	SLOT_STATUS = SLOT_TEMP0 + WMR200_MAX_TEMP_SENSORS,
+	SLOT_META,
+	NUM_SLOTS
+};
+
+/*
+ * Return the slot of @reading, or -1 if it doesn't belong anywhere.
+ */
+int reading_slot(struct wmr_reading *reading);
+
+/*
+ * Return name of @slot, such as "wind" or "temp1".
+ */
+const char *slot_name(int slot);
+
+/*
+ * Return the slot named @name, or -1 if there's no such slot.
+ */
+int slot_lookup(const char *name);
+
+/*
+ * Return the type of readings which belong to @slot.
+ */
+byte_t slot_type(int slot);
+
+/*
+ * Kind of a field of a reading.
+ */
+enum field_kind
+{
+	FIELD_FLOAT,		/* float */
+	FIELD_UINT,		/* uint_t */
+	FIELD_ULONG,		/* ulong_t */
+	FIELD_TIME,		/* time_t */
+	FIELD_STRING,		/* const char *, pointing to a static string */
+};
+
+/*
+ * Description of a field of a reading, such as the temperature of a
+ * WMR_TEMP reading.
+ */
+struct reading_field
+{
+	byte_t type;		/* type of the reading */
+	const char *name;	/* name of the field */
+	enum field_kind kind;	/* kind of the field */
+	size_t offset;		/* offset within struct wmr_reading */
+};
+
+/*
+ * Return the fields of readings of type @type. The number of fields is
+ * stored into @count.
+ */
+const struct reading_field *reading_fields(byte_t type, size_t *count);
+
+/*
+ * Return the field of readings of type @type named @name, or NULL if
+ * there's no such field.
+ */
+const struct reading_field *reading_field_lookup(byte_t type, const char *name);
+
+/*
+ * Return the value of @field of @reading as a double. For string fields,
+ * NAN is returned.
+ */
+double reading_field_value(struct wmr_reading *reading, const struct reading_field *field);
+
+/*
+ * Append the value of @field of @reading to @out, written the same way
+ * as reading_format writes it.
+ */
+void reading_format_field(struct wmr_reading *reading, const struct reading_field *field,
+	struct strbuf *out);
+
+/*
+ * Append @reading to @out as a line listing all of its fields:
+ *
+ *     =<slot>	<time>	<field>=<value>	...
+ *
+ * Floating-point values are written with the fewest digits which still
+ * read back as the same value.
+ */
+void reading_format(struct wmr_reading *reading, struct strbuf *out);
+
+/*
+ * Parse @line written by reading_format into @reading. @line is modified
+ * in the process.
+ *
+ * Return value:
+ *	Zero on success, -1 if @line is malformed.
+ */
+int reading_parse(char *line, struct wmr_reading *reading);
+
+/*
+ * Append @reading to @out as a line listing only the fields which differ
+ * from @prev, an earlier reading from the same slot. Fields are identified
+ * by their index within reading_fields() and time is relative to @prev:
+ *
+ *     ~<slot>	<+/-seconds>	<index>=<value>	...
+ */
+void reading_format_delta(struct wmr_reading *prev, struct wmr_reading *reading,
+	struct strbuf *out);
+
+#endif
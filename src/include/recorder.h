@@ -0,0 +1,59 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "capture.h"
+#include "common.h"
+
+#include <sys/types.h>
+
+#define	RECORDER_LEN	4096	/* frames kept, a power of two */
+
+/*
+ * Flight recorder configuration.
+ */
+struct recorder_cfg
+{
+	char *dump_path;	/* strftime(3) template of dump file names (or NULL) */
+	char *capture_path;	/* strftime(3) template of the capture file name */
+};
+
+/*
+ * Set the configuration of the flight recorder. It may be changed at any
+ * time, though a change of @cfg.capture_path takes effect only when the
+ * next capture is started.
+ */
+void recorder_configure(struct recorder_cfg *cfg);
+
+/*
+ * Record frame @data of @len bytes which went in direction @dir.
+ * Frames longer than CAPTURE_FRAME_MAX are truncated.
+ *
+ * May be called from any thread, never blocks.
+ */
+void recorder_record(enum capture_dir dir, const byte_t *data, size_t len);
+
+/*
+ * Dump the frames recorded to a capture file named after cfg.dump_path
+ * and the current time. If @path isn't NULL, store the name of the file
+ * there (at most @size bytes).
+ *
+ * Return value:
+ *	Number of frames dumped, -1 on error or if there's no cfg.dump_path.
+ */
+ssize_t recorder_dump(char *path, size_t size);
+
+/*
+ * Start capture mode: from now on, all frames recorded are also written
+ * to a capture file named after cfg.capture_path and the current time.
+ *
+ * Return value:
+ *	Zero on success, -1 on error.
+ */
+int recorder_capture_start(void);
+
+/*
+ * Write out the frames not yet captured and stop capture mode.
+ */
+void recorder_capture_stop(void);
+
+#endif
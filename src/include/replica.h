@@ -0,0 +1,42 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include "store.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Replication client execution context. Mirrors readings of an upstream
+ * meteod, passing each of them to a logger callback, just like the
+ * wmr200 module does with readings received from the station. Readings
+ * of the history sent upon connecting, which aren't new, are passed to
+ * another callback.
+ */
+struct replica
+{
+	char *host;			/* upstream host name */
+	char *port;			/* upstream port */
+	wmr_logger_t *func;		/* logger callback */
+	wmr_logger_t *history_func;	/* callback for readings of the history */
+	void *arg;			/* extra argument to @func and @history_func */
+	struct wmr_store *store;	/* store fed by @func, reset on reconnect */
+	atomic_uint reconnect_max;	/* maximum reconnection interval (s) */
+	unsigned num_readings;		/* readings received since connected */
+	size_t history_left;		/* readings of the history still to come */
+	pthread_t thread_id;		/* replication thread ID */
+};
+
+/*
+ * Initialize @replica to mirror the meteod at @upstream, given as
+ * "host" or "host:port".
+ */
+void replica_init(struct replica *replica, char *upstream, wmr_logger_t *func,
+	wmr_logger_t *history_func, void *arg, struct wmr_store *store);
+void replica_free(struct replica *replica);
+
+int replica_start(struct replica *replica);
+void replica_stop(struct replica *replica);
+
+#endif
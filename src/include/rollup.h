@@ -0,0 +1,119 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include "common.h"
+#include "reading.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define	ROLLUP_NUM_RES	4	/* number of resolutions */
+
+/*
+ * Resolutions of rollups (s): a minute, ten minutes, an hour and a day.
+ */
+extern const unsigned rollup_res[ROLLUP_NUM_RES];
+
+/*
+ * Rollup engine configuration.
+ */
+struct rollup_cfg
+{
+	char *path;			/* file rollups are saved to (or NULL) */
+	unsigned save_interval;		/* how often rollups are saved (s) */
+	unsigned retention[ROLLUP_NUM_RES];	/* buckets kept of each resolution */
+};
+
+/*
+ * Aggregate of values of a field of readings within a bucket, i.e. an
+ * interval of time [start, start + resolution).
+ */
+struct rollup_bucket
+{
+	int64_t start;		/* start of the bucket */
+	uint32_t count;		/* number of values (0 if the bucket is unused) */
+	uint32_t first_off;	/* time of the first value, relative to @start */
+	uint32_t last_off;	/* time of the last value, relative to @start */
+	uint32_t unused;
+	double sum;		/* sum of the values */
+	double min;		/* minimum of the values */
+	double max;		/* maximum of the values */
+	double first;		/* value of the earliest reading */
+	double last;		/* value of the latest reading */
+};
+
+/*
+ * Rollups of a field: a ring of buckets of each resolution, indexed by
+ * the bucket's start divided by the resolution.
+ */
+struct rollup_field
+{
+	struct rollup_bucket *buckets[ROLLUP_NUM_RES];	/* rings of buckets */
+};
+
+/*
+ * Rollups of the fields of a slot.
+ */
+struct rollup_slot
+{
+	struct rollup_field *fields;	/* one per field (NULL until a reading comes) */
+	size_t num_fields;		/* number of fields of readings of the slot */
+	time_t restored;		/* time of the latest reading saved before a restart */
+	time_t saved;			/* time of the latest reading saved */
+	time_t latest;			/* time of the latest reading added */
+};
+
+/*
+ * Rollup engine.
+ */
+struct rollup
+{
+	struct rollup_cfg cfg;			/* configuration */
+	pthread_mutex_t lock;			/* protects @slots */
+	struct rollup_slot slots[NUM_SLOTS];	/* rollups of each slot */
+};
+
+void rollup_init(struct rollup *rollup);
+int rollup_start(struct rollup *rollup);
+void rollup_free(struct rollup *rollup);
+
+/*
+ * Save rollups to cfg.path, if set. Meant to be called every
+ * cfg.save_interval, by one thread at a time. Readings are only held up
+ * while the rollups are copied, not while they're written.
+ *
+ * Return value:
+ *	Zero on success, -1 on error.
+ */
+int rollup_save(struct rollup *rollup);
+
+void rollup_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+/*
+ * Lower @watermarks to the time of the oldest reading of each slot added
+ * since rollups were last saved, i.e. which is lost unless replayed.
+ * Rollups which aren't saved at all don't hold readings back.
+ */
+void rollup_watermarks(struct rollup *rollup, time_t watermarks[NUM_SLOTS]);
+
+/*
+ * Return the index of resolution @name, which is either the number of
+ * seconds or one of "1m", "10m", "1h" and "1d", or -1 if there's no such
+ * resolution.
+ */
+int rollup_res_lookup(const char *name);
+
+/*
+ * Get buckets of resolution @res of @field of @slot which start within
+ * [@start, @end) and have values, ordered by time. The buckets are stored
+ * into a newly allocated array @buckets, to be freed by the caller.
+ *
+ * Return value:
+ *	Number of @buckets.
+ */
+size_t rollup_query(struct rollup *rollup, int slot, const struct reading_field *field,
+	int res, time_t start, time_t end, struct rollup_bucket **buckets);
+
+#endif
@@ -1,8 +1,12 @@
 #ifndef RRD_LOGGER_H
 #define	RRD_LOGGER_H
 
+#include "reading.h"
+#include "rrdcached.h"
 #include "wmr200.h"
-#include "strbuf.h"
+
+#include <stdbool.h>
+#include <time.h>
 
 /*
  * RRD logger configuration.
@@ -15,20 +19,149 @@ struct rrd_cfg
 	char *uvi_rrd;		/* UV index database */
 	char *baro_rrd;		/* barometric database */
 	char *temp_N_rrd;	/* temperature database of Nth sensor */
+	unsigned batch_size;	/* updates buffered per database */
+	unsigned flush_interval;	/* longest time an update is buffered (s) */
+	unsigned max_lateness;	/* how much older than the newest reading a reading may be (s) */
+	unsigned max_ahead;	/* how far in the future a reading may be (s), 0 = any */
+	char *daemon;		/* rrdcached socket to send updates to (or NULL) */
+};
+
+#define	RRD_UPDATE_MAX_LEN	64	/* longest "timestamp:values" update */
+#define	RRD_MAX_DS		3	/* most data sources in a database */
+
+/*
+ * Values of a reading held back until older readings may have arrived.
+ */
+struct rrd_pending
+{
+	time_t time;			/* time of the reading */
+	double values[RRD_MAX_DS];	/* values of the data sources */
 };
 
 /*
- * Execution context of an RRD logger.
+ * State of an RRD database file. Readings are held back to be put in order,
+ * readings which fall into the same step of the database are coalesced into
+ * a single update, updates are buffered and written in batches.
+ */
+struct rrd_file
+{
+	char *path;		/* path of the file */
+	size_t num_ds;		/* number of data sources (0 if not logged) */
+	const char *ds[RRD_MAX_DS];	/* data source names */
+	const struct reading_field *fields[RRD_MAX_DS];	/* fields logged */
+	bool gauge[RRD_MAX_DS];	/* is the data source a gauge? */
+	unsigned long step;	/* step of the database (s), 0 if unknown */
+
+	struct rrd_pending *pending;	/* readings held back, ordered by time */
+	size_t num_pending;	/* number of @pending */
+	size_t pending_size;	/* capacity of @pending */
+	time_t released;	/* time of the latest reading released */
+	bool ahead;		/* was the last reading from too far in the future? */
+
+	time_t end;		/* end of the step being coalesced */
+	size_t num_coalesced;	/* number of readings coalesced */
+	double sum[RRD_MAX_DS];	/* sums of values coalesced */
+	double value[RRD_MAX_DS];	/* latest values coalesced */
+	time_t latest;		/* time of the latest reading coalesced */
+
+	char (*updates)[RRD_UPDATE_MAX_LEN];	/* buffered updates */
+	const char **argv;	/* @updates, as passed to rrd_update_r */
+	size_t count;		/* number of @updates */
+	size_t capacity;	/* most @updates kept */
+	time_t last;		/* time of the latest update buffered */
+	ulong_t since;		/* when the oldest update was buffered (monotonic ms) */
+	time_t unsynced;	/* time of the oldest update not known to be written (or 0) */
+	bool overflowing;	/* have updates been dropped since the daemon was last sent some? */
+};
+
+/*
+ * Execution context of an RRD logger. It has no lock of its own: calls
+ * have to be serialized by the caller.
  */
 struct rrd_logger
 {
 	struct rrd_cfg cfg;
-	struct strbuf data;
+	struct rrd_file files[NUM_SLOTS];	/* state of each database file */
+	struct rrdcached rrdcached;	/* connection to cfg.daemon (if any) */
 };
 
 void rrd_logger_init(struct rrd_logger *logger);
+void rrd_logger_start(struct rrd_logger *logger);
 void rrd_logger_free(struct rrd_logger *logger);
+void rrd_logger_flush(struct rrd_logger *logger);
+
+/*
+ * Have @logger, started but not yet passed any reading, carry on from @old,
+ * which is about to be freed: readings of files both log which @old holds
+ * back or coalesces are moved to @logger, and @old writes out its buffered
+ * updates, so that @logger doesn't drop readings as late for updates it
+ * didn't know about.
+ */
+void rrd_logger_take_over(struct rrd_logger *logger, struct rrd_logger *old);
+
+/*
+ * Write out batches of updates buffered for cfg.flush_interval or longer.
+ * Batches are otherwise only looked at as readings come, so this is to be
+ * called every now and then in case they stop coming.
+ */
+void rrd_logger_flush_due(struct rrd_logger *logger);
+
+/*
+ * Write out all updates buffered, without making updates of readings still
+ * held back or being coalesced. For each slot, lower @watermarks to the time
+ * of the oldest reading which hasn't been written yet, if there's one,
+ * including readings of updates rrdcached hasn't taken or written out.
+ */
+void rrd_logger_sync(struct rrd_logger *logger, time_t watermarks[NUM_SLOTS]);
 
 void rrd_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
 
+/*
+ * Series of values of one field fetched from an RRD database file, chunk
+ * by chunk as it's read.
+ */
+struct rrd_series
+{
+	char *path;		/* path of the file */
+	const char *cf;		/* consolidation function */
+	const char *ds;		/* data source of the field */
+	time_t next;		/* start of the range not fetched yet */
+	time_t end;		/* end of the range */
+	time_t last;		/* time of the last row read */
+
+	time_t start;		/* time of the first row of the chunk */
+	unsigned long step;	/* time between rows */
+	unsigned long ds_cnt;	/* number of data sources in a row */
+	unsigned long ds_index;	/* index of the field's data source */
+	char **ds_names;	/* names of data sources */
+	double *data;		/* rows of values of the chunk */
+	size_t num_rows;	/* number of rows of the chunk */
+	size_t row;		/* index of the next row */
+};
+
+/*
+ * Fetch values of @field of readings from @slot within [@start, @end]
+ * using consolidation function @cf ("AVERAGE", "MIN" or "MAX"). The
+ * resolution of the series is chosen by librrd to be at least @step.
+ * Only the first chunk of the series is fetched here, the rest as
+ * rrd_series_next gets to it.
+ *
+ * Return value:
+ *	Zero on success, -1 if the field isn't logged or fetch fails.
+ */
+int rrd_series_fetch(struct rrd_cfg *cfg, int slot, const char *field,
+	const char *cf, time_t start, time_t end, unsigned long step,
+	struct rrd_series *series);
+
+/*
+ * Get the next row of @series: its time into @t and its value into
+ * @value (NAN if unknown).
+ *
+ * Return value:
+ *	false if there are no more rows.
+ */
+bool rrd_series_next(struct rrd_series *series, time_t *t, double *value);
+
+void rrd_series_free(struct rrd_series *series);
+
 #endif
@@ -0,0 +1,69 @@
+#ifndef RRDCACHED_H
+#define RRDCACHED_H
+
+#include "common.h"
+#include "strbuf.h"
+
+#include <stdbool.h>
+
+#define	RRDCACHED_IN_SIZE	1024	/* longest reply line read */
+
+/*
+ * Connection to an rrdcached daemon, which caches updates of RRD files
+ * and writes them out in bulk. Commands are pipelined: they're sent
+ * without waiting, and replies are read as they come.
+ */
+struct rrdcached
+{
+	char *path;		/* path of the daemon's Unix socket */
+	int fd;			/* socket descriptor (-1 if not connected) */
+	struct strbuf out;	/* commands not sent yet, whole lines */
+	size_t out_sent;	/* bytes of the first line of @out sent */
+	char in[RRDCACHED_IN_SIZE];	/* bytes of replies not processed yet */
+	size_t in_len;		/* number of bytes in @in */
+	size_t num_replies;	/* replies to commands sent still to come */
+	size_t num_lines;	/* lines of the reply being read still to come */
+	ulong_t retry_at;	/* when to try to connect again (monotonic ms) */
+	ulong_t retry_interval;	/* how long to wait before that (ms) */
+	bool failing;		/* has connecting failed since the last success? */
+};
+
+/*
+ * Updates of one RRD file to be sent to the daemon.
+ */
+struct rrdcached_update
+{
+	const char *path;	/* path of the file */
+	size_t count;		/* number of @values */
+	const char **values;	/* "timestamp:values" updates */
+};
+
+/*
+ * Initialize @rc to talk to the daemon listening at @addr, which is
+ * either a path of a Unix socket or "unix:" followed by one.
+ */
+void rrdcached_init(struct rrdcached *rc, char *addr);
+void rrdcached_free(struct rrdcached *rc);
+
+/*
+ * Queue @count updates to be sent to the daemon, and send what can be
+ * sent and read the replies which have come, without waiting. Updates the
+ * daemon rejects are logged. While the daemon can't be reached, connecting
+ * is tried again with exponential backoff.
+ *
+ * Return value:
+ *	Zero if the updates were queued, -1 if the daemon can't be reached
+ *	or doesn't keep up, in which case the caller keeps the updates.
+ */
+int rrdcached_send(struct rrdcached *rc, struct rrdcached_update *updates, size_t count);
+
+/*
+ * Ask the daemon to write out updates of @count files at @paths, and wait
+ * for it to do so, but no longer than a few seconds.
+ *
+ * Return value:
+ *	Zero on success, -1 if the daemon can't be reached or didn't reply.
+ */
+int rrdcached_flush(struct rrdcached *rc, const char **paths, size_t count);
+
+#endif
@@ -1,12 +1,50 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "reading.h"
+#include "rollup.h"
+#include "rrd-logger.h"
+#include "store.h"
+#include "tsdb.h"
 #include "wmr200.h"
+#include <poll.h>
 #include <pthread.h>
+#include <semaphore.h>
 
 struct wmr_server_cfg
 {
-	unsigned port;		/* TCP port number */
+	unsigned port;			/* TCP port number */
+	unsigned request_timeout;	/* how long to wait for a request (ms) */
+	unsigned max_wait;		/* longest wait a client may ask for (s) */
+	unsigned history_len;		/* readings kept in memory per sensor */
+	unsigned keyframe_interval;	/* readings streamed between keyframes */
+	unsigned queue_len;		/* readings queued for the server thread */
+	unsigned replica_log_len;	/* readings kept for replicas to catch up */
+};
+
+struct conn;
+struct wmr_server;
+
+/*
+ * A site whose data the server serves. A server normally has a single
+ * unnamed site, the station it's connected to (or mirrors). A gateway has
+ * a named site for every upstream meteod it mirrors.
+ */
+struct server_site
+{
+	char *name;			/* site name (NULL for the local site) */
+	struct wmr_server *srv;		/* the server the site belongs to */
+	struct wmr_store store;		/* latest data of the site */
+	struct conn *waiters[NUM_SLOTS];	/* clients waiting for a reading */
+};
+
+/*
+ * A reading queued for the server thread, with the site it comes from.
+ */
+struct queued_reading
+{
+	struct server_site *site;
+	struct wmr_reading reading;
 };
 
 /*
@@ -14,14 +52,44 @@ struct wmr_server_cfg
  */
 struct wmr_server
 {
+	struct wmr_server_cfg cfg;	/* server configuration */
 	struct wmr200 *wmr;	/* the device we serve data for */
+	struct server_site **sites;	/* sites being served */
+	size_t num_sites;	/* number of @sites */
+	struct rrd_cfg *rrd_cfg;	/* RRD files to serve history from (or NULL) */
+	struct tsdb *tsdb;	/* time-series store to serve history from (or NULL) */
+	struct rollup *rollup;	/* rollups to serve (or NULL) */
 	int fd;			/* server socket descriptor */
+	int event_fd;		/* eventfd signalled when the store changes */
+	struct conn *conns;	/* linked list of client connections */
+	struct pollfd *pfds;	/* poll(2) descriptor array */
+	size_t num_pfds;	/* size of @pfds */
+	struct conn *subscribers;	/* clients streaming readings */
+
+	struct queued_reading *queue;	/* readings not yet seen by the server thread */
+	size_t queue_head;		/* index of the oldest reading in @queue */
+	size_t queue_len;		/* number of readings in @queue */
+	pthread_mutex_t queue_lock;	/* protects @queue and the reconfiguration */
 	pthread_t thread_id;	/* server thread ID */
+
+	struct wmr_server_cfg new_cfg;	/* configuration to switch to */
+	struct rrd_cfg *new_rrd_cfg;	/* RRD files to switch to */
+	int new_fd;		/* socket to listen on from now on (or -1) */
+	bool reconfiguring;	/* has the server thread got to switch? */
+	sem_t reconfigured;	/* posted when it has switched */
 };
 
 void server_init(struct wmr_server *srv);
+void server_free(struct wmr_server *srv);
 void server_set_device(struct wmr_server *srv, struct wmr200 *wmr);
+struct server_site *server_add_site(struct wmr_server *srv, char *name);
 int server_start(struct wmr_server *srv);
 void server_stop(struct wmr_server *srv);
+int server_reconfigure(struct wmr_server *srv, struct wmr_server_cfg *cfg,
+	struct rrd_cfg *rrd_cfg);
+void server_render_snapshot(struct wmr_server *srv, struct strbuf *out);
+
+void server_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+void server_store_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
 
 #endif
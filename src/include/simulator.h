@@ -0,0 +1,33 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include "transport.h"
+
+/*
+ * Simulator configuration.
+ */
+struct simulator_cfg
+{
+	double speed;		/* how many times faster than real time (0 for no delays) */
+	unsigned num_sensors;	/* external temperature sensors (up to 9) */
+	unsigned history;	/* records in the data logger at start (meteod erases them) */
+	unsigned bad_checksum;	/* one in how many packets has a bad checksum (0 for none) */
+	unsigned truncated;	/* one in how many packets is cut short (0 for none) */
+	unsigned stall;		/* one in how many packets is delayed (0 for none) */
+	unsigned stall_len;	/* how long a packet is delayed (ms) */
+	unsigned seed;		/* seed of the weather (0 for a random one) */
+};
+
+/*
+ * Simulate a WMR200 station. The simulated station sends readings of
+ * made-up weather at about the rate a real one does, or @cfg.speed times
+ * that, keeps records in its data logger when it gets no heartbeats and
+ * replies to commands like a real one would. The clock of the station
+ * starts at the current time and runs @cfg.speed times as fast.
+ *
+ * Return value:
+ *	The transport to talk to the station over.
+ */
+struct wmr_transport *simulator_open(struct simulator_cfg *cfg);
+
+#endif
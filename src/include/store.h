@@ -0,0 +1,130 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include "reading.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * In-memory history of a slot: a ring buffer of readings ordered by time.
+ */
+struct store_history
+{
+	struct wmr_reading *readings;	/* the ring buffer */
+	size_t head;			/* index of the oldest reading */
+	size_t len;			/* number of readings */
+};
+
+/*
+ * Aggregate of a field over a range of readings.
+ */
+struct store_agg
+{
+	size_t count;		/* number of readings */
+	double sum;		/* sum of values */
+	double min;		/* minimum value */
+	double max;		/* maximum value */
+};
+
+/*
+ * Latest-data store. Keeps the latest reading of every kind, no matter
+ * where the readings came from, and a generation counter which is
+ * incremented each time the latest data change (uptime of WMR_META
+ * readings aside). Also keeps the last @history_len readings of every
+ * slot, and the last @log_len readings pushed in the order they were,
+ * which replicas are fed from.
+ *
+ * The store is written from the thread which dispatches readings and read
+ * by the server, hence all access is serialized with @lock.
+ */
+struct wmr_store
+{
+	pthread_mutex_t lock;		/* protects everything below */
+	struct wmr_latest_data latest;	/* latest readings */
+	ulong_t generation;		/* incremented with every change */
+	ulong_t seq;			/* number of readings pushed */
+	struct store_history history[NUM_SLOTS];	/* recent readings */
+	size_t history_len;		/* capacity of each history */
+	struct wmr_reading *log;	/* recent readings, reading N at N % @log_len */
+	size_t log_len;			/* capacity of @log */
+};
+
+void store_init(struct wmr_store *store, size_t history_len, size_t log_len);
+void store_free(struct wmr_store *store);
+
+/*
+ * Put @reading into @store's history and, unless a newer reading of the
+ * same kind is already present, into the latest data (incrementing the
+ * generation).
+ *
+ * Return value:
+ *	Sequence number of @reading, i.e. the number of readings pushed
+ *	into @store so far.
+ */
+ulong_t store_push(struct wmr_store *store, struct wmr_reading *reading);
+
+/*
+ * Copy the latest data from @store into @latest.
+ *
+ * Return value:
+ *	Generation of the copied data.
+ */
+ulong_t store_get_latest(struct wmr_store *store, struct wmr_latest_data *latest);
+
+/*
+ * Return current generation of @store.
+ */
+ulong_t store_get_generation(struct wmr_store *store);
+
+/*
+ * Copy the latest reading of @slot from @store into @reading.
+ *
+ * Return value:
+ *	False if no reading of @slot has been received yet.
+ */
+bool store_get_reading(struct wmr_store *store, int slot, struct wmr_reading *reading);
+
+/*
+ * Return time of the oldest reading in the history of @slot, or -1 if
+ * the history is empty.
+ */
+time_t store_history_oldest(struct wmr_store *store, int slot);
+
+/*
+ * Copy the history of all slots into a newly allocated array stored into
+ * @readings. The sequence number of the latest reading pushed is stored
+ * into @seq.
+ *
+ * Return value:
+ *	Number of readings copied.
+ */
+size_t store_history_snapshot(struct wmr_store *store, struct wmr_reading **readings,
+	ulong_t *seq);
+
+/*
+ * Copy at most @count readings pushed into @store after the reading with
+ * sequence number @seq into @readings, in the order they were pushed.
+ *
+ * Return value:
+ *	Number of readings copied, -1 if some of them aren't kept anymore.
+ */
+ssize_t store_log_read(struct wmr_store *store, ulong_t seq,
+	struct wmr_reading *readings, size_t count);
+
+/*
+ * Forget the history of all slots and the latest data.
+ */
+void store_clear(struct wmr_store *store);
+
+/*
+ * Aggregate @field of readings in the history of @slot whose time is
+ * within [@from, @to). The result is stored into @agg.
+ */
+void store_history_aggregate(struct wmr_store *store, int slot,
+	const struct reading_field *field, time_t from, time_t to,
+	struct store_agg *agg);
+
+#endif
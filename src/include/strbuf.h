@@ -16,9 +16,21 @@ void strbuf_init(struct strbuf *buf, size_t init_size);
 void strbuf_free(struct strbuf *buf);
 void strbuf_reset(struct strbuf *buf);
 size_t strbuf_putc(struct strbuf *buf, char c);
-size_t strbuf_puts(struct strbuf *buf, char *str);
+size_t strbuf_puts(struct strbuf *buf, const char *str);
+size_t strbuf_putn(struct strbuf *buf, const char *str, size_t len);
 
-void strbuf_prepare_write(struct strbuf *buf, size_t count);
+/*
+ * Append @value in decimal, like "%llu" and "%lli" would.
+ */
+size_t strbuf_putu(struct strbuf *buf, unsigned long long value);
+size_t strbuf_puti(struct strbuf *buf, long long value);
+
+/*
+ * Append @value with @prec decimals, like "%.*f" would.
+ */
+size_t strbuf_putf(struct strbuf *buf, double value, unsigned prec);
+
+void strbuf_prepare_append(struct strbuf *buf, size_t count);
 
 size_t strbuf_strlen(struct strbuf *buf);
 char *strbuf_get_string(struct strbuf *buf);
@@ -0,0 +1,98 @@
+#ifndef TEXTLOG_H
+#define TEXTLOG_H
+
+#include "common.h"
+#include "reading.h"
+#include "strbuf.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Format of lines of a text log.
+ */
+enum textlog_format
+{
+	TEXTLOG_CSV,		/* "<time>,<sensor>,<field>,<value>" per field */
+	TEXTLOG_INFLUX,		/* InfluxDB line protocol, a line per reading */
+};
+
+/*
+ * Text logger configuration.
+ */
+struct textlog_cfg
+{
+	char *path;			/* path of the log file */
+	enum textlog_format format;	/* format of lines */
+	size_t buffer_size;		/* bytes buffered before they're written */
+	unsigned flush_interval;	/* longest a line stays buffered (ms) */
+	off_t rotate_size;		/* size the log is rotated at (0 for never) */
+	bool rotate_daily;		/* rotate the log when the (UTC) day changes? */
+	char *compress;			/* command to compress rotated logs with (or NULL) */
+};
+
+/*
+ * Point within a buffer where lines of readings of another day start.
+ */
+struct textlog_mark
+{
+	size_t offset;		/* offset of the first line */
+	int64_t day;		/* day of the readings (days since the epoch) */
+};
+
+/*
+ * Buffer of lines of a text log.
+ */
+struct textlog_buf
+{
+	struct strbuf text;		/* the lines */
+	struct textlog_mark *marks;	/* where days start, the first at offset 0 */
+	size_t num_marks;		/* number of @marks */
+	size_t marks_size;		/* capacity of @marks */
+};
+
+/*
+ * Text logger. Lines are appended to a buffer which the writer thread
+ * writes out, while another buffer is being filled.
+ */
+struct textlog
+{
+	struct textlog_cfg cfg;		/* configuration */
+	int fd;				/* log file descriptor (the writer's) */
+	off_t size;			/* size of the log file (the writer's) */
+	int64_t day;			/* day of its first reading (the writer's) */
+
+	struct textlog_buf pending;	/* lines not yet written */
+	ulong_t pending_since;		/* when the oldest of them came (monotonic ms) */
+	struct textlog_buf spare;	/* buffer being written */
+	ulong_t dropped;		/* readings dropped since the last write */
+	ulong_t sync_requested;		/* number of textlog_sync calls */
+	ulong_t synced;			/* number of them served */
+	pthread_mutex_t lock;		/* protects the above and @compress_queue */
+	pthread_cond_t cond;		/* signalled when there's work to do */
+	pthread_cond_t done;		/* signalled when a sync is served */
+	bool running;			/* is the writer thread running? */
+	pthread_t thread_id;		/* writer thread ID */
+
+	bool compressing;		/* is the compressor thread running? */
+	char **compress_queue;		/* rotated logs to be compressed */
+	size_t num_compress;		/* number of @compress_queue */
+	pthread_cond_t compress_cond;	/* signalled when a log is rotated */
+	pthread_t compress_thread_id;	/* compressor thread ID */
+};
+
+void textlog_init(struct textlog *log);
+int textlog_start(struct textlog *log);
+void textlog_free(struct textlog *log);
+
+/*
+ * Write out and sync all lines buffered so far.
+ */
+void textlog_sync(struct textlog *log);
+
+void textlog_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+#endif
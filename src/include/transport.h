@@ -0,0 +1,87 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct sockaddr_nl;
+
+/*
+ * A channel frames are exchanged with the station over: the USB HID
+ * device itself, or a stand-in for it, such as a capture being replayed.
+ */
+struct wmr_transport
+{
+	/*
+	 * Read a frame of at most @size bytes into @buf, waiting for one
+	 * as long as it takes.
+	 *
+	 * Return value:
+	 *	Length of the frame, 0 if there won't be any more frames,
+	 *	-1 on error.
+	 */
+	ssize_t (*read)(struct wmr_transport *tr, byte_t *buf, size_t size);
+
+	/*
+	 * Write frame @data of @len bytes. May be called from any thread.
+	 *
+	 * Return value:
+	 *	Number of bytes written, -1 on error.
+	 */
+	ssize_t (*write)(struct wmr_transport *tr, const byte_t *data, size_t len);
+
+	/*
+	 * Close the transport and free it.
+	 */
+	void (*close)(struct wmr_transport *tr);
+};
+
+/*
+ * Open the WMR200 connected over USB.
+ *
+ * Return value:
+ *	The transport, NULL on error.
+ */
+struct wmr_transport *transport_open_hid(void);
+
+/*
+ * Watch for the WMR200 being plugged in, by listening to the uevents the
+ * kernel sends over netlink as devices are added.
+ *
+ * Return value:
+ *	A file descriptor which is readable when uevents come (see
+ *	transport_hid_plugged), -1 on error (see errno).
+ */
+int transport_watch_hid(void);
+
+/*
+ * Read all uevents pending on @fd, returned by transport_watch_hid,
+ * without waiting for more.
+ *
+ * Return value:
+ *	true if the WMR200 may have been plugged in since, false otherwise.
+ */
+bool transport_hid_plugged(int fd);
+
+/*
+ * Is uevent @uevent of @len bytes, received from @from, about the WMR200
+ * being added? @uevent[@len] has to be NUL. Used by transport_hid_plugged.
+ */
+bool transport_uevent_plugged(const struct sockaddr_nl *from, const char *uevent,
+	size_t len);
+
+/*
+ * Replay the frames received from the station in capture @path (see
+ * capture.h). Frames are read @speed times as fast as they were
+ * captured, or as fast as they're asked for if @speed is zero. Frames
+ * written are dropped, as the capture has the replies to them already.
+ *
+ * Return value:
+ *	The transport, NULL on error.
+ */
+struct wmr_transport *transport_open_replay(const char *path, double speed);
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef TSDB_H
+#define TSDB_H
+
+#include "reading.h"
+#include "wmr200.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define	TSDB_MAX_COLUMNS	8	/* most numeric fields of a reading */
+#define	TSDB_NAME_LEN		32	/* longest field name stored, with NUL */
+
+/*
+ * Time-series store configuration.
+ */
+struct tsdb_cfg
+{
+	char *root;		/* directory of segment files */
+	unsigned segment_len;	/* readings per segment */
+};
+
+/*
+ * Sealed segment: a memory-mapped file holding readings of one slot.
+ */
+struct tsdb_segment
+{
+	void *map;			/* the mapped file */
+	size_t map_len;			/* length of @map */
+	time_t first;			/* time of the first reading */
+	time_t last;			/* time of the last reading */
+	size_t count;			/* number of readings */
+	size_t num_columns;		/* number of fields stored */
+	size_t num_blocks;		/* number of blocks */
+	const char (*names)[TSDB_NAME_LEN];	/* names of fields stored */
+	const uint64_t *streams;	/* offsets of streams within @map */
+	const uint64_t *index;		/* sparse time index of blocks */
+};
+
+/*
+ * Readings of one slot: sealed segments, readings being sealed and the
+ * open segment, which is kept in memory until it's full.
+ */
+struct tsdb_series
+{
+	size_t num_columns;		/* number of fields stored */
+	const struct reading_field *fields[TSDB_MAX_COLUMNS];	/* fields stored */
+	struct tsdb_segment **segments;	/* sealed segments, ordered by time */
+	size_t num_segments;		/* number of @segments */
+	unsigned next_seq;		/* sequence number of the next segment file */
+	time_t *times;			/* times of open readings, ordered */
+	double *values;			/* their values, @num_columns per reading */
+	size_t count;			/* number of open readings */
+	size_t size;			/* capacity of @times */
+	time_t sealed;			/* time of the latest reading sealed */
+	time_t *sealing_times;		/* times of readings being sealed */
+	double *sealing_values;		/* their values */
+	size_t sealing_count;		/* number of readings being sealed */
+	unsigned sealing_seq;		/* sequence number of their segment file */
+};
+
+/*
+ * Append-only time-series store.
+ */
+struct tsdb
+{
+	struct tsdb_cfg cfg;			/* configuration */
+	pthread_mutex_t lock;			/* protects @series */
+	struct tsdb_series series[NUM_SLOTS];	/* readings of each slot */
+	pthread_cond_t seal_cond;		/* signalled when there's a seal to do */
+	bool sealing;				/* is the sealer thread running? */
+	pthread_t sealer_id;			/* sealer thread ID */
+};
+
+/*
+ * State of a timestamp decoder.
+ */
+struct tsdb_time_coder
+{
+	int64_t prev;			/* previous timestamp */
+	int64_t delta;			/* previous delta */
+};
+
+/*
+ * State of a value decoder.
+ */
+struct tsdb_value_coder
+{
+	uint64_t prev;			/* bits of the previous value */
+	unsigned lead;			/* leading zero bits of the previous XOR */
+	unsigned trail;			/* trailing zero bits of the previous XOR */
+};
+
+/*
+ * Iterator over values of a field within a time range.
+ */
+struct tsdb_iter
+{
+	struct tsdb_segment **segments;	/* sealed segments iterated over */
+	size_t num_segments;		/* number of @segments */
+	const char *field;		/* name of the field */
+	time_t start;			/* start of the range */
+	time_t end;			/* end of the range (exclusive) */
+	size_t seg;			/* index of the current segment */
+	bool in_segment;		/* is the current segment entered? */
+	size_t column;			/* column of @field in the segment */
+	size_t block;			/* index of the current block */
+	size_t left;			/* readings left in the block */
+	bool first;			/* is the next reading first in the block? */
+	size_t time_pos;		/* bit position in the timestamp stream */
+	size_t value_pos;		/* bit position in the value stream */
+	struct tsdb_time_coder tc;	/* timestamp decoder */
+	struct tsdb_value_coder vc;	/* value decoder */
+	time_t *times;			/* copy of open readings' times */
+	double *values;			/* copy of open readings' values */
+	size_t count;			/* number of open readings copied */
+	size_t pos;			/* index of the next open reading */
+};
+
+void tsdb_init(struct tsdb *db);
+int tsdb_start(struct tsdb *db);
+void tsdb_free(struct tsdb *db);
+
+void tsdb_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg);
+
+/*
+ * Write readings of open segments to disk. For each slot whose readings
+ * couldn't be written, lower @watermarks to the time of the oldest one.
+ */
+void tsdb_sync(struct tsdb *db, time_t watermarks[NUM_SLOTS]);
+
+/*
+ * Return time of the oldest reading of @slot, or -1 if there's none.
+ */
+time_t tsdb_oldest(struct tsdb *db, int slot);
+
+/*
+ * Start iterating over values of @field of readings of @slot whose time
+ * is within [@start, @end).
+ *
+ * Return value:
+ *	Zero on success, -1 if @field isn't stored.
+ */
+int tsdb_iter_init(struct tsdb *db, int slot, const char *field, time_t start,
+	time_t end, struct tsdb_iter *it);
+
+/*
+ * Get the next reading: its time into @t and the field's value into @value.
+ *
+ * Return value:
+ *	false if there are no more readings.
+ */
+bool tsdb_iter_next(struct tsdb_iter *it, time_t *t, double *value);
+
+void tsdb_iter_free(struct tsdb_iter *it);
+
+#endif
@@ -162,6 +162,13 @@ struct wmr_reading
  */
 const char *wmr_sensor_name(struct wmr_reading *reading);
 
+/*
+ * Return the static string which equals @str and which this module uses
+ * in readings (such as wind direction "NNE" or status "ok"), or NULL if
+ * there's no such string.
+ */
+const char *wmr_lookup_string(const char *str);
+
 /*
  * A structure to hold latest data, i.e. the latest reading of every
  * possible kind. And for each temperature sensor, too.
@@ -208,6 +215,15 @@ void wmr_end();
  */
 struct wmr200 *wmr_open(void);
 
+struct wmr_transport;
+
+/*
+ * Like wmr_open, but talk to the station over transport @tr, such as a
+ * capture being replayed (see transport.h). The device handle takes
+ * over @tr, which is closed with it (or right away on failure).
+ */
+struct wmr200 *wmr_open_transport(struct wmr_transport *tr);
+
 /*
  * Close connection to the specified device.
  */
@@ -227,6 +243,26 @@ void wmr_close(struct wmr200 *wmr);
  */
 int wmr_start(struct wmr200 *wmr);
 
+/*
+ * Unless a heartbeat is sent every 30 seconds, the station switches from
+ * real-time mode to logging mode and no readings are transfered. A little
+ * less than that is used, as otherwise the station often switches anyway
+ * and readings which would be sent right away come as historic records.
+ */
+#define	WMR_HEARTBEAT_INTERVAL	25	/* s */
+
+/*
+ * Like wmr_start, but leave sending heartbeats to the caller, who has to
+ * call wmr_heartbeat every WMR_HEARTBEAT_INTERVAL seconds, starting right
+ * away, such as from an event loop of its own.
+ */
+int wmr_start_receiver(struct wmr200 *wmr);
+
+/*
+ * Send a heartbeat to @wmr and pass a WMR_META reading to the loggers.
+ */
+void wmr_heartbeat(struct wmr200 *wmr);
+
 /*
  * End communication with @wmr. The station will switch to data
  * logging mode immediately.
@@ -242,6 +278,12 @@ void wmr_stop(struct wmr200 *wmr);
  */
 void wmr_register_logger(struct wmr200 *wmr, wmr_logger_t *logger, void *arg);
 
+/*
+ * Wait until the reading being passed to the loggers, if any, has reached
+ * all of them.
+ */
+void wmr_wait_dispatch(struct wmr200 *wmr);
+
 /*
  * Register error handler @handler with @wmr. Extra argument @arg will
  * be passed to @handler upon invocation.
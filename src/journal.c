@@ -0,0 +1,585 @@
+/*
+ * Write-ahead journal of readings.
+ *
+ * Readings are recorded as they are dispatched, before other loggers get
+ * them. Records are buffered and the commit thread writes and fdatasyncs
+ * them in groups, once cfg.group_size of them are buffered or the oldest
+ * one has waited cfg.group_interval. Should meteod or the host crash, only
+ * readings not yet committed are lost; the rest is replayed into loggers
+ * at startup.
+ *
+ * At checkpoints, which the owner of the journal takes every
+ * cfg.checkpoint_interval, loggers are made to write out what they can, and
+ * records of readings which they won't need replayed anymore are dropped:
+ * the journal is rewritten to a new file which replaces the old one.
+ * Readings keep coming meanwhile, and those recorded once the checkpoint
+ * has begun are kept whatever the loggers say. Those recorded before have
+ * to reach all loggers before the checkpoint handler asks them, which
+ * requires readings to be passed to loggers one at a time (see
+ * invoke_handlers in wmr200.c).
+ *
+ * A record is a header followed by the payload (in host byte order):
+ *
+ *     uint16_t len		length of the payload
+ *     uint32_t sum		FNV-1a hash of the payload
+ *     byte_t type		type of the reading
+ *     int64_t time		time of the reading
+ *     fields			in the order of reading_fields(): floats and
+ *				uints take 4 bytes, ulongs and times 8 bytes,
+ *				strings a length byte and the characters
+ *
+ * A record torn by a crash fails the check, and it and everything after
+ * it is ignored.
+ */
+
+#include "common.h"
+#include "journal.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define	DEFAULT_GROUP_SIZE		32
+#define	DEFAULT_GROUP_INTERVAL		1000	/* ms */
+#define	DEFAULT_CHECKPOINT_INTERVAL	600	/* s */
+#define	HEADER_LEN		(sizeof(uint16_t) + sizeof(uint32_t))
+#define	MAX_STRING_LEN		255
+
+void journal_init(struct journal *journal)
+{
+	pthread_condattr_t attr;
+
+	journal->cfg.path = NULL;
+	journal->cfg.group_size = DEFAULT_GROUP_SIZE;
+	journal->cfg.group_interval = DEFAULT_GROUP_INTERVAL;
+	journal->cfg.checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+
+	journal->fd = -1;
+	memset(&journal->pending, 0, sizeof(journal->pending));
+	memset(&journal->spare, 0, sizeof(journal->spare));
+	journal->num_pending = 0;
+	journal->pending_since = 0;
+	journal->running = false;
+	journal->checkpoint = NULL;
+	journal->checkpoint_arg = NULL;
+	journal->num_logged = 0;
+
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_mutex_init(&journal->io_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&journal->cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void journal_set_checkpoint_handler(struct journal *journal, journal_checkpoint_t *func,
+	void *arg)
+{
+	journal->checkpoint = func;
+	journal->checkpoint_arg = arg;
+}
+
+static void buf_put(struct journal_buf *buf, const void *data, size_t len)
+{
+	if (buf->len + len > buf->size) {
+		buf->size = MAX(2 * buf->size, MAX(buf->len + len, 1024));
+		buf->data = realloc_safe(buf->data, buf->size);
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static uint32_t fnv1a(const byte_t *data, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 16777619U;
+
+	return hash;
+}
+
+/*
+ * Append a record of @reading to @buf.
+ */
+static void encode_record(struct journal_buf *buf, struct wmr_reading *reading)
+{
+	const struct reading_field *fields;
+	size_t start = buf->len;
+	size_t count;
+	size_t i;
+	int64_t time = reading->time;
+	const char *str;
+	byte_t len;
+	uint16_t payload_len = 0;
+	uint32_t sum = 0;
+	void *ptr;
+
+	buf_put(buf, &payload_len, sizeof(payload_len));
+	buf_put(buf, &sum, sizeof(sum));
+	buf_put(buf, &reading->type, sizeof(reading->type));
+	buf_put(buf, &time, sizeof(time));
+
+	fields = reading_fields(reading->type, &count);
+	for (i = 0; i < count; i++) {
+		ptr = (byte_t *)reading + fields[i].offset;
+
+		switch (fields[i].kind) {
+		case FIELD_FLOAT:
+			buf_put(buf, ptr, sizeof(float));
+			break;
+		case FIELD_UINT:
+			buf_put(buf, ptr, sizeof(uint_t));
+			break;
+		case FIELD_ULONG:
+			buf_put(buf, ptr, sizeof(ulong_t));
+			break;
+		case FIELD_TIME:
+			time = *(time_t *)ptr;
+			buf_put(buf, &time, sizeof(time));
+			break;
+		case FIELD_STRING:
+			str = *(const char **)ptr ? *(const char **)ptr : "";
+			len = MIN(strlen(str), MAX_STRING_LEN);
+			buf_put(buf, &len, sizeof(len));
+			buf_put(buf, str, len);
+			break;
+		}
+	}
+
+	payload_len = buf->len - start - HEADER_LEN;
+	sum = fnv1a(buf->data + start + HEADER_LEN, payload_len);
+	memcpy(buf->data + start, &payload_len, sizeof(payload_len));
+	memcpy(buf->data + start + sizeof(payload_len), &sum, sizeof(sum));
+}
+
+/*
+ * Take @len bytes off the payload at @data of @left bytes into @dest.
+ */
+static int take(const byte_t **data, size_t *left, void *dest, size_t len)
+{
+	if (*left < len)
+		return -1;
+
+	memcpy(dest, *data, len);
+	*data += len;
+	*left -= len;
+	return 0;
+}
+
+/*
+ * Decode payload @data of @len bytes into @reading.
+ */
+static int decode_record(const byte_t *data, size_t len, struct wmr_reading *reading)
+{
+	const struct reading_field *fields;
+	char str[MAX_STRING_LEN + 1];
+	size_t count;
+	size_t i;
+	int64_t time;
+	byte_t str_len;
+	void *ptr;
+
+	memset(reading, 0, sizeof(*reading));
+	if (take(&data, &len, &reading->type, sizeof(reading->type)) != 0
+		|| take(&data, &len, &time, sizeof(time)) != 0)
+		return -1;
+	reading->time = time;
+
+	fields = reading_fields(reading->type, &count);
+	if (count == 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		ptr = (byte_t *)reading + fields[i].offset;
+
+		switch (fields[i].kind) {
+		case FIELD_FLOAT:
+			if (take(&data, &len, ptr, sizeof(float)) != 0)
+				return -1;
+			break;
+		case FIELD_UINT:
+			if (take(&data, &len, ptr, sizeof(uint_t)) != 0)
+				return -1;
+			break;
+		case FIELD_ULONG:
+			if (take(&data, &len, ptr, sizeof(ulong_t)) != 0)
+				return -1;
+			break;
+		case FIELD_TIME:
+			if (take(&data, &len, &time, sizeof(time)) != 0)
+				return -1;
+			*(time_t *)ptr = time;
+			break;
+		case FIELD_STRING:
+			if (take(&data, &len, &str_len, sizeof(str_len)) != 0
+				|| take(&data, &len, str, str_len) != 0)
+				return -1;
+			str[str_len] = '\0';
+			*(const char **)ptr = wmr_lookup_string(str);
+			break;
+		}
+	}
+
+	return len == 0 ? 0 : -1;
+}
+
+/*
+ * Get the record at @pos of @buf and advance @pos past it.
+ *
+ * Return value:
+ *	Zero on success, 1 at the end of @buf, -1 if the record is torn.
+ */
+static int next_record(struct journal_buf *buf, size_t *pos, struct wmr_reading *reading)
+{
+	uint16_t len;
+	uint32_t sum;
+
+	if (*pos == buf->len)
+		return 1;
+
+	if (buf->len - *pos < HEADER_LEN)
+		return -1;
+
+	memcpy(&len, buf->data + *pos, sizeof(len));
+	memcpy(&sum, buf->data + *pos + sizeof(len), sizeof(sum));
+	if (buf->len - *pos - HEADER_LEN < len
+		|| fnv1a(buf->data + *pos + HEADER_LEN, len) != sum
+		|| decode_record(buf->data + *pos + HEADER_LEN, len, reading) != 0)
+		return -1;
+
+	*pos += HEADER_LEN + len;
+	return 0;
+}
+
+static int write_all(int fd, const byte_t *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Sync the directory of @path, so that a file renamed to @path stays so.
+ */
+static int sync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int ret;
+	int fd;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	if ((slash = strrchr(dir, '/')) == NULL)
+		snprintf(dir, sizeof(dir), ".");
+	else if (slash == dir)
+		dir[1] = '\0';		/* the root */
+	else
+		*slash = '\0';
+
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+		return -1;
+	ret = fsync(fd);
+	(void) close(fd);
+	return ret;
+}
+
+/*
+ * Read the journal file into @buf.
+ */
+static int read_journal(struct journal *journal, struct journal_buf *buf)
+{
+	byte_t chunk[4096];
+	ssize_t ret;
+	int fd;
+
+	if ((fd = open(journal->cfg.path, O_RDONLY)) == -1) {
+		log_error("Cannot open journal %s: %s", journal->cfg.path, strerror(errno));
+		return -1;
+	}
+
+	while ((ret = read(fd, chunk, sizeof(chunk))) != 0) {
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			log_error("Cannot read journal %s: %s", journal->cfg.path, strerror(errno));
+			(void) close(fd);
+			return -1;
+		}
+		buf_put(buf, chunk, ret);
+	}
+
+	(void) close(fd);
+	return 0;
+}
+
+/*
+ * Write the buffered records. Called with @journal->lock held, which is
+ * released while writing.
+ */
+static void commit(struct journal *journal)
+{
+	struct journal_buf tmp;
+
+	pthread_mutex_unlock(&journal->lock);
+	pthread_mutex_lock(&journal->io_lock);
+	pthread_mutex_lock(&journal->lock);
+
+	tmp = journal->spare;
+	journal->spare = journal->pending;
+	journal->pending = tmp;
+	journal->pending.len = 0;
+	journal->num_pending = 0;
+
+	pthread_mutex_unlock(&journal->lock);
+
+	if (journal->spare.len > 0 && (write_all(journal->fd, journal->spare.data,
+		journal->spare.len) != 0 || fdatasync(journal->fd) != 0))
+		log_error("Cannot write journal %s: %s", journal->cfg.path, strerror(errno));
+
+	pthread_mutex_unlock(&journal->io_lock);
+	pthread_mutex_lock(&journal->lock);
+}
+
+static void *commit_thread(void *arg)
+{
+	struct journal *journal = (struct journal *)arg;
+	struct timespec ts;
+	ulong_t deadline;
+	ulong_t now;
+
+	pthread_mutex_lock(&journal->lock);
+
+	while (journal->running || journal->num_pending > 0) {
+		if (journal->num_pending == 0) {
+			pthread_cond_wait(&journal->cond, &journal->lock);
+			continue;
+		}
+
+		deadline = journal->pending_since + journal->cfg.group_interval;
+		now = monotonic_ms();
+		if (journal->running && journal->num_pending < journal->cfg.group_size
+			&& now < deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += (deadline - now) / 1000;
+			ts.tv_nsec += 1000000 * ((deadline - now) % 1000);
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&journal->cond, &journal->lock, &ts);
+			continue;
+		}
+
+		commit(journal);
+	}
+
+	pthread_mutex_unlock(&journal->lock);
+	return NULL;
+}
+
+static int open_journal(struct journal *journal)
+{
+	journal->fd = open(journal->cfg.path, O_WRONLY | O_CREAT | O_APPEND, 0640);
+	if (journal->fd == -1) {
+		log_error("Cannot open journal %s: %s", journal->cfg.path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int journal_start(struct journal *journal)
+{
+	int ret;
+
+	if (open_journal(journal) != 0)
+		return -1;
+
+	journal->running = true;
+	if ((ret = pthread_create(&journal->thread_id, NULL, commit_thread, journal)) != 0) {
+		log_error("Cannot create the journal thread: %s", strerror(ret));
+		journal->running = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+void journal_free(struct journal *journal)
+{
+	if (journal->running) {
+		pthread_mutex_lock(&journal->lock);
+		journal->running = false;
+		pthread_cond_signal(&journal->cond);
+		pthread_mutex_unlock(&journal->lock);
+		pthread_join(journal->thread_id, NULL);
+	}
+
+	if (journal->fd >= 0)
+		(void) close(journal->fd);
+
+	free(journal->pending.data);
+	free(journal->spare.data);
+	pthread_mutex_destroy(&journal->lock);
+	pthread_mutex_destroy(&journal->io_lock);
+	pthread_cond_destroy(&journal->cond);
+}
+
+ssize_t journal_replay(struct journal *journal, wmr_logger_t *func, void *arg)
+{
+	struct journal_buf buf = { NULL, 0, 0 };
+	struct wmr_reading reading;
+	ssize_t count = 0;
+	size_t pos = 0;
+	int ret;
+
+	pthread_mutex_lock(&journal->io_lock);
+	if (read_journal(journal, &buf) != 0) {
+		pthread_mutex_unlock(&journal->io_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&journal->io_lock);
+
+	while ((ret = next_record(&buf, &pos, &reading)) == 0) {
+		func(NULL, &reading, arg);
+		count++;
+	}
+
+	if (ret < 0)
+		log_warning("Journal %s is torn at offset %zu, ignoring the rest",
+			journal->cfg.path, pos);
+
+	free(buf.data);
+	return count;
+}
+
+/*
+ * Commit the readings recorded so far and drop from the journal those
+ * which are older than the watermark of their slot, but for those logged
+ * since @fence readings had been logged.
+ */
+static void compact(struct journal *journal, const time_t watermarks[NUM_SLOTS],
+	ulong_t fence)
+{
+	struct journal_buf old = { NULL, 0, 0 };
+	struct journal_buf new = { NULL, 0, 0 };
+	struct wmr_reading reading;
+	char tmp_path[PATH_MAX];
+	size_t num_records = 0;
+	size_t num_kept;
+	size_t pos = 0;
+	size_t start;
+	size_t i;
+	int slot;
+	int fd;
+
+	pthread_mutex_lock(&journal->io_lock);
+
+	if (read_journal(journal, &old) != 0)
+		goto out;
+
+	/* records not written yet go to the new file right away */
+	pthread_mutex_lock(&journal->lock);
+	buf_put(&old, journal->pending.data, journal->pending.len);
+	journal->pending.len = 0;
+	journal->num_pending = 0;
+	num_kept = journal->num_logged - fence;
+	pthread_mutex_unlock(&journal->lock);
+
+	/* the records kept anyway are the last ones */
+	while (next_record(&old, &pos, &reading) == 0)
+		num_records++;
+
+	pos = 0;
+	for (i = 0, start = pos; next_record(&old, &pos, &reading) == 0; i++, start = pos) {
+		slot = reading_slot(&reading);
+		if (i + num_kept >= num_records
+			|| (slot >= 0 && reading.time >= watermarks[slot]))
+			buf_put(&new, old.data + start, pos - start);
+	}
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->cfg.path);
+	if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0640)) == -1) {
+		log_error("Cannot create journal %s: %s", tmp_path, strerror(errno));
+		goto out;
+	}
+
+	if (write_all(fd, new.data, new.len) != 0 || fdatasync(fd) != 0
+		|| rename(tmp_path, journal->cfg.path) != 0) {
+		log_error("Cannot write journal %s: %s", tmp_path, strerror(errno));
+		(void) close(fd);
+		(void) unlink(tmp_path);
+		goto out;
+	}
+
+	(void) close(fd);
+	(void) close(journal->fd);
+	(void) open_journal(journal);
+
+	if (sync_dir(journal->cfg.path) != 0)
+		log_error("Cannot sync directory of journal %s: %s", journal->cfg.path,
+			strerror(errno));
+
+	log_debug("Journal compacted from %zu to %zu bytes", old.len, new.len);
+out:
+	pthread_mutex_unlock(&journal->io_lock);
+	free(old.data);
+	free(new.data);
+}
+
+void journal_checkpoint(struct journal *journal)
+{
+	time_t watermarks[NUM_SLOTS];
+	ulong_t fence;
+	size_t i;
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		watermarks[i] = LONG_MAX;
+
+	pthread_mutex_lock(&journal->lock);
+	fence = journal->num_logged;
+	pthread_mutex_unlock(&journal->lock);
+
+	if (journal->checkpoint != NULL)
+		journal->checkpoint(watermarks, journal->checkpoint_arg);
+
+	compact(journal, watermarks, fence);
+}
+
+void journal_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct journal *journal = (struct journal *)arg;
+
+	(void) wmr;
+
+	pthread_mutex_lock(&journal->lock);
+
+	if (journal->num_pending == 0)
+		journal->pending_since = monotonic_ms();
+	encode_record(&journal->pending, reading);
+	journal->num_pending++;
+	journal->num_logged++;
+
+	if (journal->num_pending == 1 || journal->num_pending >= journal->cfg.group_size)
+		pthread_cond_signal(&journal->cond);
+
+	pthread_mutex_unlock(&journal->lock);
+}
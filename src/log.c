@@ -8,16 +8,212 @@
  * Copyright (c) 2015 David Čepelík <cepelik@gymlit.cz>
  */
 
+/*
+ * Messages are formatted by the thread which logs them and put into a ring
+ * of RING_LEN slots, which the writer thread writes out. The ring is a
+ * bounded lock-free queue: each slot has a sequence number telling whether
+ * it's free for the producer of position `seq', or holds the message of
+ * position `seq - 1' for the writer. When the ring is full, messages are
+ * dropped and counted rather than waited for, so logging never blocks.
+ *
+ * Before log_start and after log_stop, messages are written right away.
+ * Threads which may be queueing a message are counted, so that log_stop
+ * can wait for them and write out what they've queued.
+ */
+
+
+#include "log.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
+#include <sys/types.h>
+#include <time.h>
+
+
+#define	RING_LEN	256	/* number of slots, a power of two */
+#define	MSG_LEN		240	/* longest message (longer ones are truncated) */
+
+
+struct slot
+{
+	atomic_size_t seq;	/* sequence number */
+	int priority;		/* priority of the message */
+	char msg[MSG_LEN];	/* the message */
+};
+
+static struct slot ring[RING_LEN];
+static atomic_size_t tail;		/* next position to be written to */
+static size_t head;			/* next position to be read (writer's) */
+static atomic_ulong dropped;		/* messages dropped for the ring was full */
+static sem_t queued;			/* posted for every message queued */
+static atomic_bool running;		/* is the writer thread running? */
+static atomic_uint queueing;		/* threads which may be queueing a message */
+static pthread_t writer_id;
+
+static struct log_cfg cfg = { LOG_INFO, LOG_TO_SYSLOG, NULL };
+static FILE *stream;			/* stream of LOG_TO_STDERR and LOG_TO_FILE */
+
+atomic_int log_level = LOG_INFO;
+
+
+static const char *
+priority_name(int priority)
+{
+	static const char *names[] = {
+		[LOG_EMERG] = "emerg",
+		[LOG_ALERT] = "alert",
+		[LOG_CRIT] = "crit",
+		[LOG_ERR] = "error",
+		[LOG_WARNING] = "warning",
+		[LOG_NOTICE] = "notice",
+		[LOG_INFO] = "info",
+		[LOG_DEBUG] = "debug",
+	};
+
+	return priority >= 0 && priority <= LOG_DEBUG ? names[priority] : "?";
+}
+
+
+/*
+ * Write a message out to the target.
+ */
+static void
+write_msg(int priority, const char *msg)
+{
+	struct timespec ts;
+	struct tm tm;
+	char stamp[32];
+
+	if (stream == NULL) {
+		syslog(priority, "%s", msg);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	localtime_r(&ts.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(stream, "%s.%03li %s: %s\n", stamp, ts.tv_nsec / 1000000,
+		priority_name(priority), msg);
+}
+
+
+/*
+ * Queue a message for the writer thread.
+ *
+ * Return value:
+ *	false if the ring is full.
+ */
+static bool
+enqueue(int priority, char *format, va_list ap)
+{
+	struct slot *slot;
+	size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	size_t seq;
+
+	for (;;) {
+		slot = &ring[pos % RING_LEN];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+		if (seq == pos) {
+			/* free, claim it unless another thread was faster */
+			if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if ((ssize_t)(seq - pos) < 0) {
+			/* the slot still holds a message from a lap ago */
+			return false;
+		}
+		else {
+			pos = atomic_load_explicit(&tail, memory_order_relaxed);
+		}
+	}
+
+	slot->priority = priority;
+	vsnprintf(slot->msg, sizeof(slot->msg), format, ap);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	sem_post(&queued);
+	return true;
+}
+
+
+/*
+ * Write out messages queued so far.
+ */
+static void
+drain(void)
+{
+	struct slot *slot;
+	unsigned long count;
+
+	for (;;) {
+		slot = &ring[head % RING_LEN];
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1)
+			break;
+
+		write_msg(slot->priority, slot->msg);
+		atomic_store_explicit(&slot->seq, head + RING_LEN, memory_order_release);
+		head++;
+	}
+
+	if ((count = atomic_exchange(&dropped, 0)) > 0) {
+		char msg[64];
+
+		snprintf(msg, sizeof(msg), "%lu log messages dropped", count);
+		write_msg(LOG_WARNING, msg);
+	}
+
+	if (stream != NULL)
+		fflush(stream);
+}
+
+
+static void *
+writer_thread(void *arg)
+{
+	(void) arg;
+
+	while (atomic_load(&running)) {
+		while (sem_wait(&queued) != 0 && errno == EINTR)
+			;
+		drain();
+	}
+
+	drain();
+	return NULL;
+}
 
 
 static void
 log_vmsg(int priority, char *format, va_list ap)
 {
-	vsyslog(priority, format, ap); 
+	char msg[MSG_LEN];
+
+	if (!log_enabled(priority))
+		return;
+
+	/* counted before running is checked, see log_stop */
+	atomic_fetch_add(&queueing, 1);
+	if (atomic_load(&running)) {
+		if (!enqueue(priority, format, ap))
+			atomic_fetch_add(&dropped, 1);
+		atomic_fetch_sub(&queueing, 1);
+		return;
+	}
+	atomic_fetch_sub(&queueing, 1);
+
+	vsnprintf(msg, sizeof(msg), format, ap);
+	write_msg(priority, msg);
+	if (stream != NULL)
+		fflush(stream);
 }
 
 
@@ -27,67 +223,114 @@ log_vmsg(int priority, char *format, va_list ap)
 
 
 void
-log_open_syslog(void)
+log_set_level(int level)
 {
-	openlog(NULL, LOG_NOWAIT | LOG_PID, LOG_USER);
+	atomic_store_explicit(&log_level, level, memory_order_relaxed);
 }
 
 
 void
-log_msg(int priority, char *format, ...)
+log_open_syslog(void)
 {
-	va_list ap;
-	va_start(ap, format);
+	openlog(NULL, LOG_NOWAIT | LOG_PID, LOG_USER);
+}
 
-	log_vmsg(priority, format, ap);
 
-	va_end(ap);
+int
+log_start(struct log_cfg *log_cfg)
+{
+	size_t i;
+	int ret;
+
+	cfg = *log_cfg;
+	log_set_level(cfg.level);
+
+	switch (cfg.target) {
+	case LOG_TO_STDERR:
+		stream = stderr;
+		break;
+	case LOG_TO_FILE:
+		if ((stream = fopen(cfg.path, "a")) == NULL) {
+			log_error("Cannot open log file %s: %s", cfg.path, strerror(errno));
+			return -1;
+		}
+		break;
+	default:
+		stream = NULL;
+	}
+
+	for (i = 0; i < RING_LEN; i++)
+		atomic_init(&ring[i].seq, i);
+	atomic_init(&tail, 0);
+	head = 0;
+	sem_init(&queued, 0, 0);
+
+	atomic_store(&running, true);
+	if ((ret = pthread_create(&writer_id, NULL, writer_thread, NULL)) != 0) {
+		atomic_store(&running, false);
+		log_error("Cannot create the log writer thread: %s", strerror(ret));
+		return -1;
+	}
+
+	return 0;
 }
 
 
 void
-log_error(char *format, ...)
+log_stop(void)
 {
-	va_list ap;
-	va_start(ap, format);
-
-	log_vmsg(LOG_ERR, format, ap);
-
-	va_end(ap);
+	if (!atomic_exchange(&running, false))
+		return;
+
+	sem_post(&queued);
+	pthread_join(writer_id, NULL);
+
+	/*
+	 * Threads which saw the writer running may have queued messages
+	 * after its last drain. New ones write their messages right away.
+	 */
+	while (atomic_load(&queueing) > 0)
+		sched_yield();
+	drain();
+
+	if (stream != NULL && stream != stderr) {
+		fclose(stream);
+		stream = NULL;
+	}
 }
 
 
 void
-log_warning(char *format, ...)
+log_msg(int priority, char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
 
-	log_vmsg(LOG_WARNING, format, ap);
+	log_vmsg(priority, format, ap);
 
 	va_end(ap);
 }
 
 
 void
-log_info(char *format, ...)
+log_error(char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
 
-	log_vmsg(LOG_INFO, format, ap);
+	log_vmsg(LOG_ERR, format, ap);
 
 	va_end(ap);
 }
 
 
 void
-log_debug(char *format, ...)
+log_warning(char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
 
-	log_vmsg(LOG_DEBUG, format, ap);
+	log_vmsg(LOG_WARNING, format, ap);
 
 	va_end(ap);
 }
@@ -102,5 +345,6 @@ log_exit(char *format, ...)
 	log_vmsg(LOG_ALERT, format, ap);
 
 	va_end(ap);
+	log_stop();
 	exit(EXIT_FAILURE);
 }
@@ -7,10 +7,19 @@
  * Copyright (c) 2015-2017 David Čepelík <d@dcepelik.cz>
  */
 
+#include "conf.h"
 #include "config.h"
+#include "journal.h"
 #include "log.h"
+#include "recorder.h"
+#include "replica.h"
+#include "rollup.h"
 #include "rrd-logger.h"
 #include "server.h"
+#include "simulator.h"
+#include "textlog.h"
+#include "transport.h"
+#include "tsdb.h"
 #include "wmr200.h"
 
 #include <assert.h>
@@ -21,63 +30,570 @@
 #include <libgen.h>
 #include <pthread.h>
 #include <pwd.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
+#define	FLUSH_TICK	1000	/* how often RRD updates are checked for being due (ms) */
+#define	HOTPLUG_DELAY	500	/* how long udev gets to set up the station plugged in (ms) */
+
 /* TODO make these configurable */
 bool reconnect_on_error = true;
 
 char *prog;
+char *config_path = CONFIG_PATH;	/* configuration file */
+bool config_given = false;	/* has it been given with -C? */
+struct config defaults;		/* configuration compiled in */
+bool foreground = false;	/* don't detach from the terminal */
+bool simulate = false;		/* talk to the simulator rather than the station */
+char *primary = NULL;		/* primary to replicate in replica mode */
+char **site_names = NULL;	/* names of sites in gateway mode */
+char **upstreams = NULL;	/* upstream meteod of each site */
+size_t num_sites = 0;		/* number of sites in gateway mode */
 unsigned reconnect_interval;
-sem_t ev_sem;
+struct rrd_cfg *served_rrd;	/* RRD files the server serves history from */
 
-volatile sig_atomic_t ev_error;	/* an error occured */
-volatile sig_atomic_t ev_alarm;	/* alarm has expired */
-volatile sig_atomic_t ev_quit;	/* quit request */
+/* command-line options, which override the configuration file */
+char *arg_capture = NULL;	/* -c */
+int arg_port = -1;		/* -p */
+double arg_speed = -1;		/* -S */
+bool arg_verbose = false;	/* -v */
 
 /*
- * Handle SIGINT, SIGINT and SIGALRM.
+ * Events the main loop waits for. Each of them has a file descriptor in
+ * event_fds which is readable once the event has occurred.
  */
-static void signal_dispatch(int signum)
+enum event
 {
-	switch (signum) {
-	case SIGINT:
-	case SIGTERM:
-		ev_quit = true;
-		break;
-	case SIGALRM:
-		ev_alarm = true;
-		break;
-	default:
-		return; /* to avoid sem_post */
-	}
+	EV_SIGNAL,	/* a signal has come (signalfd) */
+	EV_ERROR,	/* talking to the station has failed (eventfd) */
+	EV_RECONNECT,	/* time to connect to the station again (timerfd) */
+	EV_HEARTBEAT,	/* time to send the station a heartbeat (timerfd) */
+	EV_FLUSH,	/* time to write out RRD updates due (timerfd) */
+	EV_SAVE,	/* time to save rollups (timerfd) */
+	EV_CHECKPOINT,	/* time to take a journal checkpoint (timerfd) */
+	EV_HOTPLUG,	/* the station may have been plugged in (netlink) */
+	NUM_EVENTS,
+};
 
-	sem_post(&ev_sem);
-}
+sigset_t signals;		/* signals the main loop handles */
+int event_fds[NUM_EVENTS];	/* file descriptors of events */
+int epoll_fd;			/* the main loop waits on this */
 
 /*
  * Error handler. Called when a fatal error occurs while talking to
- * the station.
+ * the station, from the thread talking to it.
  */
 static void error_handler(struct wmr200 *wmr, void *arg)
 {
+	uint64_t one = 1;
+
 	(void) arg;
 	(void) wmr;
-	fprintf(stderr, "error_handler\n");
-	if (!ev_error)
-		sem_post(&ev_sem);
-	ev_error = true;
+	(void) write(event_fds[EV_ERROR], &one, sizeof(one));
+}
+
+/*
+ * Loggers readings from the station are passed to. When reconfigured,
+ * they're replaced by new ones swapped in under @lock (see reload).
+ */
+struct loggers
+{
+	pthread_mutex_t lock;		/* held while a reading is being logged */
+	struct rrd_logger *rrd;		/* the RRD logger */
+	struct tsdb *tsdb;		/* the time-series store (or NULL) */
+	struct rollup *rollup;		/* the rollup engine */
+	struct textlog *textlog;	/* the text logger */
+	bool textlogging;		/* is @textlog logging? */
+	struct wmr_server *srv;		/* the server */
+};
+
+/*
+ * Pass a reading to all loggers but the server, which has its own
+ * (see server_set_device).
+ */
+static void log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct loggers *loggers = (struct loggers *)arg;
+
+	pthread_mutex_lock(&loggers->lock);
+	rrd_log_reading(wmr, reading, loggers->rrd);
+	if (loggers->tsdb != NULL)
+		tsdb_log_reading(wmr, reading, loggers->tsdb);
+	rollup_log_reading(wmr, reading, loggers->rollup);
+	if (loggers->textlogging)
+		textlog_log_reading(wmr, reading, loggers->textlog);
+	pthread_mutex_unlock(&loggers->lock);
+}
+
+/*
+ * Pass a reading replayed from the journal to all loggers, and to the
+ * server as one which isn't new.
+ */
+static void replay_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct loggers *loggers = (struct loggers *)arg;
+
+	log_reading(wmr, reading, loggers);
+	server_store_reading(wmr, reading, loggers->srv->sites[0]);
+}
+
+/*
+ * Connection to the station.
+ */
+struct station
+{
+	struct wmr200 *wmr;		/* the station (or NULL if not connected) */
+	struct loggers *loggers;	/* loggers its readings are passed to */
+	struct journal *journal;	/* journal of its readings (or NULL) */
+};
+
+/*
+ * Journal checkpoint handler: have the loggers of the station write out
+ * what they can, once they have got the readings journaled so far.
+ */
+static void sync_loggers(time_t watermarks[NUM_SLOTS], void *arg)
+{
+	struct station *st = (struct station *)arg;
+	struct loggers *loggers = st->loggers;
+
+	if (st->wmr != NULL)
+		wmr_wait_dispatch(st->wmr);
+
+	pthread_mutex_lock(&loggers->lock);
+	rrd_logger_sync(loggers->rrd, watermarks);
+	if (loggers->tsdb != NULL)
+		tsdb_sync(loggers->tsdb, watermarks);
+	rollup_watermarks(loggers->rollup, watermarks);
+	if (loggers->textlogging)
+		textlog_sync(loggers->textlog);
+	pthread_mutex_unlock(&loggers->lock);
+}
+
+/*
+ * Journal checkpoint handler at exit, once the other loggers are gone.
+ */
+static void sync_at_exit(time_t watermarks[NUM_SLOTS], void *arg)
+{
+	struct loggers *loggers = (struct loggers *)arg;
+
+	rrd_logger_sync(loggers->rrd, watermarks);
+	if (loggers->tsdb != NULL)
+		tsdb_sync(loggers->tsdb, watermarks);
+}
+
+#define	OPTION(name, type) \
+	{ #name, type, offsetof(struct config, name), NULL, 0 }
+#define	ENUM_OPTION(name, names) \
+	{ #name, CONF_ENUM, offsetof(struct config, name), names, ARRAY_SIZE(names) }
+
+static const char *log_levels[] = {
+	[LOG_EMERG] = "emerg",
+	[LOG_ALERT] = "alert",
+	[LOG_CRIT] = "crit",
+	[LOG_ERR] = "error",
+	[LOG_WARNING] = "warning",
+	[LOG_NOTICE] = "notice",
+	[LOG_INFO] = "info",
+	[LOG_DEBUG] = "debug",
+};
+
+static const char *log_targets[] = {
+	[LOG_TO_SYSLOG] = "syslog",
+	[LOG_TO_STDERR] = "stderr",
+	[LOG_TO_FILE] = "file",
+};
+
+static const char *textlog_formats[] = {
+	[TEXTLOG_CSV] = "csv",
+	[TEXTLOG_INFLUX] = "influx",
+};
+
+/*
+ * Options of the configuration file, named after the fields of struct
+ * config they set.
+ */
+static const struct conf_option options[] = {
+	ENUM_OPTION(log.level, log_levels),
+	ENUM_OPTION(log.target, log_targets),
+	OPTION(log.path, CONF_STRING),
+	OPTION(rrd.rrd_root, CONF_STRING),
+	OPTION(rrd.wind_rrd, CONF_STRING),
+	OPTION(rrd.rain_rrd, CONF_STRING),
+	OPTION(rrd.uvi_rrd, CONF_STRING),
+	OPTION(rrd.baro_rrd, CONF_STRING),
+	OPTION(rrd.temp_N_rrd, CONF_STRING),
+	OPTION(rrd.batch_size, CONF_UINT),
+	OPTION(rrd.flush_interval, CONF_UINT),
+	OPTION(rrd.max_lateness, CONF_UINT),
+	OPTION(rrd.max_ahead, CONF_UINT),
+	OPTION(rrd.daemon, CONF_STRING),
+	OPTION(tsdb.root, CONF_STRING),
+	OPTION(tsdb.segment_len, CONF_UINT),
+	OPTION(rollup.path, CONF_STRING),
+	OPTION(rollup.save_interval, CONF_UINT),
+	OPTION(rollup.retention[0], CONF_UINT),
+	OPTION(rollup.retention[1], CONF_UINT),
+	OPTION(rollup.retention[2], CONF_UINT),
+	OPTION(rollup.retention[3], CONF_UINT),
+	OPTION(textlog.path, CONF_STRING),
+	ENUM_OPTION(textlog.format, textlog_formats),
+	OPTION(textlog.buffer_size, CONF_SIZE),
+	OPTION(textlog.flush_interval, CONF_UINT),
+	OPTION(textlog.rotate_size, CONF_OFF),
+	OPTION(textlog.rotate_daily, CONF_BOOL),
+	OPTION(textlog.compress, CONF_STRING),
+	OPTION(journal.path, CONF_STRING),
+	OPTION(journal.group_size, CONF_UINT),
+	OPTION(journal.group_interval, CONF_UINT),
+	OPTION(journal.checkpoint_interval, CONF_UINT),
+	OPTION(recorder.dump_path, CONF_STRING),
+	OPTION(recorder.capture_path, CONF_STRING),
+	OPTION(simulator.speed, CONF_DOUBLE),
+	OPTION(simulator.num_sensors, CONF_UINT),
+	OPTION(simulator.history, CONF_UINT),
+	OPTION(simulator.bad_checksum, CONF_UINT),
+	OPTION(simulator.truncated, CONF_UINT),
+	OPTION(simulator.stall, CONF_UINT),
+	OPTION(simulator.stall_len, CONF_UINT),
+	OPTION(simulator.seed, CONF_UINT),
+	OPTION(srv.port, CONF_UINT),
+	OPTION(srv.request_timeout, CONF_UINT),
+	OPTION(srv.max_wait, CONF_UINT),
+	OPTION(srv.history_len, CONF_UINT),
+	OPTION(srv.keyframe_interval, CONF_UINT),
+	OPTION(srv.queue_len, CONF_UINT),
+	OPTION(srv.replica_log_len, CONF_UINT),
+	OPTION(reconnect_default, CONF_UINT),
+	OPTION(reconnect_max, CONF_UINT),
+	OPTION(umask, CONF_MODE),
+	OPTION(user, CONF_STRING),
+	OPTION(group, CONF_STRING),
+	OPTION(chdir, CONF_STRING),
+};
+
+/*
+ * Options which take effect when reloaded (see reload), given by their
+ * names or prefixes of them.
+ */
+static const char *reloadable[] = {
+	"log.level",
+	"rrd.",
+	"textlog.",
+	"recorder.dump_path",
+	"simulator.",		/* on the next connection */
+	"srv.port",
+	"srv.request_timeout",
+	"srv.max_wait",
+	"srv.keyframe_interval",
+	"reconnect_",
+};
+
+static bool is_reloadable(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(reloadable); i++)
+		if (strncmp(name, reloadable[i], strlen(reloadable[i])) == 0)
+			return true;
+
+	return false;
+}
+
+/*
+ * Has any option whose name starts with @prefix changed from @old to @new?
+ */
+static bool changed(const char *prefix, struct config *old, struct config *new)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(options); i++)
+		if (strncmp(options[i].name, prefix, strlen(prefix)) == 0
+			&& conf_changed(&options[i], old, new))
+			return true;
+
+	return false;
+}
+
+/*
+ * Load the configuration into @conf: the defaults, overridden by the
+ * configuration file (if there's one), overridden by the command line.
+ *
+ * Return value:
+ *	Zero on success, -1 on error (see @error).
+ */
+static int load_config(struct config *conf, char error[CONF_ERROR_LEN])
+{
+	*conf = defaults;
+
+	/* the default configuration file needn't be there */
+	if (config_given || access(config_path, F_OK) == 0) {
+		if (conf_load(config_path, options, ARRAY_SIZE(options), conf, error) != 0)
+			return -1;
+	}
+
+	if (arg_capture != NULL)
+		conf->recorder.capture_path = arg_capture;
+	if (arg_port >= 0)
+		conf->srv.port = arg_port;
+	if (arg_speed >= 0)
+		conf->simulator.speed = arg_speed;
+	if (arg_verbose)
+		conf->log.level = LOG_DEBUG;
+
+	return 0;
+}
+
+/*
+ * Reload the configuration file and apply it without disconnecting the
+ * station: the RRD and text loggers are reopened if their configuration
+ * changed, the server switches to its new configuration (and port) and
+ * other options are just set (see reloadable). Options which can't be
+ * changed without a restart keep their values. @loggers is NULL if
+ * there's no station.
+ */
+static void reload(struct wmr_server *srv, struct loggers *loggers)
+{
+	char error[CONF_ERROR_LEN];
+	struct rrd_logger *rrd = NULL, *old_rrd = NULL;
+	struct textlog *textlog = NULL, *old_textlog = NULL;
+	bool textlogging = false;
+	struct rrd_cfg *rrd_cfg;
+	struct config new;
+	size_t i;
+
+	log_info("Reloading configuration from %s", config_path);
+	if (load_config(&new, error) != 0) {
+		log_error("%s, configuration not reloaded", error);
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(options); i++) {
+		if (is_reloadable(options[i].name) || !conf_changed(&options[i], &cfg, &new))
+			continue;
+		log_warning("Option %s changes only when meteod is restarted", options[i].name);
+		conf_copy(&options[i], &new, &cfg);
+	}
+
+	log_set_level(new.log.level);
+	recorder_configure(&new.recorder);
+
+	/*
+	 * New loggers are opened and old ones closed outside of the lock,
+	 * which is only held to swap them, so that readings aren't held up
+	 * by the files being examined or the compressor being waited for.
+	 * The new RRD logger takes over readings the old one holds back.
+	 */
+	if (loggers != NULL && changed("rrd.", &cfg, &new)) {
+		log_info("Reopening RRD files");
+		rrd = malloc_safe(sizeof(*rrd));
+		rrd_logger_init(rrd);
+		rrd->cfg = new.rrd;
+		rrd_logger_start(rrd);
+	}
+
+	if (loggers != NULL && changed("textlog.", &cfg, &new)) {
+		log_info("Reopening the text log");
+		textlog = malloc_safe(sizeof(*textlog));
+		textlog_init(textlog);
+		textlog->cfg = new.textlog;
+		textlogging = new.textlog.path != NULL && textlog_start(textlog) == 0;
+	}
+
+	if (rrd != NULL || textlog != NULL) {
+		pthread_mutex_lock(&loggers->lock);
+		if (rrd != NULL) {
+			old_rrd = loggers->rrd;
+			rrd_logger_take_over(rrd, old_rrd);
+			loggers->rrd = rrd;
+		}
+		if (textlog != NULL) {
+			old_textlog = loggers->textlog;
+			loggers->textlog = textlog;
+			loggers->textlogging = textlogging;
+		}
+		pthread_mutex_unlock(&loggers->lock);
+	}
+
+	if (old_rrd != NULL) {
+		rrd_logger_free(old_rrd);
+		free(old_rrd);
+	}
+
+	if (old_textlog != NULL) {
+		textlog_free(old_textlog);
+		free(old_textlog);
+	}
+
+	rrd_cfg = malloc_safe(sizeof(*rrd_cfg));
+	*rrd_cfg = new.rrd;
+	if (server_reconfigure(srv, &new.srv, rrd_cfg) != 0) {
+		log_error("Cannot listen on port %u, staying on port %u",
+			new.srv.port, cfg.srv.port);
+		new.srv.port = cfg.srv.port;
+		(void) server_reconfigure(srv, &new.srv, rrd_cfg);
+	}
+	free(served_rrd);
+	served_rrd = rrd_cfg;
+
+	cfg = new;
+	log_info("Configuration reloaded");
 }
 
 static void usage(int status)
 {
-	errx(status, "Usage: %s\n", prog);
+	errx(status, "Usage: %s [-f] [-v] [-C config] [-c capture] [-p port] [-S speed] "
+		"[-r primary[:port] | -g site=host[:port]...]\n", prog);
+}
+
+/*
+ * Add a gateway site given as "site=host[:port]" on the command line.
+ */
+static void add_site(char *arg)
+{
+	char *eq;
+	size_t i;
+
+	if ((eq = strchr(arg, '=')) == NULL || eq == arg || eq[1] == '\0')
+		errx(EXIT_FAILURE, "Invalid site '%s', expected site=host[:port]", arg);
+	*eq = '\0';
+
+	if (strchr(arg, '/') != NULL)
+		errx(EXIT_FAILURE, "Site name '%s' must not contain '/'", arg);
+	for (i = 0; i < num_sites; i++)
+		if (strcmp(site_names[i], arg) == 0)
+			errx(EXIT_FAILURE, "Site '%s' given twice", arg);
+
+	site_names = realloc_safe(site_names, (num_sites + 1) * sizeof(*site_names));
+	upstreams = realloc_safe(upstreams, (num_sites + 1) * sizeof(*upstreams));
+	site_names[num_sites] = arg;
+	upstreams[num_sites] = eq + 1;
+	num_sites++;
+}
+
+/*
+ * Create the file descriptor of event @ev.
+ */
+static int open_event(enum event ev)
+{
+	switch (ev) {
+	case EV_SIGNAL:
+		return signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	case EV_ERROR:
+		return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	case EV_HOTPLUG:
+		return transport_watch_hid();
+	default:
+		return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	}
+}
+
+/*
+ * Set up the main loop to wait for events. Signals must have been blocked
+ * in all threads by then, so that they're left to the main loop.
+ */
+static void open_events(void)
+{
+	struct epoll_event ev;
+	int i;
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		log_exit("epoll_create1: %s", strerror(errno));
+
+	for (i = 0; i < NUM_EVENTS; i++) {
+		/* only a station on USB is plugged in */
+		if (i == EV_HOTPLUG && (simulate || primary != NULL || num_sites > 0)) {
+			event_fds[i] = -1;
+			continue;
+		}
+
+		if ((event_fds[i] = open_event(i)) == -1) {
+			if (i != EV_HOTPLUG)
+				log_exit("Cannot create a file descriptor for events: %s",
+					strerror(errno));
+
+			/* the station is still looked for every reconnect interval */
+			log_warning("Cannot watch for the station being plugged in: %s",
+				strerror(errno));
+			continue;
+		}
+
+		ev = (struct epoll_event) { .events = EPOLLIN, .data.u32 = i };
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fds[i], &ev) == -1)
+			log_exit("epoll_ctl: %s", strerror(errno));
+	}
+}
+
+static void close_events(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_EVENTS; i++)
+		if (event_fds[i] >= 0)
+			(void) close(event_fds[i]);
+	(void) close(epoll_fd);
+}
+
+/*
+ * Have timer event @ev occur in @ms milliseconds and then every @interval
+ * milliseconds (or never again if zero). Zero @ms disarms the timer, which
+ * also drops an expiration not waited for yet.
+ */
+static void arm_timer(enum event ev, ulong_t ms, ulong_t interval)
+{
+	struct itimerspec spec = {
+		.it_value = { ms / 1000, ms % 1000 * 1000000 },
+		.it_interval = { interval / 1000, interval % 1000 * 1000000 },
+	};
+
+	if (timerfd_settime(event_fds[ev], 0, &spec, NULL) == -1)
+		log_error("timerfd_settime: %s", strerror(errno));
+}
+
+/*
+ * Wait for the next event and consume it. Events which occur at the same
+ * time are returned one after another. When a signal has come, its number
+ * is stored in @signum.
+ */
+static enum event next_event(int *signum)
+{
+	struct signalfd_siginfo info;
+	struct epoll_event ev;
+	uint64_t count;
+	int ret;
+
+	for (;;) {
+		if ((ret = epoll_wait(epoll_fd, &ev, 1, -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			log_exit("epoll_wait: %s", strerror(errno));
+		}
+
+		if (ev.data.u32 == EV_SIGNAL) {
+			if (read(event_fds[EV_SIGNAL], &info, sizeof(info)) != sizeof(info))
+				continue;
+			*signum = info.ssi_signo;
+		}
+		else if (ev.data.u32 == EV_HOTPLUG) {
+			if (!transport_hid_plugged(event_fds[EV_HOTPLUG]))
+				continue;
+		}
+		else if (read(event_fds[ev.data.u32], &count, sizeof(count)) != sizeof(count)) {
+			continue; /* the timer has been disarmed meanwhile */
+		}
+
+		return ev.data.u32;
+	}
 }
 
 /*
@@ -86,13 +602,105 @@ static void usage(int status)
  * NOTE: Upon successful connection, the reconnection interval will be reset
  *       to default value. It will never exceed cfg.reconnect_max.
  */
-void schedule_reconnect(void)
+static void schedule_reconnect(void)
 {
-	alarm(reconnect_interval);
-	log_info("Will attempt to reconnect in %lu seconds.", reconnect_interval);
+	arm_timer(EV_RECONNECT, 1000 * (ulong_t)MAX(reconnect_interval, 1), 0);
+	log_info("Will attempt to reconnect in %u seconds.", reconnect_interval);
 	reconnect_interval = MIN(2 * reconnect_interval, cfg.reconnect_max);
 }
 
+/*
+ * Connect to the station and start receiving readings from it, or
+ * schedule another attempt if that fails.
+ *
+ * Return value:
+ *	Zero on success, -1 on failure.
+ */
+static int connect_station(struct station *st)
+{
+	struct wmr200 *wmr;
+
+	if ((wmr = simulate ? wmr_open_transport(simulator_open(&cfg.simulator))
+		: wmr_open()) == NULL)
+		goto fail;
+
+	wmr_set_error_handler(wmr, error_handler, NULL);
+	if (wmr_start_receiver(wmr) != 0) {
+		wmr_close(wmr);
+		goto fail;
+	}
+
+	reconnect_interval = cfg.reconnect_default;
+
+	wmr_register_logger(wmr, log_reading, st->loggers);
+	server_set_device(st->loggers->srv, wmr);
+
+	/* registered last to get readings first */
+	if (st->journal != NULL)
+		wmr_register_logger(wmr, journal_log_reading, st->journal);
+
+	st->wmr = wmr;
+	wmr_heartbeat(wmr);
+	arm_timer(EV_HEARTBEAT, 1000 * WMR_HEARTBEAT_INTERVAL, 1000 * WMR_HEARTBEAT_INTERVAL);
+	return 0;
+
+fail:
+	if (reconnect_on_error)
+		schedule_reconnect();
+	return -1;
+}
+
+/*
+ * Stop talking to the station and have the loggers write out what they
+ * hold back.
+ */
+static void disconnect_station(struct station *st)
+{
+	uint64_t count;
+
+	arm_timer(EV_HEARTBEAT, 0, 0);
+	server_set_device(st->loggers->srv, NULL);
+	wmr_stop(st->wmr);
+	wmr_close(st->wmr);
+	st->wmr = NULL;
+
+	/* errors reported until the station was stopped are of no interest */
+	(void) read(event_fds[EV_ERROR], &count, sizeof(count));
+
+	pthread_mutex_lock(&st->loggers->lock);
+	rrd_logger_flush(st->loggers->rrd);
+	pthread_mutex_unlock(&st->loggers->lock);
+
+	if (st->journal != NULL)
+		journal_checkpoint(st->journal);
+}
+
+/*
+ * Handle signal @signum, received by the main loop. @loggers is NULL if
+ * there's no station.
+ *
+ * Return value:
+ *	true if the daemon is to quit, false otherwise.
+ */
+static bool handle_signal(int signum, struct wmr_server *srv, struct loggers *loggers)
+{
+	switch (signum) {
+	case SIGINT:
+	case SIGTERM:
+		log_info("Shutting down gracefully on %s", strsignal(signum));
+		return true;
+	case SIGUSR1:
+		if (loggers != NULL)
+			(void) recorder_dump(NULL, 0);
+		break;
+	case SIGHUP:
+		reload(srv, loggers);
+		break;
+	}
+
+	return false;
+}
+
 static void detach_from_parent(void)
 {
 	pid_t pid1, pid2;
@@ -155,6 +763,46 @@ static void resolve_names(void)
 	cfg.gid = grp->gr_gid;
 }
 
+/*
+ * Replica and gateway modes. There's no device, readings of every site of
+ * @srv are mirrored from its upstream meteod given in @upstreams and
+ * served by @srv. Wait until asked to quit.
+ */
+static void run_mirrors(struct wmr_server *srv, char **upstreams)
+{
+	struct replica *replicas;
+	enum event ev;
+	int signum;
+	size_t i;
+
+	replicas = malloc_safe(srv->num_sites * sizeof(*replicas));
+	for (i = 0; i < srv->num_sites; i++) {
+		replica_init(&replicas[i], upstreams[i], server_log_reading,
+			server_store_reading, srv->sites[i], &srv->sites[i]->store);
+		atomic_store(&replicas[i].reconnect_max, cfg.reconnect_max);
+		if (replica_start(&replicas[i]) != 0)
+			log_exit("Cannot start replication, see the logs.");
+	}
+
+	/* no timers are armed without a station */
+	while (1) {
+		if ((ev = next_event(&signum)) != EV_SIGNAL)
+			continue;
+		if (handle_signal(signum, srv, NULL))
+			break;
+
+		/* the configuration may have been reloaded */
+		for (i = 0; i < srv->num_sites; i++)
+			atomic_store(&replicas[i].reconnect_max, cfg.reconnect_max);
+	}
+
+	for (i = 0; i < srv->num_sites; i++) {
+		replica_stop(&replicas[i]);
+		replica_free(&replicas[i]);
+	}
+	free(replicas);
+}
+
 static void drop_root_privileges(void)
 {
 	if (setgid(cfg.gid) == -1)
@@ -171,8 +819,10 @@ static void drop_root_privileges(void)
 /*
  * Daemon entry point. This does several things.
  *
- * First of all, this is a simple event loop. It uses the semaphore ev_sem,
- * on which it waits until an event of interest occurs. The events are:
+ * First of all, this is a simple event loop. Signals are blocked in all
+ * threads and the main thread waits in epoll_wait(2) until an event of
+ * interest occurs (see enum event). All periodic work of the daemon is
+ * scheduled from here, with timers. The events are:
  *
  *     - A SIGINT/SIGTERM signal is received. In that case, the daemon should
  *       shut down gracefully, no matter what.
@@ -183,132 +833,297 @@ static void drop_root_privileges(void)
  *       case, we want to terminate the communication. (And reconnect later
  *       after some period of waiting.)
  *
- *     - A SIGALRM signal is received. In that case, we want to start connecting
- *       again, because the reconnection delay has expired.
+ *     - The reconnect timer expires. In that case, we want to start
+ *       connecting again, because the reconnection delay has expired.
+ *
+ *     - The station is plugged in while we're not connected. Connecting is
+ *       then attempted shortly, with the reconnection delay reset.
+ *
+ *     - The heartbeat timer expires. The station is sent a heartbeat and
+ *       the loggers get a WMR_META reading.
+ *
+ *     - The flush and save timers expire. RRD updates buffered for too long
+ *       are written out and rollups are saved.
+ *
+ *     - A SIGUSR1 signal is received. In that case, the frames the flight
+ *       recorder kept are dumped to a capture file (see recorder.c).
+ *
+ *     - A SIGHUP signal is received. In that case, the configuration file
+ *       is reloaded (see reload).
  */
 int main(int argc, char *argv[])
 {
-	(void) argc;
-	(void) argv;
-
-	struct wmr200 *wmr;
-	struct sigaction sa;
-	struct rrd_logger rrd;
-	sigset_t set;
-	sigset_t oldset;
-	bool running = false;
+	struct station station = { NULL, NULL, NULL };
+	struct rrd_logger *rrd;
+	struct tsdb tsdb;
+	struct rollup rollup;
+	struct textlog *textlog;
+	struct journal journal;
+	struct loggers loggers;
+	ssize_t replayed;
 	struct wmr_server srv;
+	char error[CONF_ERROR_LEN];
+	bool failed = false;
+	bool quit = false;
+	size_t i;
+	char *end;
+	int signum;
+	int opt;
 
 	prog = basename(argv[0]);
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = signal_dispatch;
-	sigaction(SIGTERM, &sa, NULL);
-	sigaction(SIGINT, &sa, NULL);
-	sigaction(SIGALRM, &sa, NULL);
+	while ((opt = getopt(argc, argv, "C:c:fg:hp:r:S:v")) != -1) {
+		switch (opt) {
+		case 'C':
+			/* it's reloaded after we've changed directories */
+			if ((config_path = realpath(optarg, NULL)) == NULL)
+				err(EXIT_FAILURE, "Cannot read configuration file %s", optarg);
+			config_given = true;
+			break;
+		case 'c':
+			arg_capture = optarg;
+			break;
+		case 'f':
+			foreground = true;
+			break;
+		case 'g':
+			add_site(optarg);
+			break;
+		case 'p':
+			arg_port = atoi(optarg);
+			break;
+		case 'r':
+			primary = optarg;
+			break;
+		case 'S':
+			arg_speed = strtod(optarg, &end);
+			if (*end != '\0' || arg_speed < 0)
+				errx(EXIT_FAILURE, "Invalid speed '%s'", optarg);
+			simulate = true;
+			break;
+		case 'v':
+			arg_verbose = true;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc || (primary != NULL && num_sites > 0))
+		usage(EXIT_FAILURE);
+
+	defaults = cfg;
+	if (load_config(&cfg, error) != 0)
+		errx(EXIT_FAILURE, "%s", error);
+
+	/* stderr is closed when detaching */
+	if (cfg.log.target == LOG_TO_STDERR && !foreground)
+		errx(EXIT_FAILURE, "log.target = stderr requires -f");
+
+	/*
+	 * Threads inherit the signal mask, so signals are left to the main
+	 * loop, which reads them from a signalfd (see open_events).
+	 */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGHUP);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
 
 	log_open_syslog();
-	sem_init(&ev_sem, false, 0);
 
 	wmr_init();
 
-	server_init(&srv);
-	if (server_start(&srv) != 0)
-		errx(EXIT_FAILURE, "Cannot start the TCP/IP server, see the logs.");
+	/* replaced with new ones when the configuration is reloaded */
+	rrd = malloc_safe(sizeof(*rrd));
+	rrd_logger_init(rrd);
+	rrd->cfg = cfg.rrd;
 
-	resolve_names();
-	detach_from_parent();
-	chdir_umask();
-	drop_root_privileges();
+	tsdb_init(&tsdb);
+	tsdb.cfg = cfg.tsdb;
 
-	reconnect_interval = cfg.reconnect_default;
+	rollup_init(&rollup);
+	rollup.cfg = cfg.rollup;
+
+	textlog = malloc_safe(sizeof(*textlog));
+	textlog_init(textlog);
+	textlog->cfg = cfg.textlog;
+
+	journal_init(&journal);
+	journal.cfg = cfg.journal;
 
-connect:
 	/*
-	 * Block SIGINT, SIGTERM and SIGALRM. Spawned threads will inherit
-	 * the sigmask, so signals will be received by this "main" thread.
+	 * In the foreground, stay where we are and keep the privileges we
+	 * have unless we're root.
 	 */
-	sigemptyset(&set);
-	sigaddset(&set, SIGINT);
-	sigaddset(&set, SIGTERM);
-	sigaddset(&set, SIGALRM);
-	pthread_sigmask(SIG_BLOCK, &set, &oldset);
-
-	assert(!running);
-
-	if ((wmr = wmr_open()) != NULL) {
-		wmr_set_error_handler(wmr, error_handler, NULL);
-		if (wmr_start(wmr) == 0) {
-			running = true;
-			reconnect_interval = cfg.reconnect_default;
+	if (!foreground) {
+		resolve_names();
+		detach_from_parent();
+		chdir_umask();
+		drop_root_privileges();
+	}
+	else if (geteuid() == 0) {
+		resolve_names();
+		drop_root_privileges();
+	}
 
-			rrd_logger_init(&rrd);
-			rrd.cfg.rrd_root = "/tmp";
-			rrd.cfg.wind_rrd = "wind.rrd";
-			rrd.cfg.rain_rrd = "rain.rrd";
-			rrd.cfg.uvi_rrd = "uvi.rrd";
-			rrd.cfg.baro_rrd = "baro.rrd";
-			rrd.cfg.temp_N_rrd = "temp%u.rrd";
+	/* NOTE: The writer thread wouldn't survive detach_from_parent either. */
+	if (log_start(&cfg.log) != 0)
+		log_exit("Cannot start logging, see the logs.");
 
-			wmr_register_logger(wmr, rrd_log_reading, &rrd);
-			server_set_device(&srv, wmr);
-		}
-		else {
-			wmr_close(wmr);
-		}
-	}
+	open_events();
 
-	if (!running) {
-		if (reconnect_on_error)
-			schedule_reconnect();
-		else
-			goto quit;
-	}
+	recorder_configure(&cfg.recorder);
+
+	if (cfg.recorder.capture_path != NULL && recorder_capture_start() != 0)
+		log_exit("Cannot start capturing frames, see the logs.");
 
-	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	rrd_logger_start(rrd);
+	if (tsdb.cfg.root != NULL && tsdb_start(&tsdb) != 0)
+		log_exit("Cannot open the time-series store, see the logs.");
+	if (rollup_start(&rollup) != 0)
+		log_exit("Cannot load rollups, see the logs.");
+	if (textlog->cfg.path != NULL && textlog_start(textlog) != 0)
+		log_exit("Cannot open the text log, see the logs.");
 
 	/*
-	 * Wait here until either an alarm expires (which implies a reconnection
-	 * attempt should proceed), or a SIGINT/SIGTERM arrives, or an error occurs.
-	 *
-	 * NOTE: sem_wait may be interrupted by a signal, hence the loop.
+	 * NOTE: The server is started only after detach_from_parent, since
+	 *       threads don't survive fork(2).
 	 */
-wait:
-	while (sem_wait(&ev_sem) != 0);
+	server_init(&srv);
+	srv.cfg = cfg.srv;
+	served_rrd = malloc_safe(sizeof(*served_rrd));
+	*served_rrd = cfg.rrd;
+	srv.rrd_cfg = served_rrd;
+	srv.tsdb = tsdb.cfg.root != NULL ? &tsdb : NULL;
+	srv.rollup = &rollup;
+	for (i = 0; i < num_sites; i++)
+		(void) server_add_site(&srv, site_names[i]);
+	if (server_start(&srv) != 0)
+		log_exit("Cannot start the TCP/IP server, see the logs.");
 
-	if (ev_alarm) {
-		ev_alarm = false;
-		goto connect;
+	pthread_mutex_init(&loggers.lock, NULL);
+	loggers.rrd = rrd;
+	loggers.tsdb = srv.tsdb;
+	loggers.rollup = &rollup;
+	loggers.textlog = textlog;
+	loggers.textlogging = textlog->cfg.path != NULL;
+	loggers.srv = &srv;
+
+	if (primary != NULL || num_sites > 0) {
+		run_mirrors(&srv, num_sites > 0 ? upstreams : &primary);
+		goto quit;
 	}
 
 	/*
-	 * We're handling a quit request or an error has occurred. In any case,
-	 * if we're connected, we should disconnect now.
+	 * Readings which didn't make it to the loggers' files before a crash
+	 * are replayed from the journal before new ones come.
 	 */
-	if (running) {
-		server_set_device(&srv, NULL);
-		wmr_stop(wmr);
-		wmr_close(wmr);
-		running = false;
+	station.loggers = &loggers;
+	if (journal.cfg.path != NULL) {
+		if (journal_start(&journal) != 0)
+			log_exit("Cannot open the journal, see the logs.");
+		station.journal = &journal;
+
+		journal_set_checkpoint_handler(&journal, sync_loggers, &station);
+		if ((replayed = journal_replay(&journal, replay_reading, &loggers)) > 0)
+			log_info("Replayed %zi readings from the journal", replayed);
+		journal_checkpoint(&journal);
+		arm_timer(EV_CHECKPOINT, 1000 * (ulong_t)MAX(journal.cfg.checkpoint_interval, 1),
+			1000 * (ulong_t)MAX(journal.cfg.checkpoint_interval, 1));
 	}
 
-	/*
-	 * OK, so an error occurred. If no signal to quit was received, schedule
-	 * a reconnection attempt.
-	 */
-	if (!ev_quit && ev_error && reconnect_on_error) {
-		ev_error = false;
-		schedule_reconnect();
-		goto wait;
+	arm_timer(EV_FLUSH, FLUSH_TICK, FLUSH_TICK);
+	if (rollup.cfg.path != NULL && rollup.cfg.save_interval > 0)
+		arm_timer(EV_SAVE, 1000 * (ulong_t)rollup.cfg.save_interval,
+			1000 * (ulong_t)rollup.cfg.save_interval);
+
+	reconnect_interval = cfg.reconnect_default;
+	if (connect_station(&station) != 0 && !reconnect_on_error)
+		failed = true;
+
+	while (!quit && !failed) {
+		switch (next_event(&signum)) {
+		case EV_SIGNAL:
+			quit = handle_signal(signum, &srv, &loggers);
+			break;
+		case EV_ERROR:
+			/* reported before the station was stopped */
+			if (station.wmr == NULL)
+				break;
+			disconnect_station(&station);
+			if (reconnect_on_error)
+				schedule_reconnect();
+			else
+				failed = true;
+			break;
+		case EV_HOTPLUG:
+			if (station.wmr != NULL)
+				break;
+			log_info("The station has been plugged in, reconnecting");
+			reconnect_interval = cfg.reconnect_default;
+			arm_timer(EV_RECONNECT, HOTPLUG_DELAY, 0);
+			break;
+		case EV_RECONNECT:
+			if (station.wmr == NULL && connect_station(&station) != 0
+				&& !reconnect_on_error)
+				failed = true;
+			break;
+		case EV_HEARTBEAT:
+			if (station.wmr != NULL)
+				wmr_heartbeat(station.wmr);
+			break;
+		case EV_FLUSH:
+			pthread_mutex_lock(&loggers.lock);
+			rrd_logger_flush_due(loggers.rrd);
+			pthread_mutex_unlock(&loggers.lock);
+			break;
+		case EV_SAVE:
+			(void) rollup_save(&rollup);
+			break;
+		case EV_CHECKPOINT:
+			journal_checkpoint(&journal);
+			break;
+		default:
+			break;
+		}
 	}
 
-	if (ev_quit)
-		log_info("Shutting down gracefully on SIGINT/SIGTERM");
+	if (station.wmr != NULL)
+		disconnect_station(&station);
 
 quit:
 	server_stop(&srv);
-	rrd_logger_free(&rrd);
+	server_free(&srv);
+	free(served_rrd);
+	rrd_logger_flush(loggers.rrd);
+	rollup_free(&rollup);
+	textlog_free(loggers.textlog);
+	free(loggers.textlog);
+
+	/*
+	 * The loggers have written out everything but what rrdcached hasn't
+	 * taken and the readings of open segments of the time-series store.
+	 */
+	if (station.journal != NULL) {
+		journal_set_checkpoint_handler(&journal, sync_at_exit, &loggers);
+		journal_checkpoint(&journal);
+	}
+	tsdb_free(&tsdb);
+	rrd_logger_free(loggers.rrd);
+	free(loggers.rrd);
+	pthread_mutex_destroy(&loggers.lock);
+	journal_free(&journal);
+	free(site_names);
+	free(upstreams);
 
+	recorder_capture_stop();
 	wmr_end();
-	return ev_error ? EXIT_FAILURE : EXIT_SUCCESS;
+	close_events();
+	log_stop();
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
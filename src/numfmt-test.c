@@ -0,0 +1,164 @@
+/*
+ * Tests of numfmt against snprintf(3): integers at the limits, every value
+ * the station decoder can produce (see wmr200.c) and averages of them at
+ * the precisions they're written with, and random doubles. Shortest
+ * numbers have to read back as the floats they were written from.
+ *
+ * Run by `make test`.
+ */
+
+#include "common.h"
+#include "numfmt.h"
+
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	MAX_PREC	3	/* most decimals compared */
+#define	MAX_TENTHS	4095	/* largest tenths of wind speeds and temperatures */
+#define	MAX_RAIN	65535	/* largest rain counter */
+#define	RAIN_UNIT	0.0254	/* what a unit of the counter is (TENTH_OF_INCH) */
+#define	NUM_RANDOM	500000	/* random doubles compared */
+
+static void check_fixed(double value, unsigned prec)
+{
+	char expected[NUMFMT_MAX_LEN];
+	char buf[NUMFMT_MAX_LEN];
+	size_t len;
+
+	snprintf(expected, sizeof(expected), "%.*f", (int)prec, value);
+	len = numfmt_fixed(buf, sizeof(buf), value, prec);
+	if (strcmp(buf, expected) != 0 || len != strlen(expected))
+		errx(EXIT_FAILURE, "%.17g with %u decimals: expected '%s', got '%s'",
+			value, prec, expected, buf);
+}
+
+static void check_all_prec(double value)
+{
+	unsigned prec;
+
+	for (prec = 0; prec <= MAX_PREC; prec++)
+		check_fixed(value, prec);
+}
+
+static void check_shortest(float value)
+{
+	char buf[NUMFMT_MAX_LEN];
+	char longest[NUMFMT_MAX_LEN];
+	size_t len;
+
+	len = numfmt_shortest(buf, sizeof(buf), value);
+	snprintf(longest, sizeof(longest), "%.9g", value);
+	if (strtof(buf, NULL) != value || len != strlen(buf))
+		errx(EXIT_FAILURE, "%.9g: '%s' doesn't read back", value, buf);
+	if (len > strlen(longest) && strchr(longest, 'e') == NULL)
+		errx(EXIT_FAILURE, "%.9g: '%s' is longer than '%s'", value, buf, longest);
+}
+
+static void check_int(long long value)
+{
+	char expected[NUMFMT_MAX_LEN];
+	char buf[NUMFMT_MAX_LEN];
+
+	snprintf(expected, sizeof(expected), "%lli", value);
+	if (numfmt_int(buf, sizeof(buf), value) != strlen(expected)
+		|| strcmp(buf, expected) != 0)
+		errx(EXIT_FAILURE, "Expected '%s', got '%s'", expected, buf);
+}
+
+static void check_uint(unsigned long long value)
+{
+	char expected[NUMFMT_MAX_LEN];
+	char buf[NUMFMT_MAX_LEN];
+
+	snprintf(expected, sizeof(expected), "%llu", value);
+	if (numfmt_uint(buf, sizeof(buf), value) != strlen(expected)
+		|| strcmp(buf, expected) != 0)
+		errx(EXIT_FAILURE, "Expected '%s', got '%s'", expected, buf);
+}
+
+/*
+ * Numbers which don't fit are cut like snprintf cuts them.
+ */
+static void check_truncated(double value, unsigned prec)
+{
+	char expected[NUMFMT_MAX_LEN];
+	char buf[NUMFMT_MAX_LEN];
+	size_t len;
+	size_t size;
+
+	len = snprintf(expected, sizeof(expected), "%.*f", (int)prec, value);
+	for (size = 1; size <= len + 1; size++) {
+		memset(buf, 'x', sizeof(buf));
+		if (numfmt_fixed(buf, size, value, prec) != len
+			|| strncmp(buf, expected, size - 1) != 0 || buf[size - 1] != '\0')
+			errx(EXIT_FAILURE, "Expected '%.*s' in %zu bytes, got '%.*s'",
+				(int)size - 1, expected, size, (int)size, buf);
+	}
+
+	buf[0] = 'x';
+	if (numfmt_fixed(buf, 0, value, prec) != len || buf[0] != 'x')
+		errx(EXIT_FAILURE, "Number written to an empty buffer");
+}
+
+int main(void)
+{
+	double sum;
+	float value;
+	long i;
+	int sign;
+
+	check_int(0);
+	check_int(LLONG_MIN);
+	check_int(LLONG_MAX);
+	check_uint(0);
+	check_uint(ULLONG_MAX);
+	for (i = -100000; i <= 100000; i++) {
+		check_int(i);
+		check_uint(i * 3 + 200000);
+	}
+
+	/* wind speeds and temperatures, and averages of consecutive ones */
+	for (sign = -1; sign <= 1; sign += 2) {
+		sum = 0;
+		for (i = 0; i <= MAX_TENTHS; i++) {
+			value = sign * (i / 10.0);
+			sum += value;
+			check_all_prec(value);
+			check_all_prec(sum / (i + 1));
+			check_shortest(value);
+		}
+	}
+
+	/* rain rates and amounts */
+	sum = 0;
+	for (i = 0; i <= MAX_RAIN; i++) {
+		value = i * RAIN_UNIT;
+		sum += value;
+		check_all_prec(value);
+		check_all_prec(sum / (i + 1));
+		check_shortest(value);
+	}
+
+	srand48(1);
+	for (i = 0; i < NUM_RANDOM; i++) {
+		check_all_prec((drand48() - 0.5) * 2e4);
+		check_fixed((drand48() - 0.5) * 1e16, 2);
+		check_shortest((drand48() - 0.5) * 2e5);
+	}
+
+	check_all_prec(0.0);
+	check_all_prec(-0.0);
+	check_all_prec(0.5);
+	check_all_prec(-2.5);
+	check_all_prec(1e20);
+	check_shortest(-0.0f);
+	check_shortest(1e30f);
+	check_shortest(1e-30f);
+	check_truncated(-123.456, 2);
+	check_truncated(1e20, 1);
+
+	return EXIT_SUCCESS;
+}
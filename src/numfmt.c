@@ -0,0 +1,159 @@
+/*
+ * Formatting of numbers of readings without printf(3).
+ *
+ * Values of readings are small and have a decimal or two, so they are
+ * written by scaling them to integers of the desired number of decimals.
+ * This is exact as long as the scaled value is far from halfway between
+ * two integers, where the rounding error of the scaling could tip the
+ * balance; such values (and huge ones) are left to snprintf(3).
+ *
+ * Numbers of readings are written through here wherever they are written
+ * (see strbuf_putu and friends); printf is left to header lines of server
+ * replies, written once per reply, and lines without numbers.
+ *
+ * numfmt-test.c compares the output with snprintf's.
+ */
+
+#include "common.h"
+#include "numfmt.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define	MAX_PREC		9	/* most decimals written without snprintf */
+#define	MAX_SCALED		1e12	/* largest scaled value written without it */
+#define	TIE_MARGIN		1e-3	/* how close to a tie a scaled value may be */
+#define	SHORTEST_MAX_PREC	6	/* most decimals numfmt_shortest tries */
+
+static const double scale[MAX_PREC + 1] = {
+	1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+};
+
+/*
+ * Copy number @num of length @len to @buf.
+ */
+static size_t put(char *buf, size_t size, const char *num, size_t len)
+{
+	size_t n;
+
+	if (size > 0) {
+		n = MIN(len, size - 1);
+		memcpy(buf, num, n);
+		buf[n] = '\0';
+	}
+
+	return len;
+}
+
+/*
+ * Write @fixed, a number of @prec decimals scaled to an integer, so that
+ * it ends right before @end. Return where it starts.
+ */
+static char *format_scaled(char *end, unsigned long long fixed, unsigned prec, bool negative)
+{
+	char *p = end;
+	unsigned i;
+
+	for (i = 0; i < prec; i++) {
+		*--p = '0' + fixed % 10;
+		fixed /= 10;
+	}
+	if (prec > 0)
+		*--p = '.';
+	do {
+		*--p = '0' + fixed % 10;
+		fixed /= 10;
+	} while (fixed > 0);
+	if (negative)
+		*--p = '-';
+
+	return p;
+}
+
+size_t numfmt_uint(char *buf, size_t size, unsigned long long value)
+{
+	char num[NUMFMT_MAX_LEN];
+	char *end = num + sizeof(num);
+	char *p = format_scaled(end, value, 0, false);
+
+	return put(buf, size, p, end - p);
+}
+
+size_t numfmt_int(char *buf, size_t size, long long value)
+{
+	char num[NUMFMT_MAX_LEN];
+	char *end = num + sizeof(num);
+	char *p;
+
+	if (value >= 0)
+		p = format_scaled(end, value, 0, false);
+	else
+		p = format_scaled(end, -(unsigned long long)value, 0, true);
+
+	return put(buf, size, p, end - p);
+}
+
+size_t numfmt_fixed(char *buf, size_t size, double value, unsigned prec)
+{
+	char num[NUMFMT_MAX_LEN];
+	char *end = num + sizeof(num);
+	char *p;
+	double scaled;
+	double frac;
+
+	if (prec > MAX_PREC || !((scaled = fabs(value) * scale[prec]) < MAX_SCALED))
+		return snprintf(buf, size, "%.*f", (int)prec, value);
+
+	frac = scaled - floor(scaled);
+	if (fabs(frac - 0.5) < TIE_MARGIN)
+		return snprintf(buf, size, "%.*f", (int)prec, value);
+
+	p = format_scaled(end, (unsigned long long)floor(scaled) + (frac > 0.5), prec,
+		signbit(value));
+	return put(buf, size, p, end - p);
+}
+
+/*
+ * The shortest "%g" representation which reads back as @value, the way
+ * numbers too big or too precise for numfmt_shortest are written.
+ */
+static size_t shortest_g(char *buf, size_t size, float value)
+{
+	char num[NUMFMT_MAX_LEN];
+	int prec;
+
+	for (prec = 1; prec < 9; prec++) {
+		snprintf(num, sizeof(num), "%.*g", prec, value);
+		if (strtof(num, NULL) == value)
+			break;
+	}
+
+	if (prec == 9)
+		snprintf(num, sizeof(num), "%.9g", value);
+	return put(buf, size, num, strlen(num));
+}
+
+size_t numfmt_shortest(char *buf, size_t size, float value)
+{
+	char num[NUMFMT_MAX_LEN];
+	char *end = num + sizeof(num);
+	char *p;
+	float magnitude = fabsf(value);
+	double fixed;
+	unsigned prec;
+
+	if (!(magnitude < MAX_SCALED / scale[SHORTEST_MAX_PREC]))
+		return shortest_g(buf, size, value);
+
+	for (prec = 0; prec <= SHORTEST_MAX_PREC; prec++) {
+		fixed = rint(magnitude * scale[prec]);
+		if ((float)(fixed / scale[prec]) == magnitude) {
+			p = format_scaled(end, fixed, prec, signbit(value));
+			return put(buf, size, p, end - p);
+		}
+	}
+
+	return shortest_g(buf, size, value);
+}
@@ -0,0 +1,365 @@
+/*
+ * Reading helpers.
+ */
+
+#include "numfmt.h"
+#include "reading.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define	FIELD(t, n, k, m)	{ (t), (n), (k), offsetof(struct wmr_reading, m) }
+
+static const char *slot_names[NUM_SLOTS] = {
+	[SLOT_WIND] = "wind",
+	[SLOT_RAIN] = "rain",
+	[SLOT_UVI] = "uvi",
+	[SLOT_BARO] = "baro",
+	[SLOT_TEMP0 + 0] = "temp0",
+	[SLOT_TEMP0 + 1] = "temp1",
+	[SLOT_TEMP0 + 2] = "temp2",
+	[SLOT_TEMP0 + 3] = "temp3",
+	[SLOT_TEMP0 + 4] = "temp4",
+	[SLOT_TEMP0 + 5] = "temp5",
+	[SLOT_TEMP0 + 6] = "temp6",
+	[SLOT_TEMP0 + 7] = "temp7",
+	[SLOT_TEMP0 + 8] = "temp8",
+	[SLOT_TEMP0 + 9] = "temp9",
+	[SLOT_STATUS] = "status",
+	[SLOT_META] = "meta",
+};
+
+static const struct reading_field fields[] = {
+	FIELD(WMR_WIND, "dir", FIELD_STRING, wind.dir),
+	FIELD(WMR_WIND, "gust_speed", FIELD_FLOAT, wind.gust_speed),
+	FIELD(WMR_WIND, "avg_speed", FIELD_FLOAT, wind.avg_speed),
+	FIELD(WMR_WIND, "chill", FIELD_FLOAT, wind.chill),
+
+	FIELD(WMR_RAIN, "rate", FIELD_FLOAT, rain.rate),
+	FIELD(WMR_RAIN, "accum_hour", FIELD_FLOAT, rain.accum_hour),
+	FIELD(WMR_RAIN, "accum_24h", FIELD_FLOAT, rain.accum_24h),
+	FIELD(WMR_RAIN, "accum_2007", FIELD_FLOAT, rain.accum_2007),
+
+	FIELD(WMR_UVI, "index", FIELD_UINT, uvi.index),
+
+	FIELD(WMR_BARO, "pressure", FIELD_UINT, baro.pressure),
+	FIELD(WMR_BARO, "alt_pressure", FIELD_UINT, baro.alt_pressure),
+	FIELD(WMR_BARO, "forecast", FIELD_STRING, baro.forecast),
+
+	FIELD(WMR_TEMP, "sensor_id", FIELD_UINT, temp.sensor_id),
+	FIELD(WMR_TEMP, "humidity", FIELD_UINT, temp.humidity),
+	FIELD(WMR_TEMP, "heat_index", FIELD_UINT, temp.heat_index),
+	FIELD(WMR_TEMP, "temp", FIELD_FLOAT, temp.temp),
+	FIELD(WMR_TEMP, "dew_point", FIELD_FLOAT, temp.dew_point),
+
+	FIELD(WMR_STATUS, "wind_bat", FIELD_STRING, status.wind_bat),
+	FIELD(WMR_STATUS, "temp_bat", FIELD_STRING, status.temp_bat),
+	FIELD(WMR_STATUS, "rain_bat", FIELD_STRING, status.rain_bat),
+	FIELD(WMR_STATUS, "uv_bat", FIELD_STRING, status.uv_bat),
+	FIELD(WMR_STATUS, "wind_sensor", FIELD_STRING, status.wind_sensor),
+	FIELD(WMR_STATUS, "temp_sensor", FIELD_STRING, status.temp_sensor),
+	FIELD(WMR_STATUS, "rain_sensor", FIELD_STRING, status.rain_sensor),
+	FIELD(WMR_STATUS, "uv_sensor", FIELD_STRING, status.uv_sensor),
+	FIELD(WMR_STATUS, "rtc_signal", FIELD_STRING, status.rtc_signal_level),
+
+	FIELD(WMR_META, "num_packets", FIELD_UINT, meta.num_packets),
+	FIELD(WMR_META, "num_failed", FIELD_UINT, meta.num_failed),
+	FIELD(WMR_META, "num_frames", FIELD_UINT, meta.num_frames),
+	FIELD(WMR_META, "error_rate", FIELD_FLOAT, meta.error_rate),
+	FIELD(WMR_META, "num_bytes", FIELD_ULONG, meta.num_bytes),
+	FIELD(WMR_META, "latest_packet", FIELD_TIME, meta.latest_packet),
+	FIELD(WMR_META, "uptime", FIELD_TIME, meta.uptime),
+};
+
+int reading_slot(struct wmr_reading *reading)
+{
+	switch (reading->type) {
+	case WMR_WIND:
+		return SLOT_WIND;
+	case WMR_RAIN:
+		return SLOT_RAIN;
+	case WMR_UVI:
+		return SLOT_UVI;
+	case WMR_BARO:
+		return SLOT_BARO;
+	case WMR_TEMP:
+		if (reading->temp.sensor_id >= WMR200_MAX_TEMP_SENSORS)
+			return -1;
+		return SLOT_TEMP0 + reading->temp.sensor_id;
+	case WMR_STATUS:
+		return SLOT_STATUS;
+	case WMR_META:
+		return SLOT_META;
+	}
+
+	return -1;
+}
+
+const char *slot_name(int slot)
+{
+	if (slot < 0 || slot >= NUM_SLOTS)
+		return NULL;
+	return slot_names[slot];
+}
+
+int slot_lookup(const char *name)
+{
+	int slot;
+
+	for (slot = 0; slot < NUM_SLOTS; slot++)
+		if (strcmp(slot_names[slot], name) == 0)
+			return slot;
+
+	return -1;
+}
+
+byte_t slot_type(int slot)
+{
+	if (slot >= SLOT_TEMP0 && slot < SLOT_TEMP0 + WMR200_MAX_TEMP_SENSORS)
+		return WMR_TEMP;
+
+	switch (slot) {
+	case SLOT_WIND:
+		return WMR_WIND;
+	case SLOT_RAIN:
+		return WMR_RAIN;
+	case SLOT_UVI:
+		return WMR_UVI;
+	case SLOT_BARO:
+		return WMR_BARO;
+	case SLOT_STATUS:
+		return WMR_STATUS;
+	case SLOT_META:
+		return WMR_META;
+	}
+
+	return 0;
+}
+
+const struct reading_field *reading_fields(byte_t type, size_t *count)
+{
+	size_t first;
+	size_t i;
+
+	for (first = 0; first < ARRAY_SIZE(fields); first++)
+		if (fields[first].type == type)
+			break;
+
+	for (i = first; i < ARRAY_SIZE(fields) && fields[i].type == type; i++);
+
+	*count = i - first;
+	return fields + first;
+}
+
+const struct reading_field *reading_field_lookup(byte_t type, const char *name)
+{
+	const struct reading_field *type_fields;
+	size_t count;
+	size_t i;
+
+	type_fields = reading_fields(type, &count);
+	for (i = 0; i < count; i++)
+		if (strcmp(type_fields[i].name, name) == 0)
+			return &type_fields[i];
+
+	return NULL;
+}
+
+double reading_field_value(struct wmr_reading *reading, const struct reading_field *field)
+{
+	void *ptr = (byte_t *)reading + field->offset;
+
+	switch (field->kind) {
+	case FIELD_FLOAT:
+		return *(float *)ptr;
+	case FIELD_UINT:
+		return *(uint_t *)ptr;
+	case FIELD_ULONG:
+		return *(ulong_t *)ptr;
+	case FIELD_TIME:
+		return *(time_t *)ptr;
+	case FIELD_STRING:
+		break;
+	}
+
+	return NAN;
+}
+
+static bool field_equal(struct wmr_reading *a, struct wmr_reading *b,
+	const struct reading_field *field)
+{
+	byte_t *pa = (byte_t *)a + field->offset;
+	byte_t *pb = (byte_t *)b + field->offset;
+
+	switch (field->kind) {
+	case FIELD_FLOAT:
+		return *(float *)pa == *(float *)pb;
+	case FIELD_UINT:
+		return *(uint_t *)pa == *(uint_t *)pb;
+	case FIELD_ULONG:
+		return *(ulong_t *)pa == *(ulong_t *)pb;
+	case FIELD_TIME:
+		return *(time_t *)pa == *(time_t *)pb;
+	case FIELD_STRING:
+		return *(const char **)pa == *(const char **)pb;
+	}
+
+	return false;
+}
+
+/*
+ * Append the shortest representation of @value which reads back as @value.
+ */
+static void format_float(float value, struct strbuf *out)
+{
+	char buf[NUMFMT_MAX_LEN];
+
+	strbuf_putn(out, buf, numfmt_shortest(buf, sizeof(buf), value));
+}
+
+void reading_format_field(struct wmr_reading *reading, const struct reading_field *field,
+	struct strbuf *out)
+{
+	void *ptr = (byte_t *)reading + field->offset;
+
+	switch (field->kind) {
+	case FIELD_FLOAT:
+		format_float(*(float *)ptr, out);
+		break;
+	case FIELD_UINT:
+		strbuf_putu(out, *(uint_t *)ptr);
+		break;
+	case FIELD_ULONG:
+		strbuf_putu(out, *(ulong_t *)ptr);
+		break;
+	case FIELD_TIME:
+		strbuf_puti(out, *(time_t *)ptr);
+		break;
+	case FIELD_STRING:
+		strbuf_puts(out, *(const char **)ptr ? *(const char **)ptr : "");
+		break;
+	}
+}
+
+void reading_format(struct wmr_reading *reading, struct strbuf *out)
+{
+	const struct reading_field *type_fields;
+	size_t count;
+	size_t i;
+
+	strbuf_putc(out, '=');
+	strbuf_puts(out, slot_name(reading_slot(reading)));
+	strbuf_putc(out, '\t');
+	strbuf_puti(out, reading->time);
+
+	type_fields = reading_fields(reading->type, &count);
+	for (i = 0; i < count; i++) {
+		strbuf_putc(out, '\t');
+		strbuf_puts(out, type_fields[i].name);
+		strbuf_putc(out, '=');
+		reading_format_field(reading, &type_fields[i], out);
+	}
+
+	strbuf_putc(out, '\n');
+}
+
+static int parse_field(struct wmr_reading *reading, const struct reading_field *field,
+	char *value)
+{
+	void *ptr = (byte_t *)reading + field->offset;
+	char *end;
+
+	errno = 0;
+	switch (field->kind) {
+	case FIELD_FLOAT:
+		*(float *)ptr = strtof(value, &end);
+		break;
+	case FIELD_UINT:
+		*(uint_t *)ptr = strtoul(value, &end, 10);
+		break;
+	case FIELD_ULONG:
+		*(ulong_t *)ptr = strtoull(value, &end, 10);
+		break;
+	case FIELD_TIME:
+		*(time_t *)ptr = strtoll(value, &end, 10);
+		break;
+	case FIELD_STRING:
+		return (*(const char **)ptr = wmr_lookup_string(value)) ? 0 : -1;
+	}
+
+	return (errno || end == value || *end != '\0') ? -1 : 0;
+}
+
+int reading_parse(char *line, struct wmr_reading *reading)
+{
+	const struct reading_field *field;
+	char *saveptr;
+	char *token;
+	char *value;
+	char *end;
+	int slot;
+
+	memset(reading, 0, sizeof(*reading));
+
+	token = strtok_r(line, "\t\n", &saveptr);
+	if (token == NULL || token[0] != '=' || (slot = slot_lookup(token + 1)) < 0)
+		return -1;
+	reading->type = slot_type(slot);
+
+	token = strtok_r(NULL, "\t\n", &saveptr);
+	if (token == NULL)
+		return -1;
+	errno = 0;
+	reading->time = strtoll(token, &end, 10);
+	if (errno || end == token || *end != '\0')
+		return -1;
+
+	while ((token = strtok_r(NULL, "\t\n", &saveptr)) != NULL) {
+		if ((value = strchr(token, '=')) == NULL)
+			return -1;
+		*value++ = '\0';
+
+		if ((field = reading_field_lookup(reading->type, token)) == NULL)
+			return -1;
+		if (parse_field(reading, field, value) != 0)
+			return -1;
+	}
+
+	/* the slot decides, even if the sensor_id field is missing */
+	if (reading->type == WMR_TEMP)
+		reading->temp.sensor_id = slot - SLOT_TEMP0;
+
+	return 0;
+}
+
+void reading_format_delta(struct wmr_reading *prev, struct wmr_reading *reading,
+	struct strbuf *out)
+{
+	const struct reading_field *type_fields;
+	size_t count;
+	size_t i;
+
+	strbuf_putc(out, '~');
+	strbuf_puts(out, slot_name(reading_slot(reading)));
+	strbuf_putc(out, '\t');
+	if (reading->time >= prev->time)
+		strbuf_putc(out, '+');
+	strbuf_puti(out, reading->time - prev->time);
+
+	type_fields = reading_fields(reading->type, &count);
+	for (i = 0; i < count; i++) {
+		if (field_equal(prev, reading, &type_fields[i]))
+			continue;
+
+		strbuf_putc(out, '\t');
+		strbuf_putu(out, i);
+		strbuf_putc(out, '=');
+		reading_format_field(reading, &type_fields[i], out);
+	}
+
+	strbuf_putc(out, '\n');
+}
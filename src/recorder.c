@@ -0,0 +1,271 @@
+/*
+ * Flight recorder of raw frames exchanged with the station.
+ *
+ * The last RECORDER_LEN frames are kept in a ring, so that there's
+ * something to look at when the station misbehaves. The ring is written
+ * without locks by whichever thread reads or writes a frame: the writer
+ * claims a position by incrementing @tail and marks the slot busy while
+ * it fills the slot in. A slot's sequence number is its position plus one
+ * when the frame in it is complete, so a dump can tell frames which were
+ * overwritten (or were being written) while it copied them and skip them.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "recorder.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	PATH_LEN		256	/* longest name of a dump or capture file */
+#define	CAPTURE_INTERVAL	250	/* how often frames are captured (ms) */
+#define	CAPTURE_BUF_SIZE	(1 << 16)	/* size of the capture file buffer */
+
+struct slot
+{
+	atomic_size_t seq;		/* position of the frame + 1, 0 if busy */
+	struct capture_frame frame;	/* the frame */
+};
+
+static struct slot ring[RECORDER_LEN];
+static atomic_size_t tail;		/* next position to be written to */
+
+static struct recorder_cfg cfg = { NULL, NULL };
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *capture;			/* the capture file */
+static size_t captured;			/* next position to be captured */
+static atomic_bool capturing;		/* is the capture thread running? */
+static pthread_t capture_id;
+
+void recorder_configure(struct recorder_cfg *recorder_cfg)
+{
+	pthread_mutex_lock(&dump_lock);
+	cfg = *recorder_cfg;
+	pthread_mutex_unlock(&dump_lock);
+}
+
+void recorder_record(enum capture_dir dir, const byte_t *data, size_t len)
+{
+	size_t pos = atomic_fetch_add_explicit(&tail, 1, memory_order_relaxed);
+	struct slot *slot = &ring[pos % RECORDER_LEN];
+
+	atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->frame.time = capture_now();
+	slot->frame.dir = dir;
+	slot->frame.len = MIN(len, CAPTURE_FRAME_MAX);
+	memcpy(slot->frame.data, data, slot->frame.len);
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * Result of copy_frame.
+ */
+enum copy_result
+{
+	COPY_OK,		/* the frame was copied */
+	COPY_BUSY,		/* the frame is being written */
+	COPY_GONE,		/* the frame was overwritten */
+};
+
+/*
+ * Copy the frame at position @pos to @frame.
+ */
+static enum copy_result copy_frame(size_t pos, struct capture_frame *frame)
+{
+	struct slot *slot = &ring[pos % RECORDER_LEN];
+	size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+	if (seq != pos + 1)
+		return seq == 0 || seq < pos + 1 ? COPY_BUSY : COPY_GONE;
+
+	memcpy(frame, &slot->frame, sizeof(*frame));
+	atomic_thread_fence(memory_order_acquire);
+
+	return atomic_load_explicit(&slot->seq, memory_order_relaxed) == pos + 1
+		? COPY_OK : COPY_GONE;
+}
+
+/*
+ * Write the frames recorded to @stream.
+ */
+static ssize_t write_frames(FILE *stream)
+{
+	struct capture_frame frame;
+	size_t end = atomic_load_explicit(&tail, memory_order_acquire);
+	size_t pos = end > RECORDER_LEN ? end - RECORDER_LEN : 0;
+	ssize_t count = 0;
+
+	if (capture_write_header(stream) != 0)
+		return -1;
+
+	for (; pos < end; pos++) {
+		if (copy_frame(pos, &frame) != COPY_OK)
+			continue;
+		if (capture_write_frame(stream, &frame) != 0)
+			return -1;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Expand strftime(3) template @path with the current time into @name.
+ */
+static int expand_path(const char *path, char name[PATH_LEN])
+{
+	struct tm tm;
+	time_t now;
+
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	if (strftime(name, PATH_LEN, path, &tm) == 0) {
+		log_error("File name %s too long", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t recorder_dump(char *path, size_t size)
+{
+	char name[PATH_LEN];
+	FILE *stream;
+	ssize_t count;
+
+	pthread_mutex_lock(&dump_lock);
+
+	if (cfg.dump_path == NULL || expand_path(cfg.dump_path, name) != 0) {
+		pthread_mutex_unlock(&dump_lock);
+		return -1;
+	}
+
+	if ((stream = fopen(name, "w")) == NULL) {
+		log_error("Cannot open dump file %s: %s", name, strerror(errno));
+		pthread_mutex_unlock(&dump_lock);
+		return -1;
+	}
+
+	count = write_frames(stream);
+	if (fclose(stream) != 0)
+		count = -1;
+
+	pthread_mutex_unlock(&dump_lock);
+
+	if (count < 0) {
+		log_error("Cannot write dump file %s: %s", name, strerror(errno));
+		return -1;
+	}
+
+	log_info("Dumped %zi recorded frames to %s", count, name);
+	if (path != NULL)
+		snprintf(path, size, "%s", name);
+	return count;
+}
+
+/*
+ * Append the frames recorded since the last call to the capture file.
+ */
+static void capture_frames(void)
+{
+	struct capture_frame frame;
+	size_t end = atomic_load_explicit(&tail, memory_order_acquire);
+	size_t lost = 0;
+
+	if (end - captured > RECORDER_LEN) {
+		lost += end - RECORDER_LEN - captured;
+		captured = end - RECORDER_LEN;
+	}
+
+	for (; captured < end; captured++) {
+		switch (copy_frame(captured, &frame)) {
+		case COPY_OK:
+			if (capture_write_frame(capture, &frame) != 0) {
+				log_error("Cannot write capture: %s", strerror(errno));
+				return;
+			}
+			break;
+		case COPY_BUSY:
+			goto out;
+		case COPY_GONE:
+			lost++;
+			break;
+		}
+	}
+
+out:
+	if (lost > 0)
+		log_warning("%zu frames were lost from the capture", lost);
+	if (fflush(capture) != 0)
+		log_error("Cannot write capture: %s", strerror(errno));
+}
+
+static void *capture_thread(void *arg)
+{
+	(void) arg;
+
+	while (atomic_load(&capturing)) {
+		usleep(CAPTURE_INTERVAL * 1000);
+		capture_frames();
+	}
+
+	capture_frames();
+	return NULL;
+}
+
+int recorder_capture_start(void)
+{
+	char name[PATH_LEN];
+	int ret;
+
+	if (expand_path(cfg.capture_path, name) != 0)
+		return -1;
+
+	if ((capture = fopen(name, "w")) == NULL) {
+		log_error("Cannot open capture %s: %s", name, strerror(errno));
+		return -1;
+	}
+
+	setvbuf(capture, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+	if (capture_write_header(capture) != 0) {
+		log_error("Cannot write capture %s: %s", name, strerror(errno));
+		goto out_close;
+	}
+
+	captured = atomic_load(&tail);
+	atomic_store(&capturing, true);
+	if ((ret = pthread_create(&capture_id, NULL, capture_thread, NULL)) != 0) {
+		atomic_store(&capturing, false);
+		log_error("Cannot create the capture thread: %s", strerror(ret));
+		goto out_close;
+	}
+
+	log_info("Capturing frames to %s", name);
+	return 0;
+
+out_close:
+	fclose(capture);
+	capture = NULL;
+	return -1;
+}
+
+void recorder_capture_stop(void)
+{
+	if (!atomic_exchange(&capturing, false))
+		return;
+
+	pthread_join(capture_id, NULL);
+	if (fclose(capture) != 0)
+		log_error("Cannot write capture: %s", strerror(errno));
+	capture = NULL;
+}
@@ -0,0 +1,229 @@
+/*
+ * Mirror readings of another meteod over TCP/IP.
+ *
+ * The replica sends the "replicate" request (see server.c) to the upstream
+ * meteod, which replies with its in-memory history and then streams all
+ * readings it receives. When the connection breaks, the replica reconnects
+ * and the history is transferred anew, replacing what was received before.
+ *
+ * The upstream may have nothing to send for long, such as when its station
+ * is unplugged, so the replica doesn't time out reading. TCP keepalives
+ * are sent instead, for a connection whose other end has gone away without
+ * a word (such as when the upstream host loses power) to break.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "reading.h"
+#include "replica.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define	DEFAULT_PORT		"20892"
+#define	DEFAULT_RECONNECT_MAX	300	/* s */
+#define	KEEPALIVE_IDLE		60	/* s before the first keepalive */
+#define	KEEPALIVE_INTERVAL	10	/* s between keepalives */
+#define	KEEPALIVE_COUNT		6	/* keepalives unanswered before giving up */
+
+/*
+ * Have the connection @fd break once the other end stops answering
+ * keepalives.
+ */
+static int set_keepalive(int fd)
+{
+	int on = 1;
+	int idle = KEEPALIVE_IDLE;
+	int interval = KEEPALIVE_INTERVAL;
+	int count = KEEPALIVE_COUNT;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) != 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) != 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) != 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) != 0) {
+		log_error("Cannot enable keepalives: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int connect_upstream(struct replica *replica)
+{
+	struct addrinfo *ai_head, *ai_cur;
+	struct addrinfo ai_hints;
+	int fd = -1;
+	int ret;
+
+	memset(&ai_hints, 0, sizeof(ai_hints));
+	ai_hints.ai_family = AF_UNSPEC;
+	ai_hints.ai_socktype = SOCK_STREAM;
+
+	if ((ret = getaddrinfo(replica->host, replica->port, &ai_hints, &ai_head)) != 0) {
+		log_error("getaddrinfo: %s", gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai_cur = ai_head; ai_cur != NULL; ai_cur = ai_cur->ai_next) {
+		fd = socket(ai_cur->ai_family, ai_cur->ai_socktype, ai_cur->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		if (connect(fd, ai_cur->ai_addr, ai_cur->ai_addrlen) == 0
+			&& set_keepalive(fd) == 0)
+			break;
+
+		(void) close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(ai_head);
+	return fd;
+}
+
+static void handle_line(struct replica *replica, char *line)
+{
+	struct wmr_reading reading;
+
+	if (strncmp(line, "replicate", strlen("replicate")) == 0) {
+		log_info("Receiving history from %s:%s", replica->host, replica->port);
+		if (sscanf(line, "replicate\tseq=%*u\tcount=%zu", &replica->history_left) != 1)
+			replica->history_left = 0;
+		if (replica->store != NULL)
+			store_clear(replica->store);
+		return;
+	}
+
+	if (reading_parse(line, &reading) != 0) {
+		log_warning("Ignoring malformed reading from %s:%s",
+			replica->host, replica->port);
+	}
+	else if (replica->history_left > 0) {
+		replica->history_func(NULL, &reading, replica->arg);
+	}
+	else {
+		replica->func(NULL, &reading, replica->arg);
+		replica->num_readings++;
+	}
+
+	if (replica->history_left > 0)
+		replica->history_left--;
+}
+
+static void cleanup_stream(void *arg)
+{
+	fclose((FILE *)arg);
+}
+
+static void cleanup_line(void *arg)
+{
+	free(*(char **)arg);
+}
+
+/*
+ * Receive readings from @fd until the connection breaks.
+ */
+static void receive(struct replica *replica, int fd)
+{
+	char *line = NULL;
+	size_t size = 0;
+	FILE *stream;
+
+	if (dprintf(fd, "replicate\n") < 0 || (stream = fdopen(fd, "r")) == NULL) {
+		(void) close(fd);
+		return;
+	}
+
+	pthread_cleanup_push(cleanup_stream, stream);
+	pthread_cleanup_push(cleanup_line, &line);
+
+	/* POSIX.1: getline may be a cancellation point */
+	while (getline(&line, &size, stream) > 0)
+		handle_line(replica, line);
+
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+}
+
+static void mainloop(struct replica *replica)
+{
+	unsigned interval = 1;
+	int fd;
+
+	while (1) {
+		if ((fd = connect_upstream(replica)) >= 0) {
+			log_info("Connected to upstream %s:%s", replica->host, replica->port);
+			replica->num_readings = 0;
+			receive(replica, fd);
+			log_warning("Connection to upstream %s:%s lost",
+				replica->host, replica->port);
+
+			if (replica->num_readings > 0)
+				interval = 1;
+		}
+
+		log_info("Will reconnect to %s:%s in %u seconds.",
+			replica->host, replica->port, interval);
+		sleep(interval);
+		interval = MIN(2 * interval, atomic_load(&replica->reconnect_max));
+	}
+}
+
+/*
+ * Wrapper around mainloop to use with pthreads.
+ */
+static void *mainloop_pthread(void *arg)
+{
+	mainloop((struct replica *)arg);
+	return NULL;
+}
+
+void replica_init(struct replica *replica, char *upstream, wmr_logger_t *func,
+	wmr_logger_t *history_func, void *arg, struct wmr_store *store)
+{
+	char *colon;
+
+	replica->host = strdup(upstream);
+	replica->port = DEFAULT_PORT;
+	if ((colon = strrchr(replica->host, ':')) != NULL) {
+		*colon = '\0';
+		replica->port = colon + 1;
+	}
+
+	replica->func = func;
+	replica->history_func = history_func;
+	replica->arg = arg;
+	replica->store = store;
+	atomic_init(&replica->reconnect_max, DEFAULT_RECONNECT_MAX);
+	replica->num_readings = 0;
+	replica->history_left = 0;
+}
+
+void replica_free(struct replica *replica)
+{
+	free(replica->host);
+}
+
+int replica_start(struct replica *replica)
+{
+	if (pthread_create(&replica->thread_id, NULL, mainloop_pthread, replica) != 0) {
+		log_error("Cannot start replication thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+void replica_stop(struct replica *replica)
+{
+	pthread_cancel(replica->thread_id);
+	pthread_join(replica->thread_id, NULL);
+}
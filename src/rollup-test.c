@@ -0,0 +1,120 @@
+/*
+ * Tests of rollup queries: buckets are found wherever the start and end
+ * of the query fall, also when the end isn't the start of a bucket, and
+ * no more buckets are returned than there are starts within the query.
+ * Buckets saved are there after a restart.
+ *
+ * Run by `make test`.
+ */
+
+#include "common.h"
+#include "rollup.h"
+
+#include <err.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	BASE		1500000000	/* start of the readings, a day */
+#define	NUM_MINUTES	150		/* minutes with readings */
+
+static struct rollup rollup;
+static const struct reading_field *field;
+
+static void add_reading(time_t t, float temp)
+{
+	struct wmr_reading reading;
+
+	memset(&reading, 0, sizeof(reading));
+	reading.type = WMR_TEMP;
+	reading.time = t;
+	reading.temp.sensor_id = 0;
+	reading.temp.temp = temp;
+	rollup_log_reading(NULL, &reading, &rollup);
+}
+
+/*
+ * Query minutes of [@start, @end) and check there are @expected buckets,
+ * the first starting at @first.
+ */
+static void check(time_t start, time_t end, size_t expected, time_t first)
+{
+	struct rollup_bucket *buckets;
+	size_t count;
+	size_t i;
+
+	count = rollup_query(&rollup, SLOT_TEMP0, field, 0, start, end, &buckets);
+	if (count != expected)
+		errx(EXIT_FAILURE, "Query [%li, %li): expected %zu buckets, got %zu",
+			(long)start, (long)end, expected, count);
+
+	for (i = 0; i < count; i++) {
+		if (buckets[i].start != first + (time_t)i * 60 || buckets[i].count != 1)
+			errx(EXIT_FAILURE, "Query [%li, %li): bucket %zu starts at %li",
+				(long)start, (long)end, i, (long)buckets[i].start);
+		if (buckets[i].sum != (buckets[i].start - BASE) / 60)
+			errx(EXIT_FAILURE, "Query [%li, %li): bucket %zu has a wrong value",
+				(long)start, (long)end, i);
+	}
+
+	free(buckets);
+}
+
+int main(void)
+{
+	char path[] = "/tmp/rollup-test.XXXXXX";
+	size_t i;
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0)
+		err(EXIT_FAILURE, "Cannot create %s", path);
+	(void) close(fd);
+	(void) unlink(path);
+
+	rollup_init(&rollup);
+	rollup.cfg.path = path;
+	if (rollup_start(&rollup) != 0)
+		return EXIT_FAILURE;
+
+	field = reading_field_lookup(WMR_TEMP, "temp");
+	check(BASE, BASE + 600, 0, 0);
+
+	for (i = 0; i < NUM_MINUTES; i++)
+		add_reading(BASE + i * 60 + 30, i);
+
+	check(BASE, BASE + 60, 1, BASE);
+	check(BASE, BASE + 600, 10, BASE);
+
+	/* the end isn't the start of a bucket */
+	check(BASE + 60, BASE + 150, 2, BASE + 60);
+	check(BASE, BASE + 61, 2, BASE);
+	check(BASE, BASE + 119, 2, BASE);
+	check(BASE + 1, BASE + 121, 2, BASE + 60);
+	check(BASE, BASE + NUM_MINUTES * 60 - 1, NUM_MINUTES, BASE);
+	check(BASE, BASE + NUM_MINUTES * 60 + 1, NUM_MINUTES, BASE);
+
+	/* no bucket starts within */
+	check(BASE + 1, BASE + 59, 0, 0);
+	check(BASE + 60, BASE + 60, 0, 0);
+
+	/* longer than the ring of minutes, which holds a day */
+	check(0, BASE + 600, 10, BASE);
+	check(BASE, BASE + 86400, NUM_MINUTES, BASE);
+	check(BASE, LONG_MAX, 0, 0);
+
+	/* saved when freed */
+	rollup_free(&rollup);
+	rollup_init(&rollup);
+	rollup.cfg.path = path;
+	if (rollup_start(&rollup) != 0)
+		errx(EXIT_FAILURE, "Cannot load %s", path);
+	check(BASE, BASE + 86400, NUM_MINUTES, BASE);
+
+	/* readings saved aren't counted again */
+	add_reading(BASE + 30, 0);
+	check(BASE, BASE + 60, 1, BASE);
+
+	rollup_free(&rollup);
+	(void) unlink(path);
+	return EXIT_SUCCESS;
+}
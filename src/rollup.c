@@ -0,0 +1,498 @@
+/*
+ * Rollups: aggregates of values of fields of readings over minutes, ten
+ * minutes, hours and days.
+ *
+ * Every reading updates one bucket of each resolution of each of its
+ * numeric fields, so the cost per reading is constant. Buckets of each
+ * resolution are kept in a ring of cfg.retention[res] buckets: a bucket is
+ * overwritten once its place in the ring is needed for a later bucket, and
+ * readings which would fall into a bucket already overwritten are dropped.
+ * Days are UTC days.
+ *
+ * Rollups are saved to cfg.path by rollup_save, which the owner of the
+ * rollups calls every cfg.save_interval, and loaded back at start. After a
+ * restart, readings not newer than the latest reading saved are ignored,
+ * so that readings replayed from the journal aren't counted twice; the
+ * journal keeps readings which came since the last save (see
+ * rollup_watermarks).
+ *
+ * The file is a struct file_header followed by a struct field_header for
+ * each field which has rollups, each of them followed by the buckets in use
+ * of each resolution (in host byte order).
+ */
+
+#include "common.h"
+#include "log.h"
+#include "rollup.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define	DEFAULT_SAVE_INTERVAL	3600	/* s */
+#define	ROLLUP_MAGIC		"WMRROLL1"
+
+const unsigned rollup_res[ROLLUP_NUM_RES] = { 60, 600, 3600, 86400 };
+
+static const char *res_names[ROLLUP_NUM_RES] = { "1m", "10m", "1h", "1d" };
+
+static const unsigned default_retention[ROLLUP_NUM_RES] = {
+	1440,		/* a day of minutes */
+	1008,		/* a week of ten minutes */
+	720,		/* a month of hours */
+	730,		/* two years of days */
+};
+
+struct file_header
+{
+	char magic[8];				/* ROLLUP_MAGIC */
+	uint32_t res[ROLLUP_NUM_RES];		/* resolutions */
+};
+
+struct field_header
+{
+	char slot[16];				/* name of the slot */
+	char field[32];				/* name of the field */
+	int64_t latest;				/* time of the latest reading added */
+	uint32_t count[ROLLUP_NUM_RES];		/* buckets of each resolution */
+};
+
+void rollup_init(struct rollup *rollup)
+{
+	size_t i;
+	int slot;
+
+	rollup->cfg.path = NULL;
+	rollup->cfg.save_interval = DEFAULT_SAVE_INTERVAL;
+	for (i = 0; i < ROLLUP_NUM_RES; i++)
+		rollup->cfg.retention[i] = default_retention[i];
+
+	pthread_mutex_init(&rollup->lock, NULL);
+
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		rollup->slots[slot].fields = NULL;
+		(void) reading_fields(slot_type(slot), &rollup->slots[slot].num_fields);
+		rollup->slots[slot].restored = 0;
+		rollup->slots[slot].saved = 0;
+		rollup->slots[slot].latest = 0;
+	}
+}
+
+/*
+ * Return rollups of field @i of @slot, allocating them if needed.
+ */
+static struct rollup_field *get_field(struct rollup *rollup, int slot, size_t i)
+{
+	struct rollup_slot *rs = &rollup->slots[slot];
+	struct rollup_field *field;
+	size_t res;
+
+	if (rs->fields == NULL) {
+		rs->fields = malloc_safe(rs->num_fields * sizeof(*rs->fields));
+		memset(rs->fields, 0, rs->num_fields * sizeof(*rs->fields));
+	}
+
+	field = &rs->fields[i];
+	if (field->buckets[0] == NULL) {
+		for (res = 0; res < ROLLUP_NUM_RES; res++) {
+			field->buckets[res] = malloc_safe(MAX(rollup->cfg.retention[res], 1)
+				* sizeof(*field->buckets[res]));
+			memset(field->buckets[res], 0, MAX(rollup->cfg.retention[res], 1)
+				* sizeof(*field->buckets[res]));
+		}
+	}
+
+	return field;
+}
+
+/*
+ * Return the place of the bucket starting at @start in ring @res of @field.
+ */
+static struct rollup_bucket *ring_place(struct rollup *rollup, struct rollup_field *field,
+	size_t res, time_t start)
+{
+	size_t len = MAX(rollup->cfg.retention[res], 1);
+
+	return &field->buckets[res][(start / rollup_res[res]) % len];
+}
+
+/*
+ * Add @value of a reading at time @t to the bucket of resolution @res.
+ */
+static void add(struct rollup *rollup, struct rollup_field *field, size_t res, time_t t,
+	double value)
+{
+	time_t start = t - t % rollup_res[res];
+	struct rollup_bucket *b = ring_place(rollup, field, res, start);
+	uint32_t off = t - start;
+
+	/* the bucket's place has been taken by a later one */
+	if (b->count > 0 && b->start > start)
+		return;
+
+	if (b->count == 0 || b->start < start) {
+		b->start = start;
+		b->count = 0;
+		b->first_off = UINT32_MAX;
+		b->last_off = 0;
+		b->sum = 0;
+		b->min = INFINITY;
+		b->max = -INFINITY;
+	}
+
+	b->count++;
+	b->sum += value;
+	b->min = MIN(b->min, value);
+	b->max = MAX(b->max, value);
+
+	if (off < b->first_off) {
+		b->first_off = off;
+		b->first = value;
+	}
+
+	if (off >= b->last_off) {
+		b->last_off = off;
+		b->last = value;
+	}
+}
+
+void rollup_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct rollup *rollup = (struct rollup *)arg;
+	const struct reading_field *fields;
+	struct rollup_field *field;
+	struct rollup_slot *rs;
+	size_t count;
+	size_t i, res;
+	double value;
+	int slot;
+
+	(void) wmr;
+
+	if ((slot = reading_slot(reading)) < 0)
+		return;
+
+	rs = &rollup->slots[slot];
+	fields = reading_fields(reading->type, &count);
+
+	pthread_mutex_lock(&rollup->lock);
+
+	/* counted before the restart */
+	if (reading->time <= rs->restored)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		value = reading_field_value(reading, &fields[i]);
+		if (isnan(value))
+			continue;
+
+		field = get_field(rollup, slot, i);
+		for (res = 0; res < ROLLUP_NUM_RES; res++)
+			add(rollup, field, res, reading->time, value);
+	}
+
+	rs->latest = MAX(rs->latest, reading->time);
+out:
+	pthread_mutex_unlock(&rollup->lock);
+}
+
+void rollup_watermarks(struct rollup *rollup, time_t watermarks[NUM_SLOTS])
+{
+	int slot;
+
+	/* rollups which aren't saved are lost anyway */
+	if (rollup->cfg.path == NULL)
+		return;
+
+	pthread_mutex_lock(&rollup->lock);
+	for (slot = 0; slot < NUM_SLOTS; slot++)
+		if (rollup->slots[slot].latest > rollup->slots[slot].saved)
+			watermarks[slot] = MIN(watermarks[slot], rollup->slots[slot].saved + 1);
+	pthread_mutex_unlock(&rollup->lock);
+}
+
+/*
+ * Image of the file being saved, built while the rollups are locked and
+ * written once they're not.
+ */
+struct image
+{
+	byte_t *data;		/* contents of the file */
+	size_t len;		/* bytes used */
+	size_t size;		/* bytes allocated */
+};
+
+static void image_put(struct image *image, const void *data, size_t len)
+{
+	if (image->len + len > image->size) {
+		image->size = MAX(2 * image->size, MAX(image->len + len, 4096));
+		image->data = realloc_safe(image->data, image->size);
+	}
+
+	memcpy(image->data + image->len, data, len);
+	image->len += len;
+}
+
+/*
+ * Append rollups of field @i of @slot to @image.
+ */
+static void put_field(struct rollup *rollup, int slot, size_t i, struct image *image)
+{
+	struct rollup_field *field = &rollup->slots[slot].fields[i];
+	const struct reading_field *fields;
+	struct field_header hdr;
+	struct rollup_bucket *b;
+	size_t count;
+	size_t res, j;
+
+	fields = reading_fields(slot_type(slot), &count);
+
+	memset(&hdr, 0, sizeof(hdr));
+	strncpy(hdr.slot, slot_name(slot), sizeof(hdr.slot) - 1);
+	strncpy(hdr.field, fields[i].name, sizeof(hdr.field) - 1);
+	hdr.latest = rollup->slots[slot].latest;
+	for (res = 0; res < ROLLUP_NUM_RES; res++)
+		for (j = 0; j < rollup->cfg.retention[res]; j++)
+			hdr.count[res] += field->buckets[res][j].count > 0;
+
+	image_put(image, &hdr, sizeof(hdr));
+
+	for (res = 0; res < ROLLUP_NUM_RES; res++) {
+		for (j = 0; j < rollup->cfg.retention[res]; j++) {
+			b = &field->buckets[res][j];
+			if (b->count > 0)
+				image_put(image, b, sizeof(*b));
+		}
+	}
+}
+
+int rollup_save(struct rollup *rollup)
+{
+	struct image image = { NULL, 0, 0 };
+	time_t latest[NUM_SLOTS];
+	char tmp_path[PATH_MAX];
+	struct file_header hdr;
+	FILE *stream;
+	size_t i;
+	int slot;
+
+	if (rollup->cfg.path == NULL)
+		return 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ROLLUP_MAGIC, sizeof(hdr.magic));
+	for (i = 0; i < ROLLUP_NUM_RES; i++)
+		hdr.res[i] = rollup_res[i];
+	image_put(&image, &hdr, sizeof(hdr));
+
+	/* readings may keep coming while the file is written */
+	pthread_mutex_lock(&rollup->lock);
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		latest[slot] = rollup->slots[slot].latest;
+		if (rollup->slots[slot].fields == NULL)
+			continue;
+		for (i = 0; i < rollup->slots[slot].num_fields; i++)
+			if (rollup->slots[slot].fields[i].buckets[0] != NULL)
+				put_field(rollup, slot, i, &image);
+	}
+	pthread_mutex_unlock(&rollup->lock);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", rollup->cfg.path);
+
+	if ((stream = fopen(tmp_path, "w")) == NULL) {
+		log_error("Cannot create %s: %s", tmp_path, strerror(errno));
+		free(image.data);
+		return -1;
+	}
+
+	if (fwrite(image.data, 1, image.len, stream) != image.len
+		|| fflush(stream) != 0 || fsync(fileno(stream)) != 0)
+		goto write_error;
+
+	if (fclose(stream) != 0 || rename(tmp_path, rollup->cfg.path) != 0) {
+		stream = NULL;
+		goto write_error;
+	}
+
+	free(image.data);
+
+	pthread_mutex_lock(&rollup->lock);
+	for (slot = 0; slot < NUM_SLOTS; slot++)
+		rollup->slots[slot].saved = latest[slot];
+	pthread_mutex_unlock(&rollup->lock);
+	return 0;
+
+write_error:
+	log_error("Cannot write %s: %s", tmp_path, strerror(errno));
+	if (stream != NULL)
+		(void) fclose(stream);
+	(void) unlink(tmp_path);
+	free(image.data);
+	return -1;
+}
+
+/*
+ * Read rollups of a field from @stream, its header being @hdr.
+ */
+static int read_field(struct rollup *rollup, struct field_header *hdr, FILE *stream)
+{
+	const struct reading_field *field;
+	struct rollup_field *rf = NULL;
+	struct rollup_bucket b;
+	struct rollup_bucket *place;
+	size_t res, j;
+	int slot;
+
+	hdr->slot[sizeof(hdr->slot) - 1] = '\0';
+	hdr->field[sizeof(hdr->field) - 1] = '\0';
+
+	/* rollups of fields which are no more are skipped */
+	if ((slot = slot_lookup(hdr->slot)) >= 0
+		&& (field = reading_field_lookup(slot_type(slot), hdr->field)) != NULL) {
+		rf = get_field(rollup, slot, field - reading_fields(slot_type(slot), &j));
+		rollup->slots[slot].restored = MAX(rollup->slots[slot].restored, hdr->latest);
+		rollup->slots[slot].saved = rollup->slots[slot].restored;
+		rollup->slots[slot].latest = rollup->slots[slot].restored;
+	}
+
+	for (res = 0; res < ROLLUP_NUM_RES; res++) {
+		for (j = 0; j < hdr->count[res]; j++) {
+			if (fread(&b, sizeof(b), 1, stream) != 1)
+				return -1;
+			if (rf == NULL || b.count == 0 || b.start % rollup_res[res] != 0)
+				continue;
+
+			place = ring_place(rollup, rf, res, b.start);
+			if (place->count == 0 || place->start < b.start)
+				*place = b;
+		}
+	}
+
+	return 0;
+}
+
+int rollup_start(struct rollup *rollup)
+{
+	struct file_header hdr;
+	struct field_header field_hdr;
+	FILE *stream;
+	size_t i;
+	int ret = 0;
+
+	if (rollup->cfg.path == NULL)
+		return 0;
+
+	if ((stream = fopen(rollup->cfg.path, "r")) == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		log_error("Cannot open %s: %s", rollup->cfg.path, strerror(errno));
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, stream) != 1
+		|| memcmp(hdr.magic, ROLLUP_MAGIC, sizeof(hdr.magic)) != 0)
+		goto corrupt;
+
+	for (i = 0; i < ROLLUP_NUM_RES; i++)
+		if (hdr.res[i] != rollup_res[i])
+			goto corrupt;
+
+	pthread_mutex_lock(&rollup->lock);
+	while (ret == 0 && fread(&field_hdr, sizeof(field_hdr), 1, stream) == 1)
+		ret = read_field(rollup, &field_hdr, stream);
+	pthread_mutex_unlock(&rollup->lock);
+
+	if (ret != 0 || ferror(stream))
+		goto corrupt;
+
+	(void) fclose(stream);
+	return 0;
+
+corrupt:
+	log_error("%s is corrupt", rollup->cfg.path);
+	(void) fclose(stream);
+	return -1;
+}
+
+void rollup_free(struct rollup *rollup)
+{
+	struct rollup_slot *rs;
+	size_t i, res;
+	int slot;
+
+	(void) rollup_save(rollup);
+
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		rs = &rollup->slots[slot];
+		if (rs->fields == NULL)
+			continue;
+
+		for (i = 0; i < rs->num_fields; i++)
+			for (res = 0; res < ROLLUP_NUM_RES; res++)
+				free(rs->fields[i].buckets[res]);
+		free(rs->fields);
+	}
+
+	pthread_mutex_destroy(&rollup->lock);
+}
+
+int rollup_res_lookup(const char *name)
+{
+	int res;
+
+	for (res = 0; res < ROLLUP_NUM_RES; res++)
+		if (strcmp(name, res_names[res]) == 0
+			|| strtoul(name, NULL, 10) == rollup_res[res])
+			return res;
+
+	return -1;
+}
+
+size_t rollup_query(struct rollup *rollup, int slot, const struct reading_field *field,
+	int res, time_t start, time_t end, struct rollup_bucket **buckets)
+{
+	struct rollup_slot *rs = &rollup->slots[slot];
+	time_t span = (time_t)rollup_res[res] * MAX(rollup->cfg.retention[res], 1);
+	struct rollup_bucket *b;
+	const struct reading_field *fields;
+	size_t count = 0;
+	size_t num_starts;
+	size_t i, j;
+	time_t t;
+
+	*buckets = NULL;
+
+	/* older buckets can't be there */
+	if (end - start > span)
+		start = end - span;
+	if (start % rollup_res[res] != 0)
+		start += rollup_res[res] - start % rollup_res[res];
+	if (start >= end)
+		return 0;
+
+	/* starts of buckets within [start, end), end needn't be one */
+	num_starts = (end - start + rollup_res[res] - 1) / rollup_res[res];
+
+	fields = reading_fields(slot_type(slot), &i);
+	i = field - fields;
+
+	pthread_mutex_lock(&rollup->lock);
+
+	if (rs->fields == NULL || rs->fields[i].buckets[0] == NULL)
+		goto out;
+
+	*buckets = malloc_safe(num_starts * sizeof(**buckets));
+	for (j = 0; j < num_starts; j++) {
+		t = start + (time_t)j * rollup_res[res];
+		b = ring_place(rollup, &rs->fields[i], res, t);
+		if (b->count > 0 && b->start == t)
+			(*buckets)[count++] = *b;
+	}
+out:
+	pthread_mutex_unlock(&rollup->lock);
+	return count;
+}
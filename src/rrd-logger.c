@@ -5,143 +5,413 @@
 
 #include "common.h"
 #include "log.h"
+#include "numfmt.h"
+#include "reading.h"
 #include "rrd-logger.h"
+#include "rrdcached.h"
 
 #include <assert.h>
 #include <limits.h>
 #include <rrd.h>
+#include <string.h>
 #include <time.h>
 
-char path_buf[PATH_MAX];	/* static path buffer */
+#define	DEFAULT_BATCH_SIZE	64	/* updates buffered per file */
+#define	DEFAULT_FLUSH_INTERVAL	60	/* s */
+#define	DEFAULT_MAX_LATENESS	300	/* s */
+#define	DEFAULT_MAX_AHEAD	300	/* s */
+#define	DAEMON_BACKLOG		1024	/* updates kept per file while rrdcached is away */
+#define	RRD_FETCH_ROWS		1024	/* most rows of a series fetched at once */
 
 /*
- * Paste paths p1 and p2.
+ * Data sources of RRD database files and fields of readings they
+ * are logged from. Whether a data source is a gauge is found out
+ * from the file, the default is what rrd_create.sh creates.
+ */
+static const struct
+{
+	byte_t type;		/* type of the reading */
+	const char *field;	/* field of the reading */
+	const char *ds;		/* data source name */
+	bool gauge;		/* is the data source a gauge by default? */
+} rrd_ds[] = {
+	{ WMR_WIND, "avg_speed", "avg_speed", true },
+	{ WMR_WIND, "gust_speed", "gust_speed", true },
+	{ WMR_RAIN, "rate", "rate", true },
+	{ WMR_RAIN, "accum_2007", "total", false },
+	{ WMR_UVI, "index", "index", true },
+	{ WMR_BARO, "pressure", "pressure", true },
+	{ WMR_BARO, "alt_pressure", "alt_pressure", true },
+	{ WMR_TEMP, "temp", "temp", true },
+	{ WMR_TEMP, "humidity", "humidity", true },
+	{ WMR_TEMP, "dew_point", "dewpoint", true },
+};
+
+/*
+ * Format path of the RRD database file of @slot into @buf.
  *
- * NOTE: The resulting string is alloc'd in a static buffer, don't pass it
- *       to free(3).
+ * Return value:
+ *	Zero on success, -1 if readings of @slot aren't logged.
  */
-static char *paste_path(char *p1, char *p2)
+static int slot_path(struct rrd_cfg *cfg, int slot, char *buf, size_t size)
 {
-	assert(snprintf(path_buf, sizeof(path_buf), "%s/%s", p1, p2) >= 0);
-	return path_buf;
+	char temp_rrd[NAME_MAX];
+	char *rel_path;
+
+	switch (slot_type(slot)) {
+	case WMR_WIND:
+		rel_path = cfg->wind_rrd;
+		break;
+	case WMR_RAIN:
+		rel_path = cfg->rain_rrd;
+		break;
+	case WMR_UVI:
+		rel_path = cfg->uvi_rrd;
+		break;
+	case WMR_BARO:
+		rel_path = cfg->baro_rrd;
+		break;
+	case WMR_TEMP:
+		snprintf(temp_rrd, sizeof(temp_rrd), cfg->temp_N_rrd, slot - SLOT_TEMP0);
+		rel_path = temp_rrd;
+		break;
+	default:
+		return -1;
+	}
+
+	snprintf(buf, size, "%s/%s", cfg->rrd_root, rel_path);
+	return 0;
 }
 
 /*
- * Update an RRD database file found whose path relative to configured
- * root is @rel_path.
+ * Set up the state of the database file of @slot: its path, which fields
+ * are logged into it, buffers for its updates and, using rrd_info, what
+ * the step of the database is, when it was last updated and which of its
+ * data sources are gauges.
  *
- * NOTE: One parameter is implicit: the data which should be written to the
- *       database file, which is contained in @logger->data.
- */
-static void update(struct rrd_logger *logger, char *rel_path)
-{
-	int ret;
-	char *cpy;
-
-	/* TODO: insert reading time instead of current time */
-	cpy = strbuf_strcpy(&logger->data);
-	strbuf_reset(&logger->data);
-	strbuf_printf(&logger->data, "%li:%s", time(NULL), cpy);
-	free(cpy);
-
-	char *update_params[] = {
-		"rrdupdate",
-		paste_path(logger->cfg.rrd_root, rel_path),
-		strbuf_get_string(&logger->data),
-		NULL
-	};
-
-	ret = rrd_update(ARRAY_SIZE(update_params) - 1, update_params);
-	if (ret != 0) {
-		log_error("rrd_update: %s", rrd_get_error()); /* TODO quit */
+ * NOTE: If the file can't be examined, the step is unknown and readings
+ *       are not coalesced.
+ */
+static void open_file(struct rrd_logger *logger, int slot)
+{
+	struct rrd_file *file = &logger->files[slot];
+	char path[PATH_MAX];
+	char key[64];
+	rrd_info_t *info, *cur;
+	size_t i;
+
+	file->num_ds = 0;
+	file->step = 0;
+
+	for (i = 0; i < ARRAY_SIZE(rrd_ds); i++) {
+		if (rrd_ds[i].type != slot_type(slot))
+			continue;
+
+		assert(file->num_ds < RRD_MAX_DS);
+		file->ds[file->num_ds] = rrd_ds[i].ds;
+		file->fields[file->num_ds] = reading_field_lookup(rrd_ds[i].type, rrd_ds[i].field);
+		file->gauge[file->num_ds] = rrd_ds[i].gauge;
+		file->num_ds++;
+	}
+
+	if (file->num_ds == 0 || slot_path(&logger->cfg, slot, path, sizeof(path)) != 0)
+		return;
+
+	file->path = malloc_safe(strlen(path) + 1);
+	strcpy(file->path, path);
+
+	file->capacity = MAX(logger->cfg.batch_size, 1);
+	if (logger->cfg.daemon != NULL)
+		file->capacity = MAX(file->capacity, DAEMON_BACKLOG);
+	file->updates = malloc_safe(file->capacity * sizeof(*file->updates));
+	file->argv = malloc_safe(file->capacity * sizeof(*file->argv));
+	for (i = 0; i < file->capacity; i++)
+		file->argv[i] = file->updates[i];
+
+	if ((info = rrd_info_r(path)) == NULL) {
+		log_warning("rrd_info_r: %s, updates of %s won't be coalesced",
+			rrd_get_error(), path);
 		rrd_clear_error();
+		return;
+	}
+
+	for (cur = info; cur != NULL; cur = cur->next) {
+		if (strcmp(cur->key, "step") == 0 && cur->type == RD_I_CNT)
+			file->step = cur->value.u_cnt;
+
+		/* so that readings replayed from the journal aren't written twice */
+		if (strcmp(cur->key, "last_update") == 0 && cur->type == RD_I_CNT)
+			file->last = cur->value.u_cnt;
+
+		for (i = 0; i < file->num_ds; i++) {
+			snprintf(key, sizeof(key), "ds[%s].type", file->ds[i]);
+			if (strcmp(cur->key, key) == 0 && cur->type == RD_I_STR)
+				file->gauge[i] = strcmp(cur->value.u_str, "GAUGE") == 0;
+		}
 	}
+
+	rrd_info_free(info);
 }
 
-static void log_wind(struct rrd_logger *logger, struct wmr_wind *wind)
+/*
+ * Write all updates buffered for the RRD database file of @slot with
+ * a single call to rrd_update_r.
+ *
+ * NOTE: Any update may flush buffered updates of all files (see
+ *       flush_batches), so calls into the logger have to be serialized
+ *       by the caller, as meteod does with the lock of its loggers.
+ */
+static void flush_batch(struct rrd_logger *logger, int slot)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%.1f:%.1f",
-		wind->avg_speed,
-		wind->gust_speed);
+	struct rrd_file *file = &logger->files[slot];
+
+	if (file->count == 0)
+		return;
+
+	if (rrd_update_r(file->path, NULL, file->count, file->argv) != 0) {
+		log_error("rrd_update_r: %s", rrd_get_error()); /* TODO quit */
+		rrd_clear_error();
+	}
 
-	update(logger, logger->cfg.wind_rrd);
+	file->count = 0;
+	file->unsynced = 0;
 }
 
-static void log_rain(struct rrd_logger *logger, struct wmr_rain *rain)
+/*
+ * Write buffered updates of all files which have enough of them or whose
+ * oldest update has waited long enough, or, if @all is set, of all files.
+ *
+ * If an rrdcached daemon is configured, the updates are sent to it. If it
+ * can't be reached, they are kept for the next time rather than written
+ * directly: the daemon may still hold older updates of the files, and
+ * rrd_update_r would get ahead of them.
+ */
+static void flush_batches(struct rrd_logger *logger, bool all)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%.1f:%.0f",
-		rain->rate,
-		rain->accum_2007);
+	struct rrdcached_update updates[NUM_SLOTS];
+	size_t batch_size = MAX(logger->cfg.batch_size, 1);
+	ulong_t now = monotonic_ms();
+	struct rrd_file *file;
+	bool flush[NUM_SLOTS];
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < NUM_SLOTS; i++) {
+		file = &logger->files[i];
+		flush[i] = file->count > 0 && (all || file->count >= batch_size
+			|| now - file->since >= 1000 * logger->cfg.flush_interval);
 
-	update(logger, logger->cfg.rain_rrd);
+		if (flush[i])
+			updates[count++] = (struct rrdcached_update) {
+				.path = file->path,
+				.count = file->count,
+				.values = file->argv,
+			};
+	}
+
+	if (count > 0 && logger->cfg.daemon != NULL) {
+		if (rrdcached_send(&logger->rrdcached, updates, count) != 0)
+			return;
+
+		for (i = 0; i < NUM_SLOTS; i++)
+			if (flush[i]) {
+				logger->files[i].count = 0;
+				logger->files[i].overflowing = false;
+			}
+		return;
+	}
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		if (flush[i])
+			flush_batch(logger, i);
 }
 
-static void log_uvi(struct rrd_logger *logger, struct wmr_uvi *uvi)
+/*
+ * Buffer an update of the database file of @slot at time @t with the
+ * readings coalesced so far: the average of each gauge and the latest
+ * value of each counter. Once enough updates are buffered, or the oldest
+ * of them has waited long enough, write them.
+ */
+static void update(struct rrd_logger *logger, int slot, time_t t)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%u",
-		uvi->index);
+	struct rrd_file *file = &logger->files[slot];
+	size_t num_coalesced = file->num_coalesced;
+	char *buf;
+	size_t len;
+	size_t i;
+
+	file->num_coalesced = 0;
+
+	/*
+	 * rrd_update gives up on the rest of a batch once an update fails,
+	 * and updates not newer than the previous one always do.
+	 */
+	if (t <= file->last) {
+		log_debug("RRD update at %li not newer than the last one, dropped", t);
+		return;
+	}
+
+	/* only while rrdcached is away, so the oldest updates make room */
+	if (file->count == file->capacity) {
+		if (!file->overflowing)
+			log_error("Too many updates of %s waiting for rrdcached, "
+				"dropping the oldest ones", file->path);
+		file->overflowing = true;
+		file->count--;
+		memmove(file->updates, file->updates + 1, file->count * sizeof(*file->updates));
+	}
 
-	update(logger, logger->cfg.uvi_rrd);
+	buf = file->updates[file->count];
+	len = numfmt_int(buf, RRD_UPDATE_MAX_LEN, t);
+	for (i = 0; i < file->num_ds && len + 1 < RRD_UPDATE_MAX_LEN; i++) {
+		buf[len++] = ':';
+		if (file->gauge[i])
+			len += numfmt_fixed(buf + len, RRD_UPDATE_MAX_LEN - len,
+				file->sum[i] / num_coalesced, 2);
+		else
+			len += numfmt_fixed(buf + len, RRD_UPDATE_MAX_LEN - len,
+				file->value[i], 0);
+	}
+
+	if (i < file->num_ds || len >= RRD_UPDATE_MAX_LEN) {
+		log_error("RRD update of %s too long, dropped", file->path);
+		return;
+	}
+
+	file->last = t;
+	if (file->count++ == 0)
+		file->since = monotonic_ms();
+	if (file->unsynced == 0)
+		file->unsynced = t;
+
+	flush_batches(logger, false);
 }
 
-static void log_baro(struct rrd_logger *logger, struct wmr_baro *baro)
+/*
+ * Coalesce @pending with other readings which fall into the same step of
+ * the database file of @slot. Like RRD does, readings from (end - step, end]
+ * are considered to be within the step which ends at end. Once a reading
+ * from a later step arrives, the step is complete and an update is made at
+ * its end, which RRD consolidates into the very same primary data point as
+ * it would the readings themselves (save for weighting them by time).
+ *
+ * NOTE: Readings are passed in order of their time.
+ */
+static void coalesce(struct rrd_logger *logger, int slot, struct rrd_pending *pending)
 {
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%u:%u",
-		baro->pressure,
-		baro->alt_pressure);
+	struct rrd_file *file = &logger->files[slot];
+	time_t t = pending->time;
+	time_t end;
+	size_t i;
+
+	end = t;
+	if (file->step > 0 && t % (time_t)file->step != 0)
+		end += file->step - t % (time_t)file->step;
+
+	/* the step has been written already */
+	if (end <= file->last || (file->num_coalesced > 0 && end < file->end)) {
+		log_debug("Reading from %s at %li arrived too late for RRD, dropped",
+			slot_name(slot), t);
+		return;
+	}
+
+	if (file->num_coalesced > 0 && end != file->end)
+		update(logger, slot, file->end);
 
-	update(logger, logger->cfg.baro_rrd);
+	if (file->num_coalesced == 0) {
+		file->end = end;
+		for (i = 0; i < file->num_ds; i++)
+			file->sum[i] = 0;
+	}
+
+	for (i = 0; i < file->num_ds; i++) {
+		file->sum[i] += pending->values[i];
+		file->value[i] = pending->values[i];
+	}
+	file->num_coalesced++;
+	file->latest = t;
 }
 
-static void log_temp(struct rrd_logger *logger, struct wmr_temp *temp)
+/*
+ * Pass the held back readings of @slot which are older than @t on to
+ * coalesce.
+ */
+static void release_pending(struct rrd_logger *logger, int slot, time_t t)
 {
-	struct strbuf filename; /* filename depends on sensor ID */
+	struct rrd_file *file = &logger->files[slot];
+	size_t i;
 
-	strbuf_reset(&logger->data);
-	strbuf_printf(
-		&logger->data,
-		"%.1f:%u:%.1f",
-		temp->temp,
-		temp->humidity,
-		temp->dew_point);
+	for (i = 0; i < file->num_pending && file->pending[i].time < t; i++) {
+		coalesce(logger, slot, &file->pending[i]);
+		file->released = file->pending[i].time;
+	}
 
-	strbuf_init(&filename, 128);
-	strbuf_printf(&filename, logger->cfg.temp_N_rrd, temp->sensor_id);
-	update(logger, strbuf_get_string(&filename));
-	strbuf_free(&filename);
+	file->num_pending -= i;
+	memmove(file->pending, file->pending + i, file->num_pending * sizeof(*file->pending));
 }
 
+/*
+ * Log @reading at the time it was taken. Since RRD only accepts updates
+ * in order, readings are held back in order of their time until no reading
+ * more than max_lateness seconds older is expected, which lets readings
+ * backfilled from the station's logger and live readings be interleaved.
+ * Readings which arrive later than that are dropped.
+ *
+ * Readings from more than max_ahead seconds in the future, such as those
+ * of a station whose clock is off, are dropped too: once held back, they
+ * would release all readings before them and have the valid readings
+ * which follow dropped as late.
+ */
 static void log_reading(struct rrd_logger *logger, struct wmr_reading *reading)
 {
-	switch (reading->type) {
-	case WMR_WIND:
-		log_wind(logger, &reading->wind);
-		break;
-	case WMR_RAIN:
-		log_rain(logger, &reading->rain);
-		break;
-	case WMR_UVI:
-		log_uvi(logger, &reading->uvi);
-		break;
-	case WMR_BARO:
-		log_baro(logger, &reading->baro);
-		break;
-	case WMR_TEMP:
-		log_temp(logger, &reading->temp);
-		break;
+	struct rrd_file *file;
+	struct rrd_pending *pending;
+	size_t i;
+	int slot;
+
+	if ((slot = reading_slot(reading)) < 0)
+		return;
+
+	file = &logger->files[slot];
+	if (file->num_ds == 0)
+		return;
+
+	if (logger->cfg.max_ahead > 0
+		&& reading->time > time(NULL) + (time_t)logger->cfg.max_ahead) {
+		if (!file->ahead)
+			log_warning("Reading from %s at %li is from the future, "
+				"dropping such readings", slot_name(slot), reading->time);
+		file->ahead = true;
+		return;
+	}
+	file->ahead = false;
+
+	if (reading->time < file->released) {
+		log_debug("Reading from %s at %li arrived too late for RRD, dropped",
+			slot_name(slot), reading->time);
+		return;
 	}
+
+	if (file->num_pending == file->pending_size) {
+		file->pending_size = MAX(2 * file->pending_size, 16);
+		file->pending = realloc_safe(file->pending,
+			file->pending_size * sizeof(*file->pending));
+	}
+
+	for (i = file->num_pending; i > 0; i--) {
+		if (file->pending[i - 1].time <= reading->time)
+			break;
+		file->pending[i] = file->pending[i - 1];
+	}
+
+	pending = &file->pending[i];
+	pending->time = reading->time;
+	for (i = 0; i < file->num_ds; i++)
+		pending->values[i] = reading_field_value(reading, file->fields[i]);
+	file->num_pending++;
+
+	release_pending(logger, slot,
+		file->pending[file->num_pending - 1].time - logger->cfg.max_lateness);
 }
 
 void rrd_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
@@ -153,10 +423,320 @@ void rrd_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
 
 void rrd_logger_init(struct rrd_logger *logger)
 {
-	strbuf_init(&logger->data, 128);
+	size_t i;
+
+	logger->cfg.batch_size = DEFAULT_BATCH_SIZE;
+	logger->cfg.flush_interval = DEFAULT_FLUSH_INTERVAL;
+	logger->cfg.max_lateness = DEFAULT_MAX_LATENESS;
+	logger->cfg.max_ahead = DEFAULT_MAX_AHEAD;
+	logger->cfg.daemon = NULL;
+
+	for (i = 0; i < NUM_SLOTS; i++) {
+		logger->files[i].num_ds = 0;
+		logger->files[i].path = NULL;
+		logger->files[i].pending = NULL;
+		logger->files[i].num_pending = 0;
+		logger->files[i].pending_size = 0;
+		logger->files[i].released = 0;
+		logger->files[i].num_coalesced = 0;
+		logger->files[i].updates = NULL;
+		logger->files[i].argv = NULL;
+		logger->files[i].count = 0;
+		logger->files[i].capacity = 0;
+		logger->files[i].last = 0;
+		logger->files[i].unsynced = 0;
+		logger->files[i].overflowing = false;
+		logger->files[i].ahead = false;
+	}
+}
+
+/*
+ * Prepare @logger, configured by now, for logging.
+ */
+void rrd_logger_start(struct rrd_logger *logger)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		open_file(logger, i);
+
+	if (logger->cfg.daemon != NULL)
+		rrdcached_init(&logger->rrdcached, logger->cfg.daemon);
+}
+
+void rrd_logger_take_over(struct rrd_logger *logger, struct rrd_logger *old)
+{
+	struct rrd_file *file, *old_file;
+	struct rrd_pending *pending;
+	size_t pending_size;
+	size_t i;
+
+	for (i = 0; i < NUM_SLOTS; i++) {
+		file = &logger->files[i];
+		old_file = &old->files[i];
+		if (file->path == NULL || old_file->path == NULL
+			|| strcmp(file->path, old_file->path) != 0)
+			continue;
+
+		pending = file->pending;
+		pending_size = file->pending_size;
+		file->pending = old_file->pending;
+		file->num_pending = old_file->num_pending;
+		file->pending_size = old_file->pending_size;
+		file->released = MAX(file->released, old_file->released);
+		file->ahead = old_file->ahead;
+		old_file->pending = pending;
+		old_file->num_pending = 0;
+		old_file->pending_size = pending_size;
+
+		/* the file has been created anew with another step */
+		if (old_file->num_coalesced > 0 && old_file->step != file->step)
+			update(old, i, old_file->latest);
+
+		if (old_file->num_coalesced > 0) {
+			file->end = old_file->end;
+			file->num_coalesced = old_file->num_coalesced;
+			memcpy(file->sum, old_file->sum, sizeof(file->sum));
+			memcpy(file->value, old_file->value, sizeof(file->value));
+			file->latest = old_file->latest;
+			old_file->num_coalesced = 0;
+		}
+	}
+
+	flush_batches(old, true);
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		if (logger->files[i].path != NULL && old->files[i].path != NULL
+			&& strcmp(logger->files[i].path, old->files[i].path) == 0)
+			logger->files[i].last = MAX(logger->files[i].last, old->files[i].last);
+}
+
+/*
+ * Write all readings held back, coalesced and buffered, such as before the
+ * logger goes idle. Incomplete steps are written as of their latest reading.
+ */
+void rrd_logger_flush(struct rrd_logger *logger)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SLOTS; i++) {
+		release_pending(logger, i, LONG_MAX);
+		if (logger->files[i].num_coalesced > 0)
+			update(logger, i, logger->files[i].latest);
+	}
+
+	flush_batches(logger, true);
+}
+
+void rrd_logger_flush_due(struct rrd_logger *logger)
+{
+	flush_batches(logger, false);
+}
+
+/*
+ * Have the daemon, if any, write out what it has cached for us. Once it
+ * has, updates it was sent are known to be written.
+ */
+static void flush_daemon(struct rrd_logger *logger)
+{
+	const char *paths[NUM_SLOTS];
+	size_t count = 0;
+	size_t i;
+
+	if (logger->cfg.daemon == NULL)
+		return;
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		if (logger->files[i].unsynced > 0)
+			paths[count++] = logger->files[i].path;
+
+	if (rrdcached_flush(&logger->rrdcached, paths, count) != 0)
+		return;
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		if (logger->files[i].count == 0)
+			logger->files[i].unsynced = 0;
+}
+
+void rrd_logger_sync(struct rrd_logger *logger, time_t watermarks[NUM_SLOTS])
+{
+	struct rrd_file *file;
+	time_t start;
+	size_t i;
+
+	flush_batches(logger, true);
+	flush_daemon(logger);
+
+	for (i = 0; i < NUM_SLOTS; i++) {
+		file = &logger->files[i];
+		if (file->unsynced > 0) {
+			start = file->step > 0 ? file->unsynced - (time_t)file->step + 1 : file->unsynced;
+			watermarks[i] = MIN(watermarks[i], start);
+		}
+
+		if (file->num_pending > 0)
+			watermarks[i] = MIN(watermarks[i], file->pending[0].time);
+
+		if (file->num_coalesced > 0) {
+			start = file->step > 0 ? file->end - (time_t)file->step + 1 : file->end;
+			watermarks[i] = MIN(watermarks[i], start);
+		}
+	}
 }
 
+/*
+ * Free @logger, writing any updates still buffered.
+ */
 void rrd_logger_free(struct rrd_logger *logger)
 {
-	strbuf_free(&logger->data);
+	size_t i;
+
+	rrd_logger_flush(logger);
+
+	if (logger->cfg.daemon != NULL) {
+		flush_daemon(logger);
+		rrdcached_free(&logger->rrdcached);
+	}
+
+	for (i = 0; i < NUM_SLOTS; i++) {
+		if (logger->files[i].count > 0)
+			log_warning("%zu updates of %s not sent to rrdcached",
+				logger->files[i].count, logger->files[i].path);
+
+		free(logger->files[i].path);
+		free(logger->files[i].pending);
+		free(logger->files[i].updates);
+		free(logger->files[i].argv);
+	}
+}
+
+/*
+ * Free the chunk of @series fetched last.
+ */
+static void free_chunk(struct rrd_series *series)
+{
+	unsigned long i;
+
+	for (i = 0; i < series->ds_cnt; i++)
+		free(series->ds_names[i]);
+	free(series->ds_names);
+	free(series->data);
+
+	series->ds_cnt = 0;
+	series->ds_names = NULL;
+	series->data = NULL;
+	series->num_rows = 0;
+	series->row = 0;
+}
+
+/*
+ * Fetch the next chunk of @series, of RRD_FETCH_ROWS rows at most, so that
+ * neither the time it takes nor the memory it needs grows with the range.
+ *
+ * Return value:
+ *	true if a chunk was fetched, false if the range is done or fetch fails.
+ */
+static bool fetch_chunk(struct rrd_series *series)
+{
+	time_t start = series->next;
+	time_t end;
+	rrd_value_t *data;
+	unsigned long i;
+
+	if (start >= series->end)
+		return false;
+
+	free_chunk(series);
+	end = MIN(series->end, start + RRD_FETCH_ROWS * (time_t)series->step);
+	if (rrd_fetch_r(series->path, series->cf, &start, &end, &series->step,
+		&series->ds_cnt, &series->ds_names, &data) != 0) {
+		log_error("rrd_fetch_r: %s", rrd_get_error());
+		rrd_clear_error();
+		series->next = series->end;
+		return false;
+	}
+
+	series->data = data;
+	series->start = start;
+	series->num_rows = (end - start) / series->step;
+	series->row = 0;
+	series->next = MAX(series->next + 1, end);
+
+	for (i = 0; i < series->ds_cnt; i++)
+		if (strcmp(series->ds_names[i], series->ds) == 0)
+			break;
+
+	if (i == series->ds_cnt) {
+		log_error("RRD file %s has no data source %s", series->path, series->ds);
+		series->next = series->end;
+		return false;
+	}
+
+	series->ds_index = i;
+	return true;
+}
+
+int rrd_series_fetch(struct rrd_cfg *cfg, int slot, const char *field,
+	const char *cf, time_t start, time_t end, unsigned long step,
+	struct rrd_series *series)
+{
+	char path[PATH_MAX];
+	const char *ds = NULL;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(rrd_ds); i++)
+		if (rrd_ds[i].type == slot_type(slot) && strcmp(rrd_ds[i].field, field) == 0)
+			ds = rrd_ds[i].ds;
+
+	if (ds == NULL || slot_path(cfg, slot, path, sizeof(path)) != 0)
+		return -1;
+
+	series->path = malloc_safe(strlen(path) + 1);
+	strcpy(series->path, path);
+	series->cf = cf;
+	series->ds = ds;
+	series->next = start;
+	series->end = end;
+	series->last = 0;
+	series->step = MAX(step, 1);
+	series->ds_cnt = 0;
+	series->ds_names = NULL;
+	series->data = NULL;
+	series->num_rows = 0;
+	series->row = 0;
+
+	/* the first chunk tells whether the file can be read at all */
+	if (!fetch_chunk(series)) {
+		rrd_series_free(series);
+		return -1;
+	}
+
+	return 0;
+}
+
+bool rrd_series_next(struct rrd_series *series, time_t *t, double *value)
+{
+	for (;;) {
+		while (series->row < series->num_rows) {
+			*t = series->start + (series->row + 1) * series->step;
+			*value = series->data[series->row * series->ds_cnt + series->ds_index];
+			series->row++;
+
+			/* chunks overlap if librrd rounds them to a coarser step */
+			if (*t > series->last) {
+				series->last = *t;
+				return true;
+			}
+		}
+
+		if (!fetch_chunk(series))
+			return false;
+	}
+}
+
+void rrd_series_free(struct rrd_series *series)
+{
+	free_chunk(series);
+	free(series->path);
+	series->path = NULL;
 }
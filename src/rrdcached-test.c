@@ -0,0 +1,172 @@
+/*
+ * Tests of the rrdcached client against a stand-in daemon listening on a
+ * Unix socket: updates are pipelined, i.e. all of them are sent before
+ * the daemon replies to any, replies (including ones of several lines and
+ * ones which come in pieces) are matched to the commands, and flushing
+ * files, as the RRD logger does when it's freed, waits for the daemon to
+ * reply to every FLUSH.
+ *
+ * Run by `make test`. Hangs are caught with alarm(2).
+ */
+
+#include "common.h"
+#include "log.h"
+#include "rrdcached.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define	TIMEOUT		10	/* longest the test may take (s) */
+
+static const char *updates_sent =
+	"UPDATE a.rrd 1500000000:1:2\n"
+	"UPDATE b.rrd 1500000000:3 1500000060:4\n"
+	"UPDATE c.rrd 1500000000:5\n";
+
+/* the second is rejected, the third has lines following */
+static const char *update_replies =
+	"0 errors, enqueued 1 value(s).\n"
+	"-1 No such file: b.rrd\n"
+	"2 lines follow\n"
+	"first\n"
+	"second\n";
+
+static const char *flushes_sent =
+	"FLUSH a.rrd\n"
+	"FLUSH b.rrd\n";
+
+static struct sockaddr_un addr = { .sun_family = AF_UNIX };
+static int listen_fd;
+static char received[1024];	/* what the daemon has got */
+static size_t received_len;
+static size_t num_lines;	/* lines in @received */
+static atomic_bool replied;	/* has the last reply been sent? */
+
+/*
+ * Read from @fd until @count lines have been received in all. Commands
+ * may come before the replies to the previous ones are sent.
+ */
+static void read_lines(int fd, size_t count)
+{
+	ssize_t ret;
+	size_t i;
+
+	while (num_lines < count) {
+		if ((ret = read(fd, received + received_len,
+			sizeof(received) - 1 - received_len)) <= 0)
+			errx(EXIT_FAILURE, "The daemon got %zu lines, expected %zu",
+				num_lines, count);
+
+		for (i = received_len; i < received_len + ret; i++)
+			num_lines += received[i] == '\n';
+		received_len += ret;
+	}
+
+	received[received_len] = '\0';
+}
+
+static void write_str(int fd, const char *str)
+{
+	if (write(fd, str, strlen(str)) != (ssize_t)strlen(str))
+		err(EXIT_FAILURE, "Cannot reply");
+}
+
+/*
+ * The daemon: take one connection, reply to the updates once all of them
+ * have come, then to the flushes, the last reply in two pieces, and wait
+ * for the client to close the connection.
+ */
+static void *daemon_thread(void *arg)
+{
+	int fd;
+
+	(void) arg;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) == -1)
+		err(EXIT_FAILURE, "accept");
+
+	read_lines(fd, 3);
+	write_str(fd, update_replies);
+
+	read_lines(fd, 5);
+	write_str(fd, "0 Successfully flushed a.rrd.\n0 Successfully");
+	usleep(100000);
+	atomic_store(&replied, true);
+	write_str(fd, " flushed b.rrd.\n");
+
+	if (read(fd, received + received_len, sizeof(received) - 1 - received_len) != 0)
+		errx(EXIT_FAILURE, "The daemon got more than expected");
+	(void) close(fd);
+	return NULL;
+}
+
+int main(void)
+{
+	struct log_cfg log_cfg = { LOG_CRIT, LOG_TO_STDERR, NULL };
+	char dir[] = "/tmp/rrdcached-test.XXXXXX";
+	const char *a_values[] = { "1500000000:1:2" };
+	const char *b_values[] = { "1500000000:3", "1500000060:4" };
+	const char *c_values[] = { "1500000000:5" };
+	struct rrdcached_update updates[] = {
+		{ "a.rrd", ARRAY_SIZE(a_values), a_values },
+		{ "b.rrd", ARRAY_SIZE(b_values), b_values },
+		{ "c.rrd", ARRAY_SIZE(c_values), c_values },
+	};
+	const char *paths[] = { "a.rrd", "b.rrd" };
+	char rc_addr[sizeof(addr.sun_path) + 8];
+	char expected[1024];
+	struct rrdcached rc;
+	pthread_t daemon_id;
+
+	if (log_start(&log_cfg) != 0)
+		return EXIT_FAILURE;
+	alarm(TIMEOUT);
+
+	if (mkdtemp(dir) == NULL)
+		err(EXIT_FAILURE, "Cannot create %s", dir);
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sock", dir);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+		|| bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+		|| listen(listen_fd, 1) == -1)
+		err(EXIT_FAILURE, "Cannot listen at %s", addr.sun_path);
+	if (pthread_create(&daemon_id, NULL, daemon_thread, NULL) != 0)
+		errx(EXIT_FAILURE, "Cannot start the daemon");
+
+	snprintf(rc_addr, sizeof(rc_addr), "unix:%s", addr.sun_path);
+	rrdcached_init(&rc, rc_addr);
+
+	/* sent without waiting for replies, which the daemon holds back */
+	if (rrdcached_send(&rc, updates, ARRAY_SIZE(updates)) != 0)
+		errx(EXIT_FAILURE, "Updates weren't queued");
+
+	if (rrdcached_flush(&rc, paths, ARRAY_SIZE(paths)) != 0)
+		errx(EXIT_FAILURE, "Flushing failed");
+	if (!atomic_load(&replied) || rc.num_replies != 0 || rc.num_lines != 0
+		|| rc.in_len != 0)
+		errx(EXIT_FAILURE, "Flushing returned before all replies came");
+
+	rrdcached_free(&rc);
+	pthread_join(daemon_id, NULL);
+	snprintf(expected, sizeof(expected), "%s%s", updates_sent, flushes_sent);
+	if (strcmp(received, expected) != 0)
+		errx(EXIT_FAILURE, "The daemon was expected to get:\n%sbut got:\n%s",
+			expected, received);
+
+	/* the daemon is gone */
+	(void) close(listen_fd);
+	(void) unlink(addr.sun_path);
+	(void) rmdir(dir);
+	rrdcached_init(&rc, rc_addr);
+	if (rrdcached_flush(&rc, paths, ARRAY_SIZE(paths)) == 0)
+		errx(EXIT_FAILURE, "Flushing succeeded with no daemon");
+	rrdcached_free(&rc);
+	log_stop();
+	return EXIT_SUCCESS;
+}
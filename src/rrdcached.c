@@ -0,0 +1,307 @@
+/*
+ * Client of rrdcached, the RRD caching daemon.
+ *
+ * The daemon speaks a line-based protocol over a Unix socket. Every command
+ * gets a reply line "<status> <message>": a negative status means an error,
+ * a positive one is the number of lines which follow. Commands may be
+ * pipelined, i.e. sent before replies to the previous ones are read, which
+ * is what is done here: updates are sent one command each without waiting,
+ * and replies are read whenever there's something more to send, so that a
+ * slow daemon never holds up the thread logging readings.
+ *
+ * Commands are kept until they're sent in whole: should the connection be
+ * lost, commands not sent yet are sent over the next one. Updates are never
+ * written to the files directly meanwhile, since the daemon may still hold
+ * older updates of them, which it writes out once it's back.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "rrdcached.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define	CMD_INIT_SIZE	1024
+#define	OUT_MAX		65536	/* most bytes of commands not sent yet */
+#define	RETRY_MIN	1000	/* first wait before connecting again (ms) */
+#define	RETRY_MAX	60000	/* longest wait before connecting again (ms) */
+#define	FLUSH_TIMEOUT	5000	/* longest wait for replies to FLUSH (ms) */
+
+void rrdcached_init(struct rrdcached *rc, char *addr)
+{
+	if (strncmp(addr, "unix:", strlen("unix:")) == 0)
+		addr += strlen("unix:");
+
+	rc->path = addr;
+	rc->fd = -1;
+	strbuf_init(&rc->out, CMD_INIT_SIZE);
+	rc->out_sent = 0;
+	rc->in_len = 0;
+	rc->num_replies = 0;
+	rc->num_lines = 0;
+	rc->retry_at = 0;
+	rc->retry_interval = RETRY_MIN;
+	rc->failing = false;
+}
+
+/*
+ * Close the connection. The command being sent when it was lost is sent
+ * again from its start over the next one, replies still to come are lost.
+ */
+static void disconnect(struct rrdcached *rc)
+{
+	if (rc->fd >= 0)
+		(void) close(rc->fd);
+
+	rc->fd = -1;
+	rc->out_sent = 0;
+	rc->in_len = 0;
+	rc->num_replies = 0;
+	rc->num_lines = 0;
+}
+
+void rrdcached_free(struct rrdcached *rc)
+{
+	disconnect(rc);
+	strbuf_free(&rc->out);
+}
+
+/*
+ * Wait for longer and longer before connecting again.
+ */
+static void back_off(struct rrdcached *rc)
+{
+	rc->retry_at = monotonic_ms() + rc->retry_interval;
+	rc->retry_interval = MIN(2 * rc->retry_interval, RETRY_MAX);
+}
+
+static int connect_daemon(struct rrdcached *rc)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (rc->fd >= 0)
+		return 0;
+
+	if (monotonic_ms() < rc->retry_at)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(rc->path) >= sizeof(addr.sun_path)) {
+		if (!rc->failing)
+			log_error("rrdcached socket path %s too long", rc->path);
+		rc->failing = true;
+		back_off(rc);
+		return -1;
+	}
+	strcpy(addr.sun_path, rc->path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		log_error("socket: %s", strerror(errno));
+		back_off(rc);
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		/* logged once, not on every attempt */
+		if (!rc->failing)
+			log_error("Cannot connect to rrdcached at %s: %s, "
+				"updates are kept until it's back", rc->path, strerror(errno));
+		rc->failing = true;
+		back_off(rc);
+		(void) close(fd);
+		return -1;
+	}
+
+	rc->fd = fd;
+	rc->failing = false;
+	rc->retry_interval = RETRY_MIN;
+	log_info("Connected to rrdcached at %s", rc->path);
+	return 0;
+}
+
+/*
+ * Process the reply line of @len bytes at @line (not NUL-terminated).
+ */
+static void process_line(struct rrdcached *rc, char *line, size_t len)
+{
+	int status;
+
+	line[len] = '\0';
+
+	if (rc->num_lines > 0) {
+		rc->num_lines--;
+		log_error("rrdcached: %s", line);
+		return;
+	}
+
+	if (rc->num_replies == 0) {
+		log_warning("rrdcached: unexpected reply: %s", line);
+		return;
+	}
+	rc->num_replies--;
+
+	if ((status = atoi(line)) < 0)
+		log_error("rrdcached: %s", line);
+	else
+		rc->num_lines = status;
+}
+
+/*
+ * Send what can be sent and process the replies which have come, without
+ * waiting.
+ *
+ * Return value:
+ *	Zero on success, -1 if the connection has been lost.
+ */
+static int pump(struct rrdcached *rc)
+{
+	char *str = strbuf_get_string(&rc->out);
+	size_t len = strbuf_strlen(&rc->out);
+	size_t sent = rc->out_sent;
+	char *end;
+	char *line;
+	ssize_t ret;
+
+	while (sent < len) {
+		ret = send(rc->fd, str + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret < 0) {
+			log_error("Cannot send to rrdcached: %s", strerror(errno));
+			return -1;
+		}
+		sent += ret;
+	}
+
+	/* drop the lines sent in whole */
+	for (end = str + sent; end > str && end[-1] != '\n'; end--)
+		;
+	memmove(str, end, len - (end - str));
+	rc->out.len = len - (end - str);
+	rc->out_sent = sent - (end - str);
+
+	for (;;) {
+		ret = recv(rc->fd, rc->in + rc->in_len, sizeof(rc->in) - 1 - rc->in_len,
+			MSG_DONTWAIT);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret <= 0) {
+			log_error("rrdcached closed the connection");
+			return -1;
+		}
+		rc->in_len += ret;
+
+		line = rc->in;
+		while ((end = memchr(line, '\n', rc->in_len - (line - rc->in))) != NULL) {
+			process_line(rc, line, end - line);
+			line = end + 1;
+		}
+		rc->in_len -= line - rc->in;
+		memmove(rc->in, line, rc->in_len);
+
+		/* a line too long is cut short */
+		if (rc->in_len == sizeof(rc->in) - 1) {
+			process_line(rc, rc->in, rc->in_len);
+			rc->in_len = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Connect if not connected and pump.
+ */
+static int talk(struct rrdcached *rc)
+{
+	if (connect_daemon(rc) != 0)
+		return -1;
+
+	if (pump(rc) != 0) {
+		disconnect(rc);
+		back_off(rc);
+		return -1;
+	}
+
+	return 0;
+}
+
+int rrdcached_send(struct rrdcached *rc, struct rrdcached_update *updates, size_t count)
+{
+	size_t i, j;
+
+	if (count == 0)
+		return 0;
+
+	/* keep the updates rather than queueing more for a daemon which lags */
+	if (talk(rc) != 0 || strbuf_strlen(&rc->out) >= OUT_MAX)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		strbuf_puts(&rc->out, "UPDATE ");
+		strbuf_puts(&rc->out, updates[i].path);
+		for (j = 0; j < updates[i].count; j++) {
+			strbuf_putc(&rc->out, ' ');
+			strbuf_puts(&rc->out, updates[i].values[j]);
+		}
+		strbuf_putc(&rc->out, '\n');
+		rc->num_replies++;
+	}
+
+	(void) talk(rc);
+	return 0;
+}
+
+int rrdcached_flush(struct rrdcached *rc, const char **paths, size_t count)
+{
+	ulong_t deadline = monotonic_ms() + FLUSH_TIMEOUT;
+	struct pollfd pfd;
+	ulong_t now;
+	size_t i;
+
+	if (count == 0)
+		return 0;
+
+	if (talk(rc) != 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		strbuf_puts(&rc->out, "FLUSH ");
+		strbuf_puts(&rc->out, paths[i]);
+		strbuf_putc(&rc->out, '\n');
+		rc->num_replies++;
+	}
+
+	/* replies come in order, so the last one is to the last FLUSH */
+	while (rc->num_replies > 0 || rc->num_lines > 0) {
+		if (talk(rc) != 0)
+			return -1;
+		if (rc->num_replies == 0 && rc->num_lines == 0)
+			break;
+
+		if ((now = monotonic_ms()) >= deadline) {
+			log_error("rrdcached didn't flush the files in time");
+			return -1;
+		}
+
+		pfd = (struct pollfd) {
+			.fd = rc->fd,
+			.events = POLLIN | (strbuf_strlen(&rc->out) > 0 ? POLLOUT : 0),
+		};
+		(void) poll(&pfd, 1, deadline - now);
+	}
+
+	return 0;
+}
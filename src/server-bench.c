@@ -0,0 +1,266 @@
+/*
+ * Benchmarks of the server:
+ *
+ *   - snapshot: how long rendering the snapshot of all latest readings
+ *     takes, which is what most clients ask for;
+ *   - requests: how many "latest" requests the server answers per second,
+ *     each over a connection of its own, with more and more clients
+ *     asking at the same time.
+ *
+ * The server is started on a port of the kernel's choice on the loopback
+ * and fed made-up readings. Run by `make bench`.
+ */
+
+#include "bench.h"
+#include "common.h"
+#include "log.h"
+#include "server.h"
+#include "strbuf.h"
+#include "wmr200.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	NUM_RENDERS	100000	/* snapshots rendered */
+#define	NUM_SENSORS	3	/* temperature sensors with readings */
+#define	DURATION	1	/* how long clients keep asking (s) */
+#define	MAX_CLIENTS	32	/* most clients asking at the same time */
+
+static const unsigned num_clients[] = { 1, 4, MAX_CLIENTS };
+
+/*
+ * A client asking the server over and over.
+ */
+struct client
+{
+	pthread_t thread_id;
+	struct sockaddr_in addr;	/* address of the server */
+	atomic_bool *stop;		/* set when the client is to stop */
+	ulong_t num_requests;		/* requests answered */
+	int error;			/* errno of the request which failed (or 0) */
+};
+
+/*
+ * Feed @site readings of every sensor, @count of each.
+ */
+static void feed(struct server_site *site, size_t count)
+{
+	struct wmr_reading reading;
+	time_t now = time(NULL);
+	size_t i;
+	size_t j;
+
+	for (i = 0; i < count; i++) {
+		memset(&reading, 0, sizeof(reading));
+		reading.time = now - (count - i);
+
+		reading.type = WMR_WIND;
+		reading.wind = (struct wmr_wind) { .dir = wmr_lookup_string("NNE"),
+			.gust_speed = 4.2, .avg_speed = 2.5 + i % 10 / 10.0, .chill = 0 };
+		server_log_reading(NULL, &reading, site);
+
+		reading.type = WMR_RAIN;
+		reading.rain = (struct wmr_rain) { .rate = 0.3, .accum_hour = 1.2,
+			.accum_24h = 7.6, .accum_2007 = 1234.5 + i };
+		server_log_reading(NULL, &reading, site);
+
+		reading.type = WMR_UVI;
+		reading.uvi.index = i % 12;
+		server_log_reading(NULL, &reading, site);
+
+		reading.type = WMR_BARO;
+		reading.baro = (struct wmr_baro) { .pressure = 1013, .alt_pressure = 1020,
+			.forecast = wmr_lookup_string("cloudy") };
+		server_log_reading(NULL, &reading, site);
+
+		reading.type = WMR_TEMP;
+		for (j = 0; j < NUM_SENSORS; j++) {
+			reading.temp = (struct wmr_temp) { .sensor_id = j, .humidity = 60 + j,
+				.heat_index = 0, .temp = 21.5 - j * 5 + i % 10 / 10.0,
+				.dew_point = 9.5 - j };
+			server_log_reading(NULL, &reading, site);
+		}
+
+		reading.type = WMR_STATUS;
+		reading.status = (struct wmr_status) {
+			.wind_bat = wmr_lookup_string("ok"),
+			.temp_bat = wmr_lookup_string("ok"),
+			.rain_bat = wmr_lookup_string("low"),
+			.uv_bat = wmr_lookup_string("ok"),
+			.wind_sensor = wmr_lookup_string("ok"),
+			.temp_sensor = wmr_lookup_string("ok"),
+			.rain_sensor = wmr_lookup_string("ok"),
+			.uv_sensor = wmr_lookup_string("failed"),
+			.rtc_signal_level = wmr_lookup_string("ok"),
+		};
+		server_log_reading(NULL, &reading, site);
+
+		reading.type = WMR_META;
+		reading.meta = (struct wmr_meta) { .num_packets = 1000 + i, .num_failed = 2,
+			.num_frames = 5000 + 5 * i, .error_rate = 0.2,
+			.num_bytes = 40000 + 40 * i, .latest_packet = reading.time,
+			.uptime = 86400 + i };
+		server_log_reading(NULL, &reading, site);
+	}
+}
+
+/*
+ * Report how long rendering a snapshot of @srv takes.
+ */
+static void bench_snapshot(struct wmr_server *srv)
+{
+	struct strbuf out;
+	double start;
+	size_t i;
+
+	strbuf_init(&out, 4096);
+
+	start = bench_now();
+	for (i = 0; i < NUM_RENDERS; i++) {
+		strbuf_reset(&out);
+		server_render_snapshot(srv, &out);
+	}
+	bench_report("server", "snapshot_render", (bench_now() - start) / NUM_RENDERS, "ns/snapshot");
+	bench_report("server", "snapshot_size", out.len, "bytes");
+
+	strbuf_free(&out);
+}
+
+/*
+ * Ask the server for the latest readings and read the reply.
+ *
+ * Return value:
+ *	Zero on success, -1 on error (see errno).
+ */
+static int request(struct client *client)
+{
+	static const char req[] = "latest\n";
+	char buf[4096];
+	ssize_t ret;
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&client->addr, sizeof(client->addr)) == -1
+		|| write(fd, req, sizeof(req) - 1) != sizeof(req) - 1)
+		goto err;
+
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		;
+	if (ret < 0)
+		goto err;
+
+	(void) close(fd);
+	return 0;
+
+err:
+	(void) close(fd);
+	return -1;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client *client = (struct client *)arg;
+
+	while (!atomic_load(client->stop)) {
+		if (request(client) != 0) {
+			client->error = errno;
+			break;
+		}
+		client->num_requests++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Report how many requests per second @count clients asking the server
+ * at @addr at the same time get answered.
+ */
+static int bench_requests(struct sockaddr_in *addr, unsigned count)
+{
+	struct client clients[MAX_CLIENTS];
+	atomic_bool stop = false;
+	ulong_t num_requests = 0;
+	char name[32];
+	double start;
+	unsigned i;
+	int ret = 0;
+
+	start = bench_now();
+	for (i = 0; i < count; i++) {
+		clients[i] = (struct client) { .addr = *addr, .stop = &stop };
+		if (pthread_create(&clients[i].thread_id, NULL, client_thread, &clients[i]) != 0)
+			errx(EXIT_FAILURE, "Cannot start a client thread");
+	}
+
+	sleep(DURATION);
+	atomic_store(&stop, true);
+
+	for (i = 0; i < count; i++) {
+		pthread_join(clients[i].thread_id, NULL);
+		num_requests += clients[i].num_requests;
+		if (clients[i].error != 0) {
+			warnx("Request failed: %s", strerror(clients[i].error));
+			ret = -1;
+		}
+	}
+
+	snprintf(name, sizeof(name), "requests_%u_clients", count);
+	bench_report("server", name, num_requests / ((bench_now() - start) / 1e9), "requests/s");
+	return ret;
+}
+
+int main(void)
+{
+	struct log_cfg log_cfg = { LOG_WARNING, LOG_TO_STDERR, NULL };
+	struct wmr_server srv;
+	struct sockaddr_storage bound;
+	socklen_t bound_len = sizeof(bound);
+	struct sockaddr_in addr;
+	int ret = EXIT_SUCCESS;
+	size_t i;
+
+	if (log_start(&log_cfg) != 0)
+		return EXIT_FAILURE;
+	signal(SIGPIPE, SIG_IGN);
+
+	server_init(&srv);
+	srv.cfg.port = 0;
+	if (server_start(&srv) != 0)
+		return EXIT_FAILURE;
+	feed(srv.sites[0], srv.cfg.history_len);
+
+	bench_snapshot(&srv);
+
+	/* the server may be listening on IPv6 as well as on IPv4 */
+	if (getsockname(srv.fd, (struct sockaddr *)&bound, &bound_len) == -1)
+		err(EXIT_FAILURE, "getsockname");
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = bound.ss_family == AF_INET6
+		? ((struct sockaddr_in6 *)&bound)->sin6_port
+		: ((struct sockaddr_in *)&bound)->sin_port;
+
+	for (i = 0; i < ARRAY_SIZE(num_clients); i++)
+		if (bench_requests(&addr, num_clients[i]) != 0)
+			ret = EXIT_FAILURE;
+
+	server_stop(&srv);
+	server_free(&srv);
+	log_stop();
+	return ret;
+}
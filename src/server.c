@@ -1,67 +1,273 @@
 /*
  * Make data available over TCP/IP.
+ *
+ * The server runs a single thread which multiplexes all client connections
+ * using poll(2). A client may send a one-line request right after it has
+ * connected; clients which send nothing (or shut down their side of the
+ * connection) get the snapshot of all latest readings, which is what the
+ * server has always done.
+ *
+ * Requests:
+ *
+ *     latest [<generation> [<timeout>]]
+ *
+ *         Reply with the generation of the latest data followed by all
+ *         latest readings. If <generation> is given and equal to the current
+ *         generation, reply with a single "unchanged" line instead. If also
+ *         <timeout> (in seconds) is given, wait up to <timeout> seconds for
+ *         the data to change before replying "unchanged".
+ *
+ *     wait <sensor> [<timeout>]
+ *
+ *         Wait until a reading from <sensor> (such as "rain" or "temp1") is
+ *         received, then reply with that reading. Reply "timeout" if none
+ *         arrives within <timeout> seconds.
+ *
+ *     history <sensor> <field> <start> <end> <step> [avg|min|max]
+ *
+ *         Reply with values of <field> (such as "temp") of readings from
+ *         <sensor> between Unix times <start> and <end>, averaged (or
+ *         otherwise consolidated) over <step> seconds long intervals, one
+ *         "<time> <value>" line per interval, "U" meaning no value. The
+ *         values come from the in-memory history if it reaches back far
+ *         enough, otherwise from the time-series store if it does, otherwise
+ *         from the RRD files.
+ *
+ *     subscribe [full|delta] [<keyframe interval>]
+ *
+ *         Keep the connection open and stream readings as they are received.
+ *         The stream starts with a "keyframe" line followed by all latest
+ *         readings, each on a line of its own (see reading_format). In the
+ *         full mode, every reading received is then sent as such a line. In
+ *         the delta mode, which is the default, only fields which changed
+ *         since the previous reading from the same sensor are sent (see
+ *         reading_format_delta), and a new keyframe is sent after every
+ *         <keyframe interval> readings, or when the client falls behind.
+ *
+ *     replicate
+ *
+ *         Used by replicas (see replica.c). Reply with a "replicate" line
+ *         followed by the in-memory history of all sensors, then keep
+ *         streaming readings like "subscribe full" does. No reading is
+ *         ever skipped: readings are sent as fast as the client takes
+ *         them, from the last replica_log_len readings received. A client
+ *         which falls further behind is disconnected.
+ *
+ *     current <sensor> <field>
+ *
+ *         Reply with the latest value of <field> of <sensor> of every site,
+ *         one "<site> <time> <value>" line per site which has one, followed
+ *         by a "summary" line with the count, minimum, maximum and average
+ *         of the values if <field> is a number.
+ *
+ *     rollup <sensor> <field> <resolution> <start> <end>
+ *
+ *         Reply with aggregates of values of <field> of readings from
+ *         <sensor> over the minutes, ten minutes, hours or days (<resolution>
+ *         being "1m", "10m", "1h" or "1d") which start between Unix times
+ *         <start> and <end>, as kept by the rollup engine (see rollup.c).
+ *         There's a "<start> <count> <avg> <min> <max> <first> <last>" line
+ *         per interval which has values.
+ *
+ *     dump
+ *
+ *         Dump the raw frames the flight recorder kept to a capture file
+ *         (see recorder.c) and reply with its name and the number of frames.
+ *
+ * Gateways (see meteod -g) serve data of several sites, each of them
+ * mirrored from an upstream meteod. There, the latest readings of every
+ * site are preceded by a "site" line, the generation is the sum of the
+ * generations of all sites and sensors are referred to as "<site>/<sensor>",
+ * such as "garden/temp1". A gateway doesn't stream readings, so the
+ * "subscribe" and "replicate" requests are not available.
  */
 
+#include "common.h"
 #include "log.h"
+#include "reading.h"
+#include "recorder.h"
 #include "server.h"
+#include "strbuf.h"
 
 #include <assert.h>
-#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #define	DEFAULT_PORT		20892
+#define	DEFAULT_REQUEST_TIMEOUT	200	/* ms */
+#define	REPLY_TIMEOUT		30000	/* ms a client may take to read more of a reply */
+#define	DEFAULT_MAX_WAIT	300	/* s */
+#define	DEFAULT_HISTORY_LEN	4096	/* readings kept per sensor */
+#define	REQUEST_MAX_LEN		256	/* longest request line accepted */
+#define	READ_CHUNK		128
+#define	DEFAULT_QUEUE_LEN	256	/* readings queued for the server thread */
+#define	HISTORY_MAX_POINTS	100000	/* most intervals a history reply may have */
+#define	HISTORY_CHUNK		256	/* intervals rendered at once */
+#define	DEFAULT_KEYFRAME_INTERVAL	100	/* deltas between keyframes */
+#define	STREAM_MAX_BACKLOG	(64 * 1024)	/* unsent bytes before resync */
+#define	DEFAULT_REPLICA_LOG_LEN	16384	/* readings kept for replicas to catch up */
+#define	REPLICA_BACKLOG		(64 * 1024)	/* unsent bytes a replica is fed up to */
+#define	REPLICA_CHUNK		64	/* readings fed to a replica at once */
 
-static void print_wind(struct wmr_wind *wind, int fd)
+/*
+ * State of a client connection.
+ */
+enum conn_state
+{
+	CONN_REQUEST,		/* waiting for the request line */
+	CONN_PARKED,		/* waiting for the latest data to change */
+	CONN_WAITING,		/* waiting for a reading from a sensor */
+	CONN_REPLY,		/* writing the reply */
+	CONN_STREAM,		/* streaming readings to a subscriber */
+	CONN_CLOSED,		/* done, to be disposed of */
+};
+
+/*
+ * Consolidation function of a history query.
+ */
+enum history_cf
+{
+	CF_AVG,
+	CF_MIN,
+	CF_MAX,
+};
+
+/*
+ * Where values of a history query come from.
+ */
+enum history_source
+{
+	SOURCE_MEMORY,		/* the in-memory history */
+	SOURCE_TSDB,		/* the time-series store */
+	SOURCE_RRD,		/* the RRD files */
+};
+
+/*
+ * State of a history query being answered.
+ */
+struct history_query
+{
+	struct server_site *site;		/* site queried */
+	int slot;				/* slot queried */
+	const struct reading_field *field;	/* field queried */
+	enum history_cf cf;			/* consolidation function */
+	time_t t;				/* start of the next interval */
+	time_t end;				/* end of the queried range */
+	unsigned long step;			/* length of an interval */
+	enum history_source source;		/* where values come from */
+	struct rrd_series series;		/* values fetched from RRD */
+	struct tsdb_iter iter;			/* values read from the store */
+	bool have_row;				/* is there a row pending? */
+	time_t row_t;				/* time of the pending row */
+	double row_value;			/* value of the pending row */
+};
+
+struct conn;
+struct wmr_server;
+
+/*
+ * Function to render the next part of a long reply into @conn->out.
+ * Once the reply is complete, the function sets @conn->produce to NULL.
+ */
+typedef void produce_t(struct wmr_server *srv, struct conn *conn);
+
+/*
+ * Client connection.
+ */
+struct conn
 {
-	dprintf(fd, "wind\tdir=%s\tgust_speed=%.1f m/s\tavg_speed=%.1f m/s\tchill=%.1f \u00B0C\n",
-		wind->dir,
-		wind->gust_speed,
-		wind->avg_speed,
-		wind->chill);
+	struct conn *next;	/* linked list of connections */
+	int fd;			/* client socket descriptor */
+	enum conn_state state;	/* connection state */
+	struct strbuf in;	/* request being read */
+	struct strbuf out;	/* reply being written */
+	size_t out_pos;		/* how much of @out has been written */
+	ulong_t deadline;	/* monotonic ms; 0 = no deadline */
+	ulong_t generation;	/* generation the client has seen */
+	struct server_site *site;	/* site waited for (CONN_WAITING) */
+	int slot;		/* slot waited for (CONN_WAITING) */
+	struct conn *wait_next;	/* next waiter on the same slot (or subscriber) */
+	struct conn **wait_prev; /* pointer to this waiter */
+	struct wmr_reading *sent;	/* last reading sent per slot (CONN_STREAM) */
+	bool delta;		/* stream deltas rather than full readings? */
+	bool resync;		/* send a keyframe once the backlog is sent? */
+	unsigned keyframe_interval;	/* deltas between keyframes */
+	unsigned num_deltas;	/* deltas sent since the last keyframe */
+	bool replica;		/* is the client a replica? */
+	ulong_t seq;		/* sequence number of the last reading sent */
+	produce_t *produce;	/* renders the rest of the reply */
+	struct history_query history;	/* history query (if any) */
+};
+
+static void render_wind(struct wmr_wind *wind, struct strbuf *out)
+{
+	strbuf_puts(out, "wind\tdir=");
+	strbuf_puts(out, wind->dir);
+	strbuf_puts(out, "\tgust_speed=");
+	strbuf_putf(out, wind->gust_speed, 1);
+	strbuf_puts(out, " m/s\tavg_speed=");
+	strbuf_putf(out, wind->avg_speed, 1);
+	strbuf_puts(out, " m/s\tchill=");
+	strbuf_putf(out, wind->chill, 1);
+	strbuf_puts(out, " \u00B0C\n");
 }
 
-static void print_rain(struct wmr_rain *rain, int fd)
+static void render_rain(struct wmr_rain *rain, struct strbuf *out)
 {
-	dprintf(fd, "rain\trate=%.1f mm/m^2\taccum_hour=%.1f mm/m^2\t"
-		"accum_24h=%1.f mm/m^2\taccum_2007=%.1f mm/m^2\n",
-		rain->rate,
-		rain->accum_hour,
-		rain->accum_24h,
-		rain->accum_2007);
+	strbuf_puts(out, "rain\trate=");
+	strbuf_putf(out, rain->rate, 1);
+	strbuf_puts(out, " mm/m^2\taccum_hour=");
+	strbuf_putf(out, rain->accum_hour, 1);
+	strbuf_puts(out, " mm/m^2\taccum_24h=");
+	strbuf_putf(out, rain->accum_24h, 0);
+	strbuf_puts(out, " mm/m^2\taccum_2007=");
+	strbuf_putf(out, rain->accum_2007, 1);
+	strbuf_puts(out, " mm/m^2\n");
 }
 
-static void print_uvi(struct wmr_uvi *uvi, int fd)
+static void render_uvi(struct wmr_uvi *uvi, struct strbuf *out)
 {
-	dprintf(fd, "uvi\tindex=%u\n", uvi->index);
+	strbuf_puts(out, "uvi\tindex=");
+	strbuf_putu(out, uvi->index);
+	strbuf_putc(out, '\n');
 }
 
-static void print_baro(struct wmr_baro *baro, int fd)
+static void render_baro(struct wmr_baro *baro, struct strbuf *out)
 {
-	dprintf(fd, "baro\talt_pressure=%u hPa\tforecast=%s\n",
-		baro->alt_pressure,
-		baro->forecast);
+	strbuf_puts(out, "baro\talt_pressure=");
+	strbuf_putu(out, baro->alt_pressure);
+	strbuf_puts(out, " hPa\tforecast=");
+	strbuf_puts(out, baro->forecast);
+	strbuf_putc(out, '\n');
 }
 
-static void print_temp(struct wmr_temp *temp, int fd)
+static void render_temp(struct wmr_temp *temp, struct strbuf *out)
 {
-	dprintf(fd, "temp\tsensor=%s\ttemp=%.1f \u00B0C\thumidity=%u %%\tdew_point=%.1f \u00B0C\n",
-		"console",
-		temp->temp,
-		temp->humidity,
-		temp->dew_point);
+	strbuf_puts(out, "temp\tsensor=console\ttemp=");
+	strbuf_putf(out, temp->temp, 1);
+	strbuf_puts(out, " \u00B0C\thumidity=");
+	strbuf_putu(out, temp->humidity);
+	strbuf_puts(out, " %\tdew_point=");
+	strbuf_putf(out, temp->dew_point, 1);
+	strbuf_puts(out, " \u00B0C\n");
 }
 
-static void print_status(struct wmr_status *status, int fd)
+static void render_status(struct wmr_status *status, struct strbuf *out)
 {
-	dprintf(fd, "status\twind_bat=%s\ttemp_bat=%s\train_bat=%s\tuv_bat=%s\t"
+	strbuf_printf(out, "status\twind_bat=%s\ttemp_bat=%s\train_bat=%s\tuv_bat=%s\t"
 		"wind_sensor=%s\ttemp_sensor=%s\train_sensor=%s\tuv_sensor=%s\t"
 		"rtc_signal=%s\n",
 		status->wind_bat, status->temp_bat, status->rain_bat, status->uv_bat,
@@ -69,86 +275,1204 @@ static void print_status(struct wmr_status *status, int fd)
 		status->uv_sensor, status->rtc_signal_level);
 }
 
-static void print_meta(struct wmr_meta *meta, int fd)
+/*
+ * Append @value with at least two digits, like "%02lu" would.
+ */
+static void put_2digits(struct strbuf *out, unsigned long value)
 {
+	if (value < 10)
+		strbuf_putc(out, '0');
+	strbuf_putu(out, value);
+}
 
-	(void) meta;
-	dprintf(fd, "meta\tnpackets=%u\tnfailed=%u\tnframes=%u\terror_rate=%.1f\t"
-		"nbytes=%lu\tlatest_packet=%s\tuptime=%02lu:%02lu:%02lu\n",
-		meta->num_packets,
-		meta->num_failed,
-		meta->num_frames,
-		meta->error_rate,
-		meta->num_bytes,
-		ctime(&meta->latest_packet),
-		meta->uptime / 3600, (meta->uptime % 3600) / 60, meta->uptime % 60);
+static void render_meta(struct wmr_meta *meta, struct strbuf *out)
+{
+	strbuf_puts(out, "meta\tnpackets=");
+	strbuf_putu(out, meta->num_packets);
+	strbuf_puts(out, "\tnfailed=");
+	strbuf_putu(out, meta->num_failed);
+	strbuf_puts(out, "\tnframes=");
+	strbuf_putu(out, meta->num_frames);
+	strbuf_puts(out, "\terror_rate=");
+	strbuf_putf(out, meta->error_rate, 1);
+	strbuf_puts(out, "\tnbytes=");
+	strbuf_putu(out, meta->num_bytes);
+	strbuf_puts(out, "\tlatest_packet=");
+	strbuf_puts(out, ctime(&meta->latest_packet));
+	strbuf_puts(out, "\tuptime=");
+	put_2digits(out, meta->uptime / 3600);
+	strbuf_putc(out, ':');
+	put_2digits(out, (meta->uptime % 3600) / 60);
+	strbuf_putc(out, ':');
+	put_2digits(out, meta->uptime % 60);
+	strbuf_putc(out, '\n');
 }
 
-static void print_reading(struct wmr_reading *reading, int fd)
+static void render_reading(struct wmr_reading *reading, struct strbuf *out)
 {
 	switch (reading->type) {
 	case 0: /* not measured yet */
 		break;
 	case WMR_WIND:
-		print_wind(&reading->wind, fd);
+		render_wind(&reading->wind, out);
 		break;
 	case WMR_RAIN:
-		print_rain(&reading->rain, fd);
+		render_rain(&reading->rain, out);
 		break;
 	case WMR_UVI:
-		print_uvi(&reading->uvi, fd);
+		render_uvi(&reading->uvi, out);
 		break;
 	case WMR_BARO:
-		print_baro(&reading->baro, fd);
+		render_baro(&reading->baro, out);
 		break;
 	case WMR_TEMP:
-		print_temp(&reading->temp, fd);
+		render_temp(&reading->temp, out);
 		break;
 	case WMR_STATUS:
-		print_status(&reading->status, fd);
+		render_status(&reading->status, out);
 		break;
 	case WMR_META:
-		print_meta(&reading->meta, fd);
+		render_meta(&reading->meta, out);
 		break;
 	default:
 		assert(0);
 	}
 }
 
-static void mainloop(struct wmr_server *srv)
+static void render_latest(struct wmr_latest_data *latest, struct strbuf *out)
+{
+	size_t i;
+
+	render_reading(&latest->wind, out);
+	render_reading(&latest->rain, out);
+	render_reading(&latest->baro, out);
+	render_reading(&latest->uvi, out);
+	for (i = 0; i < WMR200_MAX_TEMP_SENSORS; i++)
+		render_reading(&latest->temp[i], out);
+	render_reading(&latest->meta, out);
+	render_reading(&latest->status, out);
+}
+
+static void reply(struct conn *conn)
+{
+	conn->state = CONN_REPLY;
+	conn->deadline = monotonic_ms() + REPLY_TIMEOUT;
+}
+
+static void reply_error(struct conn *conn, char *msg)
+{
+	strbuf_printf(&conn->out, "error\tmsg=%s\n", msg);
+	reply(conn);
+}
+
+static const char *site_name(struct server_site *site)
+{
+	return site->name != NULL ? site->name : "local";
+}
+
+/*
+ * Is @srv a gateway, i.e. does it serve named sites?
+ */
+static bool is_gateway(struct wmr_server *srv)
+{
+	return srv->sites[0]->name != NULL;
+}
+
+/*
+ * Return the generation of @srv, which is the sum of generations of all
+ * sites, so that it changes whenever the latest data of any site change.
+ */
+static ulong_t server_generation(struct wmr_server *srv)
+{
+	ulong_t generation = 0;
+	size_t i;
+
+	for (i = 0; i < srv->num_sites; i++)
+		generation += store_get_generation(&srv->sites[i]->store);
+
+	return generation;
+}
+
+/*
+ * Render the latest readings of all sites. Unless @snapshot is set, they
+ * are preceded by the generation of the data rendered.
+ */
+static void render_sites(struct wmr_server *srv, bool snapshot, struct strbuf *out)
+{
+	struct wmr_latest_data *latest;
+	ulong_t *generations;
+	ulong_t generation = 0;
+	size_t i;
+
+	latest = malloc_safe(srv->num_sites * sizeof(*latest));
+	generations = malloc_safe(srv->num_sites * sizeof(*generations));
+
+	for (i = 0; i < srv->num_sites; i++) {
+		generations[i] = store_get_latest(&srv->sites[i]->store, &latest[i]);
+		generation += generations[i];
+	}
+
+	if (!snapshot)
+		strbuf_printf(out, "generation\tgen=%lu\n", generation);
+
+	for (i = 0; i < srv->num_sites; i++) {
+		if (srv->sites[i]->name != NULL)
+			strbuf_printf(out, "site\tname=%s\tgen=%lu\n",
+				srv->sites[i]->name, generations[i]);
+		render_latest(&latest[i], out);
+	}
+
+	free(generations);
+	free(latest);
+}
+
+/*
+ * Reply with the snapshot of all latest readings, which is what clients
+ * who don't send any request get.
+ */
+static void reply_snapshot(struct wmr_server *srv, struct conn *conn)
+{
+	server_render_snapshot(srv, &conn->out);
+	reply(conn);
+}
+
+static void reply_latest(struct wmr_server *srv, struct conn *conn)
+{
+	render_sites(srv, false, &conn->out);
+	reply(conn);
+}
+
+static void reply_unchanged(struct conn *conn)
+{
+	strbuf_printf(&conn->out, "unchanged\tgen=%lu\n", conn->generation);
+	reply(conn);
+}
+
+/*
+ * Parse an unsigned decimal number. Return -1 if @str isn't one.
+ */
+static int parse_ulong(char *str, ulong_t *val)
+{
+	char *end;
+
+	if (str == NULL || *str == '\0')
+		return -1;
+
+	errno = 0;
+	*val = strtoull(str, &end, 10);
+	if (errno || *end != '\0')
+		return -1;
+	return 0;
+}
+
+/*
+ * Return the site named @name of length @len, or NULL if there's no such site.
+ */
+static struct server_site *site_lookup(struct wmr_server *srv, char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < srv->num_sites; i++)
+		if (srv->sites[i]->name != NULL && strlen(srv->sites[i]->name) == len
+			&& strncmp(srv->sites[i]->name, name, len) == 0)
+			return srv->sites[i];
+
+	return NULL;
+}
+
+/*
+ * Find the site and the slot of @sensor, given as "<site>/<sensor>" or,
+ * unless @srv is a gateway, just "<sensor>". If @any_site is set and no
+ * site is given, the site stored into @site is NULL, meaning all sites.
+ *
+ * Return value:
+ *	Zero on success, -1 if there's no such sensor.
+ */
+static int sensor_lookup(struct wmr_server *srv, char *sensor, bool any_site,
+	struct server_site **site, int *slot)
+{
+	char *slash;
+
+	if (sensor == NULL)
+		return -1;
+
+	if ((slash = strchr(sensor, '/')) != NULL) {
+		if ((*site = site_lookup(srv, sensor, slash - sensor)) == NULL)
+			return -1;
+		sensor = slash + 1;
+	}
+	else if (is_gateway(srv)) {
+		if (!any_site)
+			return -1;
+		*site = NULL;
+	}
+	else {
+		*site = srv->sites[0];
+	}
+
+	if ((*slot = slot_lookup(sensor)) < 0)
+		return -1;
+	return 0;
+}
+
+static void handle_latest(struct wmr_server *srv, struct conn *conn, char **saveptr)
+{
+	char *gen_str = strtok_r(NULL, " \t\r", saveptr);
+	char *timeout_str = strtok_r(NULL, " \t\r", saveptr);
+	ulong_t timeout = 0;
+
+	if (gen_str == NULL) {
+		reply_latest(srv, conn);
+		return;
+	}
+
+	if (parse_ulong(gen_str, &conn->generation) != 0
+		|| (timeout_str != NULL && parse_ulong(timeout_str, &timeout) != 0)) {
+		reply_error(conn, "invalid arguments");
+		return;
+	}
+
+	if (server_generation(srv) != conn->generation) {
+		reply_latest(srv, conn);
+		return;
+	}
+
+	if (timeout == 0) {
+		reply_unchanged(conn);
+		return;
+	}
+
+	conn->state = CONN_PARKED;
+	conn->deadline = monotonic_ms() + 1000 * MIN(timeout, srv->cfg.max_wait);
+}
+
+static void wait_unlink(struct conn *conn)
+{
+	*conn->wait_prev = conn->wait_next;
+	if (conn->wait_next != NULL)
+		conn->wait_next->wait_prev = conn->wait_prev;
+	conn->wait_next = NULL;
+	conn->wait_prev = NULL;
+}
+
+static void wait_link(struct conn **head, struct conn *conn)
+{
+	conn->wait_next = *head;
+	conn->wait_prev = head;
+	if (*head != NULL)
+		(*head)->wait_prev = &conn->wait_next;
+	*head = conn;
+}
+
+static void handle_wait(struct wmr_server *srv, struct conn *conn, char **saveptr)
+{
+	char *sensor = strtok_r(NULL, " \t\r", saveptr);
+	char *timeout_str = strtok_r(NULL, " \t\r", saveptr);
+	ulong_t timeout = srv->cfg.max_wait;
+
+	if (sensor_lookup(srv, sensor, false, &conn->site, &conn->slot) != 0) {
+		reply_error(conn, "unknown sensor");
+		return;
+	}
+
+	if (timeout_str != NULL && parse_ulong(timeout_str, &timeout) != 0) {
+		reply_error(conn, "invalid arguments");
+		return;
+	}
+
+	wait_link(&conn->site->waiters[conn->slot], conn);
+	conn->state = CONN_WAITING;
+	conn->deadline = monotonic_ms() + 1000 * MIN(timeout, srv->cfg.max_wait);
+}
+
+static void history_add(struct store_agg *agg, double value)
+{
+	if (isnan(value))
+		return;
+
+	agg->count++;
+	agg->sum += value;
+	agg->min = MIN(agg->min, value);
+	agg->max = MAX(agg->max, value);
+}
+
+/*
+ * Get the next row of @query's RRD series or store iterator.
+ */
+static bool history_next(struct history_query *query)
+{
+	if (query->source == SOURCE_TSDB)
+		return tsdb_iter_next(&query->iter, &query->row_t, &query->row_value);
+	return rrd_series_next(&query->series, &query->row_t, &query->row_value);
+}
+
+/*
+ * Aggregate rows of @query's RRD series or store iterator which fall
+ * into [@from, @to).
+ */
+static void history_aggregate_rows(struct history_query *query, time_t from,
+	time_t to, struct store_agg *agg)
+{
+	agg->count = 0;
+	agg->sum = 0;
+	agg->min = INFINITY;
+	agg->max = -INFINITY;
+
+	while (query->have_row || history_next(query)) {
+		query->have_row = true;
+		if (query->row_t >= to)
+			break;
+
+		if (query->row_t >= from)
+			history_add(agg, query->row_value);
+		query->have_row = false;
+	}
+}
+
+static void history_end(struct history_query *query)
+{
+	if (query->source == SOURCE_RRD)
+		rrd_series_free(&query->series);
+	else if (query->source == SOURCE_TSDB)
+		tsdb_iter_free(&query->iter);
+	query->source = SOURCE_MEMORY;
+}
+
+static void produce_history(struct wmr_server *srv, struct conn *conn)
+{
+	struct history_query *query = &conn->history;
+	struct store_agg agg;
+	double value;
+	size_t i;
+
+	(void) srv;
+
+	for (i = 0; i < HISTORY_CHUNK && query->t < query->end; i++) {
+		if (query->source != SOURCE_MEMORY)
+			history_aggregate_rows(query, query->t, query->t + query->step, &agg);
+		else
+			store_history_aggregate(&query->site->store, query->slot, query->field,
+				query->t, query->t + query->step, &agg);
+
+		if (agg.count == 0) {
+			strbuf_puti(&conn->out, query->t);
+			strbuf_puts(&conn->out, "\tU\n");
+		}
+		else {
+			switch (query->cf) {
+			case CF_MIN:
+				value = agg.min;
+				break;
+			case CF_MAX:
+				value = agg.max;
+				break;
+			default:
+				value = agg.sum / agg.count;
+			}
+			strbuf_puti(&conn->out, query->t);
+			strbuf_putc(&conn->out, '\t');
+			strbuf_putf(&conn->out, value, 2);
+			strbuf_putc(&conn->out, '\n');
+		}
+
+		query->t += query->step;
+	}
+
+	if (query->t >= query->end) {
+		history_end(query);
+		conn->produce = NULL;
+	}
+}
+
+static void handle_history(struct wmr_server *srv, struct conn *conn, char **saveptr)
+{
+	static const char *source_names[] = {
+		[SOURCE_MEMORY] = "memory",
+		[SOURCE_TSDB] = "tsdb",
+		[SOURCE_RRD] = "rrd",
+	};
+	static const char *rrd_cf[] = {
+		[CF_AVG] = "AVERAGE",
+		[CF_MIN] = "MIN",
+		[CF_MAX] = "MAX",
+	};
+	struct history_query *query = &conn->history;
+	char *sensor = strtok_r(NULL, " \t\r", saveptr);
+	char *field = strtok_r(NULL, " \t\r", saveptr);
+	char *start_str = strtok_r(NULL, " \t\r", saveptr);
+	char *end_str = strtok_r(NULL, " \t\r", saveptr);
+	char *step_str = strtok_r(NULL, " \t\r", saveptr);
+	char *cf = strtok_r(NULL, " \t\r", saveptr);
+	ulong_t start, end, step;
+	time_t oldest;
+	time_t stored;
+
+	if (sensor_lookup(srv, sensor, false, &query->site, &query->slot) != 0) {
+		reply_error(conn, "unknown sensor");
+		return;
+	}
+
+	if (field == NULL || (query->field = reading_field_lookup(
+		slot_type(query->slot), field)) == NULL
+		|| query->field->kind == FIELD_STRING) {
+		reply_error(conn, "unknown field");
+		return;
+	}
+
+	if (parse_ulong(start_str, &start) != 0 || parse_ulong(end_str, &end) != 0
+		|| parse_ulong(step_str, &step) != 0 || step == 0 || end < start) {
+		reply_error(conn, "invalid arguments");
+		return;
+	}
+
+	if ((end - start) / step >= HISTORY_MAX_POINTS) {
+		reply_error(conn, "too many points");
+		return;
+	}
+
+	if (cf == NULL || strcmp(cf, "avg") == 0)
+		query->cf = CF_AVG;
+	else if (strcmp(cf, "min") == 0)
+		query->cf = CF_MIN;
+	else if (strcmp(cf, "max") == 0)
+		query->cf = CF_MAX;
+	else {
+		reply_error(conn, "unknown consolidation function");
+		return;
+	}
+
+	query->t = start;
+	query->end = end;
+	query->step = step;
+	query->have_row = false;
+
+	/*
+	 * If the in-memory history doesn't reach back far enough, fall back
+	 * to the time-series store, or to the RRD files unless the store
+	 * doesn't reach back either. Only the local site has them.
+	 */
+	query->source = SOURCE_MEMORY;
+	oldest = store_history_oldest(&query->site->store, query->slot);
+	if ((oldest < 0 || (time_t)start < oldest) && query->site->name == NULL) {
+		stored = srv->tsdb != NULL ? tsdb_oldest(srv->tsdb, query->slot) : -1;
+		if (stored >= 0 && ((time_t)start >= stored || srv->rrd_cfg == NULL)
+			&& tsdb_iter_init(srv->tsdb, query->slot, query->field->name,
+				start, end, &query->iter) == 0)
+			query->source = SOURCE_TSDB;
+		else if (srv->rrd_cfg != NULL && rrd_series_fetch(srv->rrd_cfg, query->slot,
+			query->field->name, rrd_cf[query->cf], start, end, step,
+			&query->series) == 0)
+			query->source = SOURCE_RRD;
+	}
+
+	strbuf_printf(&conn->out, "history\tsensor=%s\tfield=%s\tstep=%lu\tsource=%s\n",
+		sensor, field, step, source_names[query->source]);
+
+	conn->produce = produce_history;
+	produce_history(srv, conn);
+	reply(conn);
+}
+
+/*
+ * Send a keyframe, i.e. all latest readings in full, to subscriber @conn.
+ */
+static void send_keyframe(struct wmr_server *srv, struct conn *conn)
 {
 	struct wmr_latest_data latest;
+	struct wmr_reading *readings[NUM_SLOTS];
+	size_t i;
+
+	(void) store_get_latest(&srv->sites[0]->store, &latest);
+	readings[SLOT_WIND] = &latest.wind;
+	readings[SLOT_RAIN] = &latest.rain;
+	readings[SLOT_UVI] = &latest.uvi;
+	readings[SLOT_BARO] = &latest.baro;
+	for (i = 0; i < WMR200_MAX_TEMP_SENSORS; i++)
+		readings[SLOT_TEMP0 + i] = &latest.temp[i];
+	readings[SLOT_STATUS] = &latest.status;
+	readings[SLOT_META] = &latest.meta;
+
+	strbuf_puts(&conn->out, "keyframe\n");
+	for (i = 0; i < NUM_SLOTS; i++) {
+		conn->sent[i] = *readings[i];
+		if (readings[i]->type != 0)
+			reading_format(readings[i], &conn->out);
+	}
+
+	conn->num_deltas = 0;
+	conn->resync = false;
+}
+
+/*
+ * Send replica @conn the readings received after the last one it was sent,
+ * as long as it takes them. They're read from the store rather than the
+ * queue, so that bursts of readings, such as when the station's logger is
+ * read out, don't overflow the queue and make the replica start over.
+ */
+static void feed_replica(struct wmr_server *srv, struct conn *conn)
+{
+	struct wmr_reading readings[REPLICA_CHUNK];
+	ssize_t count;
+	ssize_t i;
+
+	while (strbuf_strlen(&conn->out) - conn->out_pos < REPLICA_BACKLOG) {
+		count = store_log_read(&srv->sites[0]->store, conn->seq,
+			readings, ARRAY_SIZE(readings));
+		if (count < 0) {
+			/* it will reconnect and get a fresh history */
+			log_warning("Replica fell behind, disconnecting it");
+			conn->state = CONN_CLOSED;
+			return;
+		}
+		if (count == 0)
+			return;
+
+		for (i = 0; i < count; i++)
+			reading_format(&readings[i], &conn->out);
+		conn->seq += count;
+	}
+}
+
+/*
+ * Send @reading to subscriber @conn.
+ */
+static void stream_reading(struct wmr_server *srv, struct conn *conn,
+	struct wmr_reading *reading)
+{
+	int slot = reading_slot(reading);
+
+	if (slot < 0)
+		return;
+
+	/*
+	 * If the client doesn't keep up, stop sending it readings until the
+	 * backlog is sent, then send it a keyframe.
+	 */
+	if (conn->resync || strbuf_strlen(&conn->out) - conn->out_pos > STREAM_MAX_BACKLOG) {
+		conn->resync = true;
+		return;
+	}
+
+	if (!conn->delta) {
+		reading_format(reading, &conn->out);
+	}
+	else if (conn->num_deltas >= conn->keyframe_interval) {
+		send_keyframe(srv, conn);
+	}
+	else if (conn->sent[slot].type == 0) {
+		reading_format(reading, &conn->out);
+		conn->num_deltas++;
+	}
+	else {
+		reading_format_delta(&conn->sent[slot], reading, &conn->out);
+		conn->num_deltas++;
+	}
+
+	conn->sent[slot] = *reading;
+}
+
+static void handle_subscribe(struct wmr_server *srv, struct conn *conn, char **saveptr)
+{
+	char *mode = strtok_r(NULL, " \t\r", saveptr);
+	char *interval_str = strtok_r(NULL, " \t\r", saveptr);
+	ulong_t interval = srv->cfg.keyframe_interval;
+
+	if (is_gateway(srv)) {
+		reply_error(conn, "not available in gateway mode");
+		return;
+	}
+
+	if (mode == NULL || strcmp(mode, "delta") == 0) {
+		conn->delta = true;
+	}
+	else if (strcmp(mode, "full") == 0) {
+		conn->delta = false;
+	}
+	else {
+		reply_error(conn, "unknown mode");
+		return;
+	}
+
+	if (interval_str != NULL && (parse_ulong(interval_str, &interval) != 0 || interval == 0)) {
+		reply_error(conn, "invalid arguments");
+		return;
+	}
+
+	conn->keyframe_interval = interval;
+	conn->sent = malloc_safe(NUM_SLOTS * sizeof(*conn->sent));
+	send_keyframe(srv, conn);
+
+	wait_link(&srv->subscribers, conn);
+	conn->state = CONN_STREAM;
+	conn->deadline = 0;
+}
+
+static void handle_replicate(struct wmr_server *srv, struct conn *conn)
+{
+	struct wmr_reading *readings;
+	size_t count;
+	size_t i;
+
+	if (is_gateway(srv)) {
+		reply_error(conn, "not available in gateway mode");
+		return;
+	}
+
+	count = store_history_snapshot(&srv->sites[0]->store, &readings, &conn->seq);
+
+	strbuf_printf(&conn->out, "replicate\tseq=%lu\tcount=%zu\n", conn->seq, count);
+	for (i = 0; i < count; i++)
+		reading_format(&readings[i], &conn->out);
+	free(readings);
+
+	conn->replica = true;
+	wait_link(&srv->subscribers, conn);
+	conn->state = CONN_STREAM;
+	conn->deadline = 0;
+}
+
+/*
+ * Append the value of @field of @site's latest reading of @slot to @out
+ * and account for it in @agg.
+ */
+static void current_add(struct server_site *site, int slot,
+	const struct reading_field *field, struct store_agg *agg, struct strbuf *out)
+{
+	struct wmr_reading reading;
+
+	if (!store_get_reading(&site->store, slot, &reading))
+		return;
+
+	strbuf_puts(out, site_name(site));
+	strbuf_putc(out, '\t');
+	strbuf_puti(out, reading.time);
+	strbuf_putc(out, '\t');
+	reading_format_field(&reading, field, out);
+	strbuf_puts(out, "\n");
+	history_add(agg, reading_field_value(&reading, field));
+}
+
+static void handle_current(struct wmr_server *srv, struct conn *conn, char **saveptr)
+{
+	char *sensor = strtok_r(NULL, " \t\r", saveptr);
+	char *field_name = strtok_r(NULL, " \t\r", saveptr);
+	const struct reading_field *field;
+	struct server_site *site;
+	struct store_agg agg = { .min = INFINITY, .max = -INFINITY };
+	int slot;
+	size_t i;
+
+	if (sensor_lookup(srv, sensor, true, &site, &slot) != 0) {
+		reply_error(conn, "unknown sensor");
+		return;
+	}
+
+	if (field_name == NULL
+		|| (field = reading_field_lookup(slot_type(slot), field_name)) == NULL) {
+		reply_error(conn, "unknown field");
+		return;
+	}
+
+	strbuf_printf(&conn->out, "current\tsensor=%s\tfield=%s\n", slot_name(slot), field->name);
+
+	if (site != NULL)
+		current_add(site, slot, field, &agg, &conn->out);
+	else
+		for (i = 0; i < srv->num_sites; i++)
+			current_add(srv->sites[i], slot, field, &agg, &conn->out);
+
+	if (field->kind != FIELD_STRING && agg.count > 0) {
+		strbuf_puts(&conn->out, "summary\tcount=");
+		strbuf_putu(&conn->out, agg.count);
+		strbuf_puts(&conn->out, "\tmin=");
+		strbuf_putf(&conn->out, agg.min, 2);
+		strbuf_puts(&conn->out, "\tmax=");
+		strbuf_putf(&conn->out, agg.max, 2);
+		strbuf_puts(&conn->out, "\tavg=");
+		strbuf_putf(&conn->out, agg.sum / agg.count, 2);
+		strbuf_putc(&conn->out, '\n');
+	}
+
+	reply(conn);
+}
+
+static void handle_rollup(struct wmr_server *srv, struct conn *conn, char **saveptr)
+{
+	char *sensor = strtok_r(NULL, " \t\r", saveptr);
+	char *field_name = strtok_r(NULL, " \t\r", saveptr);
+	char *res_str = strtok_r(NULL, " \t\r", saveptr);
+	char *start_str = strtok_r(NULL, " \t\r", saveptr);
+	char *end_str = strtok_r(NULL, " \t\r", saveptr);
+	const struct reading_field *field;
+	struct rollup_bucket *buckets;
+	struct server_site *site;
+	ulong_t start, end;
+	size_t count;
+	size_t i;
+	int slot;
+	int res;
+
+	if (srv->rollup == NULL) {
+		reply_error(conn, "not available");
+		return;
+	}
+
+	if (sensor_lookup(srv, sensor, false, &site, &slot) != 0 || site->name != NULL) {
+		reply_error(conn, "unknown sensor");
+		return;
+	}
+
+	if (field_name == NULL
+		|| (field = reading_field_lookup(slot_type(slot), field_name)) == NULL
+		|| field->kind == FIELD_STRING) {
+		reply_error(conn, "unknown field");
+		return;
+	}
+
+	if (res_str == NULL || (res = rollup_res_lookup(res_str)) < 0) {
+		reply_error(conn, "unknown resolution");
+		return;
+	}
+
+	/* times have to fit in time_t */
+	if (parse_ulong(start_str, &start) != 0 || parse_ulong(end_str, &end) != 0
+		|| end < start || end > LONG_MAX) {
+		reply_error(conn, "invalid arguments");
+		return;
+	}
+
+	count = rollup_query(srv->rollup, slot, field, res, start, end, &buckets);
+
+	strbuf_printf(&conn->out, "rollup\tsensor=%s\tfield=%s\tres=%u\tcount=%zu\n",
+		slot_name(slot), field->name, rollup_res[res], count);
+	for (i = 0; i < count; i++) {
+		strbuf_puti(&conn->out, buckets[i].start);
+		strbuf_putc(&conn->out, '\t');
+		strbuf_putu(&conn->out, buckets[i].count);
+		strbuf_putc(&conn->out, '\t');
+		strbuf_putf(&conn->out, buckets[i].sum / buckets[i].count, 2);
+		strbuf_putc(&conn->out, '\t');
+		strbuf_putf(&conn->out, buckets[i].min, 2);
+		strbuf_putc(&conn->out, '\t');
+		strbuf_putf(&conn->out, buckets[i].max, 2);
+		strbuf_putc(&conn->out, '\t');
+		strbuf_putf(&conn->out, buckets[i].first, 2);
+		strbuf_putc(&conn->out, '\t');
+		strbuf_putf(&conn->out, buckets[i].last, 2);
+		strbuf_putc(&conn->out, '\n');
+	}
+	free(buckets);
+
+	reply(conn);
+}
+
+static void handle_dump(struct conn *conn)
+{
+	char path[256];
+	ssize_t count;
+
+	if ((count = recorder_dump(path, sizeof(path))) < 0) {
+		reply_error(conn, "cannot dump");
+		return;
+	}
+
+	strbuf_printf(&conn->out, "dump\tpath=%s\tframes=%zi\n", path, count);
+	reply(conn);
+}
+
+static void handle_request(struct wmr_server *srv, struct conn *conn, char *line)
+{
+	char *saveptr;
+	char *cmd;
+
+	cmd = strtok_r(line, " \t\r", &saveptr);
+	if (cmd == NULL)
+		reply_snapshot(srv, conn);
+	else if (strcmp(cmd, "latest") == 0)
+		handle_latest(srv, conn, &saveptr);
+	else if (strcmp(cmd, "wait") == 0)
+		handle_wait(srv, conn, &saveptr);
+	else if (strcmp(cmd, "history") == 0)
+		handle_history(srv, conn, &saveptr);
+	else if (strcmp(cmd, "subscribe") == 0)
+		handle_subscribe(srv, conn, &saveptr);
+	else if (strcmp(cmd, "replicate") == 0)
+		handle_replicate(srv, conn);
+	else if (strcmp(cmd, "current") == 0)
+		handle_current(srv, conn, &saveptr);
+	else if (strcmp(cmd, "rollup") == 0)
+		handle_rollup(srv, conn, &saveptr);
+	else if (strcmp(cmd, "dump") == 0)
+		handle_dump(conn);
+	else
+		reply_error(conn, "unknown request");
+}
+
+/*
+ * Read what the client has sent. Once there's a complete request line,
+ * or the client won't send any more, handle the request.
+ */
+static void conn_read(struct wmr_server *srv, struct conn *conn)
+{
+	char *nl;
+	ssize_t ret;
+
+	strbuf_prepare_append(&conn->in, READ_CHUNK);
+	ret = recv(conn->fd, conn->in.str + conn->in.len, READ_CHUNK, 0);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			conn->state = CONN_CLOSED;
+		return;
+	}
+
+	if (conn->state == CONN_PARKED || conn->state == CONN_WAITING
+		|| conn->state == CONN_STREAM) {
+		if (ret == 0)
+			conn->state = CONN_CLOSED; /* client gave up waiting */
+		return;
+	}
+
+	conn->in.len += ret;
+	strbuf_get_string(&conn->in);
+
+	if ((nl = strchr(conn->in.str, '\n')) != NULL)
+		*nl = '\0';
+	else if (ret > 0 && conn->in.len <= REQUEST_MAX_LEN)
+		return; /* wait for the rest of the line */
+
+	if (conn->in.len > REQUEST_MAX_LEN)
+		reply_error(conn, "request too long");
+	else
+		handle_request(srv, conn, conn->in.str);
+}
+
+static void conn_write(struct wmr_server *srv, struct conn *conn)
+{
+	ssize_t ret;
+
+	ret = send(conn->fd, conn->out.str + conn->out_pos,
+		conn->out.len - conn->out_pos, MSG_NOSIGNAL);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			conn->state = CONN_CLOSED;
+		return;
+	}
+
+	conn->out_pos += ret;
+	if (conn->state == CONN_REPLY && ret > 0)
+		conn->deadline = monotonic_ms() + REPLY_TIMEOUT;
+	if (conn->out_pos < conn->out.len)
+		return;
+
+	strbuf_reset(&conn->out);
+	conn->out_pos = 0;
+
+	if (conn->state == CONN_STREAM) {
+		if (conn->replica)
+			feed_replica(srv, conn);
+		else if (conn->resync)
+			send_keyframe(srv, conn);
+		return;
+	}
+
+	if (conn->produce != NULL)
+		conn->produce(srv, conn);
+
+	if (strbuf_strlen(&conn->out) == 0)
+		conn->state = CONN_CLOSED;
+}
+
+/*
+ * Handle an expired deadline of @conn.
+ */
+static void conn_timeout(struct wmr_server *srv, struct conn *conn)
+{
+	switch (conn->state) {
+	case CONN_REQUEST:
+		/* the client did not send any request, assume it never will */
+		strbuf_get_string(&conn->in);
+		handle_request(srv, conn, conn->in.str);
+		break;
+	case CONN_PARKED:
+		reply_unchanged(conn);
+		break;
+	case CONN_WAITING:
+		wait_unlink(conn);
+		strbuf_printf(&conn->out, "timeout\tsensor=%s\n", slot_name(conn->slot));
+		reply(conn);
+		break;
+	case CONN_REPLY:
+		/* the client stopped reading the reply */
+		conn->state = CONN_CLOSED;
+		break;
+	default:
+		break;
+	}
+}
+
+static void conn_free(struct conn *conn)
+{
+	if (conn->wait_prev != NULL)
+		wait_unlink(conn);
+	history_end(&conn->history);
+	free(conn->sent);
+	(void) close(conn->fd);
+	strbuf_free(&conn->in);
+	strbuf_free(&conn->out);
+	free(conn);
+}
+
+static void accept_conns(struct wmr_server *srv)
+{
+	struct conn *conn;
 	int fd;
+
+	while ((fd = accept(srv->fd, NULL, 0)) >= 0) {
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			(void) close(fd);
+			continue;
+		}
+
+		conn = malloc_safe(sizeof(*conn));
+		conn->fd = fd;
+		conn->state = CONN_REQUEST;
+		strbuf_init(&conn->in, READ_CHUNK);
+		strbuf_init(&conn->out, 1024);
+		conn->out_pos = 0;
+		conn->deadline = monotonic_ms() + srv->cfg.request_timeout;
+		conn->generation = 0;
+		conn->site = NULL;
+		conn->wait_next = NULL;
+		conn->wait_prev = NULL;
+		conn->produce = NULL;
+		conn->history.source = SOURCE_MEMORY;
+		conn->sent = NULL;
+		conn->delta = false;
+		conn->resync = false;
+		conn->keyframe_interval = 0;
+		conn->num_deltas = 0;
+		conn->replica = false;
+		conn->seq = 0;
+
+		conn->next = srv->conns;
+		srv->conns = conn;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		log_error("accept: %s", strerror(errno));
+}
+
+/*
+ * Reply to all clients waiting for a reading from the slot of @reading
+ * of @site.
+ */
+static void wake_waiters(struct server_site *site, struct wmr_reading *reading)
+{
+	struct conn *conn;
+	int slot;
+
+	if ((slot = reading_slot(reading)) < 0)
+		return;
+
+	while ((conn = site->waiters[slot]) != NULL) {
+		wait_unlink(conn);
+		render_reading(reading, &conn->out);
+		reply(conn);
+	}
+}
+
+/*
+ * New readings were received. Reply to clients waiting for them and to
+ * those waiting for the store to change.
+ */
+static void wake_parked(struct wmr_server *srv)
+{
+	struct queued_reading queued;
+	struct conn *conn;
+	uint64_t count;
+	ulong_t generation;
+
+	if (read(srv->event_fd, &count, sizeof(count)) != sizeof(count))
+		return;
+
+	while (1) {
+		pthread_mutex_lock(&srv->queue_lock);
+		if (srv->queue_len == 0) {
+			pthread_mutex_unlock(&srv->queue_lock);
+			break;
+		}
+		queued = srv->queue[srv->queue_head];
+		srv->queue_head = (srv->queue_head + 1) % srv->cfg.queue_len;
+		srv->queue_len--;
+		pthread_mutex_unlock(&srv->queue_lock);
+
+		wake_waiters(queued.site, &queued.reading);
+		for (conn = srv->subscribers; conn != NULL; conn = conn->wait_next)
+			if (conn->state == CONN_STREAM && !conn->replica)
+				stream_reading(srv, conn, &queued.reading);
+	}
+
+	for (conn = srv->subscribers; conn != NULL; conn = conn->wait_next)
+		if (conn->state == CONN_STREAM && conn->replica)
+			feed_replica(srv, conn);
+
+	generation = server_generation(srv);
+	for (conn = srv->conns; conn != NULL; conn = conn->next)
+		if (conn->state == CONN_PARKED && conn->generation != generation)
+			reply_latest(srv, conn);
+}
+
+/*
+ * Dispose of closed connections.
+ */
+static void reap_conns(struct wmr_server *srv)
+{
+	struct conn **conn = &srv->conns;
+	struct conn *closed;
+
+	while (*conn != NULL) {
+		if ((*conn)->state == CONN_CLOSED) {
+			closed = *conn;
+			*conn = closed->next;
+			conn_free(closed);
+		}
+		else {
+			conn = &(*conn)->next;
+		}
+	}
+}
+
+/*
+ * Switch to the configuration server_reconfigure has left for us, if any.
+ */
+static void switch_config(struct wmr_server *srv)
+{
+	pthread_mutex_lock(&srv->queue_lock);
+	if (!srv->reconfiguring) {
+		pthread_mutex_unlock(&srv->queue_lock);
+		return;
+	}
+
+	if (srv->new_fd >= 0) {
+		(void) close(srv->fd);
+		srv->fd = srv->new_fd;
+		log_info("Listening on port %u now", srv->new_cfg.port);
+	}
+	srv->cfg = srv->new_cfg;
+	srv->rrd_cfg = srv->new_rrd_cfg;
+	srv->reconfiguring = false;
+	pthread_mutex_unlock(&srv->queue_lock);
+
+	sem_post(&srv->reconfigured);
+}
+
+static short conn_events(struct conn *conn)
+{
+	switch (conn->state) {
+	case CONN_REPLY:
+		return POLLOUT;
+	case CONN_STREAM:
+		if (conn->out_pos < strbuf_strlen(&conn->out))
+			return POLLIN | POLLOUT;
+		return POLLIN;
+	default:
+		return POLLIN;
+	}
+}
+
+static void mainloop(struct wmr_server *srv)
+{
+	struct pollfd *pfds;
+	size_t num_conns;
+	struct conn *conn;
+	ulong_t now;
+	ulong_t deadline;
+	int timeout;
 	size_t i;
 
 	log_info("%s", "Entering server main loop");
 	while (1) {
-		/* POSIX.1: accept is a cancellation point */
-		if ((fd = accept(srv->fd, NULL, 0)) == -1)
-			err(1, "accept"); /* TODO don't use err */
-
-		if (srv->wmr != NULL) {
-			wmr_get_latest_data(srv->wmr, &latest);
-
-			print_reading(&latest.wind, fd);
-			print_reading(&latest.rain, fd);
-			print_reading(&latest.baro, fd);
-			print_reading(&latest.uvi, fd);
-			for (i = 0; i < WMR200_MAX_TEMP_SENSORS; i++)
-				print_reading(&latest.temp[i], fd);
-			print_reading(&latest.meta, fd);
-			print_reading(&latest.status, fd);
+		num_conns = 0;
+		for (conn = srv->conns; conn != NULL; conn = conn->next)
+			num_conns++;
+
+		if (num_conns + 2 > srv->num_pfds) {
+			srv->num_pfds = 2 * (num_conns + 2);
+			srv->pfds = realloc_safe(srv->pfds, srv->num_pfds * sizeof(*srv->pfds));
 		}
+		pfds = srv->pfds;
 
-		(void) close(fd);
+		pfds[0] = (struct pollfd) { .fd = srv->fd, .events = POLLIN };
+		pfds[1] = (struct pollfd) { .fd = srv->event_fd, .events = POLLIN };
+
+		now = monotonic_ms();
+		deadline = 0;
+		for (conn = srv->conns, i = 2; conn != NULL; conn = conn->next, i++) {
+			pfds[i] = (struct pollfd) { .fd = conn->fd, .events = conn_events(conn) };
+			if (conn->deadline && (!deadline || conn->deadline < deadline))
+				deadline = conn->deadline;
+		}
+
+		timeout = -1;
+		if (deadline)
+			timeout = deadline > now ? (int)(deadline - now) : 0;
+
+		/* POSIX.1: poll is a cancellation point */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (poll(pfds, num_conns + 2, timeout) == -1 && errno != EINTR)
+			log_error("poll: %s", strerror(errno));
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/*
+		 * Handle the connections polled for first; new connections
+		 * accepted below are prepended to the list.
+		 */
+		now = monotonic_ms();
+		for (conn = srv->conns, i = 2; i < num_conns + 2; conn = conn->next, i++) {
+			if (pfds[i].revents & (POLLERR | POLLNVAL)) {
+				conn->state = CONN_CLOSED;
+				continue;
+			}
+
+			if (pfds[i].revents & (POLLIN | POLLHUP) && conn->state != CONN_REPLY)
+				conn_read(srv, conn);
+			if (pfds[i].revents & POLLOUT
+				&& (conn->state == CONN_REPLY || conn->state == CONN_STREAM))
+				conn_write(srv, conn);
+
+			if (conn->deadline && conn->deadline <= now)
+				conn_timeout(srv, conn);
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			wake_parked(srv);
+			switch_config(srv);
+		}
+
+		if (pfds[0].revents & POLLIN)
+			accept_conns(srv);
+
+		reap_conns(srv);
 	}
 }
 
 static void cleanup(void *arg)
 {
 	struct wmr_server *srv = (struct wmr_server *)arg;
+	struct conn *conn;
+
 	assert(srv->fd >= 0);
 	(void) close(srv->fd);
+
+	while (srv->conns != NULL) {
+		conn = srv->conns;
+		srv->conns = conn->next;
+		conn_free(conn);
+	}
+
+	free(srv->pfds);
+	srv->pfds = NULL;
+	srv->num_pfds = 0;
 }
 
 /*
@@ -158,6 +1482,7 @@ static void *mainloop_pthread(void *arg)
 {
 	struct wmr_server *srv = (struct wmr_server *)arg;
 
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	pthread_cleanup_push(cleanup, srv);
 	mainloop(srv);
 	pthread_cleanup_pop(1);
@@ -167,25 +1492,158 @@ static void *mainloop_pthread(void *arg)
 
 void server_init(struct wmr_server *srv)
 {
+	srv->cfg.port = DEFAULT_PORT;
+	srv->cfg.request_timeout = DEFAULT_REQUEST_TIMEOUT;
+	srv->cfg.max_wait = DEFAULT_MAX_WAIT;
+	srv->cfg.history_len = DEFAULT_HISTORY_LEN;
+	srv->cfg.keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+	srv->cfg.queue_len = DEFAULT_QUEUE_LEN;
+	srv->cfg.replica_log_len = DEFAULT_REPLICA_LOG_LEN;
 	srv->wmr = NULL;
-	srv->fd = srv->thread_id = -1;
+	srv->fd = -1;
+	srv->event_fd = -1;
+	srv->conns = NULL;
+	srv->pfds = NULL;
+	srv->num_pfds = 0;
+	srv->rrd_cfg = NULL;
+	srv->tsdb = NULL;
+	srv->rollup = NULL;
+	srv->sites = NULL;
+	srv->num_sites = 0;
+	srv->subscribers = NULL;
+
+	srv->queue = NULL;
+	srv->queue_head = 0;
+	srv->queue_len = 0;
+	pthread_mutex_init(&srv->queue_lock, NULL);
+
+	srv->reconfiguring = false;
+	sem_init(&srv->reconfigured, false, 0);
+}
+
+void server_free(struct wmr_server *srv)
+{
+	size_t i;
+
+	pthread_mutex_destroy(&srv->queue_lock);
+	sem_destroy(&srv->reconfigured);
+	free(srv->queue);
+	for (i = 0; i < srv->num_sites; i++) {
+		store_free(&srv->sites[i]->store);
+		free(srv->sites[i]);
+	}
+	free(srv->sites);
+	if (srv->event_fd >= 0)
+		(void) close(srv->event_fd);
 }
 
 /*
- * Configure the @srv server to serve data for @wmr.
+ * Configure the @srv server to serve data for @wmr. The server must have
+ * been started.
  */
 void server_set_device(struct wmr_server *srv, struct wmr200 *wmr)
 {
 	srv->wmr = wmr;
+	if (wmr != NULL)
+		wmr_register_logger(wmr, server_log_reading, srv->sites[0]);
 }
 
-int server_start(struct wmr_server *srv)
+/*
+ * Add a site named @name to @srv, making it a gateway. Sites are to be
+ * added before the server is started. If none is, the server has a single
+ * unnamed site (see server_start).
+ *
+ * Return value:
+ *	The site added, to be passed to server_log_reading with its readings.
+ */
+struct server_site *server_add_site(struct wmr_server *srv, char *name)
+{
+	struct server_site *site;
+	size_t i;
+
+	site = malloc_safe(sizeof(*site));
+	site->name = name;
+	site->srv = srv;
+	for (i = 0; i < NUM_SLOTS; i++)
+		site->waiters[i] = NULL;
+
+	srv->sites = realloc_safe(srv->sites, (srv->num_sites + 1) * sizeof(*srv->sites));
+	srv->sites[srv->num_sites++] = site;
+	return site;
+}
+
+/*
+ * Append the snapshot of all latest readings of @srv to @out, such as
+ * clients which send no request get.
+ */
+void server_render_snapshot(struct wmr_server *srv, struct strbuf *out)
+{
+	render_sites(srv, true, out);
+}
+
+/*
+ * Logger callback which feeds readings of the site @arg into its store and
+ * queues them for the server thread, which passes them on to waiting clients.
+ *
+ * NOTE: If the server thread falls behind by more than queue_len readings,
+ *       the oldest readings are not passed on to waiting clients and
+ *       subscribers. Replicas are fed from the store instead.
+ */
+void server_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct server_site *site = (struct server_site *)arg;
+	struct wmr_server *srv = site->srv;
+	uint64_t one = 1;
+
+	(void) wmr;
+	(void) store_push(&site->store, reading);
+
+	pthread_mutex_lock(&srv->queue_lock);
+	if (srv->queue_len == srv->cfg.queue_len) {
+		srv->queue_head = (srv->queue_head + 1) % srv->cfg.queue_len;
+		srv->queue_len--;
+	}
+	srv->queue[(srv->queue_head + srv->queue_len) % srv->cfg.queue_len]
+		= (struct queued_reading) { .site = site, .reading = *reading };
+	srv->queue_len++;
+	pthread_mutex_unlock(&srv->queue_lock);
+
+	if (srv->event_fd >= 0)
+		(void) write(srv->event_fd, &one, sizeof(one));
+}
+
+/*
+ * Logger callback like server_log_reading, for readings which aren't new,
+ * such as those replayed from the journal or the history received from
+ * upstream: they're put into the store of the site @arg and sent to
+ * replicas, but waiting clients and subscribers don't get them.
+ */
+void server_store_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct server_site *site = (struct server_site *)arg;
+	struct wmr_server *srv = site->srv;
+	uint64_t one = 1;
+
+	(void) wmr;
+	(void) store_push(&site->store, reading);
+
+	if (srv->event_fd >= 0)
+		(void) write(srv->event_fd, &one, sizeof(one));
+}
+
+/*
+ * Open a socket listening on port @port of all addresses.
+ *
+ * Return value:
+ *	The socket, -1 on error.
+ */
+static int listen_on(unsigned port)
 {
 	struct addrinfo *ai_head, *ai_cur;
-	struct addrinfo ai_hints; 
-	int port = DEFAULT_PORT;
+	struct addrinfo ai_hints;
 	char portstr[6];
 	int optval = 1;
+	int fd = -1;
 	int ret;
 
 	memset(&ai_hints, 0, sizeof(ai_hints));
@@ -201,17 +1659,17 @@ int server_start(struct wmr_server *srv)
 	}
 
 	for (ai_cur = ai_head; ai_cur != NULL; ai_cur = ai_cur->ai_next) {
-		srv->fd = socket(ai_cur->ai_family, ai_cur->ai_socktype,
+		fd = socket(ai_cur->ai_family, ai_cur->ai_socktype,
 			ai_cur->ai_protocol);
 
-		if (srv->fd == -1)
+		if (fd == -1)
 			continue;
 
-		setsockopt(srv->fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-		if (bind(srv->fd, ai_cur->ai_addr, ai_cur->ai_addrlen) == 0)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+		if (bind(fd, ai_cur->ai_addr, ai_cur->ai_addrlen) == 0)
 			break;
 
-		(void) close(srv->fd);
+		(void) close(fd);
 	}
 
 	freeaddrinfo(ai_head);
@@ -222,8 +1680,38 @@ int server_start(struct wmr_server *srv)
 		return -1;
 	}
 
-	if (listen(srv->fd, SOMAXCONN) == -1) {
+	if (listen(fd, SOMAXCONN) == -1) {
 		log_error("listen: %s", "Cannot start listening");
+		(void) close(fd);
+		return -1;
+	}
+
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		log_error("fcntl: %s", strerror(errno));
+		(void) close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int server_start(struct wmr_server *srv)
+{
+	size_t i;
+
+	if ((srv->fd = listen_on(srv->cfg.port)) < 0)
+		return -1;
+
+	if (srv->num_sites == 0)
+		(void) server_add_site(srv, NULL);
+	for (i = 0; i < srv->num_sites; i++)
+		store_init(&srv->sites[i]->store, srv->cfg.history_len,
+			is_gateway(srv) ? 0 : srv->cfg.replica_log_len);
+	srv->cfg.queue_len = MAX(srv->cfg.queue_len, 1);
+	srv->queue = malloc_safe(srv->cfg.queue_len * sizeof(*srv->queue));
+
+	if ((srv->event_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+		log_error("eventfd: %s", strerror(errno));
 		return -1;
 	}
 
@@ -242,3 +1730,41 @@ void server_stop(struct wmr_server *srv)
 	pthread_cancel(srv->thread_id);
 	pthread_join(srv->thread_id, NULL);
 }
+
+/*
+ * Switch @srv, which has been started, to configuration @cfg and to
+ * serving history from RRD files @rrd_cfg (or none if NULL), which must
+ * stay valid until the server is stopped or switched again. If the port
+ * changes, the server listens on the new one from now on, while clients
+ * connected keep their connections. The length of the history kept in
+ * memory and the lengths of the queues are fixed once the server has
+ * started.
+ *
+ * Return value:
+ *	Zero on success, -1 if the new port can't be listened on, in which
+ *	case the server stays as it was.
+ */
+int server_reconfigure(struct wmr_server *srv, struct wmr_server_cfg *cfg,
+	struct rrd_cfg *rrd_cfg)
+{
+	uint64_t one = 1;
+	int fd = -1;
+
+	/* only the server thread changes @srv->cfg, and only in here */
+	if (cfg->port != srv->cfg.port && (fd = listen_on(cfg->port)) < 0)
+		return -1;
+
+	pthread_mutex_lock(&srv->queue_lock);
+	srv->new_cfg = *cfg;
+	srv->new_cfg.history_len = srv->cfg.history_len;
+	srv->new_cfg.queue_len = srv->cfg.queue_len;
+	srv->new_cfg.replica_log_len = srv->cfg.replica_log_len;
+	srv->new_rrd_cfg = rrd_cfg;
+	srv->new_fd = fd;
+	srv->reconfiguring = true;
+	pthread_mutex_unlock(&srv->queue_lock);
+
+	(void) write(srv->event_fd, &one, sizeof(one));
+	while (sem_wait(&srv->reconfigured) != 0);
+	return 0;
+}
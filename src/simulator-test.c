@@ -0,0 +1,66 @@
+/*
+ * Test of the station simulator at full speed (meteod -S 0): readings
+ * have to come when heartbeats are sent by the caller once the station
+ * is read from, as meteod does, rather than by a thread started first.
+ *
+ * Run by `make test`. Hangs are caught with alarm(2).
+ */
+
+#include "common.h"
+#include "log.h"
+#include "simulator.h"
+#include "wmr200.h"
+
+#include <err.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define	NUM_READINGS	1000	/* readings to receive */
+#define	TIMEOUT		10	/* longest the test may take (s) */
+
+static atomic_size_t num_readings;
+
+static void count_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	(void) reading;
+	(void) arg;
+	atomic_fetch_add(&num_readings, 1);
+}
+
+static void error_handler(struct wmr200 *wmr, void *arg)
+{
+	(void) wmr;
+	(void) arg;
+	errx(EXIT_FAILURE, "Talking to the simulator failed");
+}
+
+int main(void)
+{
+	struct log_cfg log_cfg = { LOG_WARNING, LOG_TO_STDERR, NULL };
+	struct simulator_cfg cfg = { .speed = 0, .num_sensors = 2, .seed = 1 };
+	struct wmr200 *wmr;
+
+	if (log_start(&log_cfg) != 0)
+		return EXIT_FAILURE;
+	alarm(TIMEOUT);
+
+	if ((wmr = wmr_open_transport(simulator_open(&cfg))) == NULL)
+		errx(EXIT_FAILURE, "Cannot open the simulator");
+	wmr_set_error_handler(wmr, error_handler, NULL);
+	wmr_register_logger(wmr, count_reading, NULL);
+	if (wmr_start_receiver(wmr) != 0)
+		errx(EXIT_FAILURE, "Cannot start talking to the simulator");
+
+	/* let the station be read from before it gets a heartbeat */
+	usleep(100000);
+	wmr_heartbeat(wmr);
+
+	while (atomic_load(&num_readings) < NUM_READINGS)
+		usleep(1000);
+
+	wmr_stop(wmr);
+	wmr_close(wmr);
+	log_stop();
+	return EXIT_SUCCESS;
+}
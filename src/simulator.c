@@ -0,0 +1,712 @@
+/*
+ * Simulator of a WMR200 station, to test meteod without hardware.
+ *
+ * The clock of the station runs cfg.speed times as fast as the real one.
+ * Every sensor reports about as often as a real one does (see interval),
+ * each report being queued as a packet for the host, which reads it in
+ * frames of up to seven bytes. Packets are laid out the way wmr200.c
+ * decodes them, so that the host decodes the very weather simulated.
+ *
+ * Like a real station, the simulated one sends readings only while it
+ * gets heartbeats. Otherwise, it keeps a record of the weather in its data
+ * logger every LOGGER_INTERVAL, and tells the host about the records once
+ * the heartbeats are back.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "simulator.h"
+#include "wmr200.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	FRAME_SIZE		8	/* size of a HID report */
+#define	QUEUE_SIZE		4096	/* most bytes queued for the host */
+#define	LOGGER_LEN		4096	/* records the data logger holds */
+#define	LOGGER_INTERVAL		60	/* how often a record is logged (s) */
+#define	HEARTBEAT_TIMEOUT	30000	/* how long a heartbeat keeps it talking (ms) */
+#define	IDLE_WAIT		1000	/* longest wait for a heartbeat at full speed (ms) */
+#define	MAX_SENSORS		10	/* temperature sensors, the console's included */
+#define	MAX_PACKET_LEN		112	/* length of the longest HISTORIC_DATA packet */
+#define	US_PER_SEC		1000000ULL
+
+/*
+ * Offsets into HISTORIC_DATA packets, as wmr200.c reads them.
+ */
+#define	HIST_RAIN_OFFSET	7
+#define	HIST_WIND_OFFSET	20
+#define	HIST_UVI_OFFSET		27
+#define	HIST_BARO_OFFSET	28
+#define	HIST_NUM_EXT_OFFSET	32
+#define	HIST_SENSORS_OFFSET	33
+#define	HIST_SENSOR_LEN		7
+
+/*
+ * A command sent by the host.
+ */
+enum command
+{
+	CMD_HEARTBEAT = 0xD0,
+	CMD_REQUEST_HISTDATA = 0xDA,
+	CMD_ERASE = 0xDB,
+	CMD_STOP = 0xDF
+};
+
+/*
+ * Something the station does from time to time.
+ */
+enum event
+{
+	EV_WIND,
+	EV_RAIN,
+	EV_UVI,
+	EV_BARO,
+	EV_STATUS,
+	EV_LOGGER,
+	EV_TEMP,			/* EV_TEMP + i for sensor i */
+	NUM_EVENTS = EV_TEMP + MAX_SENSORS
+};
+
+/*
+ * The weather simulated.
+ */
+struct weather
+{
+	double temp[MAX_SENSORS];	/* temperature (°C) */
+	double drift[MAX_SENSORS];	/* deviation from the usual temperature */
+	double avg_speed;		/* average wind speed (m/s) */
+	double gust_speed;		/* gust speed (m/s) */
+	unsigned dir;			/* wind direction (0 for N, 1 for NNE...) */
+	bool raining;			/* is it raining? */
+	double rate;			/* rain rate (hundredths of an inch per hour) */
+	double accum_hour;		/* rain in the current hour */
+	double accum_24h;		/* rain in the current day */
+	double accum_total;		/* rain since the station was started */
+	double pressure;		/* barometric pressure (hPa) */
+	unsigned uvi;			/* UV index */
+	int hour;			/* hour @accum_hour is of */
+	int day;			/* day @accum_24h is of */
+};
+
+struct simulator
+{
+	struct wmr_transport tr;
+	struct simulator_cfg cfg;	/* configuration */
+	size_t num_sensors;		/* temperature sensors, the console's included */
+	pthread_mutex_t lock;		/* protects all of the below */
+	pthread_cond_t cond;		/* signalled when bytes are queued or a command comes */
+
+	byte_t queue[QUEUE_SIZE];	/* bytes queued for the host */
+	size_t queue_head;		/* index of the first byte in @queue */
+	size_t queue_len;		/* number of bytes in @queue */
+	ulong_t stall_until;		/* when the queue is stalled until (ms) */
+
+	ulong_t time;			/* station's clock (us) */
+	ulong_t next[NUM_EVENTS];	/* when each event happens next (us) */
+	ulong_t start_time;		/* station's clock when it was started (us) */
+	ulong_t start_real;		/* monotonic time when it was started (ms) */
+	ulong_t heartbeat;		/* monotonic time of the latest heartbeat (ms) */
+	bool heard;			/* has there been a heartbeat yet? */
+	bool stopped;			/* was it stopped since the latest heartbeat? */
+
+	byte_t (*logger)[MAX_PACKET_LEN];	/* records in the data logger */
+	size_t logger_head;		/* index of the oldest record */
+	size_t logger_len;		/* number of records */
+
+	struct weather weather;		/* the weather */
+	uint64_t rng;			/* state of the random number generator */
+};
+
+/*
+ * How often @ev happens (s).
+ */
+static unsigned interval(enum event ev)
+{
+	static const unsigned intervals[EV_TEMP] = {
+		[EV_WIND] = 14,
+		[EV_RAIN] = 47,
+		[EV_UVI] = 73,
+		[EV_BARO] = 60,
+		[EV_STATUS] = 60,
+		[EV_LOGGER] = LOGGER_INTERVAL,
+	};
+
+	return ev < EV_TEMP ? intervals[ev] : 50;
+}
+
+/*
+ * xorshift64* random number generator.
+ */
+static uint64_t rnd(struct simulator *sim)
+{
+	sim->rng ^= sim->rng >> 12;
+	sim->rng ^= sim->rng << 25;
+	sim->rng ^= sim->rng >> 27;
+	return sim->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double uniform(struct simulator *sim, double min, double max)
+{
+	return min + (max - min) * (rnd(sim) >> 11) / (double)(1ULL << 53);
+}
+
+static bool one_in(struct simulator *sim, unsigned n)
+{
+	return n > 0 && rnd(sim) % n == 0;
+}
+
+static double clamp(double val, double min, double max)
+{
+	return val < min ? min : (val > max ? max : val);
+}
+
+/*
+ * weather
+ */
+
+static void update_temp(struct simulator *sim, struct tm *tm, size_t i)
+{
+	struct weather *w = &sim->weather;
+	double hour = tm->tm_hour + tm->tm_min / 60.0;
+
+	w->drift[i] = clamp(w->drift[i] + uniform(sim, -0.2, 0.2), -4, 4);
+	if (i == 0)	/* the console is indoors */
+		w->temp[i] = 21 + w->drift[i] / 4;
+	else
+		w->temp[i] = 10 + 8 * sin(2 * M_PI * (hour - 9) / 24) - i + w->drift[i];
+}
+
+static void update_rain(struct simulator *sim, struct tm *tm)
+{
+	struct weather *w = &sim->weather;
+	double rain = w->rate * interval(EV_RAIN) / 3600;
+
+	if (one_in(sim, 20))
+		w->raining = !w->raining;
+	w->rate = w->raining ? uniform(sim, 1, 50) : 0;
+
+	if (tm->tm_hour != w->hour) {
+		w->hour = tm->tm_hour;
+		w->accum_hour = 0;
+	}
+	if (tm->tm_mday != w->day) {
+		w->day = tm->tm_mday;
+		w->accum_24h = 0;
+	}
+
+	w->accum_hour += rain;
+	w->accum_24h += rain;
+	w->accum_total = fmod(w->accum_total + rain, 65536);
+}
+
+static void update_weather(struct simulator *sim, enum event ev)
+{
+	struct weather *w = &sim->weather;
+	time_t now = sim->time / US_PER_SEC;
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+
+	switch (ev) {
+	case EV_WIND:
+		w->avg_speed = clamp(w->avg_speed + uniform(sim, -0.5, 0.5), 0, 20);
+		w->gust_speed = w->avg_speed + uniform(sim, 0, 3);
+		w->dir = (w->dir + 16 + (int)floor(uniform(sim, -1, 2))) % 16;
+		break;
+	case EV_RAIN:
+		update_rain(sim, &tm);
+		break;
+	case EV_UVI:
+		w->uvi = lround(fmax(0, 8 * sin(M_PI * (tm.tm_hour - 6) / 14)));
+		break;
+	case EV_BARO:
+		w->pressure = clamp(w->pressure + uniform(sim, -0.5, 0.5), 980, 1040);
+		break;
+	case EV_STATUS:
+	case EV_LOGGER:
+		break;
+	default:
+		update_temp(sim, &tm, ev - EV_TEMP);
+	}
+}
+
+/*
+ * packets
+ */
+
+static void put_time(struct simulator *sim, byte_t *packet)
+{
+	time_t now = sim->time / US_PER_SEC;
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	packet[2] = tm.tm_min;
+	packet[3] = tm.tm_hour;
+	packet[4] = tm.tm_mday;
+	packet[5] = tm.tm_mon;
+	packet[6] = tm.tm_year - 100;
+}
+
+static void put_checksum(byte_t *packet, size_t len)
+{
+	unsigned sum = 0;
+	size_t i;
+
+	for (i = 0; i < len - 2; i++)
+		sum += packet[i];
+
+	packet[len - 2] = sum & 0xFF;
+	packet[len - 1] = sum >> 8;
+}
+
+/*
+ * The functions below write readings at the offsets process_*_data
+ * of wmr200.c read them from.
+ */
+
+static void put_wind(struct weather *w, byte_t *data)
+{
+	unsigned gust = lround(w->gust_speed * 10);
+	unsigned avg = lround(w->avg_speed * 10);
+
+	data[7] = w->dir;
+	data[9] = gust & 0xFF;
+	data[10] = (gust >> 8 & 0x0F) | (avg & 0x0F) << 4;
+	data[11] = avg >> 4 & 0x0F;
+	data[12] = 0;
+}
+
+static void put_u16(byte_t *data, double val)
+{
+	unsigned u = lround(val);
+
+	data[0] = u & 0xFF;
+	data[1] = u >> 8 & 0xFF;
+}
+
+static void put_rain(struct weather *w, byte_t *data)
+{
+	put_u16(data + 7, w->rate);
+	put_u16(data + 9, w->accum_hour);
+	put_u16(data + 11, w->accum_24h);
+	put_u16(data + 13, w->accum_total);
+}
+
+static void put_uvi(struct weather *w, byte_t *data)
+{
+	data[7] = w->uvi & 0x0F;
+}
+
+static void put_baro(struct weather *w, byte_t *data)
+{
+	unsigned pressure = lround(w->pressure);
+	unsigned alt_pressure = pressure + 7;
+	unsigned forecast = w->raining ? 1 : (pressure >= 1020 ? 3 : (pressure >= 1005 ? 0 : 2));
+
+	data[7] = pressure & 0xFF;
+	data[8] = (pressure >> 8 & 0x0F) | forecast << 4;
+	data[9] = alt_pressure & 0xFF;
+	data[10] = alt_pressure >> 8 & 0x0F;
+}
+
+/*
+ * Write temperature (or dew point) @val to @data as sensors do.
+ */
+static void put_temp_value(byte_t *data, double val)
+{
+	unsigned u = lround(fabs(val) * 10);
+
+	data[0] = u & 0xFF;
+	data[1] = (u >> 8 & 0x0F) | (val < 0 ? 0x80 : 0);
+}
+
+static void put_temp(struct weather *w, size_t sensor, byte_t *data)
+{
+	double temp = w->temp[sensor];
+	double humidity = clamp(85 - 2 * (temp - 10), 20, 99);
+
+	data[7] = sensor;
+	put_temp_value(data + 8, temp);
+	data[10] = lround(humidity);
+	put_temp_value(data + 11, temp - (100 - humidity) / 5);
+	data[13] = 0;
+}
+
+/*
+ * Start a packet of @type of @len bytes.
+ */
+static void make_packet(struct simulator *sim, byte_t type, size_t len, byte_t *packet)
+{
+	memset(packet, 0, len);
+	packet[0] = type;
+	packet[1] = len;
+	put_time(sim, packet);
+}
+
+/*
+ * Make a HISTORIC_DATA packet of the weather. Return its length.
+ */
+static size_t make_record(struct simulator *sim, byte_t *packet)
+{
+	struct weather *w = &sim->weather;
+	size_t len = HIST_SENSORS_OFFSET + (1 + sim->num_sensors) * HIST_SENSOR_LEN + 2;
+	size_t i;
+
+	make_packet(sim, HISTORIC_DATA, len, packet);
+	put_rain(w, packet + HIST_RAIN_OFFSET);
+	put_wind(w, packet + HIST_WIND_OFFSET);
+	put_uvi(w, packet + HIST_UVI_OFFSET);
+	put_baro(w, packet + HIST_BARO_OFFSET);
+	packet[HIST_NUM_EXT_OFFSET] = sim->num_sensors;
+	for (i = 0; i < sim->num_sensors; i++)
+		put_temp(w, i, packet + HIST_SENSORS_OFFSET + i * HIST_SENSOR_LEN);
+	put_checksum(packet, len);
+
+	return len;
+}
+
+/*
+ * queue
+ */
+
+static void enqueue(struct simulator *sim, const byte_t *data, size_t len)
+{
+	size_t i;
+
+	if (sim->queue_len + len > QUEUE_SIZE) {
+		log_debug("Simulator queue full, packet dropped");
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		sim->queue[(sim->queue_head + sim->queue_len + i) % QUEUE_SIZE] = data[i];
+	sim->queue_len += len;
+	pthread_cond_signal(&sim->cond);
+}
+
+/*
+ * Queue @packet of @len bytes for the host, with the faults configured.
+ */
+static void send_packet(struct simulator *sim, byte_t *packet, size_t len)
+{
+	if (one_in(sim, sim->cfg.bad_checksum))
+		packet[len - 1] ^= 0x01;
+	if (one_in(sim, sim->cfg.truncated))
+		len = 2 + rnd(sim) % (len - 2);
+	if (one_in(sim, sim->cfg.stall))
+		sim->stall_until = monotonic_ms() + sim->cfg.stall_len;
+
+	enqueue(sim, packet, len);
+}
+
+/*
+ * Queue a single-byte packet of @type, such as PACKET_ERASE_ACK.
+ */
+static void send_ack(struct simulator *sim, byte_t type)
+{
+	enqueue(sim, &type, 1);
+}
+
+/*
+ * station
+ */
+
+static bool talking(struct simulator *sim)
+{
+	return sim->heard && !sim->stopped
+		&& monotonic_ms() - sim->heartbeat < HEARTBEAT_TIMEOUT;
+}
+
+static void log_record(struct simulator *sim)
+{
+	size_t i;
+
+	if (sim->logger_len == LOGGER_LEN) {
+		sim->logger_head = (sim->logger_head + 1) % LOGGER_LEN;
+		sim->logger_len--;
+	}
+
+	i = (sim->logger_head + sim->logger_len) % LOGGER_LEN;
+	make_record(sim, sim->logger[i]);
+	sim->logger_len++;
+}
+
+/*
+ * Send the oldest record from the data logger, and tell the host about
+ * the next one if there is one.
+ */
+static void send_record(struct simulator *sim)
+{
+	byte_t packet[MAX_PACKET_LEN];
+	byte_t *record;
+
+	if (sim->logger_len == 0)
+		return;
+
+	record = sim->logger[sim->logger_head];
+	memcpy(packet, record, record[1]);
+	sim->logger_head = (sim->logger_head + 1) % LOGGER_LEN;
+	sim->logger_len--;
+
+	send_packet(sim, packet, packet[1]);
+	if (sim->logger_len > 0)
+		send_ack(sim, PACKET_HISTDATA_NOTIF);
+}
+
+static void happen(struct simulator *sim, enum event ev)
+{
+	struct weather *w = &sim->weather;
+	byte_t packet[MAX_PACKET_LEN];
+
+	update_weather(sim, ev);
+
+	if (!talking(sim)) {
+		if (ev == EV_LOGGER)
+			log_record(sim);
+		return;
+	}
+
+	switch (ev) {
+	case EV_WIND:
+		make_packet(sim, WMR_WIND, 16, packet);
+		put_wind(w, packet);
+		break;
+	case EV_RAIN:
+		make_packet(sim, WMR_RAIN, 22, packet);
+		put_rain(w, packet);
+		break;
+	case EV_UVI:
+		make_packet(sim, WMR_UVI, 10, packet);
+		put_uvi(w, packet);
+		break;
+	case EV_BARO:
+		make_packet(sim, WMR_BARO, 13, packet);
+		put_baro(w, packet);
+		break;
+	case EV_STATUS:
+		/* all sensors and batteries are fine */
+		make_packet(sim, WMR_STATUS, 8, packet);
+		memset(packet + 2, 0, 4);
+		break;
+	case EV_LOGGER:
+		return;
+	default:
+		if ((size_t)(ev - EV_TEMP) >= sim->num_sensors)
+			return;
+		make_packet(sim, WMR_TEMP, 16, packet);
+		put_temp(w, ev - EV_TEMP, packet);
+	}
+
+	put_checksum(packet, packet[1]);
+	send_packet(sim, packet, packet[1]);
+}
+
+/*
+ * Monotonic time when the station's clock shows @time (ms).
+ */
+static ulong_t real_time(struct simulator *sim, ulong_t time)
+{
+	return sim->start_real + (time - sim->start_time) / sim->cfg.speed / 1000;
+}
+
+/*
+ * Wait until monotonic time @until (ms) or until signalled.
+ */
+static void wait_until(struct simulator *sim, ulong_t until)
+{
+	struct timespec ts;
+	ulong_t now = monotonic_ms();
+
+	if (now >= until)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += (until - now) / 1000;
+	ts.tv_nsec += 1000000 * ((until - now) % 1000);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&sim->cond, &sim->lock, &ts);
+}
+
+/*
+ * Let the next event happen, or wait for it until something is queued.
+ */
+static void run(struct simulator *sim)
+{
+	enum event ev = 0;
+	ulong_t due;
+	size_t i;
+
+	/*
+	 * At full speed, the station's clock runs only while readings are
+	 * taken; it would fill the data logger in no time otherwise, and
+	 * never give the lock up to the heartbeat which it waits for.
+	 */
+	if (sim->cfg.speed == 0 && !talking(sim)) {
+		wait_until(sim, monotonic_ms() + IDLE_WAIT);
+		return;
+	}
+
+	for (i = 1; i < EV_TEMP + sim->num_sensors; i++)
+		if (sim->next[i] < sim->next[ev])
+			ev = i;
+
+	if (sim->cfg.speed > 0 && monotonic_ms() < (due = real_time(sim, sim->next[ev]))) {
+		wait_until(sim, due);
+		return;
+	}
+
+	sim->time = sim->next[ev];
+	sim->next[ev] += interval(ev) * US_PER_SEC;
+	happen(sim, ev);
+}
+
+static void command(struct simulator *sim, byte_t cmd)
+{
+	switch (cmd) {
+	case CMD_HEARTBEAT:
+		sim->heartbeat = monotonic_ms();
+		sim->heard = true;
+		sim->stopped = false;
+		if (sim->logger_len > 0)
+			send_ack(sim, PACKET_HISTDATA_NOTIF);
+		break;
+	case CMD_REQUEST_HISTDATA:
+		send_record(sim);
+		break;
+	case CMD_ERASE:
+		sim->logger_len = 0;
+		send_ack(sim, PACKET_ERASE_ACK);
+		break;
+	case CMD_STOP:
+		sim->stopped = true;
+		send_ack(sim, PACKET_STOP_ACK);
+		break;
+	default:
+		log_debug("Simulator received unknown command 0x%02X", cmd);
+	}
+}
+
+/*
+ * transport
+ */
+
+static void unlock(void *lock)
+{
+	pthread_mutex_unlock(lock);
+}
+
+static ssize_t simulator_read(struct wmr_transport *tr, byte_t *buf, size_t size)
+{
+	struct simulator *sim = (struct simulator *)tr;
+	size_t len;
+	size_t i;
+
+	size = MIN(size, FRAME_SIZE);
+
+	pthread_mutex_lock(&sim->lock);
+	pthread_cleanup_push(unlock, &sim->lock);
+
+	while (sim->queue_len == 0 || monotonic_ms() < sim->stall_until) {
+		if (sim->queue_len > 0)
+			wait_until(sim, sim->stall_until);
+		else
+			run(sim);
+		pthread_testcancel();
+	}
+
+	len = MIN(sim->queue_len, size - 1);
+	memset(buf, 0, size);
+	buf[0] = len;
+	for (i = 0; i < len; i++)
+		buf[1 + i] = sim->queue[(sim->queue_head + i) % QUEUE_SIZE];
+	sim->queue_head = (sim->queue_head + len) % QUEUE_SIZE;
+	sim->queue_len -= len;
+
+	pthread_cleanup_pop(true);
+	return size;
+}
+
+static ssize_t simulator_write(struct wmr_transport *tr, const byte_t *data, size_t len)
+{
+	struct simulator *sim = (struct simulator *)tr;
+
+	/* commands are a byte long, the wakeup frame is ignored */
+	if (len >= 2 && data[0] == 1) {
+		pthread_mutex_lock(&sim->lock);
+		command(sim, data[1]);
+		pthread_cond_signal(&sim->cond);
+		pthread_mutex_unlock(&sim->lock);
+	}
+
+	return len;
+}
+
+static void simulator_close(struct wmr_transport *tr)
+{
+	struct simulator *sim = (struct simulator *)tr;
+
+	pthread_mutex_destroy(&sim->lock);
+	pthread_cond_destroy(&sim->cond);
+	free(sim->logger);
+	free(sim);
+}
+
+struct wmr_transport *simulator_open(struct simulator_cfg *cfg)
+{
+	struct simulator *sim = malloc_safe(sizeof(*sim));
+	pthread_condattr_t attr;
+	struct timespec ts;
+	size_t i;
+	size_t j;
+
+	memset(sim, 0, sizeof(*sim));
+	sim->tr.read = simulator_read;
+	sim->tr.write = simulator_write;
+	sim->tr.close = simulator_close;
+	sim->cfg = *cfg;
+	sim->num_sensors = 1 + MIN(cfg->num_sensors, MAX_SENSORS - 1);
+	sim->logger = malloc_safe(LOGGER_LEN * sizeof(*sim->logger));
+
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	sim->rng = cfg->seed != 0 ? cfg->seed : (uint64_t)time(NULL) ^ getpid();
+	sim->rng = sim->rng * 0x9E3779B97F4A7C15ULL | 1;
+
+	sim->weather.avg_speed = 3;
+	sim->weather.pressure = 1013;
+	sim->weather.hour = sim->weather.day = -1;
+
+	/* the records in the data logger, a record every LOGGER_INTERVAL */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	sim->start_time = ts.tv_sec * US_PER_SEC + ts.tv_nsec / 1000;
+	for (i = 0; i < cfg->history; i++) {
+		sim->time = sim->start_time
+			- (cfg->history - i) * LOGGER_INTERVAL * US_PER_SEC;
+		update_weather(sim, EV_WIND);
+		update_weather(sim, EV_RAIN);
+		update_weather(sim, EV_UVI);
+		update_weather(sim, EV_BARO);
+		for (j = 0; j < sim->num_sensors; j++)
+			update_weather(sim, EV_TEMP + j);
+		log_record(sim);
+	}
+
+	sim->time = sim->start_time;
+	sim->start_real = monotonic_ms();
+	for (i = 0; i < NUM_EVENTS; i++)
+		sim->next[i] = sim->time + rnd(sim) % (interval(i) * US_PER_SEC);
+
+	return &sim->tr;
+}
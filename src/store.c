@@ -0,0 +1,333 @@
+/*
+ * Latest-data store with a generation counter and in-memory history.
+ */
+
+#include "store.h"
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * Return the slot within @latest where @reading belongs, or NULL if there
+ * is no such slot.
+ */
+static struct wmr_reading *latest_slot(struct wmr_latest_data *latest,
+	struct wmr_reading *reading)
+{
+	switch (reading->type) {
+	case WMR_WIND:
+		return &latest->wind;
+	case WMR_RAIN:
+		return &latest->rain;
+	case WMR_UVI:
+		return &latest->uvi;
+	case WMR_BARO:
+		return &latest->baro;
+	case WMR_TEMP:
+		if (reading->temp.sensor_id >= WMR200_MAX_TEMP_SENSORS)
+			return NULL;
+		return &latest->temp[reading->temp.sensor_id];
+	case WMR_STATUS:
+		return &latest->status;
+	case WMR_META:
+		return &latest->meta;
+	}
+
+	return NULL;
+}
+
+/*
+ * Does @reading tell anything new compared to @old, the latest one of its
+ * kind? Uptime of WMR_META readings, which changes with every heartbeat,
+ * doesn't count, so that the generation only changes with the counters.
+ */
+static bool is_news(struct wmr_reading *old, struct wmr_reading *reading)
+{
+	if (reading->type != WMR_META || old->type != WMR_META)
+		return true;
+
+	return old->meta.num_packets != reading->meta.num_packets
+		|| old->meta.num_failed != reading->meta.num_failed
+		|| old->meta.num_frames != reading->meta.num_frames
+		|| old->meta.num_bytes != reading->meta.num_bytes
+		|| old->meta.latest_packet != reading->meta.latest_packet;
+}
+
+/*
+ * Return the reading within @latest which belongs to @slot.
+ */
+static struct wmr_reading *latest_of_slot(struct wmr_latest_data *latest, int slot)
+{
+	switch (slot) {
+	case SLOT_WIND:
+		return &latest->wind;
+	case SLOT_RAIN:
+		return &latest->rain;
+	case SLOT_UVI:
+		return &latest->uvi;
+	case SLOT_BARO:
+		return &latest->baro;
+	case SLOT_STATUS:
+		return &latest->status;
+	case SLOT_META:
+		return &latest->meta;
+	default:
+		return &latest->temp[slot - SLOT_TEMP0];
+	}
+}
+
+static struct wmr_reading *history_at(struct wmr_store *store,
+	struct store_history *history, size_t i)
+{
+	return &history->readings[(history->head + i) % store->history_len];
+}
+
+/*
+ * Insert @reading into @history so that it remains ordered by time. If the
+ * history is full, the oldest reading is dropped.
+ *
+ * NOTE: Readings usually arrive in order, so this is mostly an append.
+ */
+static void history_insert(struct wmr_store *store, struct store_history *history,
+	struct wmr_reading *reading)
+{
+	size_t i;
+
+	if (store->history_len == 0)
+		return;
+
+	if (history->len == store->history_len) {
+		if (reading->time < history_at(store, history, 0)->time)
+			return;
+		history->head = (history->head + 1) % store->history_len;
+		history->len--;
+	}
+
+	for (i = history->len; i > 0; i--) {
+		if (history_at(store, history, i - 1)->time <= reading->time)
+			break;
+		*history_at(store, history, i) = *history_at(store, history, i - 1);
+	}
+
+	*history_at(store, history, i) = *reading;
+	history->len++;
+}
+
+/*
+ * Return index of the first reading in @history whose time is at least @t.
+ */
+static size_t history_lower_bound(struct wmr_store *store,
+	struct store_history *history, time_t t)
+{
+	size_t lo = 0;
+	size_t hi = history->len;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (history_at(store, history, mid)->time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void store_init(struct wmr_store *store, size_t history_len, size_t log_len)
+{
+	size_t i;
+
+	pthread_mutex_init(&store->lock, NULL);
+	memset(&store->latest, 0, sizeof(store->latest));
+	store->generation = 0;
+	store->seq = 0;
+
+	store->history_len = history_len;
+	for (i = 0; i < NUM_SLOTS; i++) {
+		store->history[i].readings = NULL;
+		if (history_len > 0)
+			store->history[i].readings = malloc_safe(history_len
+				* sizeof(*store->history[i].readings));
+		store->history[i].head = 0;
+		store->history[i].len = 0;
+	}
+
+	store->log_len = log_len;
+	store->log = NULL;
+	if (log_len > 0)
+		store->log = malloc_safe(log_len * sizeof(*store->log));
+}
+
+void store_free(struct wmr_store *store)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_SLOTS; i++)
+		free(store->history[i].readings);
+	free(store->log);
+
+	pthread_mutex_destroy(&store->lock);
+}
+
+ulong_t store_push(struct wmr_store *store, struct wmr_reading *reading)
+{
+	struct wmr_reading *slot;
+	ulong_t seq;
+	int history;
+
+	pthread_mutex_lock(&store->lock);
+
+	if ((history = reading_slot(reading)) >= 0)
+		history_insert(store, &store->history[history], reading);
+
+	slot = latest_slot(&store->latest, reading);
+	if (slot != NULL && reading->time >= slot->time) {
+		if (is_news(slot, reading))
+			store->generation++;
+		*slot = *reading;
+	}
+	seq = ++store->seq;
+	if (store->log_len > 0)
+		store->log[seq % store->log_len] = *reading;
+
+	pthread_mutex_unlock(&store->lock);
+	return seq;
+}
+
+ulong_t store_get_latest(struct wmr_store *store, struct wmr_latest_data *latest)
+{
+	ulong_t generation;
+
+	pthread_mutex_lock(&store->lock);
+	*latest = store->latest;
+	generation = store->generation;
+	pthread_mutex_unlock(&store->lock);
+
+	return generation;
+}
+
+ulong_t store_get_generation(struct wmr_store *store)
+{
+	ulong_t generation;
+
+	pthread_mutex_lock(&store->lock);
+	generation = store->generation;
+	pthread_mutex_unlock(&store->lock);
+
+	return generation;
+}
+
+bool store_get_reading(struct wmr_store *store, int slot, struct wmr_reading *reading)
+{
+	pthread_mutex_lock(&store->lock);
+	*reading = *latest_of_slot(&store->latest, slot);
+	pthread_mutex_unlock(&store->lock);
+
+	return reading->type != 0;
+}
+
+time_t store_history_oldest(struct wmr_store *store, int slot)
+{
+	struct store_history *history = &store->history[slot];
+	time_t oldest = -1;
+
+	pthread_mutex_lock(&store->lock);
+	if (history->len > 0)
+		oldest = history_at(store, history, 0)->time;
+	pthread_mutex_unlock(&store->lock);
+
+	return oldest;
+}
+
+size_t store_history_snapshot(struct wmr_store *store, struct wmr_reading **readings,
+	ulong_t *seq)
+{
+	struct store_history *history;
+	size_t count = 0;
+	size_t slot;
+	size_t i;
+
+	pthread_mutex_lock(&store->lock);
+
+	for (slot = 0; slot < NUM_SLOTS; slot++)
+		count += store->history[slot].len;
+
+	*readings = malloc_safe(MAX(count, 1) * sizeof(**readings));
+
+	count = 0;
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		history = &store->history[slot];
+		for (i = 0; i < history->len; i++)
+			(*readings)[count++] = *history_at(store, history, i);
+	}
+	*seq = store->seq;
+
+	pthread_mutex_unlock(&store->lock);
+	return count;
+}
+
+ssize_t store_log_read(struct wmr_store *store, ulong_t seq,
+	struct wmr_reading *readings, size_t count)
+{
+	size_t i;
+
+	pthread_mutex_lock(&store->lock);
+
+	if (store->seq - seq > store->log_len) {
+		pthread_mutex_unlock(&store->lock);
+		return -1;
+	}
+
+	count = MIN(count, store->seq - seq);
+	for (i = 0; i < count; i++)
+		readings[i] = store->log[(seq + 1 + i) % store->log_len];
+
+	pthread_mutex_unlock(&store->lock);
+	return count;
+}
+
+void store_clear(struct wmr_store *store)
+{
+	size_t slot;
+
+	pthread_mutex_lock(&store->lock);
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		store->history[slot].head = 0;
+		store->history[slot].len = 0;
+	}
+	memset(&store->latest, 0, sizeof(store->latest));
+	store->generation++;
+	pthread_mutex_unlock(&store->lock);
+}
+
+void store_history_aggregate(struct wmr_store *store, int slot,
+	const struct reading_field *field, time_t from, time_t to,
+	struct store_agg *agg)
+{
+	struct store_history *history = &store->history[slot];
+	struct wmr_reading *reading;
+	double value;
+	size_t i;
+
+	agg->count = 0;
+	agg->sum = 0;
+	agg->min = INFINITY;
+	agg->max = -INFINITY;
+
+	pthread_mutex_lock(&store->lock);
+
+	for (i = history_lower_bound(store, history, from); i < history->len; i++) {
+		reading = history_at(store, history, i);
+		if (reading->time >= to)
+			break;
+
+		value = reading_field_value(reading, field);
+		agg->count++;
+		agg->sum += value;
+		agg->min = MIN(agg->min, value);
+		agg->max = MAX(agg->max, value);
+	}
+
+	pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,64 @@
+/*
+ * Microbenchmark of strbuf: formatting lines of readings with
+ * strbuf_printf versus the non-format append functions.
+ *
+ * Run by `make bench`. Reports nanoseconds per line of each way.
+ */
+
+#include "bench.h"
+#include "common.h"
+#include "strbuf.h"
+
+#define	NUM_LINES	1000000
+#define	BUF_SIZE	4096
+
+/*
+ * The line formatted, kept in a volatile so that the work isn't optimized
+ * away.
+ */
+static volatile size_t sink;
+
+static void bench_printf(struct strbuf *buf, long i)
+{
+	strbuf_printf(buf, "%li\t%s\t%u\t%.1f\n", 1500000000 + i, "temp1",
+		(unsigned)(i % 100), (i % 500) / 10.0 - 20);
+}
+
+static void bench_put(struct strbuf *buf, long i)
+{
+	strbuf_puti(buf, 1500000000 + i);
+	strbuf_putc(buf, '\t');
+	strbuf_puts(buf, "temp1");
+	strbuf_putc(buf, '\t');
+	strbuf_putu(buf, i % 100);
+	strbuf_putc(buf, '\t');
+	strbuf_putf(buf, (i % 500) / 10.0 - 20, 1);
+	strbuf_putc(buf, '\n');
+}
+
+static void run(const char *name, void (*func)(struct strbuf *buf, long i))
+{
+	struct strbuf buf;
+	double start;
+	long i;
+
+	strbuf_init(&buf, BUF_SIZE);
+
+	start = bench_now();
+	for (i = 0; i < NUM_LINES; i++) {
+		if (buf.len > BUF_SIZE / 2)
+			strbuf_reset(&buf);
+		func(&buf, i);
+		sink = buf.len;
+	}
+
+	bench_report("strbuf", name, (bench_now() - start) / NUM_LINES, "ns/line");
+	strbuf_free(&buf);
+}
+
+int main(void)
+{
+	run("strbuf_printf", bench_printf);
+	run("strbuf_put*", bench_put);
+	return 0;
+}
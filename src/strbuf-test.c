@@ -0,0 +1,57 @@
+/*
+ * Tests of strbuf: appending strings longer than twice the buffer, which
+ * has to leave room for the NUL strbuf_get_string adds.
+ *
+ * Run by `make test`, under AddressSanitizer, which catches overflows.
+ */
+
+#include "common.h"
+#include "strbuf.h"
+
+#include <err.h>
+#include <string.h>
+
+static void check(struct strbuf *buf, const char *expected)
+{
+	if (strcmp(strbuf_get_string(buf), expected) != 0)
+		errx(EXIT_FAILURE, "Expected '%s', got '%s'", expected, buf->str);
+}
+
+int main(void)
+{
+	struct strbuf buf;
+	size_t i;
+
+	strbuf_init(&buf, 4);
+	strbuf_puts(&buf, "0123456789");
+	check(&buf, "0123456789");
+	strbuf_free(&buf);
+
+	strbuf_init(&buf, 1);
+	strbuf_putc(&buf, 'a');
+	check(&buf, "a");
+	strbuf_putn(&buf, "bcd", 3);
+	check(&buf, "abcd");
+	strbuf_free(&buf);
+
+	/* every length an append may grow a buffer by */
+	for (i = 0; i < 64; i++) {
+		char str[64];
+
+		memset(str, 'x', i);
+		str[i] = '\0';
+		strbuf_init(&buf, 1 + i % 7);
+		strbuf_puts(&buf, "y");
+		strbuf_puts(&buf, str);
+		if (strbuf_strlen(&buf) != i + 1 || strbuf_get_string(&buf)[i + 1] != '\0')
+			errx(EXIT_FAILURE, "Wrong string of %zu bytes appended", i);
+		strbuf_free(&buf);
+	}
+
+	strbuf_init(&buf, 2);
+	strbuf_puti(&buf, -1234567890123LL);
+	check(&buf, "-1234567890123");
+	strbuf_free(&buf);
+
+	return EXIT_SUCCESS;
+}
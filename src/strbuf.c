@@ -1,5 +1,6 @@
 #include "common.h"
 #include "memory.h"
+#include "numfmt.h"
 #include "strbuf.h"
 
 #include <assert.h>
@@ -34,7 +35,7 @@ void strbuf_init(struct strbuf *buf, size_t init_size)
 void strbuf_prepare_append(struct strbuf *buf, size_t count)
 {
 	if (buf->len + count >= buf->size) /* >= because of the '\0' */
-		strbuf_resize(buf, MAX(buf->len + count, 2 * buf->size));
+		strbuf_resize(buf, MAX(buf->len + count + 1, 2 * buf->size));
 }
 
 
@@ -46,10 +47,46 @@ size_t strbuf_putc(struct strbuf *buf, char c)
 }
 
 
-size_t strbuf_puts(struct strbuf *buf, char *str)
+size_t strbuf_putn(struct strbuf *buf, const char *str, size_t len)
 {
-	strbuf_printf(buf, "%s", str);
-	return strlen(str);
+	strbuf_prepare_append(buf, len);
+	memcpy(buf->str + buf->len, str, len);
+	buf->len += len;
+	return len;
+}
+
+
+size_t strbuf_puts(struct strbuf *buf, const char *str)
+{
+	return strbuf_putn(buf, str, strlen(str));
+}
+
+
+size_t strbuf_putu(struct strbuf *buf, unsigned long long value)
+{
+	char num[NUMFMT_MAX_LEN];
+
+	return strbuf_putn(buf, num, numfmt_uint(num, sizeof(num), value));
+}
+
+
+size_t strbuf_puti(struct strbuf *buf, long long value)
+{
+	char num[NUMFMT_MAX_LEN];
+
+	return strbuf_putn(buf, num, numfmt_int(num, sizeof(num), value));
+}
+
+
+size_t strbuf_putf(struct strbuf *buf, double value, unsigned prec)
+{
+	char num[NUMFMT_MAX_LEN];
+	size_t len;
+
+	if ((len = numfmt_fixed(num, sizeof(num), value, prec)) >= sizeof(num))
+		return strbuf_printf(buf, "%.*f", (int)prec, value);
+
+	return strbuf_putn(buf, num, len);
 }
 
 
@@ -95,22 +132,23 @@ size_t strbuf_vprintf_at(struct strbuf *buf, size_t offset, char *fmt, va_list a
 	int num_written;
 	size_t size_needed;
 
+	/*
+	 * Usually, there's room enough, so try to write right away and only
+	 * grow the buffer and write again if the output was truncated.
+	 */
 	va_copy(args2, args);
-
-	num_written = vsnprintf(NULL, 0, fmt, args2);
+	num_written = vsnprintf(buf->str + offset, buf->size - offset, fmt, args2);
+	va_end(args2);
 	if (num_written < 0)
 		return -1;
 
 	size_needed = offset + num_written + 1;
-	if (size_needed > buf->size)
+	if (size_needed > buf->size) {
 		strbuf_resize(buf, MAX(2 * buf->size, size_needed));
+		vsnprintf(buf->str + offset, num_written + 1, fmt, args);
+	}
 
-	vsnprintf(buf->str + offset, (num_written + 1), fmt, args);
 	buf->len = MAX(buf->len, offset + num_written);
-
-	va_end(args2);
-	va_end(args);
-
 	return num_written;
 }
 
@@ -0,0 +1,580 @@
+/*
+ * Text logs of readings: CSV or InfluxDB line protocol.
+ *
+ * Lines are appended to a buffer in memory, which the writer thread writes
+ * to the log with a single write(2) once cfg.buffer_size bytes are buffered
+ * or the oldest line has waited cfg.flush_interval. Another buffer is
+ * filled meanwhile, so readings never wait for the disk; should the writer
+ * fall behind by more than MAX_BUFFERED buffers (such as while history is
+ * being backfilled onto a slow card), readings are dropped and counted.
+ *
+ * The log is rotated once it would grow beyond cfg.rotate_size or, if
+ * cfg.rotate_daily is set, when readings of another (UTC) day come. Rotated
+ * logs are renamed to "<path>.<day of their first reading>" and compressed
+ * by the compressor thread, which runs the cfg.compress command on them.
+ *
+ * CSV logs have a line per field of a reading:
+ *
+ *     time,sensor,field,value
+ *     1700000000,temp1,temp,21.5
+ *     1700000000,temp1,humidity,45
+ *
+ * InfluxDB logs have a line per reading, times being in nanoseconds:
+ *
+ *     meteod,sensor=temp1 temp=21.5,humidity=45i,... 1700000000000000000
+ *
+ * Readings replayed from the journal after a crash may appear twice.
+ */
+
+#include "common.h"
+#include "log.h"
+#include "textlog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	DEFAULT_BUFFER_SIZE	(1 << 20)
+#define	DEFAULT_FLUSH_INTERVAL	1000	/* ms */
+#define	MAX_BUFFERED		8	/* buffers queued before readings are dropped */
+#define	SECONDS_PER_DAY		86400
+#define	CSV_HEADER		"time,sensor,field,value\n"
+#define	INFLUX_MEASUREMENT	"meteod"
+#define	MAX_COMPRESS_ARGS	16
+
+void textlog_init(struct textlog *log)
+{
+	pthread_condattr_t attr;
+
+	log->cfg.path = NULL;
+	log->cfg.format = TEXTLOG_CSV;
+	log->cfg.buffer_size = DEFAULT_BUFFER_SIZE;
+	log->cfg.flush_interval = DEFAULT_FLUSH_INTERVAL;
+	log->cfg.rotate_size = 0;
+	log->cfg.rotate_daily = false;
+	log->cfg.compress = NULL;
+
+	log->fd = -1;
+	log->size = 0;
+	log->day = -1;
+	memset(&log->pending, 0, sizeof(log->pending));
+	memset(&log->spare, 0, sizeof(log->spare));
+	log->pending_since = 0;
+	log->dropped = 0;
+	log->sync_requested = 0;
+	log->synced = 0;
+	log->running = false;
+	log->compressing = false;
+	log->compress_queue = NULL;
+	log->num_compress = 0;
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&log->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&log->done, NULL);
+	pthread_cond_init(&log->compress_cond, NULL);
+}
+
+/*
+ * Note that lines of readings of @day start at the end of @buf.
+ */
+static void buf_mark(struct textlog_buf *buf, int64_t day)
+{
+	if (buf->num_marks > 0 && buf->marks[buf->num_marks - 1].day == day)
+		return;
+
+	if (buf->num_marks == buf->marks_size) {
+		buf->marks_size = MAX(2 * buf->marks_size, 4);
+		buf->marks = realloc_safe(buf->marks, buf->marks_size * sizeof(*buf->marks));
+	}
+
+	buf->marks[buf->num_marks].offset = buf->text.len;
+	buf->marks[buf->num_marks].day = day;
+	buf->num_marks++;
+}
+
+static void buf_free(struct textlog_buf *buf)
+{
+	if (buf->text.str != NULL)
+		strbuf_free(&buf->text);
+	free(buf->marks);
+}
+
+/*
+ * Append a CSV line of each field of @reading to @out.
+ */
+static void format_csv(struct wmr_reading *reading, struct strbuf *out)
+{
+	const struct reading_field *fields;
+	const char *sensor = slot_name(reading_slot(reading));
+	size_t count;
+	size_t i;
+
+	fields = reading_fields(reading->type, &count);
+	for (i = 0; i < count; i++) {
+		if (fields[i].kind != FIELD_STRING
+			&& isnan(reading_field_value(reading, &fields[i])))
+			continue;
+
+		strbuf_puti(out, reading->time);
+		strbuf_putc(out, ',');
+		strbuf_puts(out, sensor);
+		strbuf_putc(out, ',');
+		strbuf_puts(out, fields[i].name);
+		strbuf_putc(out, ',');
+		reading_format_field(reading, &fields[i], out);
+		strbuf_putc(out, '\n');
+	}
+}
+
+/*
+ * Append an InfluxDB line of @reading to @out.
+ */
+static void format_influx(struct wmr_reading *reading, struct strbuf *out)
+{
+	const struct reading_field *fields;
+	size_t start = out->len;
+	size_t count;
+	size_t i;
+	char sep = ' ';
+
+	strbuf_puts(out, INFLUX_MEASUREMENT ",sensor=");
+	strbuf_puts(out, slot_name(reading_slot(reading)));
+
+	fields = reading_fields(reading->type, &count);
+	for (i = 0; i < count; i++) {
+		if (fields[i].kind != FIELD_STRING
+			&& isnan(reading_field_value(reading, &fields[i])))
+			continue;
+
+		strbuf_putc(out, sep);
+		strbuf_puts(out, fields[i].name);
+		strbuf_putc(out, '=');
+		sep = ',';
+
+		if (fields[i].kind == FIELD_STRING)
+			strbuf_putc(out, '"');
+		reading_format_field(reading, &fields[i], out);
+		if (fields[i].kind == FIELD_STRING)
+			strbuf_putc(out, '"');
+		else if (fields[i].kind != FIELD_FLOAT)
+			strbuf_putc(out, 'i');
+	}
+
+	/* a line without fields isn't valid */
+	if (sep == ' ') {
+		out->len = start;
+		return;
+	}
+
+	/* in nanoseconds */
+	strbuf_putc(out, ' ');
+	strbuf_puti(out, reading->time);
+	strbuf_puts(out, "000000000\n");
+}
+
+void textlog_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct textlog *log = (struct textlog *)arg;
+	int64_t day;
+
+	(void) wmr;
+
+	if (reading_slot(reading) < 0)
+		return;
+
+	day = reading->time / SECONDS_PER_DAY;
+
+	pthread_mutex_lock(&log->lock);
+
+	if (log->pending.text.len >= MAX_BUFFERED * log->cfg.buffer_size) {
+		log->dropped++;
+		pthread_mutex_unlock(&log->lock);
+		return;
+	}
+
+	if (log->pending.text.len == 0)
+		log->pending_since = monotonic_ms();
+
+	buf_mark(&log->pending, day);
+	if (log->cfg.format == TEXTLOG_INFLUX)
+		format_influx(reading, &log->pending.text);
+	else
+		format_csv(reading, &log->pending.text);
+
+	if (log->pending.text.len >= log->cfg.buffer_size)
+		pthread_cond_signal(&log->cond);
+
+	pthread_mutex_unlock(&log->lock);
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the log file, creating it if needed.
+ */
+static int open_log(struct textlog *log)
+{
+	struct stat st;
+
+	log->fd = open(log->cfg.path, O_WRONLY | O_CREAT | O_APPEND, 0640);
+	if (log->fd == -1 || fstat(log->fd, &st) != 0) {
+		log_error("Cannot open %s: %s", log->cfg.path, strerror(errno));
+		if (log->fd != -1)
+			(void) close(log->fd);
+		log->fd = -1;
+		return -1;
+	}
+
+	/* a log which was there before is taken to be of the day it was last written */
+	log->size = st.st_size;
+	log->day = st.st_size > 0 ? st.st_mtime / SECONDS_PER_DAY : -1;
+
+	if (log->size == 0 && log->cfg.format == TEXTLOG_CSV) {
+		if (write_all(log->fd, CSV_HEADER, strlen(CSV_HEADER)) != 0) {
+			log_error("Cannot write %s: %s", log->cfg.path, strerror(errno));
+			return -1;
+		}
+		log->size = strlen(CSV_HEADER);
+	}
+
+	return 0;
+}
+
+/*
+ * Is there a rotated log named @path, compressed or not?
+ */
+static bool rotated_exists(const char *path)
+{
+	char pattern[PATH_MAX + 2];
+	size_t len = strlen(path);
+	const char *rest;
+	bool exists = false;
+	glob_t g;
+	size_t i;
+
+	snprintf(pattern, sizeof(pattern), "%s*", path);
+	if (glob(pattern, GLOB_NOSORT | GLOB_NOESCAPE, NULL, &g) != 0)
+		return false;
+
+	/* "<path>.gz" is the same log, "<path>.1" isn't */
+	for (i = 0; i < g.gl_pathc && !exists; i++) {
+		rest = g.gl_pathv[i] + len;
+		exists = rest[0] == '\0' || (rest[0] == '.' && (rest[1] < '0' || rest[1] > '9'));
+	}
+
+	globfree(&g);
+	return exists;
+}
+
+/*
+ * Rename the log to "<path>.<day>" (or "<path>.<day>.<n>" if that's
+ * taken), have it compressed and open a new one.
+ */
+static void rotate(struct textlog *log)
+{
+	char path[PATH_MAX];
+	char day[16];
+	struct tm tm;
+	time_t t = log->day * SECONDS_PER_DAY;
+	unsigned n = 0;
+	int ret;
+
+	gmtime_r(&t, &tm);
+	strftime(day, sizeof(day), "%Y-%m-%d", &tm);
+
+	ret = snprintf(path, sizeof(path), "%s.%s", log->cfg.path, day);
+	while (ret < (int)sizeof(path) && rotated_exists(path))
+		ret = snprintf(path, sizeof(path), "%s.%s.%u", log->cfg.path, day, ++n);
+
+	if (ret >= (int)sizeof(path) || rename(log->cfg.path, path) != 0) {
+		log_error("Cannot rotate %s: %s", log->cfg.path,
+			ret >= (int)sizeof(path) ? "path too long" : strerror(errno));
+		return;
+	}
+
+	(void) close(log->fd);
+	log->fd = -1;
+
+	if (log->compressing) {
+		pthread_mutex_lock(&log->lock);
+		log->compress_queue = realloc_safe(log->compress_queue,
+			(log->num_compress + 1) * sizeof(*log->compress_queue));
+		log->compress_queue[log->num_compress++] = strdup(path);
+		pthread_cond_signal(&log->compress_cond);
+		pthread_mutex_unlock(&log->lock);
+	}
+
+	(void) open_log(log);
+}
+
+/*
+ * Write lines in @buf to the log, rotating it as needed.
+ */
+static void write_buf(struct textlog *log, struct textlog_buf *buf)
+{
+	size_t start, end;
+	size_t i;
+
+	for (i = 0; i < buf->num_marks; i++) {
+		start = buf->marks[i].offset;
+		end = i + 1 < buf->num_marks ? buf->marks[i + 1].offset : buf->text.len;
+		if (start == end)
+			continue;
+
+		if (log->fd >= 0 && log->day >= 0
+			&& ((log->cfg.rotate_daily && buf->marks[i].day != log->day)
+			|| (log->cfg.rotate_size > 0
+			&& log->size + (off_t)(end - start) > log->cfg.rotate_size)))
+			rotate(log);
+
+		if (log->fd < 0 && open_log(log) != 0)
+			return;
+
+		if (write_all(log->fd, buf->text.str + start, end - start) != 0) {
+			log_error("Cannot write %s: %s", log->cfg.path, strerror(errno));
+			return;
+		}
+
+		log->size += end - start;
+		if (log->day < 0)
+			log->day = buf->marks[i].day;
+	}
+}
+
+static void *writer_thread(void *arg)
+{
+	struct textlog *log = (struct textlog *)arg;
+	struct textlog_buf tmp;
+	struct timespec ts;
+	ulong_t deadline;
+	ulong_t now;
+	ulong_t requested;
+	ulong_t dropped;
+
+	pthread_mutex_lock(&log->lock);
+
+	while (log->running || log->pending.text.len > 0) {
+		requested = log->sync_requested;
+
+		if (log->pending.text.len == 0 && requested == log->synced) {
+			pthread_cond_wait(&log->cond, &log->lock);
+			continue;
+		}
+
+		deadline = log->pending_since + log->cfg.flush_interval;
+		now = monotonic_ms();
+		if (log->running && requested == log->synced
+			&& log->pending.text.len < log->cfg.buffer_size && now < deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += (deadline - now) / 1000;
+			ts.tv_nsec += 1000000 * ((deadline - now) % 1000);
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&log->cond, &log->lock, &ts);
+			continue;
+		}
+
+		tmp = log->spare;
+		log->spare = log->pending;
+		log->pending = tmp;
+		log->pending.text.len = 0;
+		log->pending.num_marks = 0;
+		dropped = log->dropped;
+		log->dropped = 0;
+
+		pthread_mutex_unlock(&log->lock);
+
+		if (dropped > 0)
+			log_warning("Dropped %lu readings, %s can't keep up",
+				dropped, log->cfg.path);
+
+		write_buf(log, &log->spare);
+		if (requested != log->synced && log->fd >= 0 && fdatasync(log->fd) != 0)
+			log_error("Cannot sync %s: %s", log->cfg.path, strerror(errno));
+
+		pthread_mutex_lock(&log->lock);
+		log->synced = requested;
+		pthread_cond_broadcast(&log->done);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+/*
+ * Run cfg.compress on @path.
+ */
+static void compress(struct textlog *log, const char *path)
+{
+	char *argv[MAX_COMPRESS_ARGS + 2];
+	posix_spawnattr_t attr;
+	sigset_t set;
+	char *saveptr;
+	char *cmd;
+	size_t argc = 0;
+	pid_t pid;
+	int status;
+	int ret;
+
+	cmd = strdup(log->cfg.compress);
+	for (argv[argc] = strtok_r(cmd, " \t", &saveptr);
+		argv[argc] != NULL && argc < MAX_COMPRESS_ARGS;
+		argv[argc] = strtok_r(NULL, " \t", &saveptr))
+		argc++;
+	argv[argc++] = (char *)path;
+	argv[argc] = NULL;
+
+	/* signals meteod blocks or handles shouldn't stay so in the child */
+	sigemptyset(&set);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &set);
+	sigfillset(&set);
+	posix_spawnattr_setsigdefault(&attr, &set);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	if ((ret = posix_spawnp(&pid, argv[0], NULL, &attr, argv, NULL)) != 0)
+		log_error("Cannot run %s: %s", argv[0], strerror(ret));
+	else if (waitpid(pid, &status, 0) == -1)
+		log_error("Cannot wait for %s: %s", argv[0], strerror(errno));
+	else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		log_error("Cannot compress %s: %s failed", path, argv[0]);
+
+	posix_spawnattr_destroy(&attr);
+	free(cmd);
+}
+
+static void *compress_thread(void *arg)
+{
+	struct textlog *log = (struct textlog *)arg;
+	char *path;
+
+	pthread_mutex_lock(&log->lock);
+
+	while (log->compressing || log->num_compress > 0) {
+		if (log->num_compress == 0) {
+			pthread_cond_wait(&log->compress_cond, &log->lock);
+			continue;
+		}
+
+		path = log->compress_queue[0];
+		memmove(log->compress_queue, log->compress_queue + 1,
+			--log->num_compress * sizeof(*log->compress_queue));
+		pthread_mutex_unlock(&log->lock);
+
+		compress(log, path);
+		free(path);
+
+		pthread_mutex_lock(&log->lock);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+int textlog_start(struct textlog *log)
+{
+	int ret;
+
+	strbuf_init(&log->pending.text, log->cfg.buffer_size + 1);
+	strbuf_init(&log->spare.text, log->cfg.buffer_size + 1);
+
+	if (open_log(log) != 0)
+		return -1;
+
+	log->running = true;
+	if ((ret = pthread_create(&log->thread_id, NULL, writer_thread, log)) != 0) {
+		log_error("Cannot create the text log writer thread: %s", strerror(ret));
+		log->running = false;
+		return -1;
+	}
+
+	if (log->cfg.compress != NULL) {
+		log->compressing = true;
+		if ((ret = pthread_create(&log->compress_thread_id, NULL, compress_thread,
+			log)) != 0) {
+			log_error("Cannot create the compressor thread: %s", strerror(ret));
+			log->compressing = false;
+		}
+	}
+
+	return 0;
+}
+
+void textlog_sync(struct textlog *log)
+{
+	ulong_t requested;
+
+	pthread_mutex_lock(&log->lock);
+	if (log->running) {
+		requested = ++log->sync_requested;
+		pthread_cond_signal(&log->cond);
+		while (log->synced < requested)
+			pthread_cond_wait(&log->done, &log->lock);
+	}
+	pthread_mutex_unlock(&log->lock);
+}
+
+void textlog_free(struct textlog *log)
+{
+	size_t i;
+
+	if (log->running) {
+		pthread_mutex_lock(&log->lock);
+		log->running = false;
+		pthread_cond_signal(&log->cond);
+		pthread_mutex_unlock(&log->lock);
+		pthread_join(log->thread_id, NULL);
+	}
+
+	/* logs rotated by the writer's last writes are compressed too */
+	if (log->compressing) {
+		pthread_mutex_lock(&log->lock);
+		log->compressing = false;
+		pthread_cond_signal(&log->compress_cond);
+		pthread_mutex_unlock(&log->lock);
+		pthread_join(log->compress_thread_id, NULL);
+	}
+
+	if (log->fd >= 0)
+		(void) close(log->fd);
+
+	for (i = 0; i < log->num_compress; i++)
+		free(log->compress_queue[i]);
+	free(log->compress_queue);
+	buf_free(&log->pending);
+	buf_free(&log->spare);
+	pthread_mutex_destroy(&log->lock);
+	pthread_cond_destroy(&log->cond);
+	pthread_cond_destroy(&log->done);
+	pthread_cond_destroy(&log->compress_cond);
+}
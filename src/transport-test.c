@@ -0,0 +1,83 @@
+/*
+ * Tests of recognizing the WMR200 being plugged in from uevents, such as
+ * the kernel sends when a USB device is added or removed.
+ *
+ * Run by `make test`.
+ */
+
+#include "common.h"
+#include "transport.h"
+
+#include <err.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#define	DEVICE_KEYS \
+	"DEVPATH=/devices/pci0000:00/0000:00:14.0/usb1/1-2\0" \
+	"SUBSYSTEM=usb\0" \
+	"MAJOR=189\0" \
+	"MINOR=3\0" \
+	"DEVNAME=bus/usb/001/004\0" \
+	"DEVTYPE=usb_device\0"
+
+static const char added[] =
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2\0"
+	"ACTION=add\0"
+	DEVICE_KEYS
+	"PRODUCT=fde/ca01/302\0"
+	"SEQNUM=4567";
+
+static const char removed[] =
+	"remove@/devices/pci0000:00/0000:00:14.0/usb1/1-2\0"
+	"ACTION=remove\0"
+	DEVICE_KEYS
+	"PRODUCT=fde/ca01/302\0"
+	"SEQNUM=4568";
+
+static const char foreign[] =
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2\0"
+	"ACTION=add\0"
+	DEVICE_KEYS
+	"PRODUCT=46d/c52b/1201\0"
+	"SEQNUM=4569";
+
+/* a product ID merely starting like the WMR200's */
+static const char lookalike[] =
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2\0"
+	"ACTION=add\0"
+	DEVICE_KEYS
+	"PRODUCT=fde/ca011/302\0"
+	"SEQNUM=4570";
+
+static const char hidraw[] =
+	"add@/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/0003:0FDE:CA01.0001/hidraw/hidraw0\0"
+	"ACTION=add\0"
+	"SUBSYSTEM=hidraw\0"
+	"DEVNAME=hidraw0\0"
+	"SEQNUM=4571";
+
+static void check(const char *name, const char *uevent, size_t len, unsigned pid,
+	bool expected)
+{
+	struct sockaddr_nl from = { .nl_family = AF_NETLINK, .nl_pid = pid };
+
+	if (transport_uevent_plugged(&from, uevent, len) != expected)
+		errx(EXIT_FAILURE, "Uevent '%s' from %u %s the WMR200 being plugged in",
+			name, pid, expected ? "isn't" : "is");
+}
+
+int main(void)
+{
+	/* the arrays end with the NUL which has to follow a uevent */
+	check("added", added, sizeof(added) - 1, 0, true);
+	check("removed", removed, sizeof(removed) - 1, 0, false);
+	check("foreign", foreign, sizeof(foreign) - 1, 0, false);
+	check("lookalike", lookalike, sizeof(lookalike) - 1, 0, false);
+	check("hidraw", hidraw, sizeof(hidraw) - 1, 0, false);
+	check("empty", "", 0, 0, false);
+
+	/* only the kernel is trusted, not a process sending the same */
+	check("added", added, sizeof(added) - 1, 1234, false);
+
+	return EXIT_SUCCESS;
+}
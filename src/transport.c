@@ -0,0 +1,262 @@
+/*
+ * Transports frames are exchanged with the station over.
+ */
+
+#include "capture.h"
+#include "common.h"
+#include "log.h"
+#include "transport.h"
+
+#include <errno.h>
+#include <hidapi.h>
+#include <linux/netlink.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define	VENDOR_ID		0x0FDE
+#define	PRODUCT_ID		0xCA01
+#define	UEVENT_GROUP		1	/* netlink group of the kernel's uevents */
+#define	UEVENT_MAX_LEN		8192	/* longest uevent read */
+
+/*
+ * USB HID device.
+ */
+struct hid_transport
+{
+	struct wmr_transport tr;
+	hid_device *dev;		/* HIDAPI device handle */
+};
+
+static ssize_t hid_transport_read(struct wmr_transport *tr, byte_t *buf, size_t size)
+{
+	struct hid_transport *hid = (struct hid_transport *)tr;
+
+	return hid_read(hid->dev, buf, size);
+}
+
+static ssize_t hid_transport_write(struct wmr_transport *tr, const byte_t *data, size_t len)
+{
+	struct hid_transport *hid = (struct hid_transport *)tr;
+
+	return hid_write(hid->dev, data, len);
+}
+
+static void hid_transport_close(struct wmr_transport *tr)
+{
+	struct hid_transport *hid = (struct hid_transport *)tr;
+
+	hid_close(hid->dev);
+	free(hid);
+}
+
+struct wmr_transport *transport_open_hid(void)
+{
+	struct hid_transport *hid;
+	hid_device *dev;
+
+	if ((dev = hid_open(VENDOR_ID, PRODUCT_ID, NULL)) == NULL) {
+		log_error("hid_open: cannot connect to WMR200");
+		return NULL;
+	}
+
+	hid = malloc_safe(sizeof(*hid));
+	hid->tr.read = hid_transport_read;
+	hid->tr.write = hid_transport_write;
+	hid->tr.close = hid_transport_close;
+	hid->dev = dev;
+	return &hid->tr;
+}
+
+int transport_watch_hid(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = UEVENT_GROUP,
+	};
+	int saved_errno;
+	int fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT)) == -1)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		saved_errno = errno;
+		(void) close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Is @uevent of @len bytes about the WMR200 being added? A uevent is
+ * "<action>@<devpath>" followed by "<key>=<value>" pairs, each of them
+ * NUL-terminated, and @uevent[@len] is NUL.
+ */
+static bool is_hid_added(const char *uevent, size_t len)
+{
+	const char *end = uevent + len;
+	char product[32];
+	size_t product_len;
+	bool add = false;
+	bool usb = false;
+	bool ours = false;
+
+	/* such as PRODUCT=fde/ca01/302, the last being the device's version */
+	product_len = snprintf(product, sizeof(product), "PRODUCT=%x/%x/",
+		VENDOR_ID, PRODUCT_ID);
+
+	for (; uevent < end; uevent += strlen(uevent) + 1) {
+		if (strcmp(uevent, "ACTION=add") == 0)
+			add = true;
+		else if (strcmp(uevent, "SUBSYSTEM=usb") == 0)
+			usb = true;
+		else if (strncmp(uevent, product, product_len) == 0)
+			ours = true;
+	}
+
+	return add && usb && ours;
+}
+
+bool transport_uevent_plugged(const struct sockaddr_nl *from, const char *uevent,
+	size_t len)
+{
+	/* only the kernel sends uevents to be trusted */
+	return from->nl_pid == 0 && is_hid_added(uevent, len);
+}
+
+bool transport_hid_plugged(int fd)
+{
+	char buf[UEVENT_MAX_LEN + 1];
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	bool plugged = false;
+	ssize_t len;
+
+	for (;;) {
+		addr_len = sizeof(addr);
+		len = recvfrom(fd, buf, UEVENT_MAX_LEN, 0, (struct sockaddr *)&addr, &addr_len);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			/* uevents were lost, the station may have been among them */
+			if (errno == ENOBUFS) {
+				plugged = true;
+				continue;
+			}
+			break;
+		}
+
+		buf[len] = '\0';
+		plugged |= transport_uevent_plugged(&addr, buf, len);
+	}
+
+	return plugged;
+}
+
+/*
+ * Replay of a capture.
+ */
+struct replay_transport
+{
+	struct wmr_transport tr;
+	FILE *stream;			/* the capture */
+	double speed;			/* speed-up (0 for no delays) */
+	ulong_t first;			/* capture time of the first frame (us) */
+	ulong_t start;			/* when the first frame was read (us) */
+	bool started;			/* has the first frame been read? */
+};
+
+/*
+ * Wait until @frame is due.
+ */
+static void replay_wait(struct replay_transport *replay, struct capture_frame *frame)
+{
+	struct timespec ts;
+	ulong_t due;
+	ulong_t now;
+
+	if (!replay->started) {
+		replay->first = frame->time;
+		replay->start = capture_now();
+		replay->started = true;
+		return;
+	}
+
+	due = replay->start + (frame->time - replay->first) / replay->speed;
+	if ((now = capture_now()) >= due)
+		return;
+
+	ts.tv_sec = (due - now) / 1000000;
+	ts.tv_nsec = (due - now) % 1000000 * 1000;
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+static ssize_t replay_transport_read(struct wmr_transport *tr, byte_t *buf, size_t size)
+{
+	struct replay_transport *replay = (struct replay_transport *)tr;
+	struct capture_frame frame;
+	int ret;
+
+	do {
+		if ((ret = capture_read_frame(replay->stream, &frame)) <= 0) {
+			if (ret < 0)
+				log_error("Capture is truncated or corrupt");
+			return ret;
+		}
+	} while (frame.dir != CAPTURE_IN);
+
+	if (replay->speed > 0)
+		replay_wait(replay, &frame);
+
+	memcpy(buf, frame.data, MIN(size, frame.len));
+	return MIN(size, frame.len);
+}
+
+static ssize_t replay_transport_write(struct wmr_transport *tr, const byte_t *data, size_t len)
+{
+	(void) tr;
+	(void) data;
+	return len;
+}
+
+static void replay_transport_close(struct wmr_transport *tr)
+{
+	struct replay_transport *replay = (struct replay_transport *)tr;
+
+	fclose(replay->stream);
+	free(replay);
+}
+
+struct wmr_transport *transport_open_replay(const char *path, double speed)
+{
+	struct replay_transport *replay;
+	struct capture_header hdr;
+	FILE *stream;
+
+	if ((stream = fopen(path, "r")) == NULL) {
+		log_error("Cannot open capture %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (capture_read_header(stream, &hdr) != 0) {
+		log_error("%s is not a capture", path);
+		fclose(stream);
+		return NULL;
+	}
+
+	replay = malloc_safe(sizeof(*replay));
+	replay->tr.read = replay_transport_read;
+	replay->tr.write = replay_transport_write;
+	replay->tr.close = replay_transport_close;
+	replay->stream = stream;
+	replay->speed = speed;
+	replay->started = false;
+	return &replay->tr;
+}
@@ -0,0 +1,1134 @@
+/*
+ * Append-only time-series store.
+ *
+ * Numeric fields of readings of each slot are appended to segment files
+ * in <root>/<slot>/, one file per cfg.segment_len readings. Readings of
+ * the open segment are kept in memory, ordered by time; once there's
+ * enough of them, the segment is sealed: encoded, written to a new file
+ * (which is never modified afterwards) and memory-mapped for reads. That
+ * is done by the sealer thread, so that the ingest thread doesn't wait
+ * for the disk; readings being sealed are kept in memory until it's done.
+ *
+ * A segment is columnar: it has a stream of timestamps and a stream of
+ * values of each field. Timestamps are encoded as deltas of deltas and
+ * values as XORs with the previous value, the way Gorilla (Facebook's
+ * in-memory TSDB) does it. Regular readings of slowly changing values
+ * thus take a couple of bits each.
+ *
+ * The streams are cut into blocks of BLOCK_LEN readings. Each block starts
+ * with a full timestamp and full values, so decoding can start at any
+ * block; the sparse time index of the segment lists the first timestamp
+ * of each block along with its offset within each of the streams.
+ *
+ * So that the open segment survives restarts, and so that the journal
+ * (see journal.c) doesn't have to keep its readings, tsdb_sync and
+ * tsdb_free write the readings not sealed yet as they are to file
+ * <root>/<slot>/open, which is read back by tsdb_start. Readings which
+ * made it to a segment file meanwhile are skipped then.
+ *
+ * The file layout (all integers in host byte order):
+ *
+ *     struct segment_header
+ *     char names[num_columns][TSDB_NAME_LEN]	names of the fields
+ *     uint64_t streams[num_columns + 2]	offsets of the streams and the end
+ *     uint64_t index[num_blocks][num_columns + 2]	time and bit offsets
+ *     the streams, timestamps first
+ */
+
+#include "common.h"
+#include "log.h"
+#include "tsdb.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define	DEFAULT_SEGMENT_LEN	4096	/* readings per segment */
+#define	BLOCK_LEN		128	/* readings per block */
+#define	OPEN_INIT_SIZE		64	/* initial capacity of the open segment */
+#define	SEGMENT_MAGIC		"WMRTSDB1"
+#define	OPEN_MAGIC		"WMRTSDBO"
+
+struct segment_header
+{
+	char magic[8];		/* SEGMENT_MAGIC */
+	uint32_t num_columns;	/* number of fields stored */
+	uint32_t count;		/* number of readings */
+	uint32_t num_blocks;	/* number of blocks */
+	uint32_t block_len;	/* readings per block */
+	int64_t first;		/* time of the first reading */
+	int64_t last;		/* time of the last reading */
+};
+
+/*
+ * Header of the file of the open segment, followed by times of its
+ * readings (int64_t) and their values (double, num_columns per reading).
+ */
+struct open_header
+{
+	char magic[8];		/* OPEN_MAGIC */
+	uint32_t num_columns;	/* number of fields stored */
+	uint32_t count;		/* number of readings */
+};
+
+/*
+ * Bits of a delta of deltas, by the number of 1s its prefix has.
+ */
+static const unsigned dod_bits[] = { 0, 7, 9, 12, 64 };
+
+struct bit_writer
+{
+	byte_t *data;		/* the bits, MSB first */
+	size_t len;		/* number of bits written */
+	size_t size;		/* size of @data in bytes */
+};
+
+struct bit_reader
+{
+	const byte_t *data;	/* the bits, MSB first */
+	size_t pos;		/* number of bits read */
+	size_t len;		/* number of bits available */
+	bool error;		/* was a read past the end attempted? */
+};
+
+static void put_bits(struct bit_writer *w, uint64_t bits, unsigned n)
+{
+	size_t need = (w->len + n + 7) / 8;
+	size_t old_size = w->size;
+	unsigned room, take;
+
+	if (need > w->size) {
+		w->size = MAX(2 * w->size, MAX(need, 64));
+		w->data = realloc_safe(w->data, w->size);
+		memset(w->data + old_size, 0, w->size - old_size);
+	}
+
+	while (n > 0) {
+		room = 8 - w->len % 8;
+		take = MIN(room, n);
+		w->data[w->len / 8] |= ((bits >> (n - take)) & ((1U << take) - 1)) << (room - take);
+		w->len += take;
+		n -= take;
+	}
+}
+
+static uint64_t get_bits(struct bit_reader *r, unsigned n)
+{
+	uint64_t bits = 0;
+	unsigned room, take;
+
+	if (r->pos + n > r->len) {
+		r->error = true;
+		return 0;
+	}
+
+	while (n > 0) {
+		room = 8 - r->pos % 8;
+		take = MIN(room, n);
+		bits = (bits << take) | ((r->data[r->pos / 8] >> (room - take)) & ((1U << take) - 1));
+		r->pos += take;
+		n -= take;
+	}
+
+	return bits;
+}
+
+/*
+ * Encode timestamp @t. The first timestamp of a block is stored in full,
+ * the following ones as the difference of their delta and the previous
+ * delta, prefixed by a class:
+ *
+ *     0	the same delta
+ *     10	7 bits
+ *     110	9 bits
+ *     1110	12 bits
+ *     1111	64 bits
+ */
+static void encode_time(struct bit_writer *w, struct tsdb_time_coder *c, time_t t, bool first)
+{
+	int64_t delta, dod, bias;
+	unsigned i;
+
+	if (first) {
+		put_bits(w, (uint64_t)t, 64);
+		c->prev = t;
+		c->delta = 0;
+		return;
+	}
+
+	delta = t - c->prev;
+	dod = delta - c->delta;
+	c->prev = t;
+	c->delta = delta;
+
+	for (i = 0; dod != 0 && i < ARRAY_SIZE(dod_bits) - 1; i++) {
+		if (i == 0)
+			continue;
+		bias = ((int64_t)1 << (dod_bits[i] - 1)) - 1;
+		if (dod >= -bias && dod <= bias + 1)
+			break;
+	}
+
+	put_bits(w, (1U << i) - 1, i);
+	if (i < ARRAY_SIZE(dod_bits) - 1)
+		put_bits(w, 0, 1);
+
+	if (dod_bits[i] == 64)
+		put_bits(w, (uint64_t)dod, 64);
+	else if (dod_bits[i] > 0)
+		put_bits(w, dod + ((int64_t)1 << (dod_bits[i] - 1)) - 1, dod_bits[i]);
+}
+
+static time_t decode_time(struct bit_reader *r, struct tsdb_time_coder *c, bool first)
+{
+	int64_t dod = 0;
+	unsigned i;
+
+	if (first) {
+		c->prev = (int64_t)get_bits(r, 64);
+		c->delta = 0;
+		return c->prev;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(dod_bits) - 1 && get_bits(r, 1) == 1; i++);
+
+	if (dod_bits[i] == 64)
+		dod = (int64_t)get_bits(r, 64);
+	else if (dod_bits[i] > 0)
+		dod = (int64_t)get_bits(r, dod_bits[i]) - ((int64_t)1 << (dod_bits[i] - 1)) + 1;
+
+	c->delta += dod;
+	c->prev += c->delta;
+	return c->prev;
+}
+
+/*
+ * Encode @value. The first value of a block is stored in full, the
+ * following ones as a XOR with the previous value:
+ *
+ *     0	the same value
+ *     10	meaningful bits of the XOR, within the previous window
+ *     11	5 bits of leading zeros, 6 bits of length, meaningful bits
+ */
+static void encode_value(struct bit_writer *w, struct tsdb_value_coder *c, double value,
+	bool first)
+{
+	unsigned lead, trail, len;
+	uint64_t bits, x;
+
+	memcpy(&bits, &value, sizeof(bits));
+
+	if (first) {
+		put_bits(w, bits, 64);
+		c->prev = bits;
+		c->lead = 64;
+		c->trail = 64;
+		return;
+	}
+
+	x = bits ^ c->prev;
+	c->prev = bits;
+
+	if (x == 0) {
+		put_bits(w, 0, 1);
+		return;
+	}
+
+	lead = MIN(__builtin_clzll(x), 31);
+	trail = __builtin_ctzll(x);
+
+	if (lead >= c->lead && trail >= c->trail) {
+		put_bits(w, 2, 2);
+		put_bits(w, x >> c->trail, 64 - c->lead - c->trail);
+		return;
+	}
+
+	len = 64 - lead - trail;
+	put_bits(w, 3, 2);
+	put_bits(w, lead, 5);
+	put_bits(w, len % 64, 6);
+	put_bits(w, x >> trail, len);
+	c->lead = lead;
+	c->trail = trail;
+}
+
+static double decode_value(struct bit_reader *r, struct tsdb_value_coder *c, bool first)
+{
+	unsigned len;
+	uint64_t x = 0;
+	double value;
+
+	if (first) {
+		c->prev = get_bits(r, 64);
+		c->lead = 64;
+		c->trail = 64;
+	}
+	else if (get_bits(r, 1) == 1) {
+		if (get_bits(r, 1) == 1) {
+			c->lead = get_bits(r, 5);
+			len = get_bits(r, 6);
+			if (len == 0)
+				len = 64;
+			if (c->lead + len > 64) {
+				r->error = true;
+				return 0;
+			}
+			c->trail = 64 - c->lead - len;
+		}
+		else if (c->lead + c->trail >= 64) {
+			r->error = true;
+			return 0;
+		}
+
+		x = get_bits(r, 64 - c->lead - c->trail) << c->trail;
+		c->prev ^= x;
+	}
+
+	memcpy(&value, &c->prev, sizeof(value));
+	return value;
+}
+
+void tsdb_init(struct tsdb *db)
+{
+	const struct reading_field *fields;
+	struct tsdb_series *series;
+	size_t count;
+	size_t i;
+	int slot;
+
+	db->cfg.root = NULL;
+	db->cfg.segment_len = DEFAULT_SEGMENT_LEN;
+	pthread_mutex_init(&db->lock, NULL);
+	pthread_cond_init(&db->seal_cond, NULL);
+	db->sealing = false;
+
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		series = &db->series[slot];
+		memset(series, 0, sizeof(*series));
+
+		fields = reading_fields(slot_type(slot), &count);
+		for (i = 0; i < count && series->num_columns < TSDB_MAX_COLUMNS; i++)
+			if (fields[i].kind != FIELD_STRING)
+				series->fields[series->num_columns++] = &fields[i];
+	}
+}
+
+static void unmap_segment(struct tsdb_segment *seg)
+{
+	(void) munmap(seg->map, seg->map_len);
+	free(seg);
+}
+
+/*
+ * Map segment file at @path and check it's sane.
+ *
+ * Return value:
+ *	The segment, or NULL on error.
+ */
+static struct tsdb_segment *map_segment(const char *path)
+{
+	const struct segment_header *hdr;
+	struct tsdb_segment *seg;
+	struct stat st;
+	size_t hdr_len;
+	size_t i;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_error("Cannot open segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*hdr)) {
+		log_error("Segment %s is truncated", path);
+		(void) close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close(fd);
+	if (map == MAP_FAILED) {
+		log_error("Cannot map segment %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	seg = malloc_safe(sizeof(*seg));
+	seg->map = map;
+	seg->map_len = st.st_size;
+
+	hdr = map;
+	if (memcmp(hdr->magic, SEGMENT_MAGIC, sizeof(hdr->magic)) != 0
+		|| hdr->num_columns > TSDB_MAX_COLUMNS || hdr->block_len == 0
+		|| hdr->num_blocks != (hdr->count + hdr->block_len - 1) / hdr->block_len)
+		goto corrupt;
+
+	seg->first = hdr->first;
+	seg->last = hdr->last;
+	seg->count = hdr->count;
+	seg->num_columns = hdr->num_columns;
+	seg->num_blocks = hdr->num_blocks;
+
+	hdr_len = sizeof(*hdr) + seg->num_columns * TSDB_NAME_LEN
+		+ (seg->num_columns + 2) * sizeof(uint64_t)
+		+ seg->num_blocks * (seg->num_columns + 2) * sizeof(uint64_t);
+	if (hdr_len > seg->map_len)
+		goto corrupt;
+
+	seg->names = (const char (*)[TSDB_NAME_LEN])((byte_t *)map + sizeof(*hdr));
+	seg->streams = (const void *)(seg->names + seg->num_columns);
+	seg->index = seg->streams + seg->num_columns + 2;
+
+	if (seg->streams[0] < hdr_len || seg->streams[seg->num_columns + 1] > seg->map_len)
+		goto corrupt;
+	for (i = 0; i <= seg->num_columns; i++)
+		if (seg->streams[i] > seg->streams[i + 1])
+			goto corrupt;
+
+	return seg;
+
+corrupt:
+	log_error("Segment %s is corrupt", path);
+	unmap_segment(seg);
+	return NULL;
+}
+
+static int segment_cmp(const void *a, const void *b)
+{
+	const struct tsdb_segment *sa = *(struct tsdb_segment * const *)a;
+	const struct tsdb_segment *sb = *(struct tsdb_segment * const *)b;
+
+	return (sa->first > sb->first) - (sa->first < sb->first);
+}
+
+/*
+ * Map segment files of @slot which are already there.
+ */
+static int load_series(struct tsdb *db, int slot)
+{
+	struct tsdb_series *series = &db->series[slot];
+	struct tsdb_segment *seg;
+	char path[PATH_MAX];
+	struct dirent *ent;
+	unsigned seq;
+	char end;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/%s", db->cfg.root, slot_name(slot));
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		log_error("Cannot create directory %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if ((dir = opendir(path)) == NULL) {
+		log_error("Cannot open directory %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (sscanf(ent->d_name, "%u.se%c", &seq, &end) != 2 || end != 'g'
+			|| strstr(ent->d_name, ".tmp") != NULL)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/%s", db->cfg.root, slot_name(slot),
+			ent->d_name);
+		if ((seg = map_segment(path)) == NULL)
+			continue;
+
+		series->segments = realloc_safe(series->segments,
+			(series->num_segments + 1) * sizeof(*series->segments));
+		series->segments[series->num_segments++] = seg;
+		series->next_seq = MAX(series->next_seq, seq + 1);
+	}
+
+	(void) closedir(dir);
+
+	qsort(series->segments, series->num_segments, sizeof(*series->segments), segment_cmp);
+	if (series->num_segments > 0)
+		series->sealed = series->segments[series->num_segments - 1]->last;
+
+	return 0;
+}
+
+/*
+ * Write @len bytes at @data to @stream.
+ */
+static int write_all(FILE *stream, const void *data, size_t len)
+{
+	return fwrite(data, 1, len, stream) == len ? 0 : -1;
+}
+
+/*
+ * Encode @count readings of @slot at @times with @values and write them
+ * to a new segment file. The file is written under a temporary name and
+ * renamed once it's complete, so a segment file is never seen half-written.
+ */
+static int write_segment(struct tsdb *db, int slot, const char *path,
+	const time_t *times, const double *values, size_t count)
+{
+	struct tsdb_series *series = &db->series[slot];
+	size_t num_streams = series->num_columns + 1;
+	struct bit_writer w[TSDB_MAX_COLUMNS + 1];
+	struct tsdb_time_coder tc;
+	struct tsdb_value_coder vc[TSDB_MAX_COLUMNS];
+	struct segment_header hdr;
+	char names[TSDB_MAX_COLUMNS][TSDB_NAME_LEN];
+	uint64_t streams[TSDB_MAX_COLUMNS + 2];
+	uint64_t *index;
+	char tmp_path[PATH_MAX + sizeof(".tmp")];
+	FILE *stream;
+	size_t entry_len = num_streams + 1;
+	size_t num_blocks = (count + BLOCK_LEN - 1) / BLOCK_LEN;
+	size_t i, s;
+	bool first;
+	int ret = -1;
+
+	memset(w, 0, sizeof(w));
+	memset(&tc, 0, sizeof(tc));
+	memset(vc, 0, sizeof(vc));
+	index = malloc_safe(num_blocks * entry_len * sizeof(*index));
+
+	for (i = 0; i < count; i++) {
+		first = (i % BLOCK_LEN == 0);
+		if (first) {
+			index[(i / BLOCK_LEN) * entry_len] = (uint64_t)times[i];
+			for (s = 0; s < num_streams; s++)
+				index[(i / BLOCK_LEN) * entry_len + 1 + s] = w[s].len;
+		}
+
+		encode_time(&w[0], &tc, times[i], first);
+		for (s = 0; s < series->num_columns; s++)
+			encode_value(&w[s + 1], &vc[s],
+				values[i * series->num_columns + s], first);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SEGMENT_MAGIC, sizeof(hdr.magic));
+	hdr.num_columns = series->num_columns;
+	hdr.count = count;
+	hdr.num_blocks = num_blocks;
+	hdr.block_len = BLOCK_LEN;
+	hdr.first = times[0];
+	hdr.last = times[count - 1];
+
+	memset(names, 0, sizeof(names));
+	for (s = 0; s < series->num_columns; s++)
+		strncpy(names[s], series->fields[s]->name, TSDB_NAME_LEN - 1);
+
+	streams[0] = sizeof(hdr) + series->num_columns * TSDB_NAME_LEN
+		+ (num_streams + 1) * sizeof(*streams)
+		+ num_blocks * entry_len * sizeof(*index);
+	for (s = 0; s < num_streams; s++)
+		streams[s + 1] = streams[s] + (w[s].len + 7) / 8;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if ((stream = fopen(tmp_path, "w")) == NULL) {
+		log_error("Cannot create segment %s: %s", tmp_path, strerror(errno));
+		goto out;
+	}
+
+	if (write_all(stream, &hdr, sizeof(hdr)) != 0
+		|| write_all(stream, names, series->num_columns * TSDB_NAME_LEN) != 0
+		|| write_all(stream, streams, (num_streams + 1) * sizeof(*streams)) != 0
+		|| write_all(stream, index, num_blocks * entry_len * sizeof(*index)) != 0)
+		goto write_error;
+
+	for (s = 0; s < num_streams; s++)
+		if (write_all(stream, w[s].data, (w[s].len + 7) / 8) != 0)
+			goto write_error;
+
+	if (fflush(stream) != 0 || fsync(fileno(stream)) != 0)
+		goto write_error;
+
+	if (fclose(stream) != 0 || rename(tmp_path, path) != 0) {
+		stream = NULL;
+		goto write_error;
+	}
+
+	ret = 0;
+	goto out;
+
+write_error:
+	log_error("Cannot write segment %s: %s", tmp_path, strerror(errno));
+	if (stream != NULL)
+		(void) fclose(stream);
+	(void) unlink(tmp_path);
+out:
+	for (s = 0; s < num_streams; s++)
+		free(w[s].data);
+	free(index);
+	return ret;
+}
+
+static void open_path(struct tsdb *db, int slot, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/%s/open", db->cfg.root, slot_name(slot));
+}
+
+/*
+ * Write readings of @slot not sealed yet, those being sealed and those of
+ * the open segment, to its file, or remove the file if there are none.
+ * Called with @db->lock held.
+ */
+static int write_open(struct tsdb *db, int slot)
+{
+	struct tsdb_series *series = &db->series[slot];
+	struct open_header hdr;
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + sizeof(".tmp")];
+	int64_t t;
+	FILE *stream;
+	size_t i;
+
+	open_path(db, slot, path, sizeof(path));
+	if (series->sealing_count + series->count == 0)
+		return unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OPEN_MAGIC, sizeof(hdr.magic));
+	hdr.num_columns = series->num_columns;
+	hdr.count = series->sealing_count + series->count;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if ((stream = fopen(tmp_path, "w")) == NULL) {
+		log_error("Cannot create %s: %s", tmp_path, strerror(errno));
+		return -1;
+	}
+
+	if (write_all(stream, &hdr, sizeof(hdr)) != 0)
+		goto write_error;
+
+	for (i = 0; i < series->sealing_count; i++) {
+		t = series->sealing_times[i];
+		if (write_all(stream, &t, sizeof(t)) != 0)
+			goto write_error;
+	}
+
+	for (i = 0; i < series->count; i++) {
+		t = series->times[i];
+		if (write_all(stream, &t, sizeof(t)) != 0)
+			goto write_error;
+	}
+
+	if (write_all(stream, series->sealing_values, series->sealing_count
+		* series->num_columns * sizeof(*series->sealing_values)) != 0
+		|| write_all(stream, series->values,
+		series->count * series->num_columns * sizeof(*series->values)) != 0
+		|| fflush(stream) != 0 || fsync(fileno(stream)) != 0)
+		goto write_error;
+
+	if (fclose(stream) != 0 || rename(tmp_path, path) != 0) {
+		stream = NULL;
+		goto write_error;
+	}
+
+	return 0;
+
+write_error:
+	log_error("Cannot write %s: %s", tmp_path, strerror(errno));
+	if (stream != NULL)
+		(void) fclose(stream);
+	(void) unlink(tmp_path);
+	return -1;
+}
+
+/*
+ * Hand the open segment of @slot over to the sealer thread. If it's still
+ * busy with the previous segment of the slot, the open one grows a bit
+ * longer instead. Called with @db->lock held.
+ */
+static void seal(struct tsdb *db, int slot)
+{
+	struct tsdb_series *series = &db->series[slot];
+
+	if (series->count == 0 || series->sealing_count > 0)
+		return;
+
+	series->sealing_times = series->times;
+	series->sealing_values = series->values;
+	series->sealing_count = series->count;
+	series->sealing_seq = series->next_seq++;
+	series->sealed = series->times[series->count - 1];
+
+	series->times = NULL;
+	series->values = NULL;
+	series->count = 0;
+	series->size = 0;
+	pthread_cond_signal(&db->seal_cond);
+}
+
+static void *sealer_thread(void *arg)
+{
+	struct tsdb *db = (struct tsdb *)arg;
+	struct tsdb_series *series;
+	struct tsdb_segment *seg;
+	char path[PATH_MAX];
+	size_t count;
+	int slot;
+
+	pthread_mutex_lock(&db->lock);
+
+	while (db->sealing) {
+		for (slot = 0; slot < NUM_SLOTS; slot++)
+			if (db->series[slot].sealing_count > 0)
+				break;
+
+		if (slot == NUM_SLOTS) {
+			pthread_cond_wait(&db->seal_cond, &db->lock);
+			continue;
+		}
+
+		series = &db->series[slot];
+		count = series->sealing_count;
+		snprintf(path, sizeof(path), "%s/%s/%08u.seg", db->cfg.root, slot_name(slot),
+			series->sealing_seq);
+		pthread_mutex_unlock(&db->lock);
+
+		/* readings being sealed are only read by others until they're freed */
+		seg = NULL;
+		if (write_segment(db, slot, path, series->sealing_times,
+			series->sealing_values, count) == 0)
+			seg = map_segment(path);
+
+		pthread_mutex_lock(&db->lock);
+
+		/*
+		 * Should the segment fail to be written, its readings are lost
+		 * rather than kept piling up in memory.
+		 */
+		if (seg != NULL) {
+			series->segments = realloc_safe(series->segments,
+				(series->num_segments + 1) * sizeof(*series->segments));
+			series->segments[series->num_segments++] = seg;
+		}
+
+		free(series->sealing_times);
+		free(series->sealing_values);
+		series->sealing_times = NULL;
+		series->sealing_values = NULL;
+		series->sealing_count = 0;
+	}
+
+	pthread_mutex_unlock(&db->lock);
+	return NULL;
+}
+
+void tsdb_free(struct tsdb *db)
+{
+	struct tsdb_series *series;
+	size_t i;
+	int slot;
+
+	if (db->sealing) {
+		pthread_mutex_lock(&db->lock);
+		db->sealing = false;
+		pthread_cond_signal(&db->seal_cond);
+		pthread_mutex_unlock(&db->lock);
+		pthread_join(db->sealer_id, NULL);
+	}
+
+	/*
+	 * Readings not sealed yet are written out as they are, the open
+	 * segment is continued after a restart.
+	 */
+	pthread_mutex_lock(&db->lock);
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		series = &db->series[slot];
+		if (db->cfg.root != NULL && series->num_columns > 0)
+			(void) write_open(db, slot);
+
+		for (i = 0; i < series->num_segments; i++)
+			unmap_segment(series->segments[i]);
+		free(series->segments);
+		free(series->sealing_times);
+		free(series->sealing_values);
+		free(series->times);
+		free(series->values);
+	}
+	pthread_mutex_unlock(&db->lock);
+
+	pthread_cond_destroy(&db->seal_cond);
+	pthread_mutex_destroy(&db->lock);
+}
+
+/*
+ * Add a reading of @slot at time @t with @values of its fields to the open
+ * segment. Called with @db->lock held.
+ */
+static void append(struct tsdb *db, int slot, time_t t, const double *values)
+{
+	struct tsdb_series *series = &db->series[slot];
+	size_t nc = series->num_columns;
+	size_t i;
+
+	/*
+	 * Segments never overlap, so readings not newer than the last sealed
+	 * one can't be stored anymore.
+	 */
+	if (t <= series->sealed) {
+		log_debug("Dropping %s reading from %li, already sealed", slot_name(slot), t);
+		return;
+	}
+
+	if (series->count == series->size) {
+		series->size = MAX(2 * series->size, OPEN_INIT_SIZE);
+		series->times = realloc_safe(series->times,
+			series->size * sizeof(*series->times));
+		series->values = realloc_safe(series->values,
+			series->size * nc * sizeof(*series->values));
+	}
+
+	/*
+	 * Readings mostly come in order, so look for their place from the end.
+	 */
+	for (i = series->count; i > 0 && series->times[i - 1] > t; i--);
+
+	/* such as one replayed from the journal */
+	if (i > 0 && series->times[i - 1] == t)
+		return;
+
+	memmove(series->times + i + 1, series->times + i,
+		(series->count - i) * sizeof(*series->times));
+	memmove(series->values + (i + 1) * nc, series->values + i * nc,
+		(series->count - i) * nc * sizeof(*series->values));
+
+	series->times[i] = t;
+	memcpy(series->values + i * nc, values, nc * sizeof(*values));
+	series->count++;
+
+	if (series->count >= db->cfg.segment_len)
+		seal(db, slot);
+}
+
+void tsdb_log_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	struct tsdb *db = (struct tsdb *)arg;
+	struct tsdb_series *series;
+	double values[TSDB_MAX_COLUMNS];
+	size_t i;
+	int slot;
+
+	(void) wmr;
+
+	if ((slot = reading_slot(reading)) < 0)
+		return;
+
+	series = &db->series[slot];
+	if (series->num_columns == 0)
+		return;
+
+	for (i = 0; i < series->num_columns; i++)
+		values[i] = reading_field_value(reading, series->fields[i]);
+
+	pthread_mutex_lock(&db->lock);
+	append(db, slot, reading->time, values);
+	pthread_mutex_unlock(&db->lock);
+}
+
+void tsdb_sync(struct tsdb *db, time_t watermarks[NUM_SLOTS])
+{
+	struct tsdb_series *series;
+	int slot;
+
+	pthread_mutex_lock(&db->lock);
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		series = &db->series[slot];
+		if (series->num_columns == 0 || write_open(db, slot) == 0)
+			continue;
+
+		if (series->sealing_count > 0)
+			watermarks[slot] = MIN(watermarks[slot], series->sealing_times[0]);
+		else if (series->count > 0)
+			watermarks[slot] = MIN(watermarks[slot], series->times[0]);
+	}
+	pthread_mutex_unlock(&db->lock);
+}
+
+/*
+ * Read back readings of the open segment of @slot written by write_open.
+ */
+static void load_open(struct tsdb *db, int slot)
+{
+	struct tsdb_series *series = &db->series[slot];
+	double values[TSDB_MAX_COLUMNS];
+	struct open_header hdr;
+	char path[PATH_MAX];
+	int64_t *times;
+	FILE *stream;
+	size_t i;
+
+	open_path(db, slot, path, sizeof(path));
+	if ((stream = fopen(path, "r")) == NULL)
+		return;
+
+	if (fread(&hdr, sizeof(hdr), 1, stream) != 1
+		|| memcmp(hdr.magic, OPEN_MAGIC, sizeof(hdr.magic)) != 0
+		|| hdr.num_columns != series->num_columns) {
+		log_error("%s is corrupt, ignoring it", path);
+		(void) fclose(stream);
+		return;
+	}
+
+	times = malloc_safe(MAX(hdr.count, 1) * sizeof(*times));
+	if (fread(times, sizeof(*times), hdr.count, stream) != hdr.count) {
+		log_error("%s is truncated, ignoring it", path);
+		hdr.count = 0;
+	}
+
+	for (i = 0; i < hdr.count; i++) {
+		if (fread(values, sizeof(*values), series->num_columns, stream)
+			!= series->num_columns) {
+			log_error("%s is truncated", path);
+			break;
+		}
+		append(db, slot, times[i], values);
+	}
+
+	free(times);
+	(void) fclose(stream);
+}
+
+int tsdb_start(struct tsdb *db)
+{
+	int slot;
+	int ret;
+
+	if (mkdir(db->cfg.root, 0755) == -1 && errno != EEXIST) {
+		log_error("Cannot create directory %s: %s", db->cfg.root, strerror(errno));
+		return -1;
+	}
+
+	db->sealing = true;
+	if ((ret = pthread_create(&db->sealer_id, NULL, sealer_thread, db)) != 0) {
+		log_error("Cannot create the segment sealer thread: %s", strerror(ret));
+		db->sealing = false;
+		return -1;
+	}
+
+	for (slot = 0; slot < NUM_SLOTS; slot++) {
+		if (db->series[slot].num_columns == 0)
+			continue;
+		if (load_series(db, slot) != 0)
+			return -1;
+
+		pthread_mutex_lock(&db->lock);
+		load_open(db, slot);
+		pthread_mutex_unlock(&db->lock);
+	}
+
+	return 0;
+}
+
+time_t tsdb_oldest(struct tsdb *db, int slot)
+{
+	struct tsdb_series *series = &db->series[slot];
+	time_t oldest = -1;
+
+	pthread_mutex_lock(&db->lock);
+	if (series->num_segments > 0)
+		oldest = series->segments[0]->first;
+	else if (series->sealing_count > 0)
+		oldest = series->sealing_times[0];
+	else if (series->count > 0)
+		oldest = series->times[0];
+	pthread_mutex_unlock(&db->lock);
+
+	return oldest;
+}
+
+int tsdb_iter_init(struct tsdb *db, int slot, const char *field, time_t start,
+	time_t end, struct tsdb_iter *it)
+{
+	struct tsdb_series *series = &db->series[slot];
+	size_t column;
+	size_t count;
+	size_t i;
+
+	for (column = 0; column < series->num_columns; column++)
+		if (strcmp(series->fields[column]->name, field) == 0)
+			break;
+
+	if (column == series->num_columns)
+		return -1;
+
+	memset(it, 0, sizeof(*it));
+	it->field = field;
+	it->start = start;
+	it->end = end;
+
+	/*
+	 * Sealed segments stay mapped until the store is freed, so it's
+	 * enough to remember them. Readings being sealed and those of the
+	 * open segment, which are newer, are copied.
+	 */
+	pthread_mutex_lock(&db->lock);
+
+	it->num_segments = series->num_segments;
+	it->segments = malloc_safe(MAX(it->num_segments, 1) * sizeof(*it->segments));
+	memcpy(it->segments, series->segments, it->num_segments * sizeof(*it->segments));
+
+	count = series->sealing_count + series->count;
+	it->times = malloc_safe(MAX(count, 1) * sizeof(*it->times));
+	it->values = malloc_safe(MAX(count, 1) * sizeof(*it->values));
+	for (i = 0; i < series->sealing_count; i++) {
+		if (series->sealing_times[i] < start || series->sealing_times[i] >= end)
+			continue;
+		it->times[it->count] = series->sealing_times[i];
+		it->values[it->count] =
+			series->sealing_values[i * series->num_columns + column];
+		it->count++;
+	}
+
+	for (i = 0; i < series->count; i++) {
+		if (series->times[i] < start || series->times[i] >= end)
+			continue;
+		it->times[it->count] = series->times[i];
+		it->values[it->count] = series->values[i * series->num_columns + column];
+		it->count++;
+	}
+
+	pthread_mutex_unlock(&db->lock);
+	return 0;
+}
+
+static const uint64_t *block_entry(struct tsdb_segment *seg, size_t block)
+{
+	return seg->index + block * (seg->num_columns + 2);
+}
+
+/*
+ * Enter the current segment of @it: find the column iterated over and the
+ * block the range starts in.
+ *
+ * Return value:
+ *	false if the segment has nothing to offer.
+ */
+static bool enter_segment(struct tsdb_iter *it, struct tsdb_segment *seg)
+{
+	size_t lo, hi, mid;
+
+	if (seg->count == 0 || seg->last < it->start || seg->first >= it->end)
+		return false;
+
+	for (it->column = 0; it->column < seg->num_columns; it->column++)
+		if (strncmp(seg->names[it->column], it->field, TSDB_NAME_LEN) == 0)
+			break;
+
+	if (it->column == seg->num_columns)
+		return false;
+
+	/*
+	 * Look for the last block which starts before the range does.
+	 */
+	lo = 0;
+	hi = seg->num_blocks;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if ((time_t)block_entry(seg, mid)[0] <= it->start)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	it->block = lo;
+	it->in_segment = true;
+	return true;
+}
+
+static void enter_block(struct tsdb_iter *it, struct tsdb_segment *seg)
+{
+	const uint64_t *entry = block_entry(seg, it->block);
+
+	it->time_pos = entry[1];
+	it->value_pos = entry[2 + it->column];
+	it->left = MIN(seg->count - it->block * BLOCK_LEN, BLOCK_LEN);
+	it->first = true;
+}
+
+static void init_reader(struct bit_reader *r, struct tsdb_segment *seg, size_t stream,
+	size_t pos)
+{
+	r->data = (const byte_t *)seg->map + seg->streams[stream];
+	r->len = 8 * (seg->streams[stream + 1] - seg->streams[stream]);
+	r->pos = pos;
+	r->error = false;
+}
+
+bool tsdb_iter_next(struct tsdb_iter *it, time_t *t, double *value)
+{
+	struct tsdb_segment *seg;
+	struct bit_reader tr, vr;
+
+	while (it->seg < it->num_segments) {
+		seg = it->segments[it->seg];
+
+		if (!it->in_segment) {
+			if (!enter_segment(it, seg)) {
+				it->seg++;
+				continue;
+			}
+			enter_block(it, seg);
+		}
+		else if (it->left == 0) {
+			if (++it->block == seg->num_blocks) {
+				it->in_segment = false;
+				it->seg++;
+				continue;
+			}
+			enter_block(it, seg);
+		}
+
+		init_reader(&tr, seg, 0, it->time_pos);
+		init_reader(&vr, seg, 1 + it->column, it->value_pos);
+		*t = decode_time(&tr, &it->tc, it->first);
+		*value = decode_value(&vr, &it->vc, it->first);
+		it->time_pos = tr.pos;
+		it->value_pos = vr.pos;
+		it->first = false;
+		it->left--;
+
+		if (tr.error || vr.error) {
+			log_error("Segment of %s starting at %li is corrupt", it->field, seg->first);
+			it->in_segment = false;
+			it->seg++;
+			continue;
+		}
+
+		if (*t < it->start)
+			continue;
+
+		/*
+		 * Segments are ordered and so is the open one, which follows
+		 * them: there's nothing more to be found.
+		 */
+		if (*t >= it->end) {
+			it->seg = it->num_segments;
+			it->pos = it->count;
+			return false;
+		}
+
+		return true;
+	}
+
+	if (it->pos < it->count) {
+		*t = it->times[it->pos];
+		*value = it->values[it->pos];
+		it->pos++;
+		return true;
+	}
+
+	return false;
+}
+
+void tsdb_iter_free(struct tsdb_iter *it)
+{
+	free(it->segments);
+	free(it->times);
+	free(it->values);
+}
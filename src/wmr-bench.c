@@ -0,0 +1,426 @@
+/*
+ * Benchmarks of the way readings take from the station to the RRD files:
+ *
+ *   - decoding: captures (see capture.h) are replayed as fast as possible
+ *     through the code meteod talks to the station with, which parses,
+ *     verifies and decodes packets;
+ *   - fan-out: the same, with more and more loggers registered, up to
+ *     MAX_LOGGERS of them; the cost of passing a reading to a logger is
+ *     the slope of the line fitted through the times of all of them by
+ *     least squares;
+ *   - RRD logger: readings are logged into RRD files in a temporary
+ *     directory, a reading per step of the database, so that every
+ *     reading makes an update.
+ *
+ * Usage: wmr-bench [capture...]
+ *
+ * Without captures, a capture of a simulated station is made to decode.
+ * Run by `make bench`, which passes it $(CAPTURES). Names of the decoding
+ * cases start with the name of the capture decoded.
+ */
+
+#include "bench.h"
+#include "capture.h"
+#include "common.h"
+#include "log.h"
+#include "rrd-logger.h"
+#include "simulator.h"
+#include "transport.h"
+#include "wmr200.h"
+
+#include <err.h>
+#include <libgen.h>
+#include <limits.h>
+#include <rrd.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	CORPUS_FRAMES	500000	/* frames of the capture made up */
+#define	NUM_RUNS	5	/* replays of a capture, the median counts */
+#define	MAX_LOGGERS	1024	/* most loggers of the fan-out benchmark */
+#define	RRD_STEP	180	/* step of the RRD files (s) */
+#define	RRD_STEPS	20000	/* steps logged into each RRD file */
+
+static const unsigned num_loggers[] = { 1, 4, 16, 64, 256, MAX_LOGGERS };
+
+/*
+ * Progress of a replay.
+ */
+struct replay
+{
+	struct wmr_transport *tr;	/* the replay transport */
+	ssize_t (*read)(struct wmr_transport *tr, byte_t *buf, size_t size);	/* its read */
+	volatile bool replayed;		/* has the whole capture been read? */
+	sem_t done;			/* posted when the replay is over */
+	ulong_t num_frames;		/* frames read */
+	ulong_t num_readings[MAX_LOGGERS];	/* readings passed to each logger */
+};
+
+/* there's a replay at a time, the wrapped read of which needs to find it */
+static struct replay *current;
+
+static ssize_t replay_read(struct wmr_transport *tr, byte_t *buf, size_t size)
+{
+	ssize_t ret = current->read(tr, buf, size);
+
+	if (ret > 0)
+		current->num_frames++;
+	else if (ret == 0)
+		current->replayed = true;
+	return ret;
+}
+
+static void count_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+
+	/* made up by the heartbeat thread rather than decoded */
+	if (reading->type != WMR_META)
+		(*(ulong_t *)arg)++;
+}
+
+static void error_handler(struct wmr200 *wmr, void *arg)
+{
+	struct replay *replay = (struct replay *)arg;
+
+	(void) wmr;
+
+	if (replay->replayed)
+		sem_post(&replay->done);
+}
+
+/*
+ * Replay capture @path through @loggers loggers.
+ *
+ * Return value:
+ *	How long the replay took (ns), -1 on error.
+ */
+static double replay(const char *path, unsigned loggers, struct replay *replay)
+{
+	struct wmr200 *wmr;
+	double start;
+	double end;
+	unsigned i;
+
+	memset(replay, 0, sizeof(*replay));
+	if ((replay->tr = transport_open_replay(path, 0)) == NULL)
+		return -1;
+	replay->read = replay->tr->read;
+	replay->tr->read = replay_read;
+	current = replay;
+
+	if ((wmr = wmr_open_transport(replay->tr)) == NULL)
+		return -1;
+
+	sem_init(&replay->done, false, 0);
+	wmr_set_error_handler(wmr, error_handler, replay);
+	for (i = 0; i < loggers; i++)
+		wmr_register_logger(wmr, count_reading, &replay->num_readings[i]);
+
+	start = bench_now();
+	if (wmr_start(wmr) != 0)
+		return -1;
+	while (sem_wait(&replay->done) != 0);
+	end = bench_now();
+
+	wmr_stop(wmr);
+	wmr_close(wmr);
+	sem_destroy(&replay->done);
+	return end - start;
+}
+
+static int time_cmp(const void *a, const void *b)
+{
+	double ta = *(const double *)a;
+	double tb = *(const double *)b;
+
+	return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Replay capture @path NUM_RUNS times through @loggers loggers.
+ *
+ * Return value:
+ *	How long the median replay took (ns), -1 on error.
+ */
+static double median_replay(const char *path, unsigned loggers, struct replay *result)
+{
+	double times[NUM_RUNS];
+	size_t i;
+
+	for (i = 0; i < NUM_RUNS; i++)
+		if ((times[i] = replay(path, loggers, result)) < 0)
+			return -1;
+
+	qsort(times, NUM_RUNS, sizeof(*times), time_cmp);
+	return times[NUM_RUNS / 2];
+}
+
+/*
+ * Fit line y = a + b * x through @count points by least squares and
+ * return its slope b.
+ */
+static double fit_slope(const double *x, const double *y, size_t count)
+{
+	double mean_x = 0;
+	double mean_y = 0;
+	double cov = 0;
+	double var = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		mean_x += x[i] / count;
+		mean_y += y[i] / count;
+	}
+
+	for (i = 0; i < count; i++) {
+		cov += (x[i] - mean_x) * (y[i] - mean_y);
+		var += (x[i] - mean_x) * (x[i] - mean_x);
+	}
+
+	return cov / var;
+}
+
+/*
+ * Report how fast capture @path is decoded and how much every logger
+ * adds to that. Names of the cases start with @label.
+ */
+static int bench_decode(const char *path, const char *label)
+{
+	double loggers[ARRAY_SIZE(num_loggers)];
+	double per_reading[ARRAY_SIZE(num_loggers)];
+	struct replay result;
+	char name[64];
+	double base;
+	double time;
+	size_t i;
+
+	if ((base = median_replay(path, 1, &result)) < 0)
+		return -1;
+	if (result.num_readings[0] == 0) {
+		warnx("No readings decoded from %s", path);
+		return -1;
+	}
+
+	snprintf(name, sizeof(name), "%s/decode_frames", label);
+	bench_report("wmr", name, result.num_frames / (base / 1e9), "frames/s");
+	snprintf(name, sizeof(name), "%s/decode_readings", label);
+	bench_report("wmr", name, result.num_readings[0] / (base / 1e9), "readings/s");
+
+	for (i = 0; i < ARRAY_SIZE(num_loggers); i++) {
+		if (i == 0)
+			time = base;
+		else if ((time = median_replay(path, num_loggers[i], &result)) < 0)
+			return -1;
+
+		loggers[i] = num_loggers[i];
+		per_reading[i] = time / result.num_readings[0];
+		snprintf(name, sizeof(name), "%s/fanout_%u_loggers", label, num_loggers[i]);
+		bench_report("wmr", name, per_reading[i], "ns/reading");
+	}
+
+	/* all of the points, so that no single noisy replay decides */
+	snprintf(name, sizeof(name), "%s/fanout_logger_call", label);
+	bench_report("wmr", name, fit_slope(loggers, per_reading, ARRAY_SIZE(num_loggers)),
+		"ns/call");
+
+	return 0;
+}
+
+/*
+ * Make a capture @path of CORPUS_FRAMES frames of a simulated station.
+ */
+static int make_corpus(const char *path)
+{
+	struct simulator_cfg cfg = { .speed = 0, .num_sensors = 3, .seed = 1 };
+	const byte_t heartbeat[] = { 0x01, 0xD0, 0, 0, 0, 0, 0, 0 };
+	struct capture_frame frame;
+	struct wmr_transport *tr;
+	FILE *stream;
+	ssize_t len;
+	size_t i;
+
+	if ((stream = fopen(path, "w")) == NULL) {
+		warn("Cannot create %s", path);
+		return -1;
+	}
+
+	/* the simulator talks once it gets a heartbeat */
+	tr = simulator_open(&cfg);
+	(void) tr->write(tr, heartbeat, sizeof(heartbeat));
+
+	(void) capture_write_header(stream);
+	for (i = 0; i < CORPUS_FRAMES; i++) {
+		if ((len = tr->read(tr, frame.data, sizeof(frame.data))) <= 0)
+			break;
+		frame.time = capture_now();
+		frame.dir = CAPTURE_IN;
+		frame.len = len;
+		(void) capture_write_frame(stream, &frame);
+	}
+
+	tr->close(tr);
+	if (fclose(stream) != 0) {
+		warn("Cannot write %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create an RRD file @name in @dir with data sources @ds.
+ */
+static int create_rrd(const char *dir, const char *name, time_t start, const char **ds)
+{
+	const char *argv[RRD_MAX_DS + 1];
+	char path[PATH_MAX];
+	int argc = 0;
+
+	while (ds[argc] != NULL) {
+		argv[argc] = ds[argc];
+		argc++;
+	}
+	argv[argc++] = "RRA:AVERAGE:0.5:1:480";
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (rrd_create_r(path, RRD_STEP, start - 1, argc, argv) != 0) {
+		warnx("Cannot create %s: %s", path, rrd_get_error());
+		rrd_clear_error();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Remove RRD file @name from @dir.
+ */
+static void remove_rrd(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	(void) unlink(path);
+}
+
+/*
+ * Report how many updates per second the RRD logger makes.
+ */
+static int bench_rrd(void)
+{
+	static const char *wind_ds[] = {
+		"DS:avg_speed:GAUGE:360:0:100", "DS:gust_speed:GAUGE:360:0:100", NULL };
+	static const char *rain_ds[] = {
+		"DS:rate:GAUGE:1200:0:600", "DS:total:COUNTER:1200:U:U", NULL };
+	static const char *baro_ds[] = {
+		"DS:pressure:GAUGE:360:U:U", "DS:alt_pressure:GAUGE:360:U:U", NULL };
+	static const char *temp_ds[] = {
+		"DS:temp:GAUGE:360:-100:100", "DS:humidity:GAUGE:360:-100:100",
+		"DS:dewpoint:GAUGE:360:-100:100", NULL };
+	struct rrd_logger logger;
+	struct wmr_reading reading;
+	char dir[] = "/tmp/wmr-bench-XXXXXX";
+	time_t start = time(NULL) - RRD_STEPS * RRD_STEP;
+	double begin;
+	double end;
+	size_t i;
+	int ret = -1;
+
+	if (mkdtemp(dir) == NULL) {
+		warn("Cannot create a directory for RRD files");
+		return -1;
+	}
+
+	if (create_rrd(dir, "wind.rrd", start, wind_ds) != 0
+		|| create_rrd(dir, "rain.rrd", start, rain_ds) != 0
+		|| create_rrd(dir, "baro.rrd", start, baro_ds) != 0
+		|| create_rrd(dir, "temp0.rrd", start, temp_ds) != 0)
+		goto out;
+
+	rrd_logger_init(&logger);
+	logger.cfg.rrd_root = dir;
+	logger.cfg.wind_rrd = "wind.rrd";
+	logger.cfg.rain_rrd = "rain.rrd";
+	logger.cfg.uvi_rrd = "uvi.rrd";
+	logger.cfg.baro_rrd = "baro.rrd";
+	logger.cfg.temp_N_rrd = "temp%d.rrd";
+	rrd_logger_start(&logger);
+
+	begin = bench_now();
+	for (i = 0; i < RRD_STEPS; i++) {
+		memset(&reading, 0, sizeof(reading));
+		reading.time = start + i * RRD_STEP;
+
+		reading.type = WMR_WIND;
+		reading.wind.avg_speed = i % 10;
+		reading.wind.gust_speed = i % 20;
+		rrd_log_reading(NULL, &reading, &logger);
+
+		reading.type = WMR_RAIN;
+		reading.rain = (struct wmr_rain) { .rate = i % 3, .accum_2007 = i / 100.0 };
+		rrd_log_reading(NULL, &reading, &logger);
+
+		reading.type = WMR_BARO;
+		reading.baro = (struct wmr_baro) { .pressure = 1000 + i % 30,
+			.alt_pressure = 1010 + i % 30 };
+		rrd_log_reading(NULL, &reading, &logger);
+
+		reading.type = WMR_TEMP;
+		reading.temp = (struct wmr_temp) { .sensor_id = 0, .humidity = 50 + i % 40,
+			.temp = (i % 400) / 10.0 - 10, .dew_point = (i % 200) / 10.0 - 10 };
+		rrd_log_reading(NULL, &reading, &logger);
+	}
+	rrd_logger_flush(&logger);
+	end = bench_now();
+
+	bench_report("rrd", "updates", 4 * RRD_STEPS / ((end - begin) / 1e9), "updates/s");
+	rrd_logger_free(&logger);
+	ret = 0;
+
+out:
+	remove_rrd(dir, "wind.rrd");
+	remove_rrd(dir, "rain.rrd");
+	remove_rrd(dir, "baro.rrd");
+	remove_rrd(dir, "temp0.rrd");
+	(void) rmdir(dir);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	/* warnings of RRD files not there to be logged into are expected */
+	struct log_cfg log_cfg = { LOG_ERR, LOG_TO_STDERR, NULL };
+	char corpus[] = "/tmp/wmr-bench-XXXXXX";
+	int ret = EXIT_SUCCESS;
+	int fd;
+	int i;
+
+	if (log_start(&log_cfg) != 0)
+		return EXIT_FAILURE;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++)
+			if (bench_decode(argv[i], basename(argv[i])) != 0)
+				ret = EXIT_FAILURE;
+	}
+	else {
+		if ((fd = mkstemp(corpus)) == -1)
+			err(EXIT_FAILURE, "Cannot create a capture to decode");
+		(void) close(fd);
+
+		if (make_corpus(corpus) != 0 || bench_decode(corpus, "simulated") != 0)
+			ret = EXIT_FAILURE;
+		(void) unlink(corpus);
+	}
+
+	if (bench_rrd() != 0)
+		ret = EXIT_FAILURE;
+
+	log_stop();
+	return ret;
+}
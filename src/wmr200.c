@@ -11,6 +11,8 @@
 
 #include "common.h"
 #include "log.h"
+#include "recorder.h"
+#include "transport.h"
 #include "wmr200.h"
 
 #include <assert.h>
@@ -30,14 +32,6 @@
 
 #define	FRAME_SIZE		8
 
-/*
- * Although heartbeat is required every 30 seconds, using a little
- * less is reasonable. Otherwise the station will (often) switch to
- * logging mode and data which would otherwise be sent immediately
- * will be received as historic records.
- */
-#define	HEARTBEAT_INTERVAL_SEC	25
-
 /*
  * Although packet length is validated for each reading as it is
  * processed, packet length is checked against MAX_PACKET_LEN before
@@ -49,8 +43,6 @@
  */
 #define MAX_PACKET_LEN		112
 
-#define	VENDOR_ID		0x0FDE
-#define	PRODUCT_ID		0xCA01
 #define	TENTH_OF_INCH		0.0254
 
 /*
@@ -84,10 +76,12 @@ static void default_error_handler(struct wmr200 *wmr, void *arg)
  */
 struct wmr200
 {
-	hid_device *dev;		/* HIDAPI device handle */
+	struct wmr_transport *tr;	/* transport frames are exchanged over */
 	struct wmr_logger *logger;	/* linked list of loggers */
+	pthread_mutex_t dispatch_lock;	/* serializes passing readings to loggers */
 	pthread_t mainloop_thread;	/* main loop thread */
 	pthread_t heartbeat_thread;	/* heartbeat loop thread */
+	bool heartbeating;		/* is @heartbeat_thread running? */
 	struct wmr_latest_data latest;	/* latest readings */
 	struct wmr_meta meta;		/* system metadata packet (updated on the fly) */
 	time_t conn_since;		/* time the connection was established */
@@ -208,26 +202,60 @@ static const char *wind_dir_string[] = {
 
 static void error(struct wmr200 *wmr, char *msg, ...)
 {
+	char buf[256];
 	va_list args;
+	int state;
 
 	va_start(args, msg);
-	vsyslog(LOG_ERR, msg, args); /* TODO */
+	vsnprintf(buf, sizeof(buf), msg, args);
 	va_end(args);
+	log_error("%s", buf);
+
+	/* keep the frames which led to the error, not cancelled with the lock held */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	(void) recorder_dump(NULL, 0);
+	pthread_setcancelstate(state, NULL);
 
 	if (wmr->err_handler)
 		wmr->err_handler(wmr, wmr->err_arg);
 }
 
+/*
+ * Stop the main loop, as there's nothing more to read.
+ */
+static void end_mainloop(struct wmr200 *wmr)
+{
+	free(wmr->packet);
+	wmr->packet = NULL;
+	pthread_exit(NULL);
+}
+
 static byte_t read_byte(struct wmr200 *wmr)
 {
 	ssize_t ret;
 
-	if (wmr->buf_avail == 0) {
-		ret = hid_read(wmr->dev, wmr->buf, FRAME_SIZE);
-		if (ret < 0)
-			error(wmr, "hid_read: read error\n");
+	while (wmr->buf_avail == 0) {
+		ret = wmr->tr->read(wmr->tr, wmr->buf, FRAME_SIZE);
+		if (ret < 0) {
+			error(wmr, "Read error");
+			end_mainloop(wmr);
+		}
+		else if (ret == 0) {
+			log_info("No more frames to read");
+			if (wmr->err_handler)
+				wmr->err_handler(wmr, wmr->err_arg);
+			end_mainloop(wmr);
+		}
 
+		recorder_record(CAPTURE_IN, wmr->buf, ret);
 		wmr->meta.num_frames++;
+
+		/* the first byte is the number of bytes which follow */
+		if (wmr->buf[0] >= ret) {
+			error(wmr, "Invalid frame (count=%u, len=%zi)", wmr->buf[0], ret);
+			continue;
+		}
+
 		wmr->buf_avail = wmr->buf[0];
 		wmr->buf_pos = 1;
 	}
@@ -240,10 +268,13 @@ static byte_t read_byte(struct wmr200 *wmr)
 static void send_cmd(struct wmr200 *wmr, byte_t cmd)
 {
 	byte_t data[2] = { 0x01, cmd };
-	int ret = hid_write(wmr->dev, data, sizeof(data));
+	int ret;
+
+	recorder_record(CAPTURE_OUT, data, sizeof(data));
+	ret = wmr->tr->write(wmr->tr, data, sizeof(data));
 
 	if (ret != sizeof(data))
-		error(wmr, "hid_write: cannot write command\n");
+		error(wmr, "Cannot write command");
 }
 
 static void send_heartbeat(struct wmr200 *wmr)
@@ -270,12 +301,27 @@ static time_t get_reading_time_from_packet(struct wmr200 *wmr)
 	return mktime(&tm);
 }
 
+/*
+ * Pass @reading to the loggers. Loggers take locks, so the thread isn't
+ * cancelled (see wmr_stop) until all of them have got the reading.
+ *
+ * Readings of the main loop and WMR_META readings of heartbeats, which
+ * come from another thread, are passed one at a time: a reading reaches
+ * all loggers before the next one reaches any, and wmr_wait_dispatch can
+ * tell when one has, which the journal relies on for its checkpoints (see
+ * journal.c).
+ */
 static void invoke_handlers(struct wmr200 *wmr, struct wmr_reading *reading)
 {
 	struct wmr_logger *logger;
+	int state;
 
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&wmr->dispatch_lock);
 	for (logger = wmr->logger; logger != NULL; logger = logger->next)
 		logger->func(wmr, reading, logger->arg);
+	pthread_mutex_unlock(&wmr->dispatch_lock);
+	pthread_setcancelstate(state, NULL);
 }
 
 static void update_if_newer(struct wmr_reading *old, struct wmr_reading *new)
@@ -526,6 +572,7 @@ static bool verify_packet(struct wmr200 *wmr)
 		if (wmr->packet_len != packet_len[wmr->packet_type]) {
 			error(wmr, "Invalid %s packet length (%zu)",
 				packet_type_to_string(wmr->packet_type), wmr->packet_len);
+			return false;
 		}
 	}
 
@@ -617,8 +664,11 @@ static void mainloop(struct wmr200 *wmr)
 		/*
 		 * If a packet is too big or too small, it is an error.
 		 */
-		if (wmr->packet_len <= 2 || wmr->packet_len > MAX_PACKET_LEN)
+		if (wmr->packet_len <= 2 || wmr->packet_len > MAX_PACKET_LEN) {
 			error(wmr, "Unexpected packet length (len=%zu)", wmr->packet_len);
+			wmr->meta.num_failed++;
+			continue;
+		}
 
 		wmr->packet = malloc_safe(wmr->packet_len);
 		wmr->packet[0] = wmr->packet_type;
@@ -640,20 +690,18 @@ static void mainloop(struct wmr200 *wmr)
 
 free_packet:
 		free(wmr->packet);
+		wmr->packet = NULL;
 	}
 }
 
 /*
- * Heartbeat loop. Unless a heartbeat packet is sent every 30 seconds, the
- * station will switch from real-time mode to logging mode and no readings
- * will be transfered.
+ * Heartbeat loop, see WMR_HEARTBEAT_INTERVAL.
  */
 static void heartbeat_loop(struct wmr200 *wmr)
 {
 	while (1) {
-		send_heartbeat(wmr);
-		emit_meta_packet(wmr);
-		usleep(HEARTBEAT_INTERVAL_SEC * 1e6);
+		wmr_heartbeat(wmr);
+		usleep(WMR_HEARTBEAT_INTERVAL * 1e6);
 	}
 }
 
@@ -683,41 +731,58 @@ static void *heartbeat_loop_pthread(void *arg)
 
 struct wmr200 *wmr_open(void)
 {
-	struct wmr200 *wmr = malloc_safe(sizeof(*wmr));
+	struct wmr_transport *tr;
 
-	wmr->dev = hid_open(VENDOR_ID, PRODUCT_ID, NULL);
-	if (wmr->dev == NULL) {
-		log_error("hid_open: cannot connect to WMR200");
+	if ((tr = transport_open_hid()) == NULL)
 		return NULL;
-	}
+	return wmr_open_transport(tr);
+}
+
+struct wmr200 *wmr_open_transport(struct wmr_transport *tr)
+{
+	struct wmr200 *wmr = malloc_safe(sizeof(*wmr));
 
+	wmr->tr = tr;
 	wmr->packet = NULL;
 	wmr->buf_avail = wmr->buf_pos = 0;
 	wmr->logger = NULL;
+	pthread_mutex_init(&wmr->dispatch_lock, NULL);
 	wmr->conn_since = time(NULL);
 	wmr->err_handler = default_error_handler;
+	wmr->heartbeating = false;
 	memset(&wmr->latest, 0, sizeof(wmr->latest));
 	memset(&wmr->meta, 0, sizeof(wmr->meta));
 
-	if (hid_write(wmr->dev, wakeup, sizeof(wakeup)) != sizeof(wakeup)) {
-		log_error("hid_write: cannot write wakeup packet");
+	recorder_record(CAPTURE_OUT, wakeup, sizeof(wakeup));
+	if (tr->write(tr, wakeup, sizeof(wakeup)) != sizeof(wakeup)) {
+		log_error("Cannot write wakeup packet");
 		goto out_free;
 	}
 
 	return wmr;
 
 out_free:
+	tr->close(tr);
+	pthread_mutex_destroy(&wmr->dispatch_lock);
 	free(wmr);
 	return NULL;
 }
 
 void wmr_close(struct wmr200 *wmr)
 {
-	if (wmr->dev != NULL) {
-		send_cmd(wmr, CMD_STOP);
-		hid_close(wmr->dev);
+	struct wmr_logger *logger;
+
+	send_cmd(wmr, CMD_STOP);
+	wmr->tr->close(wmr->tr);
+
+	while ((logger = wmr->logger) != NULL) {
+		wmr->logger = logger->next;
+		free(logger);
 	}
 
+	/* the main loop may have been stopped halfway through a packet */
+	free(wmr->packet);
+	pthread_mutex_destroy(&wmr->dispatch_lock);
 	free(wmr);
 }
 
@@ -738,9 +803,15 @@ int wmr_start(struct wmr200 *wmr)
 		log_error("Cannot start heartbeat loop thread");
 		return -1;
 	}
+	wmr->heartbeating = true;
 
 	log_debug("Started heartbeat thread");
 
+	return wmr_start_receiver(wmr);
+}
+
+int wmr_start_receiver(struct wmr200 *wmr)
+{
 	if (pthread_create(&wmr->mainloop_thread,
 		NULL, mainloop_pthread, wmr) != 0) {
 		log_error("Cannot start main communication loop thread");
@@ -753,11 +824,20 @@ int wmr_start(struct wmr200 *wmr)
 	return 0;
 }
 
+void wmr_heartbeat(struct wmr200 *wmr)
+{
+	send_heartbeat(wmr);
+	emit_meta_packet(wmr);
+}
+
 void wmr_stop(struct wmr200 *wmr)
 {
-	pthread_cancel(wmr->heartbeat_thread);
+	if (wmr->heartbeating) {
+		pthread_cancel(wmr->heartbeat_thread);
+		pthread_join(wmr->heartbeat_thread, NULL);
+		wmr->heartbeating = false;
+	}
 	pthread_cancel(wmr->mainloop_thread);
-	pthread_join(wmr->heartbeat_thread, NULL);
 	pthread_join(wmr->mainloop_thread, NULL);
 	send_cmd(wmr, CMD_STOP);
 }
@@ -774,6 +854,12 @@ void wmr_register_logger(struct wmr200 *wmr, wmr_logger_t *func, void *arg)
 	wmr->logger = logger;
 }
 
+void wmr_wait_dispatch(struct wmr200 *wmr)
+{
+	pthread_mutex_lock(&wmr->dispatch_lock);
+	pthread_mutex_unlock(&wmr->dispatch_lock);
+}
+
 void wmr_set_error_handler(struct wmr200 *wmr, wmr_err_handler_t handler, void *arg)
 {
 	wmr->err_handler = handler;
@@ -830,6 +916,27 @@ const char *wmr_sensor_name(struct wmr_reading *reading)
 	return NULL;
 }
 
+const char *wmr_lookup_string(const char *str)
+{
+	static const struct {
+		const char **strings;
+		size_t count;
+	} tables[] = {
+		{ level_string, ARRAY_SIZE(level_string) },
+		{ status_string, ARRAY_SIZE(status_string) },
+		{ forecast_string, ARRAY_SIZE(forecast_string) },
+		{ wind_dir_string, ARRAY_SIZE(wind_dir_string) },
+	};
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(tables); i++)
+		for (j = 0; j < tables[i].count; j++)
+			if (strcmp(tables[i].strings[j], str) == 0)
+				return tables[i].strings[j];
+
+	return NULL;
+}
+
 const char *packet_type_to_string(enum packet_type type)
 {
 	switch (type) {
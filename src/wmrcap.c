@@ -0,0 +1,185 @@
+/*
+ * Tool to inspect and replay captures of raw traffic between meteod and
+ * the station (see capture.h), such as those written by meteod -c.
+ *
+ * By default, the capture is replayed through the same code meteod uses
+ * to talk to the station and the readings decoded are printed, one per
+ * line (see reading_format). Replaying a capture gives the same readings
+ * every time, so captures of real traffic make good regression tests.
+ */
+
+#include "capture.h"
+#include "common.h"
+#include "log.h"
+#include "reading.h"
+#include "strbuf.h"
+#include "transport.h"
+#include "wmr200.h"
+
+#include <err.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+char *prog;
+sem_t done;			/* posted when the replay is over */
+volatile bool replayed;		/* has the whole capture been read? */
+struct strbuf out;		/* reading being printed */
+
+/* read of the replay transport, which replay_read wraps */
+ssize_t (*transport_read)(struct wmr_transport *tr, byte_t *buf, size_t size);
+
+static void usage(int status)
+{
+	errx(status, "Usage: %s [-f] [-v] [-s speed] capture\n", prog);
+}
+
+/*
+ * Print the frames of capture @path.
+ */
+static int print_frames(const char *path)
+{
+	struct capture_header hdr;
+	struct capture_frame frame;
+	FILE *stream;
+	int64_t time;
+	size_t i;
+	int ret;
+
+	if ((stream = fopen(path, "r")) == NULL)
+		err(EXIT_FAILURE, "Cannot open %s", path);
+	if (capture_read_header(stream, &hdr) != 0)
+		errx(EXIT_FAILURE, "%s is not a capture", path);
+
+	while ((ret = capture_read_frame(stream, &frame)) > 0) {
+		time = hdr.realtime + ((int64_t)frame.time - hdr.monotonic);
+		printf("%lli.%06lli\t%s\t", (long long)(time / 1000000),
+			(long long)(time % 1000000), frame.dir == CAPTURE_IN ? "in" : "out");
+		for (i = 0; i < frame.len; i++)
+			printf("%s%02X", i > 0 ? " " : "", frame.data[i]);
+		putchar('\n');
+	}
+
+	fclose(stream);
+	if (ret < 0)
+		errx(EXIT_FAILURE, "%s is truncated or corrupt", path);
+	return EXIT_SUCCESS;
+}
+
+static void print_reading(struct wmr200 *wmr, struct wmr_reading *reading, void *arg)
+{
+	(void) wmr;
+	(void) arg;
+
+	/* made up by the heartbeat thread rather than received */
+	if (reading->type == WMR_META)
+		return;
+
+	strbuf_reset(&out);
+	reading_format(reading, &out);
+	fwrite(out.str, 1, out.len, stdout);
+}
+
+static ssize_t replay_read(struct wmr_transport *tr, byte_t *buf, size_t size)
+{
+	ssize_t ret = transport_read(tr, buf, size);
+
+	if (ret == 0)
+		replayed = true;
+	return ret;
+}
+
+/*
+ * Errors are logged and the replay goes on until the end of the capture.
+ */
+static void error_handler(struct wmr200 *wmr, void *arg)
+{
+	(void) wmr;
+	(void) arg;
+
+	if (replayed)
+		sem_post(&done);
+}
+
+/*
+ * Replay capture @path @speed times as fast as it was captured (or as
+ * fast as possible if @speed is zero) and print the readings.
+ */
+static int replay(const char *path, double speed)
+{
+	struct wmr_transport *tr;
+	struct wmr200 *wmr;
+
+	if ((tr = transport_open_replay(path, speed)) == NULL)
+		return EXIT_FAILURE;
+	transport_read = tr->read;
+	tr->read = replay_read;
+
+	if ((wmr = wmr_open_transport(tr)) == NULL)
+		return EXIT_FAILURE;
+
+	strbuf_init(&out, 256);
+	sem_init(&done, false, 0);
+	wmr_set_error_handler(wmr, error_handler, NULL);
+	wmr_register_logger(wmr, print_reading, NULL);
+
+	if (wmr_start(wmr) != 0)
+		return EXIT_FAILURE;
+	while (sem_wait(&done) != 0);
+
+	wmr_stop(wmr);
+	wmr_close(wmr);
+	strbuf_free(&out);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	struct log_cfg log_cfg = { LOG_WARNING, LOG_TO_STDERR, NULL };
+	bool frames = false;
+	double speed = 0;
+	char *end;
+	int ret;
+	int opt;
+
+	prog = basename(argv[0]);
+
+	while ((opt = getopt(argc, argv, "fhs:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			frames = true;
+			break;
+		case 's':
+			errno = 0;
+			speed = strtod(optarg, &end);
+			if (errno != 0 || *end != '\0' || speed < 0)
+				errx(EXIT_FAILURE, "Invalid speed '%s'", optarg);
+			break;
+		case 'v':
+			log_cfg.level = LOG_DEBUG;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+			break;
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(EXIT_FAILURE);
+
+	if (frames)
+		return print_frames(argv[optind]);
+
+	if (log_start(&log_cfg) != 0)
+		return EXIT_FAILURE;
+	ret = replay(argv[optind], speed);
+	log_stop();
+	return ret;
+}